@@ -0,0 +1,441 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Assembler.h"
+#include "CPU.h"
+#include "Instructions.h"
+
+#define MNEMONIC_TABLE_BITS 10
+#define MNEMONIC_TABLE_SIZE (1 << MNEMONIC_TABLE_BITS)
+
+/// FNV-1a, folded to a table slot. The seed is chosen at compile time so no two mnemonics share a slot.
+constexpr uint32_t mnemonic_hash(const char* name, size_t length, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ seed;
+    for(size_t i = 0; i < length; ++i)
+        hash = (hash ^ uint8_t(name[i])) * 16777619u;
+    return (hash ^ (hash >> MNEMONIC_TABLE_BITS) ^ (hash >> (2 * MNEMONIC_TABLE_BITS))) & (MNEMONIC_TABLE_SIZE - 1);
+}
+
+constexpr size_t mnemonic_length(const char* name)
+{
+    size_t length = 0;
+    while(name[length])
+        ++length;
+    return length;
+}
+
+/// Slots hold (type << 8 | func) + 1, zero is empty.
+struct MnemonicTable
+{
+    uint32_t seed;
+    uint16_t slots[MNEMONIC_TABLE_SIZE];
+};
+
+constexpr bool place_mnemonic(MnemonicTable& table, const char* name, uint32_t type, uint32_t func)
+{
+    uint32_t slot = mnemonic_hash(name, mnemonic_length(name), table.seed);
+    if(table.slots[slot])
+        return false;
+    table.slots[slot] = uint16_t(((type << 8) | func) + 1);
+    return true;
+}
+
+constexpr MnemonicTable build_mnemonic_table()
+{
+    for(uint32_t seed = 0; ; ++seed)
+    {
+        MnemonicTable table = {seed, {}};
+        bool placed = true;
+        for(uint32_t i = 0; placed && i < MemoryInstructionsSize; ++i)
+            placed = place_mnemonic(table, MI_asm[i], MemoryInstructionType, i);
+        for(uint32_t i = 0; placed && i < RegisterInstructionSize; ++i)
+            placed = place_mnemonic(table, RI_asm[i], RegisterInstructionType, i);
+        for(uint32_t i = 0; placed && i < ImmediateInstructionSize; ++i)
+            placed = place_mnemonic(table, II_asm[i], ImmediateInstructionType, i);
+        for(uint32_t i = 0; placed && i < VectorInstructionSize; ++i)
+            placed = place_mnemonic(table, VI_asm[i], VectorInstructionType, i);
+        if(placed)
+            return table;
+    }
+}
+
+static constexpr MnemonicTable mnemonic_table = build_mnemonic_table();
+static_assert(mnemonic_table.seed < 1024, "Mnemonic table is too crowded, raise MNEMONIC_TABLE_BITS.");
+
+static const char* mnemonic_name(uint32_t type, uint32_t func)
+{
+    return type == MemoryInstructionType ? MI_asm[func] : type == RegisterInstructionType ? RI_asm[func] :
+           type == ImmediateInstructionType ? II_asm[func] : VI_asm[func];
+}
+
+static const char* mnemonic_operands(uint32_t type, uint32_t func)
+{
+    return type == MemoryInstructionType ? MI_operands[func] : type == RegisterInstructionType ? RI_operands[func] :
+           type == ImmediateInstructionType ? II_operands[func] : VI_operands[func];
+}
+
+static bool find_mnemonic(const char* name, size_t length, uint32_t& type, uint32_t& func)
+{
+    uint16_t entry = mnemonic_table.slots[mnemonic_hash(name, length, mnemonic_table.seed)];
+    if(!entry)
+        return false;
+    
+    type = (entry - 1) >> 8;
+    func = (entry - 1) & 0xFF;
+    const char* expected = mnemonic_name(type, func);
+    return strncmp(expected, name, length) == 0 && expected[length] == '\0';
+}
+
+/// An instruction whose quad operand names a label that was not defined yet.
+struct AsmFixup
+{
+    size_t index;
+    uint32_t type, func;
+    uint8_t vals[5];
+    int predicate;
+    int slot;
+    char kind;
+    int line;
+    std::string label;
+};
+
+class AsmParser
+{
+public:
+    AsmParser(const char* text, size_t size, uint32_t origin, AssembledProgram& out, std::string& error)
+        : p(text), end(text + size), origin(origin), line(1), out(out), error(error)
+    {
+    }
+    
+    bool parse();
+
+private:
+    const char* p;
+    const char* end;
+    uint32_t origin;
+    int line;
+    AssembledProgram& out;
+    std::string& error;
+    std::vector<AsmFixup> fixups;
+    
+    bool fail(const std::string& message)
+    {
+        error = "line " + std::to_string(line) + ": " + message;
+        return false;
+    }
+    
+    void skip_blanks()
+    {
+        while(p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            ++p;
+    }
+    
+    bool at_statement_end() const
+    {
+        return p == end || *p == '\n' || *p == ';' || *p == '?' || (*p == '/' && p + 1 < end && p[1] == '/');
+    }
+    
+    static bool identifier_start(char c)
+    {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '.';
+    }
+    
+    static bool identifier_char(char c)
+    {
+        return identifier_start(c) || (c >= '0' && c <= '9');
+    }
+    
+    size_t identifier()
+    {
+        const char* start = p;
+        if(p < end && identifier_start(*p))
+            while(p < end && identifier_char(*p))
+                ++p;
+        return size_t(p - start);
+    }
+    
+    bool number(int64_t& value, int64_t low, int64_t high);
+    bool operand(char kind, uint8_t* vals, int& slot, size_t index, AsmFixup& fixup, bool& needs_fixup);
+    static uint32_t resolve(char kind, uint32_t label_address, uint32_t pc);
+};
+
+bool AsmParser::number(int64_t& value, int64_t low, int64_t high)
+{
+    bool negative = p < end && *p == '-';
+    if(negative)
+        ++p;
+    
+    value = 0;
+    if(p < end && *p == '\'')
+    {
+        if(p + 2 < end && p[1] == '\\' && p + 3 < end && p[3] == '\'')
+        {
+            char escaped = p[2];
+            value = escaped == 'n' ? '\n' : escaped == 't' ? '\t' : escaped == 'r' ? '\r' : escaped == '0' ? 0 : escaped;
+            p += 4;
+        }
+        else if(p + 2 < end && p[2] == '\'')
+        {
+            value = uint8_t(p[1]);
+            p += 3;
+        }
+        else
+            return fail("bad character literal");
+    }
+    else if(p + 1 < end && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+    {
+        p += 2;
+        const char* digits = p;
+        while(p < end && value <= UINT32_MAX)
+        {
+            char c = *p;
+            int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if(digit < 0)
+                break;
+            value = value * 16 + digit;
+            ++p;
+        }
+        if(p == digits)
+            return fail("expected hex digits");
+    }
+    else
+    {
+        const char* digits = p;
+        while(p < end && *p >= '0' && *p <= '9' && value <= UINT32_MAX)
+            value = value * 10 + (*p++ - '0');
+        if(p == digits)
+            return fail(p < end && *p != '\n' ? std::string("unexpected '") + *p + "'" : "expected operand");
+    }
+    
+    if(negative)
+        value = -value;
+    if(value < low || value > high || (p < end && identifier_char(*p)))
+        return fail("operand out of range");
+    return true;
+}
+
+uint32_t AsmParser::resolve(char kind, uint32_t label_address, uint32_t pc)
+{
+    /// jumpiq lands on pc + quad, bjumpiq on pc - quad.
+    if(kind == 'j')
+        return label_address - pc;
+    if(kind == 'k')
+        return pc - label_address;
+    return label_address;
+}
+
+bool AsmParser::operand(char kind, uint8_t* vals, int& slot, size_t index, AsmFixup& fixup, bool& needs_fixup)
+{
+    int64_t value;
+    if(kind == 'r')
+    {
+        if(p < end && *p == '$')
+            ++p;
+        if(!number(value, 0, NUM_REGISTERS - 1))
+            return false;
+        vals[slot++] = uint8_t(value);
+        return true;
+    }
+    if(kind == 'i')
+    {
+        if(!number(value, INT8_MIN, UINT8_MAX))
+            return false;
+        vals[slot++] = uint8_t(value);
+        return true;
+    }
+    
+    uint32_t quad;
+    const char* name = p;
+    size_t length = identifier();
+    if(length)
+    {
+        uint32_t pc = origin + uint32_t(index * 8);
+        std::string label(name, length);
+        auto found = out.labels.find(label);
+        if(found != out.labels.end())
+            quad = resolve(kind, found->second, pc);
+        else
+        {
+            needs_fixup = true;
+            fixup.slot = slot;
+            fixup.kind = kind;
+            fixup.line = line;
+            fixup.label = std::move(label);
+            quad = 0;
+        }
+    }
+    else
+    {
+        if(!number(value, INT32_MIN, UINT32_MAX))
+            return false;
+        quad = uint32_t(value);
+    }
+    
+    vals[slot++] = uint8_t(quad >> 24);
+    vals[slot++] = uint8_t(quad >> 16);
+    vals[slot++] = uint8_t(quad >> 8);
+    vals[slot++] = uint8_t(quad);
+    return true;
+}
+
+bool AsmParser::parse()
+{
+    out.code.clear();
+    out.labels.clear();
+    out.code.reserve(size_t(end - p) / 16);
+    
+    while(true)
+    {
+        skip_blanks();
+        if(p == end)
+            break;
+        if(*p == '\n' || *p == ';')
+        {
+            line += *p++ == '\n';
+            continue;
+        }
+        if(*p == '/' && p + 1 < end && p[1] == '/')
+        {
+            while(p < end && *p != '\n')
+                ++p;
+            continue;
+        }
+        
+        const char* name = p;
+        size_t length = identifier();
+        if(!length)
+            return fail(std::string("unexpected '") + *p + "'");
+        
+        skip_blanks();
+        if(p < end && *p == ':')
+        {
+            ++p;
+            uint32_t address = origin + uint32_t(out.code.size() * 8);
+            if(!out.labels.emplace(std::string(name, length), address).second)
+                return fail("label \"" + std::string(name, length) + "\" defined twice");
+            continue;
+        }
+        
+        uint32_t type, func;
+        if(!find_mnemonic(name, length, type, func))
+            return fail("unknown mnemonic \"" + std::string(name, length) + "\"");
+        
+        size_t index = out.code.size();
+        uint8_t vals[5] = {0, 0, 0, 0, 0};
+        int slot = 0;
+        bool optional = false;
+        bool needs_fixup = false;
+        AsmFixup fixup;
+        
+        for(const char* format = mnemonic_operands(type, func); *format; ++format)
+        {
+            if(*format == '*')
+            {
+                optional = true;
+                continue;
+            }
+            
+            skip_blanks();
+            if(slot > 0 && p < end && *p == ',')
+            {
+                ++p;
+                skip_blanks();
+            }
+            if(at_statement_end())
+            {
+                if(optional)
+                    break;
+                return fail(std::string("too few operands for \"") + mnemonic_name(type, func) + "\"");
+            }
+            if(!operand(*format, vals, slot, index, fixup, needs_fixup))
+                return false;
+        }
+        
+        int predicate = NO_PREDICATE;
+        skip_blanks();
+        if(p < end && *p == '?')
+        {
+            ++p;
+            skip_blanks();
+            if(p < end && *p == '$')
+                ++p;
+            int64_t value;
+            if(!number(value, 0, NUM_REGISTERS - 1))
+                return false;
+            predicate = int(value);
+            skip_blanks();
+        }
+        if(!at_statement_end() || (p < end && *p == '?'))
+            return fail(std::string("too many operands for \"") + mnemonic_name(type, func) + "\"");
+        
+        if(needs_fixup)
+        {
+            fixup.index = index;
+            fixup.type = type;
+            fixup.func = func;
+            memcpy(fixup.vals, vals, sizeof(vals));
+            fixup.predicate = predicate;
+            fixups.push_back(std::move(fixup));
+        }
+        out.code.push_back(encode_instruction(type, func, vals[0], vals[1], vals[2], vals[3], vals[4], predicate));
+    }
+    
+    for(AsmFixup& fixup : fixups)
+    {
+        auto found = out.labels.find(fixup.label);
+        if(found == out.labels.end())
+        {
+            line = fixup.line;
+            return fail("undefined label \"" + fixup.label + "\"");
+        }
+        
+        uint32_t quad = resolve(fixup.kind, found->second, origin + uint32_t(fixup.index * 8));
+        uint8_t* vals = fixup.vals;
+        vals[fixup.slot] = uint8_t(quad >> 24);
+        vals[fixup.slot + 1] = uint8_t(quad >> 16);
+        vals[fixup.slot + 2] = uint8_t(quad >> 8);
+        vals[fixup.slot + 3] = uint8_t(quad);
+        out.code[fixup.index] = encode_instruction(fixup.type, fixup.func, vals[0], vals[1], vals[2], vals[3], vals[4], fixup.predicate);
+    }
+    
+    return true;
+}
+
+bool assemble(const char* text, size_t size, uint32_t origin, AssembledProgram& out, std::string& error)
+{
+    AsmParser parser(text, size, origin, out, error);
+    return parser.parse();
+}
+
+bool assemble_file(FILE* in, uint32_t origin, AssembledProgram& out, std::string& error)
+{
+    std::vector<char> text;
+    size_t used = 0;
+    while(true)
+    {
+        text.resize(used + (1 << 20));
+        size_t got = fread(text.data() + used, 1, text.size() - used, in);
+        used += got;
+        if(got == 0)
+            break;
+    }
+    
+    return assemble(text.data(), used, origin, out, error);
+}
+
+std::vector<uint64_t> parse_asm(FILE* in)
+{
+    AssembledProgram program;
+    std::string error;
+    if(!assemble_file(in, 0, program, error))
+    {
+        fprintf(stderr, "%s\n", error.c_str());
+        exit(1);
+    }
+    return std::move(program.code);
+}
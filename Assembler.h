@@ -0,0 +1,26 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Output of the assembler. Labels map to absolute guest addresses.
+struct AssembledProgram
+{
+    std::vector<uint64_t> code;
+    std::unordered_map<std::string, uint32_t> labels;
+};
+
+/// Assembles text as if loaded at origin. Statements end at ';' or a newline, "//" comments to the end of the line.
+///     label: mnemonic operand, operand ... ?predicate
+/// Registers may be written $5 or 5. Numbers are decimal, 0x hex or 'c'. Quad operands take a number or a label,
+/// jumpiq and bjumpiq take the label itself and encode the relative distance.
+/// On failure returns false and sets error to "line N: ...".
+bool assemble(const char* text, size_t size, uint32_t origin, AssembledProgram& out, std::string& error);
+
+/// Reads the rest of in in large blocks and assembles it.
+bool assemble_file(FILE* in, uint32_t origin, AssembledProgram& out, std::string& error);
+
+/// Assembles a whole file for address 0. Prints the error and exits on failure.
+std::vector<uint64_t> parse_asm(FILE* in);
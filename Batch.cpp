@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "Batch.h"
+
+BatchJob::BatchJob() : load_address(0), entry(0), stack_address(0)
+{
+    memset(registers, 0, sizeof(registers));
+}
+
+/// A job in flight. The CPU is only created when the job is first scheduled.
+struct BatchTask
+{
+    std::size_t index;
+    std::unique_ptr<CPU> cpu;
+    uint32_t slices;
+};
+
+struct BatchWorkerQueue
+{
+    std::mutex lock;
+    std::deque<BatchTask*> tasks;
+};
+
+BatchExecutor::BatchExecutor(unsigned threads, uint64_t slice_instructions) : threads(threads),
+    slice_instructions(slice_instructions), instruction_limit(0), trap_memory_faults(true), steals(0)
+{
+    if(this->threads == 0)
+        this->threads = std::max(1u, std::thread::hardware_concurrency());
+}
+
+std::vector<BatchResult> BatchExecutor::run(const std::vector<BatchJob>& jobs)
+{
+    std::vector<BatchResult> results(jobs.size());
+    std::vector<BatchTask> tasks(jobs.size());
+    std::vector<BatchWorkerQueue> queues(threads);
+    std::atomic<std::size_t> remaining(jobs.size());
+    std::atomic<uint64_t> stolen(0);
+    
+    /// Deal jobs out round-robin so every worker starts with local work.
+    for(std::size_t i = 0; i < jobs.size(); ++i)
+    {
+        tasks[i].index = i;
+        tasks[i].slices = 0;
+        queues[i % threads].tasks.push_back(&tasks[i]);
+    }
+    
+    auto take = [&](unsigned self) -> BatchTask*
+    {
+        {
+            std::lock_guard<std::mutex> guard(queues[self].lock);
+            if(!queues[self].tasks.empty())
+            {
+                BatchTask* task = queues[self].tasks.back();
+                queues[self].tasks.pop_back();
+                return task;
+            }
+        }
+        
+        for(unsigned offset = 1; offset < threads; ++offset)
+        {
+            BatchWorkerQueue& victim = queues[(self + offset) % threads];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if(!victim.tasks.empty())
+            {
+                BatchTask* task = victim.tasks.front();
+                victim.tasks.pop_front();
+                ++stolen;
+                return task;
+            }
+        }
+        return nullptr;
+    };
+    
+    auto worker = [&](unsigned self)
+    {
+        while(remaining.load(std::memory_order_acquire) != 0)
+        {
+            BatchTask* task = take(self);
+            if(!task)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            
+            const BatchJob& job = jobs[task->index];
+            if(!task->cpu)
+            {
+                task->cpu.reset(new CPU());
+                CPU& cpu = *task->cpu;
+                cpu.trap_memory_faults = trap_memory_faults;
+                cpu.load_program(job.program, job.load_address);
+                cpu.program_counter = job.entry;
+                cpu.stack_address = job.stack_address;
+                memcpy(cpu.registers, job.registers, NUM_REGISTERS);
+            }
+            
+            CPU& cpu = *task->cpu;
+            uint32_t value = cpu.run(slice_instructions);
+            ++task->slices;
+            
+            if(!cpu.halted && (instruction_limit == 0 || cpu.instructions_retired() < instruction_limit))
+            {
+                std::lock_guard<std::mutex> guard(queues[self].lock);
+                queues[self].tasks.push_front(task);
+                continue;
+            }
+            
+            BatchResult& result = results[task->index];
+            result.halted = cpu.halted;
+            result.halt_value = value;
+            result.program_counter = cpu.program_counter;
+            memcpy(result.registers, cpu.registers, NUM_REGISTERS);
+            result.exception_reason = cpu.exception_reason;
+            result.instructions = cpu.instructions_retired();
+            result.slices = task->slices;
+            task->cpu.reset();
+            remaining.fetch_sub(1, std::memory_order_release);
+        }
+    };
+    
+    std::vector<std::thread> pool;
+    for(unsigned i = 1; i < threads; ++i)
+        pool.emplace_back(worker, i);
+    worker(0);
+    for(std::thread& thread : pool)
+        thread.join();
+    
+    steals = stolen.load();
+    return results;
+}
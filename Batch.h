@@ -0,0 +1,45 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "CPU.h"
+
+/// One independent guest to run: a program image and the state to start it in.
+struct BatchJob
+{
+    BatchJob();
+    
+    std::vector<uint64_t> program;
+    uint32_t load_address;
+    uint32_t entry; /// Initial program_counter.
+    uint32_t stack_address;
+    uint8_t registers[NUM_REGISTERS];
+};
+
+struct BatchResult
+{
+    bool halted; /// False if the guest was given up on at instruction_limit.
+    uint32_t halt_value;
+    uint32_t program_counter;
+    uint8_t registers[NUM_REGISTERS];
+    uint8_t exception_reason;
+    uint64_t instructions;
+    uint32_t slices; /// Number of time slices the guest was scheduled for.
+};
+
+/// Runs many guests on a pool of threads. Every worker owns a deque of jobs, takes from its back and steals
+/// from the front of the others. A guest that does not halt within its time slice goes back to the front of
+/// its worker's deque, so long running guests round-robin instead of starving short ones.
+class BatchExecutor
+{
+public:
+    /// threads 0 means one per host core.
+    BatchExecutor(unsigned threads = 0, uint64_t slice_instructions = 1 << 20);
+    
+    std::vector<BatchResult> run(const std::vector<BatchJob>& jobs);
+    
+    unsigned threads;
+    uint64_t slice_instructions;
+    uint64_t instruction_limit; /// Guests still running after this many instructions are abandoned. 0 for no limit.
+    bool trap_memory_faults;
+    uint64_t steals; /// Jobs taken from another worker's deque during the last run.
+};
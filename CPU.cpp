@@ -1,639 +1,1793 @@
 #include <cstdio>
 #include <cstdint>
 #include <cstdlib>
-#include <string>
-#include <istream>
 #include <vector>
-#include <map>
-#include <cctype>
+#include <cstring>
+#include <algorithm>
+#if defined(__unix__)
+#include <sys/mman.h>
+#endif
 #include "CPU.h"
+#include "Instructions.h"
+#include "JIT.h"
+#include "Faults.h"
+#include "Console.h"
+#include "Profiler.h"
+#include "Machine.h"
+#include "Superinstructions.h"
 
-enum InstructionTypes
+template<class Config>
+using InstructionHandler = void (*)(BasicCPU<Config>&, const DecodedInstruction&);
+
+template<class Config> void MILoadMemoryRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void MILoadMemoryImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void MIStoreMemoryRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void MIStoreMemoryImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void MIBlockCopy(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void MIBlockFill(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void MIBlockCompare(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void MIBlockSearch(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void MICompareAndSwap(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void MIFetchAdd(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void MIFetchAddQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void MIFence(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+
+
+template<class Config> void RILoadImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RILoadRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIAddImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIAddRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIAddImmediateSaveCarry(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIAddRegisterSaveCarry(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIMulImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIMulRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIMulImmediateSaveCarry(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIMulRegisterSaveCarry(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIDivImmediateRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIDivRegisterImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIDivRegisterRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIModImmediateRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIModRegisterImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIModRegisterRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIAndImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIAndRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIOrImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIOrRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIXorImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIXorRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIBitwiseComplement(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIAddRegister16(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIAddRegister32(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIAddRegister64(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RISubRegister16(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RISubRegister32(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RISubRegister64(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIMulRegister16(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIMulRegister32(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIMulRegister64(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIShiftLeftImmediate16(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIShiftLeftImmediate32(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIShiftLeftImmediate64(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIShiftRightImmediate16(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIShiftRightImmediate32(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIShiftRightImmediate64(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RICompareRegister16(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RICompareRegister32(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RICompareRegister64(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIIncrementImmediate16(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIIncrementImmediate32(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void RIIncrementImmediate64(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+
+
+template<class Config> void IIJumpImmediateQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IIJumpRegisterQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IIJumpBackImmediateQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IIJumpBackRegisterQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IIHaltImmediateQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IIHaltRegisterQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IISetStackAddressImmediateQuadAddress(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IISetStackAddressRegisterQuadAddress(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IIPushStackRegisterArguments(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IIPushStackImmediateArguments(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IIPopStack(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IIPrintToScreenImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IIPrintToScreenRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IISetInterruptHandlerRoutineImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IISaveInterruptReasonRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IICallImmediateQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IICallRegisterQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IISaveStackAddressRegisterQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IISaveHartIdRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IISpawnHartImmediateQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IIJoinHartRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void IIReturnFromInterruptImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+
+
+template<class Config> void VIVectorAdd(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void VIVectorAddSaveCarry(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void VIVectorAnd(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void VIVectorOr(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void VIVectorXor(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void VIVectorCompareEqual(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void VIVectorCompareGreater(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void VIVectorMin(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void VIVectorMax(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void VIVectorSum(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void VIVectorLoadMemory(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+template<class Config> void VIVectorStoreMemory(BasicCPU<Config>& cpu, const DecodedInstruction& inst);
+
+template<class Config>
+static void InvalidInstruction(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    MemoryInstructionType = 0, /// Eg: Load memory address %X into $A. Things that only reference one memory address and one register
-    RegisterInstructionType, /// Eg: Load an immediate into a register. Things that only reference at least one register.
-    ImmediateInstructionType, /// Reference neither registers nor memory.
-    InstructionTypesSize /// Sentinel
-};
-#define NUM_INSTRUCTION_TYPE_SELECTION_BITS 2
-
-#define NUM_PREDICATE_BITS (1 + NUM_REGISTER_BITS)
-typedef void (*MIType)(CPU&, uint8_t, uint8_t, uint8_t, uint8_t, uint8_t);
-void MILoadMemoryRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-void MILoadMemoryImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-void MIStoreMemoryRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-void MIStoreMemoryImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-
-enum MemoryInstructions
-{
-    LoadMemoryRegister = 0, /// Loads a memory address into the given register. requires: 1 mem, 1 register
-    LoadMemoryImmediate,
-    StoreMemoryRegister,
-    StoreMemoryImmediate, /// Stores a register into a memory address. requires: 1 mem, 1 register
-    MemoryInstructionsSize /// Sentinel
-};
-static MIType MI_insts[MemoryInstructionsSize] = {&MILoadMemoryRegister, &MILoadMemoryImmediate,
-    &MIStoreMemoryRegister, &MIStoreMemoryImmediate};
-static const std::string MI_asm[MemoryInstructionsSize] = {"load", "store"};
-static const int MI_args[MemoryInstructionsSize] = {2, 2};
-
-#define NUM_MEMORY_INSTRUCTIONS_SELECTION_BITS 2
-static_assert(MemoryInstructionsSize <= (1 << NUM_MEMORY_INSTRUCTIONS_SELECTION_BITS), "NUM_INSTRUCTION_TYPE_SELECTION_BITS too low for number of instructions.");
-static_assert(NUM_INSTRUCTION_TYPE_SELECTION_BITS + 
-              NUM_PREDICATE_BITS + 
-              NUM_MEMORY_INSTRUCTIONS_SELECTION_BITS +
-              PHYSICAL_MEMORY_SIZE_BITS +
-              NUM_REGISTER_BITS <= INSTRUCTION_SIZE_BITS, "Too few bits in instruction for memory instruction.");
-
-typedef void (*RIType)(CPU&, uint8_t, uint8_t, uint8_t, uint8_t);
-void RILoadImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RILoadRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIAddImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIAddRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIAddImmediateSaveCarry(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIAddRegisterSaveCarry(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIMulImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIMulRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIMulImmediateSaveCarry(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIMulRegisterSaveCarry(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIDivImmediateRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIDivRegisterImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIDivRegisterRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIModImmediateRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIModRegisterImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIModRegisterRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIAndImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIAndRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIOrImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIOrRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIXorImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIXorRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-void RIBitwiseComplement(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4);
-
-enum RegisterInstructions
-{
-    LoadImmediate = 0, /// Loads an immediate value into a register. requires: 1 register, 1 immediate
-    LoadRegister, ///Copy a register
-    AddImmediate, /// Unsigned adds a immediate value to a register. requires: 1 register, 1 immediate
-    AddRegister, /// Unsigned adds register value to a register. requires: 2 register
-    AddImmediateSaveCarry, /// Unsigned adds an immediate to a register and saves any carry into a another register requires: 3 registers
-    AddRegisterSaveCarry, /// Unsigned adds a register to a register and saves any carry into a another register requires: 3 registers
-    MulImmediate, /// Unsigned multiplies a register and an immediate, High order bits are discarded
-    MulRegister, /// Unsigned multiplies two registers. The high-order bits are discarded.
-    MulImmediateSaveCarry, /// Unsigned multiplies a register and an immediate, High order bits are saved to the specified register.
-    MulRegisterSaveCarry, /// Unsigned multiplies two registers. The high-order bits are saved to the specified register.
-    DivImmediateRegister, /// Performs signed integer division of an immediate and a register. Needs 2 registers and 1 immediate.
-    DivRegisterImmediate, /// Performs signed integer division of a register and an immediate. Needs 2 registers and 1 immediate.
-    DivRegisterRegister, /// Performs unsigned integer division of two registers.
-    ModImmediateRegister, /// Calculates the remainder of unsigned division of an immediate and a register. Needs 2 registers and 1 immediate,
-    ModRegisterImmediate, /// Calculates the remainder of unsigned division of a register and an immediate. Needs 2 registers and 1 immediate,
-    ModRegisterRegister, /// Calculates the remainder of unsigned division of two register. Needs 3 registers.
-    AndImmediate, /// Bitwise-ands a register and immediate. Needs 2 registers and 1 immediate.
-    AndRegister, /// Bitwise-ands two registers. Needs 3 registers.
-    OrImmediate, /// Bitwise-ors a register and immediate. Needs 2 registers and 1 immediate.
-    OrRegister, /// Bitwise-ors two registers. Needs 3 registers.
-    XorImmediate, /// Bitwise-xors a register and immediate. Needs 2 registers and 1 immediate..
-    XorRegister, /// Bitwise-xors two registers. Needs 3 registers.
-    BitwiseComplement, /// Bitwise-complements a register. Needs 2 registers
-    RegisterInstructionSize
-};
-static RIType RI_insts[RegisterInstructionSize] = {&RILoadImmediate, &RILoadRegister, &RIAddImmediate, &RIAddRegister,
-&RIAddImmediateSaveCarry, &RIAddRegisterSaveCarry, &RIMulImmediate, &RIMulRegister, &RIMulImmediateSaveCarry,
-&RIMulRegisterSaveCarry, &RIDivImmediateRegister, &RIDivRegisterImmediate, &RIDivRegisterRegister, &RIModImmediateRegister,
-&RIModRegisterImmediate, &RIModRegisterRegister, &RIAndImmediate, &RIAndRegister, &RIOrImmediate, &RIOrRegister,
-&RIXorImmediate, &RIXorRegister, &RIBitwiseComplement};
-static const std::string RI_asm[RegisterInstructionSize] = {"loadi", "loadr", "addi", "addr",
-"addic", "addrc", "muli", "mulr", "mulic", "mulrc", "divir", "divri", "divrr", "modir",
-"modri", "modrr", "andi", "andr", "ori", "orr", "xori", "xorr", "bcomp"};
-static const int RI_args[RegisterInstructionSize] = {2, 2, 3, 3,
-4, 4, 3, 3, 4, 4, 3, 3, 3, 3,
-3, 3, 3, 3, 3, 3, 3, 3, 2};
-
-#define NUM_REGISTRY_INSTRUCTIONS_SELECTION_BITS 6
-static_assert(RegisterInstructionSize <= (1 << NUM_REGISTRY_INSTRUCTIONS_SELECTION_BITS), "NUM_REGISTRY_INSTRUCTIONS_SELECTION_BITS too low for number of instructions.");
-static_assert(NUM_INSTRUCTION_TYPE_SELECTION_BITS + 
-              NUM_PREDICATE_BITS + 
-              NUM_MEMORY_INSTRUCTIONS_SELECTION_BITS + 
-              3*NUM_REGISTER_BITS +
-              NUM_WORD_BITS <= INSTRUCTION_SIZE_BITS, "Too few bits in instruction for registry instructions.");
-
-typedef void (*IIType)(CPU&, uint8_t, uint8_t, uint8_t, uint8_t, uint8_t);
-void IIJumpImmediateQuad(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-void IIJumpRegisterQuad(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-void IIJumpBackRegisterQuad(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-void IIJumpBackRegisterQuad(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-void IIHaltImmediateQuad(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-void IIHaltRegisterQuad(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-void IISetStackAddressImmediateQuadAddress(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-void IISetStackAddressRegisterQuadAddress(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-void IIPushStackRegisterArguments(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-void IIPushStackImmediateArguments(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-void IIPopStack(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-void IIPrintToScreenImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-void IIPrintToScreenRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-void IISetInterruptHandlerRoutineImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-void IISaveInterruptReasonRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5);
-
-enum ImmediateInstructions
-{
-    JumpImmediateQuad, /// Increment program counter by immediate quad, unsigned
-    JumpRegisterQuad, /// Increment program counter by register quad, unsigned
-    JumpBackImmediateQuad, /// Decrement program counter by immediate quad, unsigned
-    JumpBackRegisterQuad, /// Decrement program counter by register quad, unsigned
-    HaltImmediateQuad, /// Stops execution return the immediate.
-    HaltRegisterQuad, /// Stops execution returning the register quad.
-    SetStackAddressImmediateQuadAddress, /// Sets the stack address to the immediate address
-    SetStackAddressRegisterQuadAddress, /// Sets the stack address to the register quad address
-    PushStackRegisterArguments, /// Pushes a frame onto the stack.
-    PushStackImmediateArguments, /// Pushes a frame onto the stack.
-    PopStack, /// Pops a stack frame and jumps to the return address
-    PrintToScreenImmediate,
-    PrintToScreenRegister,
-    SetInterruptHandlerRoutineImmediate,
-    SaveInterruptReasonRegister,
-    ImmediateInstructionSize
+    ///Invalid instruction type or function.
+    cpu.trap(IllegalInstruction);
+}
+
+constexpr InstructionTypeFields InstructionEncoding::types[];
+
+void decode_instruction(uint64_t instruction, DecodedInstruction& out)
+{
+    decode_instruction<InstructionEncoding>(instruction, out);
+}
+
+/// Zero filled memory the host only commits on first touch.
+static void* reserve_zeroed(std::size_t size)
+{
+#if defined(__unix__)
+    void* reservation = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(reservation == MAP_FAILED)
+        reservation = nullptr;
+#else
+    void* reservation = calloc(size, 1);
+#endif
+    if(!reservation)
+    {
+        fprintf(stderr, "Could not reserve %zu bytes of guest memory\n", size);
+        abort();
+    }
+    return reservation;
+}
+
+static void release(void* reservation, std::size_t size)
+{
+#if defined(__unix__)
+    munmap(reservation, size);
+#else
+    free(reservation);
+#endif
+}
+
+/// Reserves the whole 32-bit guest address space plus a guard, with only physical memory accessible.
+template<class Config>
+static uint8_t* reserve_guest_memory()
+{
+#if defined(__unix__)
+    void* reservation = mmap(nullptr, GUEST_RESERVATION_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(reservation != MAP_FAILED && mprotect(reservation, Config::physical_memory_size, PROT_READ | PROT_WRITE) == 0)
+        return static_cast<uint8_t*>(reservation);
+    
+    fprintf(stderr, "Could not reserve %llu bytes of guest address space\n", (unsigned long long)GUEST_RESERVATION_SIZE);
+    abort();
+#else
+    return static_cast<uint8_t*>(reserve_zeroed(Config::physical_memory_size));
+#endif
+}
+
+template<class Config>
+BasicCPU<Config>::BasicCPU() : BasicCPU(reserve_guest_memory<Config>())
+{
+    owns_memory = true;
+}
+
+template<class Config>
+BasicCPU<Config>::BasicCPU(uint8_t* shared_memory) : memory(shared_memory), owns_memory(false), stack_address(0), program_counter(0),
+    exception_handler_routine_address(0), exception_reason(0), errored_program_counter(0), interrupts_enabled(true), in_exception_handler(false), pending_interrupts(0),
+    held_interrupts(0), timer_interval(0), timer_deadline(0), halted(false), halt_value(0), output(nullptr),
+    owns_output(false), trap_memory_faults(false), machine(nullptr), hart_id(0), dirty_bitmap(Config::guest_page_count / 64),
+    decode_cache_hits(0), decode_cache_misses(0), superinstructions(true), jit(nullptr), jit_instructions(0), jit_code_low(0), jit_code_span(0)
+{
+    return_stack.reserve(Config::return_stack_size);
+    /// Kept in its own mapping so no guest address can ever reach the handler pointers.
+    decode_cache = static_cast<DecodedInstruction*>(reserve_zeroed(Config::decode_cache_size*sizeof(DecodedInstruction)));
+    memset(registers, 0, sizeof(registers));
+    PROFILE(profiler = nullptr);
+    TRACE_MEMORY(memory_tracer = nullptr; trace_countdown = 0);
+}
+
+template<class Config>
+BasicCPU<Config>::~BasicCPU()
+{
+    if(owns_output)
+        delete output;
+    if(owns_memory)
+    {
+#if defined(__unix__)
+        munmap(memory, GUEST_RESERVATION_SIZE);
+#else
+        release(memory, Config::physical_memory_size);
+#endif
+    }
+    release(decode_cache, Config::decode_cache_size*sizeof(DecodedInstruction));
+}
+
+template<class Config>
+void BasicCPU<Config>::perform_instruction(uint64_t instruction)
+{
+    DecodedInstruction inst;
+    decode_instruction<typename Config::Encoding>(instruction, inst);
+    
+    if(!inst.has_predicate || registers[inst.predicate_register])
+        execute(inst);
+    
+    program_counter += 8;
+}
+
+template<class Config>
+uint64_t BasicCPU<Config>::fetch_instruction(uint32_t address) const
+{
+    /// Instruction words are stored little-endian.
+    uint64_t instruction = 0;
+    for(int i = 7; i >= 0; --i)
+        instruction = (instruction << 8) | memory[uint32_t(address + i)];
+    return instruction;
+}
+
+template<class Config>
+void BasicCPU<Config>::step()
+{
+    DecodedInstruction& inst = decode_cache[(program_counter >> 3) & (Config::decode_cache_size - 1)];
+    
+    if(inst.valid && inst.address == program_counter)
+    {
+        ++decode_cache_hits;
+    }
+    else
+    {
+        decode_into_cache(inst);
+    }
+    
+    PROFILE(++inst.profile_hits);
+    TRACE_MEMORY(trace_access(program_counter, 8, MemoryExecute));
+    if(!inst.has_predicate || registers[inst.predicate_register])
+    {
+        execute(inst);
+    }
+    else
+    {
+        PROFILE(++inst.profile_skips);
+    }
+    
+    program_counter += 8;
+}
+
+template<class Config>
+void BasicCPU<Config>::decode_into_cache(DecodedInstruction& inst)
+{
+    ++decode_cache_misses;
+    decode_at(inst, program_counter);
+    if(superinstructions)
+        fuse(inst);
+}
+
+template<class Config>
+void BasicCPU<Config>::decode_at(DecodedInstruction& inst, uint32_t address)
+{
+    drop_decoded(inst);
+    decode_instruction<typename Config::Encoding>(fetch_instruction(address), inst);
+    inst.address = address;
+    inst.valid = true;
+    inst.jit_state = 0;
+}
+
+template<class Config>
+const DecodedInstruction& BasicCPU<Config>::decoded(uint32_t address)
+{
+    DecodedInstruction& inst = decode_cache[(address >> 3) & (Config::decode_cache_size - 1)];
+    if(!inst.valid || inst.address != address)
+        decode_at(inst, address);
+    return inst;
+}
+
+/// Every handler in flat opcode order: MI_insts, then RI_insts, then II_insts, then VI_insts.
+/// INST is a handler that always continues, JUMP one that ends a basic block, HALT one that may stop the machine
+/// and CALL one that does both.
+#define DISPATCHED_INSTRUCTIONS(INST, JUMP, HALT, CALL) \
+    INST(MILoadMemoryRegister) INST(MILoadMemoryImmediate) INST(MIStoreMemoryRegister) INST(MIStoreMemoryImmediate) \
+    INST(MIBlockCopy) INST(MIBlockFill) INST(MIBlockCompare) INST(MIBlockSearch) \
+    INST(MICompareAndSwap) INST(MIFetchAdd) HALT(MIFetchAddQuad) INST(MIFence) \
+    INST(RILoadImmediate) INST(RILoadRegister) INST(RIAddImmediate) INST(RIAddRegister) \
+    INST(RIAddImmediateSaveCarry) INST(RIAddRegisterSaveCarry) INST(RIMulImmediate) INST(RIMulRegister) \
+    INST(RIMulImmediateSaveCarry) INST(RIMulRegisterSaveCarry) HALT(RIDivImmediateRegister) HALT(RIDivRegisterImmediate) \
+    HALT(RIDivRegisterRegister) HALT(RIModImmediateRegister) HALT(RIModRegisterImmediate) HALT(RIModRegisterRegister) \
+    INST(RIAndImmediate) INST(RIAndRegister) INST(RIOrImmediate) INST(RIOrRegister) \
+    INST(RIXorImmediate) INST(RIXorRegister) INST(RIBitwiseComplement) \
+    INST(RIAddRegister16) INST(RIAddRegister32) INST(RIAddRegister64) \
+    INST(RISubRegister16) INST(RISubRegister32) INST(RISubRegister64) \
+    INST(RIMulRegister16) INST(RIMulRegister32) INST(RIMulRegister64) \
+    INST(RIShiftLeftImmediate16) INST(RIShiftLeftImmediate32) INST(RIShiftLeftImmediate64) \
+    INST(RIShiftRightImmediate16) INST(RIShiftRightImmediate32) INST(RIShiftRightImmediate64) \
+    INST(RICompareRegister16) INST(RICompareRegister32) INST(RICompareRegister64) \
+    INST(RIIncrementImmediate16) INST(RIIncrementImmediate32) INST(RIIncrementImmediate64) \
+    JUMP(IIJumpImmediateQuad) JUMP(IIJumpRegisterQuad) JUMP(IIJumpBackImmediateQuad) JUMP(IIJumpBackRegisterQuad) \
+    HALT(IIHaltImmediateQuad) HALT(IIHaltRegisterQuad) \
+    INST(IISetStackAddressImmediateQuadAddress) INST(IISetStackAddressRegisterQuadAddress) \
+    HALT(IIPushStackRegisterArguments) HALT(IIPushStackImmediateArguments) CALL(IIPopStack) \
+    INST(IIPrintToScreenImmediate) INST(IIPrintToScreenRegister) \
+    INST(IISetInterruptHandlerRoutineImmediate) INST(IISaveInterruptReasonRegister) \
+    CALL(IICallImmediateQuad) CALL(IICallRegisterQuad) INST(IISaveStackAddressRegisterQuad) \
+    INST(IISaveHartIdRegister) INST(IISpawnHartImmediateQuad) JUMP(IIJoinHartRegister) JUMP(IIReturnFromInterruptImmediate) \
+    INST(VIVectorAdd) INST(VIVectorAddSaveCarry) INST(VIVectorAnd) INST(VIVectorOr) \
+    INST(VIVectorXor) INST(VIVectorCompareEqual) INST(VIVectorCompareGreater) INST(VIVectorMin) \
+    INST(VIVectorMax) INST(VIVectorSum) INST(VIVectorLoadMemory) INST(VIVectorStoreMemory) \
+    HALT(InvalidInstruction)
+
+#define COUNT_INSTRUCTION(handler) + 1
+static_assert(0 DISPATCHED_INSTRUCTIONS(COUNT_INSTRUCTION, COUNT_INSTRUCTION, COUNT_INSTRUCTION, COUNT_INSTRUCTION) == OpcodesSize, "DISPATCHED_INSTRUCTIONS is out of sync with the instruction tables.");
+#undef COUNT_INSTRUCTION
+
+/// What DecodedInstruction::dispatch holds: the opcodes, then the superinstructions in Superinstructions.h order.
+#define OPCODE_NAME(handler) Op##handler,
+#define PAIR_NAME(first, second) Op##first##_##second,
+#define TRIPLE_NAME(first, second, third) Op##first##_##second##_##third,
+enum DispatchOpcodes { DISPATCHED_INSTRUCTIONS(OPCODE_NAME, OPCODE_NAME, OPCODE_NAME, OPCODE_NAME) SUPERINSTRUCTIONS(PAIR_NAME, TRIPLE_NAME) DispatchOpcodesSize };
+#undef OPCODE_NAME
+#undef PAIR_NAME
+#undef TRIPLE_NAME
+static_assert(DispatchOpcodesSize <= 256, "Superinstructions must fit in DecodedInstruction::dispatch.");
+
+#define PAIR_CHECK(first, second) \
+    static_assert(fusable_leader(Op##first) && fusable_last(Op##second), #first ", " #second " cannot be fused.");
+#define TRIPLE_CHECK(first, second, third) \
+    static_assert(fusable_leader(Op##first) && fusable_leader(Op##second) && fusable_last(Op##third), #first ", " #second ", " #third " cannot be fused.");
+SUPERINSTRUCTIONS(PAIR_CHECK, TRIPLE_CHECK)
+#undef PAIR_CHECK
+#undef TRIPLE_CHECK
+
+struct Superinstruction
+{
+    uint8_t dispatch;
+    uint8_t length;
+    uint8_t opcodes[SUPERINSTRUCTION_MAX_LENGTH];
 };
-static IIType II_insts[ImmediateInstructionSize] = {IIJumpImmediateQuad, &IIJumpRegisterQuad, &IIJumpBackRegisterQuad, &IIJumpBackRegisterQuad,
-&IIHaltImmediateQuad, &IIHaltRegisterQuad, &IISetStackAddressImmediateQuadAddress, &IISetStackAddressRegisterQuadAddress,
-&IIPushStackRegisterArguments, &IIPushStackImmediateArguments,
-&IIPopStack, &IIPrintToScreenImmediate, &IIPrintToScreenRegister,
-&IISetInterruptHandlerRoutineImmediate, &IISaveInterruptReasonRegister};
-static const std::string II_asm[ImmediateInstructionSize] = {"jumpiq", "jumprq", "bjumpiq", "bjumprq",
-"haltiq", "haltrq", "setstkiq", "setstkrq", "pushstkr", "pushstki",
-"popstk", "prti", "prtr", "setihriq", "saveirr"};
-static const int II_args[ImmediateInstructionSize] = {1, 4, 1, 4,
-1, 4, 1, 4, -1, -1,
-0, 1, 1, 1, 1};
-
-#define NUM_IMMEDIATE_INSTRUCTIONS_SELECTION_BITS 5
-static_assert(ImmediateInstructionSize <= (1 << NUM_IMMEDIATE_INSTRUCTIONS_SELECTION_BITS), "NUM_IMMEDIATE_INSTRUCTIONS_SELECTION_BITS too low for number of instructions.");
-static_assert(NUM_INSTRUCTION_TYPE_SELECTION_BITS + 
-              NUM_PREDICATE_BITS + 
-              NUM_IMMEDIATE_INSTRUCTIONS_SELECTION_BITS + 
-              5*NUM_REGISTER_BITS <= INSTRUCTION_SIZE_BITS, "Too few bits in instruction for immediate instruction.");
-static_assert(NUM_INSTRUCTION_TYPE_SELECTION_BITS + 
-              NUM_PREDICATE_BITS + 
-              NUM_IMMEDIATE_INSTRUCTIONS_SELECTION_BITS + 
-              1*NUM_REGISTER_BITS + 
-              4*NUM_WORD_BITS <= INSTRUCTION_SIZE_BITS, "Too few bits in instruction for immediate instruction.");
-static_assert(NUM_INSTRUCTION_TYPE_SELECTION_BITS + 
-              NUM_PREDICATE_BITS + 
-              NUM_IMMEDIATE_INSTRUCTIONS_SELECTION_BITS + 
-              5*NUM_WORD_BITS <= INSTRUCTION_SIZE_BITS, "Too few bits in instruction for immediate instruction.");
-
-static_assert(NUM_REGISTER_BITS <= 8, "Too many bits for register.");
-
-void CPU::perform_instruction(uint64_t instruction)
-{
-    uint64_t has_predicate = instruction & 1;
-    uint64_t predicate_register = (instruction & ((1 << NUM_PREDICATE_BITS) - 1)) >> 1;
-    
-    if(!has_predicate || registers[predicate_register])
-    {
-        uint64_t pure_instruction = instruction >> NUM_PREDICATE_BITS;
-        uint64_t type = pure_instruction & ((1 << NUM_INSTRUCTION_TYPE_SELECTION_BITS) - 1);
-        uint64_t args = pure_instruction >> NUM_INSTRUCTION_TYPE_SELECTION_BITS;
+
+/// The last entry matches nothing, so the list may be empty.
+#define PAIR_ENTRY(first, second) {Op##first##_##second, 2, {Op##first, Op##second}},
+#define TRIPLE_ENTRY(first, second, third) {Op##first##_##second##_##third, 3, {Op##first, Op##second, Op##third}},
+static const Superinstruction superinstruction_table[] = {SUPERINSTRUCTIONS(PAIR_ENTRY, TRIPLE_ENTRY) {InvalidOpcode, 0, {}}};
+#undef PAIR_ENTRY
+#undef TRIPLE_ENTRY
+
+/// Instructions run by one dispatch of dispatch.
+static inline unsigned dispatch_length(uint8_t dispatch)
+{
+    return dispatch < OpcodesSize ? 1 : superinstruction_table[dispatch - OpcodesSize].length;
+}
+
+const char* handler_name(uint8_t opcode)
+{
+#define HANDLER_NAME(handler) #handler,
+    static const char* const names[OpcodesSize] = {DISPATCHED_INSTRUCTIONS(HANDLER_NAME, HANDLER_NAME, HANDLER_NAME, HANDLER_NAME)};
+#undef HANDLER_NAME
+    return opcode < OpcodesSize ? names[opcode] : names[InvalidOpcode];
+}
+
+/// Config's handlers by opcode, for everything that runs an instruction outside the run loop.
+#define HANDLER_ADDRESS(handler) &handler<Config>,
+template<class Config>
+static const InstructionHandler<Config> handler_table[OpcodesSize] = {DISPATCHED_INSTRUCTIONS(HANDLER_ADDRESS, HANDLER_ADDRESS, HANDLER_ADDRESS, HANDLER_ADDRESS)};
+#undef HANDLER_ADDRESS
+
+template<class Config>
+void BasicCPU<Config>::execute(const DecodedInstruction& inst)
+{
+    handler_table<Config>[inst.opcode](*this, inst);
+}
+
+template<class Config>
+void BasicCPU<Config>::fuse(DecodedInstruction& inst)
+{
+    DecodedInstruction* sequence[SUPERINSTRUCTION_MAX_LENGTH] = {&inst};
+    unsigned decoded = 1;
+    const Superinstruction* best = nullptr;
+    for(const Superinstruction& candidate : superinstruction_table)
+    {
+        if(candidate.opcodes[0] != inst.opcode || candidate.length <= (best ? best->length : 1))
+            continue;
         
-        if(type == MemoryInstructionType)
-        {
-            uint32_t func = args & ((1 << NUM_MEMORY_INSTRUCTIONS_SELECTION_BITS) - 1);
-            args >>= NUM_MEMORY_INSTRUCTIONS_SELECTION_BITS;
-            uint8_t val_1 = args & ((1 << NUM_REGISTER_BITS) - 1);
-            args >>= NUM_REGISTER_BITS;
-            uint8_t val_2 = args & ((1 << NUM_REGISTER_BITS) - 1);
-            args >>= NUM_REGISTER_BITS;
-            uint8_t val_3 = args & ((1 << NUM_REGISTER_BITS) - 1);
-            args >>= NUM_REGISTER_BITS;
-            uint8_t val_4 = args & ((1 << NUM_REGISTER_BITS) - 1);
-            args >>= NUM_REGISTER_BITS;
-            uint8_t val_5 = args & ((1 << NUM_REGISTER_BITS) - 1);
-            
-            if(func < MemoryInstructionsSize)
-            {
-                MI_insts[func](*this, val_1, val_2, val_3, val_4, val_5);
-            }
-        }
-        else if (type == RegisterInstructionType)
+        unsigned matched = 1;
+        for(; matched < candidate.length; ++matched)
         {
-            uint32_t func = args & ((1 << NUM_REGISTRY_INSTRUCTIONS_SELECTION_BITS) - 1);
-            args >>= NUM_REGISTRY_INSTRUCTIONS_SELECTION_BITS;
-            uint8_t val_1 = args & ((1 << NUM_REGISTER_BITS) - 1);
-            args >>= NUM_REGISTER_BITS;
-            uint8_t val_2 = args & ((1 << NUM_REGISTER_BITS) - 1);
-            args >>= NUM_REGISTER_BITS;
-            uint8_t val_3 = args & ((1 << NUM_REGISTER_BITS) - 1);
-            args >>= NUM_REGISTER_BITS;
-            uint8_t val_4 = args & ((1 << NUM_REGISTER_BITS) - 1);
-            
-            if(func < RegisterInstructionSize)
+            if(matched == decoded)
             {
-                RI_insts[func](*this, val_1, val_2, val_3, val_4);
+                /// Decoded here but only counted when they run.
+                uint32_t address = inst.address + 8*matched;
+                if(address < inst.address || address > Config::physical_memory_size - 8)
+                    break;
+                DecodedInstruction& next = decode_cache[(address >> 3) & (Config::decode_cache_size - 1)];
+                if(!next.valid || next.address != address)
+                    decode_at(next, address);
+                sequence[decoded++] = &next;
             }
+            if(sequence[matched]->opcode != candidate.opcodes[matched])
+                break;
         }
-        else if(type == ImmediateInstructionType)
+        if(matched == candidate.length)
+            best = &candidate;
+    }
+    
+    if(!best)
+        return;
+    inst.dispatch = best->dispatch;
+    for(unsigned i = 1; i < best->length; ++i)
+        sequence[i]->fused = true;
+}
+
+template<class Config>
+void BasicCPU<Config>::drop_fused(uint32_t address)
+{
+    for(unsigned back = 1; back < SUPERINSTRUCTION_MAX_LENGTH; ++back)
+    {
+        uint32_t start = address - 8*back;
+        DecodedInstruction& head = decode_cache[(start >> 3) & (Config::decode_cache_size - 1)];
+        if(head.valid && head.address == start && dispatch_length(head.dispatch) > back)
+            drop_decoded(head);
+    }
+}
+
+/// Runs the instruction after the one program_counter is on from its decode cache entry, which fuse() keeps valid
+/// for as long as the superinstruction is. False if its predicate skipped it.
+template<class Config, InstructionHandler<Config> Handler>
+static inline bool run_fused(BasicCPU<Config>& cpu)
+{
+    cpu.program_counter += 8;
+    DecodedInstruction& inst = cpu.decode_cache[(cpu.program_counter >> 3) & (Config::decode_cache_size - 1)];
+    ++cpu.decode_cache_hits;
+    PROFILE(++inst.profile_hits);
+    TRACE_MEMORY(cpu.trace_access(cpu.program_counter, 8, MemoryExecute));
+    if(inst.has_predicate && !cpu.registers[inst.predicate_register])
+    {
+        PROFILE(++inst.profile_skips);
+        return false;
+    }
+    Handler(cpu, inst);
+    return true;
+}
+
+/// First on inst, then each of Rest on the instruction after the previous one, under its own predicate. Leaves
+/// program_counter on the last instruction, as if it had been fetched alone, and returns whether that one ran.
+template<class Config, InstructionHandler<Config> First, InstructionHandler<Config>... Rest>
+static inline bool superinstruction(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    First(cpu, inst);
+    bool ran[] = {run_fused<Config, Rest>(cpu)...};
+    return ran[sizeof...(Rest) - 1];
+}
+
+#if defined(__GNUC__) && !defined(DERP_NO_COMPUTED_GOTO)
+#define DERP_COMPUTED_GOTO 1
+#endif
+
+template<class Config>
+uint32_t BasicCPU<Config>::run(uint64_t instruction_budget)
+{
+    DecodedInstruction* inst;
+    halted = false;
+    uint64_t instruction_limit = instruction_budget > UINT64_MAX - instructions_retired() ? UINT64_MAX : instructions_retired() + instruction_budget;
+    /// The budget or the timer, whichever runs out first.
+    uint64_t next_event = timer_interval ? std::min(instruction_limit, timer_deadline) : instruction_limit;
+    JIT* compiler = jit;
+#if defined(DERP_PROFILE)
+    /// Compiled blocks would hide their instructions from the profiler.
+    if(profiler)
+        compiler = nullptr;
+#endif
+#if defined(DERP_TRACE_MEMORY)
+    /// So would the memory tracer's fetches.
+    if(memory_tracer)
+        compiler = nullptr;
+#endif
+    
+#if defined(__unix__)
+    /// A guest access that hits a guard page longjmps back here with the faulting instruction's program_counter
+    /// still current. Everything the loop needs lives in the CPU, inst is reloaded by FETCH.
+    sigjmp_buf fault_resume;
+    FaultScope fault_scope(memory, trap_memory_faults ? &fault_resume : nullptr);
+    if(trap_memory_faults)
+    {
+        install_fault_handler();
+        if(sigsetjmp(fault_resume, 0))
         {
-            uint64_t func = args & ((1 << NUM_IMMEDIATE_INSTRUCTIONS_SELECTION_BITS) - 1);
-            args >>= NUM_IMMEDIATE_INSTRUCTIONS_SELECTION_BITS;
-            uint8_t val_1 = args & ((1 << NUM_REGISTER_BITS) - 1);
-            args >>= NUM_REGISTER_BITS;
-            uint8_t val_2 = args & ((1 << NUM_REGISTER_BITS) - 1);
-            args >>= NUM_REGISTER_BITS;
-            uint8_t val_3 = args & ((1 << NUM_REGISTER_BITS) - 1);
-            args >>= NUM_REGISTER_BITS;
-            uint8_t val_4 = args & ((1 << NUM_REGISTER_BITS) - 1);
-            args >>= NUM_REGISTER_BITS;
-            uint8_t val_5 = args & ((1 << NUM_REGISTER_BITS) - 1);
-            
-            if(func < RegisterInstructionSize)
-            {
-                II_insts[func](*this, val_1, val_2, val_3, val_4, val_5);
-            }
+            raise_exception(MemoryFault);
+            if(halted)
+                return halt_value;
         }
-        else
+    }
+#endif
+    
+#if defined(DERP_PROFILE)
+    /// Call stacks are sampled at jumps, weighted by the instructions since the last sample.
+#define PROFILE_SAMPLE() \
+    if(profiler && instructions_retired() >= profiler->next_sample) \
+        profiler->sample(*this);
+#else
+#define PROFILE_SAMPLE()
+#endif
+    
+    /// At block boundaries: one branch on the budget, the timer and pending interrupts together, | rather than || so
+    /// there is no second one. Everything else is left to service_interrupts.
+#define SAFE_POINT() \
+    if((instructions_retired() >= next_event) | (pending_interrupts.load(std::memory_order_relaxed) != 0)) \
+    { \
+        if(!service_interrupts(instruction_limit, next_event)) \
+            return 0; \
+    }
+    
+    /// After a jump or call. The target's decode cache entry counts the jumps to it, so the JIT is only called for targets
+    /// that just got hot or have compiled code. One decoded after the jump is counted from the next. The verdict is
+    /// only stored if the entry still holds the target, JitVerify steps may have decoded something else into it.
+#define ENTER_COMPILED_CODE() \
+    if(compiler) \
+    { \
+        DecodedInstruction& target = decode_cache[(program_counter >> 3) & (Config::decode_cache_size - 1)]; \
+        if(target.address == program_counter && target.valid && target.jit_state != JIT_NEVER && \
+           (target.jit_state == JIT_COMPILED || ++target.jit_state == JIT_HOT_THRESHOLD)) \
+        { \
+            uint32_t target_address = program_counter; \
+            uint8_t state = compiler->enter(*this, next_event); \
+            if(target.address == target_address) \
+                target.jit_state = state; \
+        } \
+    }
+    
+    /// Looks up the instruction at program_counter and skips it when its predicate is false.
+#define FETCH() \
+    inst = &decode_cache[(program_counter >> 3) & (Config::decode_cache_size - 1)]; \
+    if(inst->valid && inst->address == program_counter) \
+        ++decode_cache_hits; \
+    else \
+        decode_into_cache(*inst); \
+    PROFILE(++inst->profile_hits); \
+    TRACE_MEMORY(trace_access(program_counter, 8, MemoryExecute)); \
+    if(inst->has_predicate && !registers[inst->predicate_register]) \
+    { \
+        PROFILE(++inst->profile_skips); \
+        program_counter += 8; \
+        goto fetch; \
+    }
+    
+#define PAIR_HANDLER(first, second) FUSED_HANDLER(first##_##second, second, first<Config>, second<Config>)
+#define TRIPLE_HANDLER(first, second, third) FUSED_HANDLER(first##_##second##_##third, third, first<Config>, second<Config>, third<Config>)
+    
+#if DERP_COMPUTED_GOTO
+    /// Each handler ends in its own indirect jump so the host predictor sees one branch per guest opcode.
+#define LABEL_ADDRESS(handler) &&op_##handler,
+#define PAIR_LABEL_ADDRESS(first, second) &&op_##first##_##second,
+#define TRIPLE_LABEL_ADDRESS(first, second, third) &&op_##first##_##second##_##third,
+    static const void* const dispatch_table[DispatchOpcodesSize] = {DISPATCHED_INSTRUCTIONS(LABEL_ADDRESS, LABEL_ADDRESS, LABEL_ADDRESS, LABEL_ADDRESS)
+                                                                    SUPERINSTRUCTIONS(PAIR_LABEL_ADDRESS, TRIPLE_LABEL_ADDRESS)};
+#undef LABEL_ADDRESS
+#undef PAIR_LABEL_ADDRESS
+#undef TRIPLE_LABEL_ADDRESS
+    
+#define DISPATCH() \
+    fetch: \
+    FETCH(); \
+    goto *dispatch_table[inst->dispatch];
+    
+#define CONTINUE_HANDLER(handler) \
+    op_##handler: \
+    handler(*this, *inst); \
+    program_counter += 8; \
+    FETCH(); \
+    goto *dispatch_table[inst->dispatch];
+    
+#define JUMP_HANDLER(handler) \
+    op_##handler: \
+    handler(*this, *inst); \
+    program_counter += 8; \
+    ENTER_COMPILED_CODE(); \
+    PROFILE_SAMPLE(); \
+    SAFE_POINT(); \
+    FETCH(); \
+    goto *dispatch_table[inst->dispatch];
+    
+#define HALT_HANDLER(handler) \
+    op_##handler: \
+    handler(*this, *inst); \
+    program_counter += 8; \
+    if(halted) \
+        return halt_value; \
+    FETCH(); \
+    goto *dispatch_table[inst->dispatch];
+    
+#define CALL_HANDLER(handler) \
+    op_##handler: \
+    handler(*this, *inst); \
+    program_counter += 8; \
+    if(halted) \
+        return halt_value; \
+    ENTER_COMPILED_CODE(); \
+    PROFILE_SAMPLE(); \
+    SAFE_POINT(); \
+    FETCH(); \
+    goto *dispatch_table[inst->dispatch];
+    
+    /// A superinstruction ends like its last instruction, a jump its predicate skipped included.
+#define FUSED_HANDLER(name, last, ...) \
+    op_##name: \
+    if(superinstruction<Config, __VA_ARGS__>(*this, *inst) && ends_basic_block(Op##last)) \
+    { \
+        program_counter += 8; \
+        ENTER_COMPILED_CODE(); \
+        PROFILE_SAMPLE(); \
+        SAFE_POINT(); \
+    } \
+    else \
+    { \
+        program_counter += 8; \
+    } \
+    FETCH(); \
+    goto *dispatch_table[inst->dispatch];
+    
+    DISPATCH();
+    DISPATCHED_INSTRUCTIONS(CONTINUE_HANDLER, JUMP_HANDLER, HALT_HANDLER, CALL_HANDLER)
+    SUPERINSTRUCTIONS(PAIR_HANDLER, TRIPLE_HANDLER)
+#else
+#define CONTINUE_HANDLER(handler) \
+        case Op##handler: \
+            handler(*this, *inst); \
+            break;
+    
+#define JUMP_HANDLER(handler) \
+        case Op##handler: \
+            handler(*this, *inst); \
+            program_counter += 8; \
+            ENTER_COMPILED_CODE(); \
+            PROFILE_SAMPLE(); \
+            SAFE_POINT(); \
+            goto fetch;
+    
+#define HALT_HANDLER(handler) \
+        case Op##handler: \
+            handler(*this, *inst); \
+            if(halted) \
+            { \
+                program_counter += 8; \
+                return halt_value; \
+            } \
+            break;
+    
+#define CALL_HANDLER(handler) \
+        case Op##handler: \
+            handler(*this, *inst); \
+            program_counter += 8; \
+            if(halted) \
+                return halt_value; \
+            ENTER_COMPILED_CODE(); \
+            PROFILE_SAMPLE(); \
+            SAFE_POINT(); \
+            goto fetch;
+    
+#define FUSED_HANDLER(name, last, ...) \
+        case Op##name: \
+            if(superinstruction<Config, __VA_ARGS__>(*this, *inst) && ends_basic_block(Op##last)) \
+            { \
+                program_counter += 8; \
+                ENTER_COMPILED_CODE(); \
+                PROFILE_SAMPLE(); \
+                SAFE_POINT(); \
+                goto fetch; \
+            } \
+            break;
+    
+    while(true)
+    {
+    fetch:
+        FETCH();
+        switch(inst->dispatch)
         {
-            ///Invalid instruction type
+            DISPATCHED_INSTRUCTIONS(CONTINUE_HANDLER, JUMP_HANDLER, HALT_HANDLER, CALL_HANDLER)
+            SUPERINSTRUCTIONS(PAIR_HANDLER, TRIPLE_HANDLER)
         }
+        program_counter += 8;
+    }
+#endif
+#undef FETCH
+#undef ENTER_COMPILED_CODE
+#undef SAFE_POINT
+#undef PROFILE_SAMPLE
+#undef DISPATCH
+#undef CONTINUE_HANDLER
+#undef JUMP_HANDLER
+#undef HALT_HANDLER
+#undef CALL_HANDLER
+#undef FUSED_HANDLER
+#undef PAIR_HANDLER
+#undef TRIPLE_HANDLER
+}
+
+template<class Config>
+void BasicCPU<Config>::load_program(const std::vector<uint64_t>& program, uint32_t address)
+{
+    for(std::size_t i = 0; i < program.size(); ++i)
+        for(int j = 0; j < 8; ++j)
+            store(address + 8*i + j, (program[i] >> (8*j)) & 0xFF);
+}
+
+template<class Config>
+void BasicCPU<Config>::raise_exception(uint8_t reason)
+{
+    /// A fault anywhere in the handler would overwrite the return address and enter it again, most likely to fault
+    /// again forever, so it is a double fault.
+    if(in_exception_handler)
+    {
+        halt(UNHANDLED_EXCEPTION_HALT_VALUE);
+        return;
     }
     
-    program_counter += 8;
+    exception_reason = reason;
+    errored_program_counter = program_counter;
+    if(exception_handler_routine_address)
+    {
+        program_counter = exception_handler_routine_address;
+        interrupts_enabled = false;
+        in_exception_handler = true;
+    }
+    else
+    {
+        halt(UNHANDLED_EXCEPTION_HALT_VALUE);
+    }
+}
+
+template<class Config>
+void BasicCPU<Config>::trap(uint8_t reason)
+{
+    raise_exception(reason);
+    program_counter -= 8;
+}
+
+template<class Config>
+void BasicCPU<Config>::set_timer(uint64_t interval)
+{
+    timer_interval = interval;
+    timer_deadline = instructions_retired() + interval;
+}
+
+template<class Config>
+void BasicCPU<Config>::release_held_interrupts()
+{
+    if(held_interrupts)
+    {
+        pending_interrupts.fetch_or(held_interrupts, std::memory_order_relaxed);
+        held_interrupts = 0;
+    }
+}
+
+template<class Config>
+bool BasicCPU<Config>::service_interrupts(uint64_t instruction_limit, uint64_t& next_event)
+{
+    uint64_t retired = instructions_retired();
+    if(timer_interval && retired >= timer_deadline)
+    {
+        /// Like a level triggered line, a timer interrupt still pending absorbs the next one. Re-armed from the
+        /// deadline rather than from now, so being late to the safe point does not add up over the run. A deadline
+        /// already passed again, with an interval shorter than the block that overran it, starts over from now.
+        interrupt(TimerInterrupt);
+        timer_deadline += timer_interval;
+        if(timer_deadline <= retired)
+            timer_deadline = retired + timer_interval;
+    }
+    next_event = timer_interval ? std::min(instruction_limit, timer_deadline) : instruction_limit;
+    
+    uint32_t pending = pending_interrupts.load(std::memory_order_relaxed);
+    if(pending & PREEMPT_REQUEST)
+    {
+        pending_interrupts.fetch_and(~PREEMPT_REQUEST, std::memory_order_relaxed);
+        return false;
+    }
+    if(pending && (!interrupts_enabled || !exception_handler_routine_address))
+    {
+        /// Held off the fast path until the guest can take them, so polling stays one branch meanwhile.
+        held_interrupts |= pending_interrupts.fetch_and(PREEMPT_REQUEST, std::memory_order_relaxed) & ~PREEMPT_REQUEST;
+    }
+    else if(pending)
+    {
+        /// Delivered before the budget is looked at, so splitting a run into budgets delivers at the same points.
+        uint8_t reason = uint8_t(__builtin_ctz(pending));
+        pending_interrupts.fetch_and(~(1u << reason), std::memory_order_relaxed);
+        raise_exception(reason);
+    }
+    return retired < instruction_limit;
+}
+
+template<class Config>
+void BasicCPU<Config>::halt(uint32_t value)
+{
+    halted = true;
+    halt_value = value;
+    if(output)
+        output->halt();
+}
+
+template<class Config>
+OutputDevice& BasicCPU<Config>::console()
+{
+    if(!output)
+    {
+        output = new ConsoleDevice();
+        owns_output = true;
+    }
+    return *output;
+}
+
+template<class Config>
+void BasicCPU<Config>::flush_decode_cache()
+{
+    for(uint32_t i = 0; i < Config::decode_cache_size; ++i)
+    {
+        PROFILE(profile_evict(decode_cache[i]));
+        decode_cache[i].valid = false;
+        decode_cache[i].fused = false;
+    }
+}
+
+template<class Config>
+void BasicCPU<Config>::invalidate_range(uint32_t address, uint32_t length)
+{
+    if(!length)
+        return;
+    if(jit_code_span && address < uint64_t(jit_code_low) + jit_code_span && jit_code_low < uint64_t(address) + length)
+        jit_invalidate();
+    
+    /// Instructions starting up to 7 bytes before the range overlap it. Past Config::decode_cache_size slots every entry
+    /// gets looked at once.
+    uint32_t first = address - 7;
+    uint64_t span = uint64_t(length) + 7;
+    uint64_t slots = std::min<uint64_t>((span + 6) / 8 + 1, Config::decode_cache_size);
+    for(uint64_t i = 0; i < slots; ++i)
+    {
+        DecodedInstruction& inst = decode_cache[((first >> 3) + i) & (Config::decode_cache_size - 1)];
+        if(inst.valid && uint32_t(inst.address - first) < span)
+            drop_decoded(inst);
+    }
+}
+
+template<class Config>
+void BasicCPU<Config>::mark_dirty_range(uint32_t address, uint32_t length)
+{
+    if(!length)
+        return;
+    uint32_t last = uint32_t(std::min<uint64_t>(uint64_t(address) + length, Config::physical_memory_size) - 1);
+    for(uint32_t page = address >> GUEST_PAGE_BITS; page <= last >> GUEST_PAGE_BITS; ++page)
+        mark_dirty(page << GUEST_PAGE_BITS);
+}
+
+template<class Config>
+void BasicCPU<Config>::mark_read_only_range(uint32_t address, uint32_t length)
+{
+    if(!length)
+        return;
+    if(read_only_bitmap.empty())
+        read_only_bitmap.resize(Config::guest_page_count / 64);
+    uint32_t last = uint32_t(std::min<uint64_t>(uint64_t(address) + length, Config::physical_memory_size) - 1);
+    for(uint32_t page = address >> GUEST_PAGE_BITS; page <= last >> GUEST_PAGE_BITS; ++page)
+        read_only_bitmap[page >> 6] |= uint64_t(1) << (page & 63);
+}
+
+template<class Config>
+void MILoadMemoryRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    uint32_t value = (cpu.registers[inst.val1] << 24) | (cpu.registers[inst.val2] << 16) | (cpu.registers[inst.val3] << 8) | (cpu.registers[inst.val4]);
+    TRACE_MEMORY(cpu.trace_access(value, 1, MemoryRead));
+    cpu.registers[inst.val5] = cpu.memory[value];
+}
+
+template<class Config>
+void MILoadMemoryImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    uint32_t value = inst.quad;
+    TRACE_MEMORY(cpu.trace_access(value, 1, MemoryRead));
+    cpu.registers[inst.val5] = cpu.memory[value];
+}
+
+template<class Config>
+void MIStoreMemoryRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    uint32_t value = (cpu.registers[inst.val1] << 24) | (cpu.registers[inst.val2] << 16) | (cpu.registers[inst.val3] << 8) | (cpu.registers[inst.val4]);
+    TRACE_MEMORY(cpu.trace_access(value, 1, MemoryWrite));
+    cpu.store(value, cpu.registers[inst.val5]);
+}
+
+template<class Config>
+void MIStoreMemoryImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    uint32_t value = inst.quad;
+    TRACE_MEMORY(cpu.trace_access(value, 1, MemoryWrite));
+    cpu.store(value, cpu.registers[inst.val5]);
+}
+
+/// The block instructions check the whole range up front. A block reaching past physical memory touches its first
+/// bad byte, which faults exactly like the equivalent byte loop would, but before anything is written.
+template<class Config>
+static bool block_in_range(BasicCPU<Config>& cpu, uint32_t address, uint32_t length)
+{
+    if(!length || uint64_t(address) + length <= Config::physical_memory_size)
+        return true;
+#if defined(__unix__)
+    volatile uint8_t touch = cpu.memory[address < Config::physical_memory_size ? Config::physical_memory_size : address];
+    (void)touch;
+#endif
+    return false;
+}
+
+template<class Config>
+void MIBlockCopy(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    uint32_t destination = cpu.register_quad(inst.val1);
+    uint32_t source = cpu.register_quad(inst.val2);
+    uint32_t length = cpu.register_quad(inst.val3);
+    if(!block_in_range(cpu, source, length) || !block_in_range(cpu, destination, length))
+        return;
+    
+    TRACE_MEMORY(cpu.trace_access(source, length, MemoryRead));
+    TRACE_MEMORY(cpu.trace_access(destination, length, MemoryWrite));
+    cpu.invalidate_range(destination, length);
+    cpu.mark_dirty_range(destination, length);
+    memmove(cpu.memory + destination, cpu.memory + source, length);
+}
+
+template<class Config>
+void MIBlockFill(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    uint32_t destination = cpu.register_quad(inst.val1);
+    uint32_t length = cpu.register_quad(inst.val2);
+    if(!block_in_range(cpu, destination, length))
+        return;
+    
+    TRACE_MEMORY(cpu.trace_access(destination, length, MemoryWrite));
+    cpu.invalidate_range(destination, length);
+    cpu.mark_dirty_range(destination, length);
+    memset(cpu.memory + destination, cpu.registers[inst.val3], length);
+}
+
+template<class Config>
+void MIBlockCompare(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    uint32_t first = cpu.register_quad(inst.val2);
+    uint32_t second = cpu.register_quad(inst.val3);
+    uint32_t length = cpu.register_quad(inst.val4);
+    if(!block_in_range(cpu, first, length) || !block_in_range(cpu, second, length))
+        return;
+    
+    TRACE_MEMORY(cpu.trace_access(first, length, MemoryRead));
+    TRACE_MEMORY(cpu.trace_access(second, length, MemoryRead));
+    /// 0 when equal, 1 when the first block is greater and 255 when it is smaller.
+    int order = memcmp(cpu.memory + first, cpu.memory + second, length);
+    cpu.registers[inst.val1] = order > 0 ? 1 : order < 0 ? 255 : 0;
+}
+
+template<class Config>
+void MIBlockSearch(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    uint32_t source = cpu.register_quad(inst.val2);
+    uint32_t length = cpu.register_quad(inst.val3);
+    if(!block_in_range(cpu, source, length))
+        return;
+    
+    /// The offset of the first match, or length when there is none.
+    const void* found = length ? memchr(cpu.memory + source, cpu.registers[inst.val4], length) : nullptr;
+    uint32_t offset = found ? uint32_t(static_cast<const uint8_t*>(found) - (cpu.memory + source)) : length;
+    TRACE_MEMORY(cpu.trace_access(source, found ? offset + 1 : length, MemoryRead));
+    cpu.set_register_quad(inst.val1, offset);
+}
+
+/// The atomics work on the guest bytes in place with the GCC builtins, so plain loads and stores stay plain.
+template<class Config>
+void MICompareAndSwap(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    uint32_t address = cpu.register_quad(inst.val1);
+    uint8_t value = cpu.registers[inst.val2];
+    TRACE_MEMORY(cpu.trace_access(address, 1, MemoryWrite));
+    cpu.invalidate_code(address);
+    if(__atomic_compare_exchange_n(cpu.memory + address, &value, cpu.registers[inst.val3], false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        cpu.mark_dirty(address);
+    cpu.registers[inst.val4] = value;
+}
+
+template<class Config>
+void MIFetchAdd(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    uint32_t address = cpu.register_quad(inst.val1);
+    TRACE_MEMORY(cpu.trace_access(address, 1, MemoryWrite));
+    cpu.invalidate_code(address);
+    uint8_t value = __atomic_fetch_add(cpu.memory + address, cpu.registers[inst.val2], __ATOMIC_SEQ_CST);
+    cpu.mark_dirty(address);
+    cpu.registers[inst.val3] = value;
+}
+
+/// Between a host word and the big-endian quad it holds in guest memory.
+static inline uint32_t guest_quad_order(uint32_t word)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return word;
+#else
+    return __builtin_bswap32(word);
+#endif
+}
+
+template<class Config>
+void MIFetchAddQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    uint32_t address = cpu.register_quad(inst.val1);
+    if(address % 4)
+    {
+        cpu.trap(MisalignedAccess);
+        return;
+    }
+    
+    uint32_t addend = cpu.register_quad(inst.val2);
+    TRACE_MEMORY(cpu.trace_access(address, 4, MemoryWrite));
+    for(uint32_t i = 0; i < 4; ++i)
+        cpu.invalidate_code(address + i);
+    uint32_t* word = reinterpret_cast<uint32_t*>(cpu.memory + address);
+    uint32_t value = __atomic_load_n(word, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(word, &value, guest_quad_order(guest_quad_order(value) + addend), false, __ATOMIC_SEQ_CST,
+                                       __ATOMIC_RELAXED))
+    {
+    }
+    cpu.mark_dirty(address);
+    cpu.set_register_quad(inst.val3, guest_quad_order(value));
+}
+
+template<class Config>
+void MIFence(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+template<class Config>
+void RILoadImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    cpu.registers[inst.val1] = inst.val2;
+}
+
+template<class Config>
+void RILoadRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    cpu.registers[inst.val1] = cpu.registers[inst.val2];
+}
+
+template<class Config>
+void RIAddImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    cpu.registers[inst.val1] = cpu.registers[inst.val2] + inst.val3;
+}
+
+template<class Config>
+void RIAddRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    cpu.registers[inst.val1] = cpu.registers[inst.val2] + cpu.registers[inst.val3];
 }
 
-void MILoadMemoryRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+template<class Config>
+void RIAddImmediateSaveCarry(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint32_t value = (cpu.registers[val1] << 24) | (cpu.registers[val2] << 16) | (cpu.registers[val3] << 8) | (cpu.registers[val4]);
-    cpu.memory[value] = cpu.registers[val5];
+    uint16_t sum = cpu.registers[inst.val3] + inst.val4;
+    cpu.registers[inst.val1] = sum & 0xFF;
+    cpu.registers[inst.val2] = (sum >> 8) & 0xFF;
 }
 
-void MILoadMemoryImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+template<class Config>
+void RIAddRegisterSaveCarry(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint32_t value = (val1 << 24) | (val2 << 16) | (val3 << 8) | (val4);
-    cpu.registers[val5] = cpu.memory[value];
+    uint16_t sum = cpu.registers[inst.val3] + cpu.registers[inst.val4];
+    cpu.registers[inst.val1] = sum & 0xFF;
+    cpu.registers[inst.val2] = (sum >> 8) & 0xFF;
 }
 
-void MIStoreMemoryRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+template<class Config>
+void RIMulImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint32_t value = (cpu.registers[val1] << 24) | (cpu.registers[val2] << 16) | (cpu.registers[val3] << 8) | (cpu.registers[val4]);
-    cpu.memory[value] = cpu.registers[val5];
+    uint16_t product = cpu.registers[inst.val2]*inst.val3;
+    cpu.registers[inst.val1] = product & 0xFF;
 }
 
-void MIStoreMemoryImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+template<class Config>
+void RIMulRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint32_t value = (val1 << 24) | (val2 << 16) | (val3 << 8) | (val4);
-    cpu.memory[value] = cpu.registers[val5];
+    uint16_t product = cpu.registers[inst.val2]*cpu.registers[inst.val3];
+    cpu.registers[inst.val1] = product & 0xFF;
 }
 
-void RILoadImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<class Config>
+void RIMulImmediateSaveCarry(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    cpu.registers[val1] = val2;
+    uint16_t product = cpu.registers[inst.val4]*inst.val3;
+    cpu.registers[inst.val1] = product & 0xFF;
+    cpu.registers[inst.val2] = (product >> 8) & 0xFF;
 }
 
-void RILoadRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<class Config>
+void RIMulRegisterSaveCarry(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    cpu.registers[val1] = cpu.registers[val2];
+    uint16_t product = cpu.registers[inst.val4]*cpu.registers[inst.val3];
+    cpu.registers[inst.val1] = product & 0xFF;
+    cpu.registers[inst.val2] = (product >> 8) & 0xFF;
 }
 
-void RIAddImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<class Config>
+void RIDivImmediateRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    cpu.registers[val1] = cpu.registers[val2] + val3;
+    if(cpu.registers[inst.val3] == 0)
+    {
+        cpu.trap(DivideByZero);
+        return;
+    }
+    uint8_t quotient = inst.val2/cpu.registers[inst.val3];
+    cpu.registers[inst.val1] = quotient;
+}
+
+template<class Config>
+void RIDivRegisterImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    if(inst.val3 == 0)
+    {
+        cpu.trap(DivideByZero);
+        return;
+    }
+    uint8_t quotient = cpu.registers[inst.val2]/inst.val3;
+    cpu.registers[inst.val1] = quotient;
 }
 
-void RIAddRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<class Config>
+void RIDivRegisterRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    cpu.registers[val1] = cpu.registers[val2] + cpu.registers[val3];
+    if(cpu.registers[inst.val3] == 0)
+    {
+        cpu.trap(DivideByZero);
+        return;
+    }
+    uint8_t quotient = cpu.registers[inst.val2]/cpu.registers[inst.val3];
+    cpu.registers[inst.val1] = quotient;
 }
 
-void RIAddImmediateSaveCarry(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<class Config>
+void RIModImmediateRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint16_t sum = cpu.registers[val3] + val4;
-    cpu.registers[val1] = sum & 0xFF;
-    cpu.registers[val2] = (sum >> 8) & 0xFF;
+    if(cpu.registers[inst.val3] == 0)
+    {
+        cpu.trap(DivideByZero);
+        return;
+    }
+    uint8_t modulus = inst.val2 % cpu.registers[inst.val3];
+    cpu.registers[inst.val1] = modulus;
 }
 
-void RIAddRegisterSaveCarry(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<class Config>
+void RIModRegisterImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint16_t sum = cpu.registers[val3] + cpu.registers[val4];
-    cpu.registers[val1] = sum & 0xFF;
-    cpu.registers[val2] = (sum >> 8) & 0xFF;
+    if(inst.val3 == 0)
+    {
+        cpu.trap(DivideByZero);
+        return;
+    }
+    uint8_t modulus = cpu.registers[inst.val2] % inst.val3;
+    cpu.registers[inst.val1] = modulus;
 }
 
-void RIMulImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<class Config>
+void RIModRegisterRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint16_t product = cpu.registers[val2]*val3;
-    cpu.registers[val1] = product & 0xFF;
+    if(cpu.registers[inst.val3] == 0)
+    {
+        cpu.trap(DivideByZero);
+        return;
+    }
+    uint8_t modulus = cpu.registers[inst.val2] % cpu.registers[inst.val3];
+    cpu.registers[inst.val1] = modulus;
 }
 
-void RIMulRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<class Config>
+void RIAndImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint16_t product = cpu.registers[val2]*cpu.registers[val3];
-    cpu.registers[val1] = product & 0xFF;
+    uint8_t result = cpu.registers[inst.val2] & inst.val3;
+    cpu.registers[inst.val1] = result;
 }
 
-void RIMulImmediateSaveCarry(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<class Config>
+void RIAndRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint16_t product = cpu.registers[val4]*val3;
-    cpu.registers[val1] = product & 0xFF;
-    cpu.registers[val2] = (product >> 8) & 0xFF;
+    uint8_t result = cpu.registers[inst.val2] & cpu.registers[inst.val3];
+    cpu.registers[inst.val1] = result;
 }
 
-void RIMulRegisterSaveCarry(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<class Config>
+void RIOrImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint16_t product = cpu.registers[val4]*cpu.registers[val3];
-    cpu.registers[val1] = product & 0xFF;
-    cpu.registers[val2] = (product >> 8) & 0xFF;
+    uint8_t result = cpu.registers[inst.val2] | inst.val3;
+    cpu.registers[inst.val1] = result;
 }
 
-void RIDivImmediateRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<class Config>
+void RIOrRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint8_t quotient = val2/cpu.registers[val3];
-    cpu.registers[val1] = quotient;
+    uint8_t result = cpu.registers[inst.val2] | cpu.registers[inst.val3];
+    cpu.registers[inst.val1] = result;
 }
 
-void RIDivRegisterImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<class Config>
+void RIXorImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint8_t quotient = cpu.registers[val2]/val3;
-    cpu.registers[val1] = quotient;
+    uint8_t result = cpu.registers[inst.val2] ^ inst.val3;
+    cpu.registers[inst.val1] = result;
 }
 
-void RIDivRegisterRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<class Config>
+void RIXorRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint8_t quotient = cpu.registers[val2]/cpu.registers[val3];
-    cpu.registers[val1] = quotient;
+    uint8_t result = cpu.registers[inst.val2] ^ cpu.registers[inst.val3];
+    cpu.registers[inst.val1] = result;
 }
 
-void RIModImmediateRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<class Config>
+void RIBitwiseComplement(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint8_t modulus = val2 % cpu.registers[val3];
-    cpu.registers[val1] = modulus;
+    uint8_t result = ~cpu.registers[inst.val2];
+    cpu.registers[inst.val1] = result;
 }
 
-void RIModRegisterImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define DERP_BSWAP_GROUPS 1
+/// Host integer of a group's width, for loading groups that do not wrap in one access.
+template<int Bytes> struct GroupWord;
+template<> struct GroupWord<2>
+{
+    typedef uint16_t Type;
+    static inline Type swap(Type value) { return __builtin_bswap16(value); }
+};
+template<> struct GroupWord<4>
+{
+    typedef uint32_t Type;
+    static inline Type swap(Type value) { return __builtin_bswap32(value); }
+};
+template<> struct GroupWord<8>
+{
+    typedef uint64_t Type;
+    static inline Type swap(Type value) { return __builtin_bswap64(value); }
+};
+#endif
+
+/// A register group as an integer. Bytes is 2, 4 or 8.
+template<int Bytes, class Config>
+static inline uint64_t load_group(const BasicCPU<Config>& cpu, uint8_t first)
 {
-    uint8_t modulus = cpu.registers[val2] % val3;
-    cpu.registers[val1] = modulus;
+#if DERP_BSWAP_GROUPS
+    /// Groups that do not wrap are one load and a byte swap.
+    if(first <= NUM_REGISTERS - Bytes)
+    {
+        typename GroupWord<Bytes>::Type word;
+        memcpy(&word, cpu.registers + first, Bytes);
+        return GroupWord<Bytes>::swap(word);
+    }
+#endif
+    uint64_t value = 0;
+    for(int i = 0; i < Bytes; ++i)
+        value = (value << 8) | cpu.registers[uint8_t(first + i)];
+    return value;
 }
 
-void RIModRegisterRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<int Bytes, class Config>
+static inline void store_group(BasicCPU<Config>& cpu, uint8_t first, uint64_t value)
 {
-    uint8_t modulus = cpu.registers[val2] % cpu.registers[val3];
-    cpu.registers[val1] = modulus;
+#if DERP_BSWAP_GROUPS
+    if(first <= NUM_REGISTERS - Bytes)
+    {
+        typename GroupWord<Bytes>::Type word = GroupWord<Bytes>::swap(typename GroupWord<Bytes>::Type(value));
+        memcpy(cpu.registers + first, &word, Bytes);
+        return;
+    }
+#endif
+    for(int i = Bytes - 1; i >= 0; --i)
+    {
+        cpu.registers[uint8_t(first + i)] = value & 0xFF;
+        value >>= 8;
+    }
 }
 
-void RIAndImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<int Bytes, class Config>
+static inline void wide_add(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint8_t result = cpu.registers[val2] & val3;
-    cpu.registers[val1] = result;
+    store_group<Bytes>(cpu, inst.val1, load_group<Bytes>(cpu, inst.val2) + load_group<Bytes>(cpu, inst.val3));
 }
 
-void RIAndRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<int Bytes, class Config>
+static inline void wide_sub(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint8_t result = cpu.registers[val2] & cpu.registers[val3];
-    cpu.registers[val1] = result;
+    store_group<Bytes>(cpu, inst.val1, load_group<Bytes>(cpu, inst.val2) - load_group<Bytes>(cpu, inst.val3));
 }
 
-void RIOrImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<int Bytes, class Config>
+static inline void wide_mul(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint8_t result = cpu.registers[val2] | val3;
-    cpu.registers[val1] = result;
+    store_group<Bytes>(cpu, inst.val1, load_group<Bytes>(cpu, inst.val2) * load_group<Bytes>(cpu, inst.val3));
 }
 
-void RIOrRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<int Bytes, class Config>
+static inline void wide_shift_left(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint8_t result = cpu.registers[val2] | cpu.registers[val3];
-    cpu.registers[val1] = result;
+    uint64_t value = load_group<Bytes>(cpu, inst.val2);
+    store_group<Bytes>(cpu, inst.val1, inst.val3 < 8*Bytes ? value << inst.val3 : 0);
 }
 
-void RIXorImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<int Bytes, class Config>
+static inline void wide_shift_right(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint8_t result = cpu.registers[val2] ^ val3;
-    cpu.registers[val1] = result;
+    uint64_t value = load_group<Bytes>(cpu, inst.val2);
+    store_group<Bytes>(cpu, inst.val1, inst.val3 < 8*Bytes ? value >> inst.val3 : 0);
 }
 
-void RIXorRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<int Bytes, class Config>
+static inline void wide_compare(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint8_t result = cpu.registers[val2] ^ cpu.registers[val3];
-    cpu.registers[val1] = result;
+    uint64_t a = load_group<Bytes>(cpu, inst.val2);
+    uint64_t b = load_group<Bytes>(cpu, inst.val3);
+    cpu.registers[inst.val1] = a > b ? 1 : a < b ? 255 : 0;
 }
 
-void RIBitwiseComplement(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4)
+template<int Bytes, class Config>
+static inline void wide_increment(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint8_t result = ~cpu.registers[val2];
-    cpu.registers[val1] = result;
+    store_group<Bytes>(cpu, inst.val1, load_group<Bytes>(cpu, inst.val1) + inst.val2);
 }
 
-void IIJumpImmediateQuad(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+/// The handler tables and the run loop need one named function per width.
+#define WIDE_HANDLERS(name, kernel) \
+    template<class Config> void name##16(BasicCPU<Config>& cpu, const DecodedInstruction& inst) { kernel<2>(cpu, inst); } \
+    template<class Config> void name##32(BasicCPU<Config>& cpu, const DecodedInstruction& inst) { kernel<4>(cpu, inst); } \
+    template<class Config> void name##64(BasicCPU<Config>& cpu, const DecodedInstruction& inst) { kernel<8>(cpu, inst); }
+
+WIDE_HANDLERS(RIAddRegister, wide_add)
+WIDE_HANDLERS(RISubRegister, wide_sub)
+WIDE_HANDLERS(RIMulRegister, wide_mul)
+WIDE_HANDLERS(RIShiftLeftImmediate, wide_shift_left)
+WIDE_HANDLERS(RIShiftRightImmediate, wide_shift_right)
+WIDE_HANDLERS(RICompareRegister, wide_compare)
+WIDE_HANDLERS(RIIncrementImmediate, wide_increment)
+#undef WIDE_HANDLERS
+
+template<class Config>
+void IIJumpImmediateQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint32_t value = (val1 << 24) | (val2 << 16) | (val3 << 8) | (val4);
+    uint32_t value = inst.quad;
     cpu.program_counter += value;
     cpu.program_counter -= 8;
     
 }
 
-void IIJumpRegisterQuad(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+template<class Config>
+void IIJumpRegisterQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint32_t value = (cpu.registers[val1] << 24) | (cpu.registers[val2] << 16) | (cpu.registers[val3] << 8) | (cpu.registers[val4]);
-    cpu.program_counter -= value;
+    uint32_t value = (cpu.registers[inst.val1] << 24) | (cpu.registers[inst.val2] << 16) | (cpu.registers[inst.val3] << 8) | (cpu.registers[inst.val4]);
+    cpu.program_counter += value;
     cpu.program_counter -= 8;
 }
 
-void IIJumpBackImmediateQuad(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+template<class Config>
+void IIJumpBackImmediateQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint32_t value = (val1 << 24) | (val2 << 16) | (val3 << 8) | (val4);
+    uint32_t value = inst.quad;
     cpu.program_counter -= value;
     cpu.program_counter -= 8;
 }
 
-void IIJumpBackRegisterQuad(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+template<class Config>
+void IIJumpBackRegisterQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint32_t value = (cpu.registers[val1] << 24) | (cpu.registers[val2] << 16) | (cpu.registers[val3] << 8) | (cpu.registers[val4]);
+    uint32_t value = (cpu.registers[inst.val1] << 24) | (cpu.registers[inst.val2] << 16) | (cpu.registers[inst.val3] << 8) | (cpu.registers[inst.val4]);
     cpu.program_counter -= value;
     cpu.program_counter -= 8;
 }
 
-void IIHaltImmediateQuad(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+template<class Config>
+void IIHaltImmediateQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint32_t value = (val1 << 24) | (val2 << 16) | (val3 << 8) | (val4);
-    exit(value);
+    uint32_t value = inst.quad;
+    cpu.halt(value);
 }
 
-void IIHaltRegisterQuad(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+template<class Config>
+void IIHaltRegisterQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint32_t value = (cpu.registers[val1] << 24) | (cpu.registers[val2] << 16) | (cpu.registers[val3] << 8) | (cpu.registers[val4]);
-    exit(value);
+    uint32_t value = (cpu.registers[inst.val1] << 24) | (cpu.registers[inst.val2] << 16) | (cpu.registers[inst.val3] << 8) | (cpu.registers[inst.val4]);
+    cpu.halt(value);
 }
 
-void IISetStackAddressImmediateQuadAddress(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+template<class Config>
+void IISetStackAddressImmediateQuadAddress(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint32_t value = (val1 << 24) | (val2 << 16) | (val3 << 8) | (val4);
+    uint32_t value = inst.quad;
     cpu.stack_address = value;
 }
 
-void IISetStackAddressRegisterQuadAddress(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+template<class Config>
+void IISetStackAddressRegisterQuadAddress(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint32_t value = (cpu.registers[val1] << 24) | (cpu.registers[val2] << 16) | (cpu.registers[val3] << 8) | (cpu.registers[val4]);
+    uint32_t value = (cpu.registers[inst.val1] << 24) | (cpu.registers[inst.val2] << 16) | (cpu.registers[inst.val3] << 8) | (cpu.registers[inst.val4]);
     cpu.stack_address = value;
 }
 
-void IIPushStackRegisterArguments(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+/// Pushes the first count operands, at most 4, then the count itself.
+template<class Config>
+static inline void push_arguments(BasicCPU<Config>& cpu, uint8_t count, const uint8_t* operands)
 {
-    cpu.memory[cpu.stack_address++] = cpu.registers[val1];
-    switch(val1)
+    count = count > 4 ? 4 : count;
+    if(uint64_t(cpu.stack_address) + count + 1 > Config::physical_memory_size)
     {
-        case 1:
-            cpu.memory[cpu.stack_address++] = cpu.registers[val2];
-        case 2:
-            cpu.memory[cpu.stack_address++] = cpu.registers[val3];
-        case 3:
-            cpu.memory[cpu.stack_address++] = cpu.registers[val4];
-        default:
-            cpu.memory[cpu.stack_address++] = cpu.registers[val5]; /// Default case = write mem address
-        case 0:
-            cpu.memory[cpu.stack_address++] = cpu.registers[val1];
+        cpu.trap(StackOverflow);
+        return;
     }
+    TRACE_MEMORY(cpu.trace_access(cpu.stack_address, count + 1, MemoryWrite));
+    for(uint8_t i = 0; i < count; ++i)
+        cpu.store(cpu.stack_address++, operands[i]);
+    cpu.store(cpu.stack_address++, count);
 }
 
-void IIPushStackImmediateArguments(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+template<class Config>
+void IIPushStackRegisterArguments(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-//     cpu.memory[cpu.stack_address++] = val1;
-    switch(val1)
-    {
-        case 1:
-            cpu.memory[cpu.stack_address++] = val2;
-        case 2:
-            cpu.memory[cpu.stack_address++] = val3;
-        case 3:
-            cpu.memory[cpu.stack_address++] = val4;
-        default:
-            cpu.memory[cpu.stack_address++] = val5; /// Default case = write mem address
-        case 0:
-            cpu.memory[cpu.stack_address++] = val1;
-    }
+    const uint8_t operands[4] = {cpu.registers[inst.val2], cpu.registers[inst.val3], cpu.registers[inst.val4], cpu.registers[inst.val5]};
+    push_arguments(cpu, inst.val1, operands);
 }
 
-void IIPopStack(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+template<class Config>
+void IIPushStackImmediateArguments(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint8_t num_args = cpu.memory[--cpu.stack_address];
-    cpu.stack_address -= num_args >= 4 ? 4 : num_args;
+    const uint8_t operands[4] = {inst.val2, inst.val3, inst.val4, inst.val5};
+    push_arguments(cpu, inst.val1, operands);
 }
 
-void IIPrintToScreenImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+template<class Config>
+void IIPopStack(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    printf("%c", cpu.registers[val1]);
-    fflush(stdout);
+    if(cpu.return_stack.empty())
+    {
+        cpu.trap(StackUnderflow);
+        return;
+    }
+    PROFILE(if(cpu.profiler) cpu.profiler->pop_frame());
+    const ReturnFrame& frame = cpu.return_stack.back();
+    cpu.stack_address = frame.stack_address;
+    cpu.program_counter = frame.return_address - 8;
+    cpu.return_stack.pop_back();
 }
 
-void IIPrintToScreenRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+template<class Config>
+void IIPrintToScreenImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    printf("%c", cpu.registers[val1]);
-    fflush(stdout);
+    cpu.console().put(inst.val1);
 }
 
-void IISetInterruptHandlerRoutineImmediate(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+template<class Config>
+void IIPrintToScreenRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    uint32_t value = (val1 << 24) | (val2 << 16) | (val3 << 8) | (val4);
-    cpu.exception_handler_routine_address = value;
+    cpu.console().put(cpu.registers[inst.val1]);
 }
 
-void IISaveInterruptReasonRegister(CPU& cpu, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5)
+template<class Config>
+void IISetInterruptHandlerRoutineImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    cpu.registers[val1] = cpu.exception_reason;
+    uint32_t value = inst.quad;
+    cpu.exception_handler_routine_address = value;
+    if(value && cpu.interrupts_enabled)
+        cpu.release_held_interrupts();
 }
 
-std::string trim(std::string in)
+template<class Config>
+void IISaveInterruptReasonRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
 {
-    int beg = 0;
-    while(beg < int(in.size()) && isspace(in[beg]))
-        ++beg;
-    
-    int end = int(in.size()) - 1;
-    while(end >= 0 && isspace(in[end]))
-        --end;
-    
-    if(beg > end)
-        return "";
-    else
-        return in.substr(beg, end - beg + 1);
+    cpu.registers[inst.val1] = cpu.exception_reason;
 }
 
-std::vector<uint64_t> parse_asm(FILE* in)
+/// Pushes a return frame owning the top frames argument frames and jumps to target. The argument frames are found
+/// from their count bytes here, so popstk is a plain pop.
+template<class Config>
+static inline void call(BasicCPU<Config>& cpu, uint32_t target, uint8_t frames)
 {
-    std::vector<uint64_t> result;
-    
-    std::map<std::string, uint8_t> masm_to_idx;
-    for(uint8_t i = 0; i < MemoryInstructionsSize; ++i)
-        masm_to_idx[MI_asm[i]] = i;
-    
-    std::map<std::string, uint8_t> rasm_to_idx;
-    for(uint8_t i = 0; i < RegisterInstructionSize; ++i)
-        rasm_to_idx[RI_asm[i]] = i;
-    
-    std::map<std::string, uint8_t> iasm_to_idx;
-    for(uint8_t i = 0; i < RegisterInstructionSize; ++i)
-        iasm_to_idx[II_asm[i]] = i;
-    
-    std::map<std::string, std::size_t> labels_to_statement_idx;
-    std::vector<std::string> statements;
-    
-    while(true)
+    if(cpu.return_stack.size() >= Config::return_stack_size)
     {
-        uint64_t out_inst = 0;
-        std::string statement = "";
-        int predicated_on = -1;
-        
-        while(true)
-        {
-            char chr = fgetc(in);
-            
-            if(chr == ';')
-                break;
-            else
-                statement.push_back(chr);
-        }
-        
-        if(feof(in))
-            break;
-        
-        std::size_t colon_pos = statement.find(":");
-        
-        if(colon_pos != std::string::npos)
-        {
-            std::string label = trim(statement.substr(0, colon_pos - 1));
-            std::size_t idx = statements.size();
-            labels_to_statement_idx[label] = idx;
-            statement = trim(statement.substr(colon_pos + 1));
-        }
-        
-        std::size_t qmark_pos = statement.find("?");
-        
-        if(qmark_pos != std::string::npos)
-        {
-            std::string predicate_register = trim(statement.substr(qmark_pos + 1));
-            sscanf(predicate_register.c_str(), "%d", &predicated_on);
-            statement = trim(statement.substr(0, qmark_pos - 1));
-        }
-        
-        std::size_t first_word_boundary = statement.find(" ");
-        std::string inst = statement.substr(0, first_word_boundary);
-        
-        if(masm_to_idx.count(inst) == 0)
-        {
-            std::string args;
-            
-            
-        }
-        else if(rasm_to_idx.count(inst) == 0)
-        {
-        }
-        else if(iasm_to_idx.count(inst) == 0)
-        {
-        }
-        else
+        cpu.trap(StackOverflow);
+        return;
+    }
+    uint32_t base = cpu.stack_address;
+    for(uint8_t i = 0; i < frames; ++i)
+    {
+        uint32_t size = base - 1 < Config::physical_memory_size ? 1 + std::min<uint32_t>(cpu.memory[base - 1], 4) : UINT32_MAX;
+        if(base < size)
         {
-            fprintf(stderr, "Illegal instruction \"%s\"", inst.c_str());
-            exit(1);
+            cpu.trap(StackUnderflow);
+            return;
         }
-        
-        
+        TRACE_MEMORY(cpu.trace_access(base - 1, 1, MemoryRead));
+        base -= size;
     }
-    
-    return result;
-}
\ No newline at end of file
+    PROFILE(if(cpu.profiler) cpu.profiler->push_frame(cpu.program_counter));
+    cpu.return_stack.push_back({cpu.program_counter + 8, base});
+    cpu.program_counter = target - 8;
+}
+
+template<class Config>
+void IICallImmediateQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    call(cpu, inst.quad, inst.val5);
+}
+
+template<class Config>
+void IICallRegisterQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    uint32_t value = (cpu.registers[inst.val1] << 24) | (cpu.registers[inst.val2] << 16) | (cpu.registers[inst.val3] << 8) | (cpu.registers[inst.val4]);
+    call(cpu, value, inst.val5);
+}
+
+template<class Config>
+void IISaveStackAddressRegisterQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    cpu.registers[inst.val1] = cpu.stack_address >> 24;
+    cpu.registers[inst.val2] = cpu.stack_address >> 16;
+    cpu.registers[inst.val3] = cpu.stack_address >> 8;
+    cpu.registers[inst.val4] = cpu.stack_address;
+}
+
+template<class Config>
+void IISaveHartIdRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    cpu.registers[inst.val1] = cpu.hart_id;
+}
+
+template<class Config>
+void IISpawnHartImmediateQuad(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    cpu.registers[inst.val5] = cpu.machine ? cpu.machine->spawn(cpu, inst.quad) : 0;
+}
+
+template<class Config>
+void IIJoinHartRegister(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    uint32_t value = UNHANDLED_EXCEPTION_HALT_VALUE;
+    if(cpu.machine && !cpu.machine->join(cpu, cpu.registers[inst.val1], value))
+    {
+        /// The machine is stopping or an interrupt is pending. Run the join again once run() has taken the
+        /// interrupt, or until it returns at its budget.
+        cpu.program_counter -= 8;
+        return;
+    }
+    cpu.set_register_quad(inst.val2, value);
+}
+
+template<class Config>
+void IIReturnFromInterruptImmediate(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    cpu.program_counter = cpu.errored_program_counter + 8*inst.val1 - 8;
+    cpu.interrupts_enabled = true;
+    cpu.in_exception_handler = false;
+    if(cpu.exception_handler_routine_address)
+        cpu.release_held_interrupts();
+}
+
+#if defined(__GNUC__)
+/// The kernels are all internal, the AVX argument passing ABI note does not apply to them.
+#pragma GCC diagnostic ignored "-Wpsabi"
+/// One host vector, a single AVX2 register when built with -mavx2.
+typedef uint8_t VectorChunk __attribute__((vector_size(32)));
+typedef uint16_t WideVectorChunk __attribute__((vector_size(64)));
+#else
+typedef uint8_t VectorChunk;
+#endif
+static_assert(NUM_REGISTERS % sizeof(VectorChunk) == 0, "Register file must be a whole number of host vectors.");
+
+static inline unsigned vector_length(uint8_t immediate)
+{
+    return immediate ? immediate : NUM_REGISTERS;
+}
+
+/// Copies a range out of the register file, wrapping past the last register.
+template<class Config>
+static inline void gather_range(const BasicCPU<Config>& cpu, uint8_t first, unsigned length, uint8_t* out)
+{
+    unsigned head = std::min(length, unsigned(NUM_REGISTERS - first));
+    memcpy(out, cpu.registers + first, head);
+    memcpy(out + head, cpu.registers, length - head);
+}
+
+template<class Config>
+static inline void scatter_range(BasicCPU<Config>& cpu, uint8_t first, unsigned length, const uint8_t* in)
+{
+    unsigned head = std::min(length, unsigned(NUM_REGISTERS - first));
+    memcpy(cpu.registers + first, in, head);
+    memcpy(cpu.registers, in + head, length - head);
+}
+
+static inline VectorChunk load_chunk(const uint8_t* bytes)
+{
+    VectorChunk value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static inline void store_chunk(uint8_t* bytes, const VectorChunk& value)
+{
+    memcpy(bytes, &value, sizeof(value));
+}
+
+struct alignas(32) VectorBuffer
+{
+    uint8_t bytes[NUM_REGISTERS];
+};
+
+/// A source range as one run that can be read a whole chunk at a time: the registers themselves unless the range
+/// wraps or ends too close to the last register, a copy otherwise.
+template<class Config>
+static inline const uint8_t* source_range(const BasicCPU<Config>& cpu, uint8_t first, unsigned length, VectorBuffer& copy)
+{
+    if(first + std::max<unsigned>(length, sizeof(VectorChunk)) <= NUM_REGISTERS)
+        return cpu.registers + first;
+    gather_range(cpu, first, length, copy.bytes);
+    return copy.bytes;
+}
+
+/// Offset of the chunk starting at i. The last chunk is pulled back to end exactly at length, overlapping the one
+/// before it, so kernels need no tail loop. Ranges shorter than a chunk use one chunk and ignore the extra lanes.
+static inline unsigned chunk_offset(unsigned i, unsigned length)
+{
+    return length >= sizeof(VectorChunk) ? std::min<unsigned>(i, length - sizeof(VectorChunk)) : 0;
+}
+
+/// Writes a result back once every source has been read, so ranges may overlap in any way.
+template<class Config>
+static inline void store_range(BasicCPU<Config>& cpu, uint8_t first, unsigned length, const uint8_t* result)
+{
+    if(length < sizeof(VectorChunk) || first + length > NUM_REGISTERS)
+    {
+        scatter_range(cpu, first, length, result);
+        return;
+    }
+    for(unsigned i = 0; i < length; i += sizeof(VectorChunk))
+    {
+        unsigned at = chunk_offset(i, length);
+        store_chunk(cpu.registers + first + at, load_chunk(result + at));
+    }
+}
+
+/// val1 = operation(val2, val3) over val4 registers.
+template<typename Operation, class Config>
+static inline void vector_binary(BasicCPU<Config>& cpu, const DecodedInstruction& inst, Operation operation)
+{
+    unsigned length = vector_length(inst.val4);
+    VectorBuffer a_copy, b_copy, result;
+    const uint8_t* a = source_range(cpu, inst.val2, length, a_copy);
+    const uint8_t* b = source_range(cpu, inst.val3, length, b_copy);
+    for(unsigned i = 0; i < length; i += sizeof(VectorChunk))
+    {
+        unsigned at = chunk_offset(i, length);
+        store_chunk(result.bytes + at, operation(load_chunk(a + at), load_chunk(b + at)));
+    }
+    store_range(cpu, inst.val1, length, result.bytes);
+}
+
+template<class Config>
+void VIVectorAdd(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    vector_binary(cpu, inst, [](const VectorChunk& a, const VectorChunk& b) { return VectorChunk(a + b); });
+}
+
+template<class Config>
+void VIVectorAddSaveCarry(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    unsigned length = vector_length(inst.val5);
+    VectorBuffer a_copy, b_copy, sum, carry;
+    const uint8_t* a = source_range(cpu, inst.val3, length, a_copy);
+    const uint8_t* b = source_range(cpu, inst.val4, length, b_copy);
+    for(unsigned i = 0; i < length; i += sizeof(VectorChunk))
+    {
+        unsigned at = chunk_offset(i, length);
+        VectorChunk none = {};
+        VectorChunk first = load_chunk(a + at);
+        VectorChunk low = first + load_chunk(b + at);
+        store_chunk(sum.bytes + at, low);
+        store_chunk(carry.bytes + at, low < first ? VectorChunk(none + 1) : none);
+    }
+    store_range(cpu, inst.val1, length, sum.bytes);
+    store_range(cpu, inst.val2, length, carry.bytes);
+}
+
+template<class Config>
+void VIVectorAnd(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    vector_binary(cpu, inst, [](const VectorChunk& a, const VectorChunk& b) { return VectorChunk(a & b); });
+}
+
+template<class Config>
+void VIVectorOr(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    vector_binary(cpu, inst, [](const VectorChunk& a, const VectorChunk& b) { return VectorChunk(a | b); });
+}
+
+template<class Config>
+void VIVectorXor(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    vector_binary(cpu, inst, [](const VectorChunk& a, const VectorChunk& b) { return VectorChunk(a ^ b); });
+}
+
+template<class Config>
+void VIVectorCompareEqual(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    vector_binary(cpu, inst, [](const VectorChunk& a, const VectorChunk& b) { VectorChunk none = {}; return a == b ? VectorChunk(~none) : none; });
+}
+
+template<class Config>
+void VIVectorCompareGreater(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    vector_binary(cpu, inst, [](const VectorChunk& a, const VectorChunk& b) { VectorChunk none = {}; return a > b ? VectorChunk(~none) : none; });
+}
+
+template<class Config>
+void VIVectorMin(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    vector_binary(cpu, inst, [](const VectorChunk& a, const VectorChunk& b) { return a < b ? a : b; });
+}
+
+template<class Config>
+void VIVectorMax(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    vector_binary(cpu, inst, [](const VectorChunk& a, const VectorChunk& b) { return a > b ? a : b; });
+}
+
+template<class Config>
+void VIVectorSum(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    unsigned length = vector_length(inst.val3);
+    VectorBuffer copy;
+    const uint8_t* a = source_range(cpu, inst.val2, length, copy);
+    uint32_t sum = 0;
+    unsigned i = 0;
+#if defined(__GNUC__)
+    /// 16-bit lanes cannot overflow, each sees at most NUM_REGISTERS / 32 bytes.
+    WideVectorChunk wide = {};
+    for(; i + sizeof(VectorChunk) <= length; i += sizeof(VectorChunk))
+        wide += __builtin_convertvector(load_chunk(a + i), WideVectorChunk);
+    for(unsigned lane = 0; lane < sizeof(VectorChunk); ++lane)
+        sum += wide[lane];
+#endif
+    for(; i < length; ++i)
+        sum += a[i];
+    cpu.set_register_quad(inst.val1, sum);
+}
+
+template<class Config>
+void VIVectorLoadMemory(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    uint32_t address = cpu.register_quad(inst.val2);
+    unsigned length = vector_length(inst.val3);
+    if(!block_in_range(cpu, address, length))
+        return;
+    TRACE_MEMORY(cpu.trace_access(address, length, MemoryRead));
+    store_range(cpu, inst.val1, length, cpu.memory + address);
+}
+
+template<class Config>
+void VIVectorStoreMemory(BasicCPU<Config>& cpu, const DecodedInstruction& inst)
+{
+    uint32_t address = cpu.register_quad(inst.val1);
+    unsigned length = vector_length(inst.val3);
+    if(!block_in_range(cpu, address, length))
+        return;
+    VectorBuffer copy;
+    const uint8_t* source = source_range(cpu, inst.val2, length, copy);
+    TRACE_MEMORY(cpu.trace_access(address, length, MemoryWrite));
+    cpu.invalidate_range(address, length);
+    cpu.mark_dirty_range(address, length);
+    memcpy(cpu.memory + address, source, length);
+}
+
+#define INSTANTIATE_CPU(Config) template class BasicCPU<Config>;
+CPU_CONFIGS(INSTANTIATE_CPU)
+#undef INSTANTIATE_CPU
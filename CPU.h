@@ -1,28 +1,425 @@
+#pragma once
+#include <atomic>
 #include <cstdint>
+#include <cstdio>
+#include <memory>
 #include <string>
 #include <vector>
 
 #define INSTRUCTION_SIZE_BITS 64
-#define PHYSICAL_MEMORY_SIZE_BITS 30
-#define PHYSICAL_MEMORY_SIZE (1 << PHYSICAL_MEMORY_SIZE_BITS)
 #define NUM_REGISTER_BITS 8
 #define NUM_REGISTERS (1 << NUM_REGISTER_BITS)
 #define NUM_WORD_BITS 8
+/// Every 32-bit guest address lands inside the reservation. Only the configuration's physical memory is accessible,
+/// the rest (and the guard past 4 GiB for reads that straddle the top) faults.
+#define GUEST_ADDRESS_SPACE_SIZE (uint64_t(1) << 32)
+#define GUEST_GUARD_SIZE (64 << 10)
+#define GUEST_RESERVATION_SIZE (GUEST_ADDRESS_SPACE_SIZE + GUEST_GUARD_SIZE)
+/// Granularity of dirty tracking and snapshots. Matches the host page so snapshot pages can be mapped into a fork.
+#define GUEST_PAGE_BITS 12
+#define GUEST_PAGE_SIZE (1 << GUEST_PAGE_BITS)
+/// Bounds every configuration stays within. Snapshot files, which any configuration can read, are checked against them.
+#define MAX_PHYSICAL_MEMORY_SIZE_BITS 31
+#define MAX_RETURN_STACK_SIZE 4096
+#define MAX_GUEST_PAGE_COUNT (1u << (MAX_PHYSICAL_MEMORY_SIZE_BITS - GUEST_PAGE_BITS))
 
 static_assert(NUM_WORD_BITS == NUM_REGISTER_BITS, "Word size and num register bits must be same size.");
 
-class CPU
+enum ExceptionReasons
+{
+    NoException = 0,
+    MemoryFault, /// Access outside physical memory while trap_memory_faults is set.
+    StackOverflow, /// A call past the configuration's return_stack_size, or an argument frame that does not fit in physical memory.
+    StackUnderflow, /// popstk with no call outstanding, or a call taking more argument frames than the stack holds.
+    MisalignedAccess, /// faddmrq on an address that is not a multiple of 4.
+    DivideByZero, /// A division or modulo by zero.
+    IllegalInstruction, /// An instruction word naming no instruction.
+    /// Interrupts come from outside the instruction stream and are delivered by run() at the next block boundary while
+    /// interrupts are enabled, with errored_program_counter on the instruction that was about to run.
+    TimerInterrupt, /// timer_interval instructions retired since the last one, or a host timer went off (Interrupts.h).
+    HostInterrupt, /// Raised by the host with interrupt().
+    ExceptionReasonsSize
+};
+
+/// Bit of BasicCPU::pending_interrupts asking run() to return at the next block boundary, above every reason's bit.
+#define PREEMPT_REQUEST (1u << 31)
+static_assert(ExceptionReasonsSize <= 31, "Every exception reason needs a bit of pending_interrupts below PREEMPT_REQUEST.");
+
+/// The instruction word layout, as tables the decoder is specialized on (Instructions.h).
+struct InstructionEncoding;
+
+/// Geometry of a CPU, fixed at compile time. BasicCPU, its handlers and its decoder are compiled once per configuration
+/// in CPU_CONFIGS, so every size below is a constant in the code of that configuration.
+template<unsigned MemoryBits, unsigned DecodeCacheBits, uint32_t ReturnStackFrames>
+struct CPUConfig
+{
+    static constexpr uint32_t physical_memory_size = uint32_t(1) << MemoryBits;
+    static constexpr uint32_t guest_page_count = physical_memory_size >> GUEST_PAGE_BITS;
+    /// Decode cache entries, direct mapped on program_counter >> 3.
+    static constexpr uint32_t decode_cache_size = uint32_t(1) << DecodeCacheBits;
+    /// Calls that can be outstanding at once, one more raises StackOverflow.
+    static constexpr uint32_t return_stack_size = ReturnStackFrames;
+    typedef InstructionEncoding Encoding;
+    
+    static_assert(MemoryBits >= GUEST_PAGE_BITS + 6, "Physical memory must fill whole words of the dirty bitmap.");
+    static_assert(MemoryBits <= MAX_PHYSICAL_MEMORY_SIZE_BITS, "Physical memory must leave the top of the address space to fault.");
+    static_assert(DecodeCacheBits >= 2, "Superinstructions need their instructions in distinct decode cache entries.");
+    static_assert(ReturnStackFrames <= MAX_RETURN_STACK_SIZE, "Return stack too deep for the snapshot format.");
+};
+
+template<unsigned MemoryBits, unsigned DecodeCacheBits, uint32_t ReturnStackFrames>
+constexpr uint32_t CPUConfig<MemoryBits, DecodeCacheBits, ReturnStackFrames>::physical_memory_size;
+template<unsigned MemoryBits, unsigned DecodeCacheBits, uint32_t ReturnStackFrames>
+constexpr uint32_t CPUConfig<MemoryBits, DecodeCacheBits, ReturnStackFrames>::guest_page_count;
+template<unsigned MemoryBits, unsigned DecodeCacheBits, uint32_t ReturnStackFrames>
+constexpr uint32_t CPUConfig<MemoryBits, DecodeCacheBits, ReturnStackFrames>::decode_cache_size;
+template<unsigned MemoryBits, unsigned DecodeCacheBits, uint32_t ReturnStackFrames>
+constexpr uint32_t CPUConfig<MemoryBits, DecodeCacheBits, ReturnStackFrames>::return_stack_size;
+
+/// 1 GiB. What CPU is, and what the assembler, images, traces and the command line tools use.
+typedef CPUConfig<30, 12, 4096> DefaultConfig;
+/// 16 MiB, a 256 entry decode cache and 256 outstanding calls, for packing many small guests into one host.
+typedef CPUConfig<24, 8, 256> SmallConfig;
+/// 2 GiB and a 16K entry decode cache, for guests working on large data.
+typedef CPUConfig<31, 14, 4096> LargeConfig;
+
+/// Every configuration compiled into the binary. Adding one here is all it takes to use BasicCPU<Config>.
+#define CPU_CONFIGS(CONFIG) \
+    CONFIG(DefaultConfig) \
+    CONFIG(SmallConfig) \
+    CONFIG(LargeConfig)
+
+/// Halt value reported when an exception is raised with no handler routine set.
+#define UNHANDLED_EXCEPTION_HALT_VALUE 0xFFFFFFFF
+
+/// Profiling support is compiled in with -DDERP_PROFILE, for every translation unit, and switched on at runtime by
+/// setting CPU::profiler. PROFILE(statement) compiles to nothing otherwise.
+#if defined(DERP_PROFILE)
+#define PROFILE(statement) statement
+#else
+#define PROFILE(statement)
+#endif
+
+/// Memory access tracing is compiled in with -DDERP_TRACE_MEMORY, for every translation unit, and switched on at
+/// runtime by setting CPU::memory_tracer. TRACE_MEMORY(statement) compiles to nothing otherwise.
+#if defined(DERP_TRACE_MEMORY)
+#define TRACE_MEMORY(statement) statement
+#else
+#define TRACE_MEMORY(statement)
+#endif
+
+/// What CPU::trace_access is told an access is.
+enum MemoryAccessKind
+{
+    MemoryRead,
+    MemoryWrite, /// Atomics count as writes.
+    MemoryExecute, /// Instruction fetch, 8 bytes, predicate skips included.
+    MemoryAccessKindsSize
+};
+
+class JIT;
+class MemoryTracer;
+template<class Config> class BasicMachine;
+class OutputDevice;
+class Profiler;
+struct Snapshot;
+
+/// One outstanding call. popstk jumps to return_address and puts the stack back to stack_address.
+struct ReturnFrame
+{
+    uint32_t return_address;
+    uint32_t stack_address; /// Below the argument frames the call took.
+};
+
+inline bool operator==(const ReturnFrame& a, const ReturnFrame& b)
+{
+    return a.return_address == b.return_address && a.stack_address == b.stack_address;
+}
+
+/// An instruction with every field already extracted, as kept in the decode cache.
+struct DecodedInstruction
+{
+    uint32_t address; /// Program counter the instruction was decoded at. Tag for the decode cache.
+    bool valid;
+    bool has_predicate;
+    uint8_t predicate_register;
+    uint8_t opcode; /// Flat index over the MI, RI, II and VI handlers, InvalidOpcode raises IllegalInstruction.
+    uint8_t val1;
+    uint8_t val2;
+    uint8_t val3;
+    uint8_t val4;
+    uint8_t val5;
+    uint8_t dispatch; /// What CPU::run dispatches on: opcode, or a superinstruction starting here (Superinstructions.h).
+    bool fused; /// Part of a superinstruction starting before it, which has to be dropped with it.
+    /// Jumps here the run loop has counted towards JIT_HOT_THRESHOLD, then JIT_COMPILED once the JIT has code starting
+    /// here or JIT_NEVER once it refused to compile any, so cold and refused targets never call into the JIT.
+    uint8_t jit_state;
+    uint32_t quad; /// val1-val4 as a big-endian quad, precomputed for the immediate quad forms.
+#if defined(DERP_PROFILE)
+    uint64_t profile_hits; /// Fetches since decode, predicate skips included. Handed to the profiler when the entry is dropped.
+    uint64_t profile_skips;
+#endif
+};
+
+/// One hart of the VM with the geometry of Config. CPU is the default configuration, the others are BasicCPU<SmallConfig>
+/// and so on, and any number of configurations can run side by side.
+template<class Config>
+class BasicCPU
 {
 public:
-    uint8_t memory[PHYSICAL_MEMORY_SIZE];
+    /// Reserves guest memory without committing it, pages are backed by the host on first touch.
+    BasicCPU();
+    /// A CPU running in memory reserved by another CPU, which must outlive it. How a Machine builds its harts.
+    explicit BasicCPU(uint8_t* shared_memory);
+    ~BasicCPU();
+    BasicCPU(const BasicCPU&) = delete;
+    BasicCPU& operator=(const BasicCPU&) = delete;
+    
+    uint8_t* memory; /// Config::physical_memory_size bytes, zero until written, inside a GUEST_RESERVATION_SIZE reservation.
+    bool owns_memory; /// False for the harts sharing another CPU's memory.
     uint8_t registers[NUM_REGISTERS];
     uint32_t stack_address;
+    /// Return addresses of the outstanding calls, innermost last. Kept by the host next to the stack in guest memory,
+    /// so returns never read guest memory and guest stores cannot redirect them.
+    std::vector<ReturnFrame> return_stack;
     uint32_t program_counter;
     uint32_t exception_handler_routine_address;
     uint8_t exception_reason;
     uint32_t errored_program_counter;
+    /// Cleared when the exception handler routine is entered and set again by reti, so an interrupt cannot overwrite
+    /// errored_program_counter before the handler has used it. Traps are taken either way.
+    bool interrupts_enabled;
+    /// From entering the exception handler routine until reti. An exception raised meanwhile is a double fault.
+    bool in_exception_handler;
+    /// One bit per interrupt reason raised and not yet delivered, plus PREEMPT_REQUEST. Set from any thread, run()
+    /// tests it at every block boundary together with the budget, a single branch when nothing is pending.
+    std::atomic<uint32_t> pending_interrupts;
+    /// Interrupts taken off pending_interrupts while the guest could not be interrupted, with interrupts disabled or
+    /// no handler set. Pending again once reti or setihriq changes that.
+    uint32_t held_interrupts;
+    /// Raise TimerInterrupt every timer_interval retired instructions, 0 for never. Counts instructions rather than
+    /// time so a run is the same every time. Changed with set_timer().
+    uint64_t timer_interval;
+    uint64_t timer_deadline; /// instructions_retired() the next TimerInterrupt is due at.
+    bool halted;
+    uint32_t halt_value;
+    /// Receives prti/prtr output. Null until the first print, which then creates a ConsoleDevice on stdout owned by the CPU.
+    OutputDevice* output;
+    bool owns_output;
+    /// Out of range accesses raise MemoryFault instead of killing the host. Free on the fast path, the
+    /// guard pages do the checking.
+    bool trap_memory_faults;
+    /// One bit per page load_image or map_file write-protected, empty if none was, so restore and fork can protect
+    /// them again after rewriting them.
+    std::vector<uint64_t> read_only_bitmap;
+    
+    /// The Machine running this CPU as one of its harts, null when it runs alone as hart 0.
+    BasicMachine<Config>* machine;
+    uint8_t hart_id;
+    
+    /// One bit per guest page written since the last snapshot or restore. The same pages are listed in dirty_pages,
+    /// so taking a snapshot costs the pages written and never a scan of the bitmap.
+    std::vector<uint64_t> dirty_bitmap;
+    std::vector<uint32_t> dirty_pages;
+    /// The snapshot memory matched when dirty tracking last started over, null for a fresh CPU (all zero).
+    std::shared_ptr<const Snapshot> snapshot_base;
+    
+    /// Config::decode_cache_size entries direct mapped on program_counter >> 3. Entries are dropped by invalidate_decoded on stores.
+    /// Allocated zeroed (all invalid) next to guest memory so only the part in use is ever touched.
+    DecodedInstruction* decode_cache;
+    uint64_t decode_cache_hits;
+    uint64_t decode_cache_misses;
+    
+    /// Fuse the sequences listed in Superinstructions.h when run() decodes them. Flush the decode cache after changing it.
+    bool superinstructions;
+    
+    /// Optional compiler for hot blocks, entered by run() after each jump.
+    JIT* jit;
+    uint64_t jit_instructions; /// Guest instructions retired in compiled code. None under JitVerify, which steps them.
+    /// Guest range holding compiled code. A store inside it throws away the compiled code.
+    uint32_t jit_code_low;
+    uint32_t jit_code_span;
+    
+#if defined(DERP_PROFILE)
+    /// Counts everything run() and step() execute while set. Compiled blocks are not entered while profiling.
+    Profiler* profiler;
+    /// Passes the counts of a decode cache entry to the profiler and clears them.
+    void profile_evict(DecodedInstruction& inst);
+#endif
+    
+#if defined(DERP_TRACE_MEMORY)
+    /// Sees the guest accesses run() and step() make while set, instruction fetches included, one in every
+    /// MemoryTracer::sample_period. Compiled blocks are not entered while tracing.
+    MemoryTracer* memory_tracer;
+    uint32_t trace_countdown; /// Accesses until the next one handed to memory_tracer.
+    /// One access of length bytes at address, a MemoryAccessKind. A decrement unless this one is recorded.
+    inline void trace_access(uint32_t address, uint32_t length, uint8_t kind)
+    {
+        if(memory_tracer && !--trace_countdown)
+            trace_sampled(address, length, kind);
+    }
+    /// Hands an access to memory_tracer and starts the next countdown.
+    void trace_sampled(uint32_t address, uint32_t length, uint8_t kind);
+#endif
     
     void perform_instruction(uint64_t instruction);
+    /// Runs inst's handler once, ignoring its predicate and leaving program_counter to the caller.
+    void execute(const DecodedInstruction& inst);
+    void step();
+    /// Executes from program_counter until a halt instruction and returns its value. The budget is checked at
+    /// jumps, once instructions_retired() reaches it run() returns early with halted false. Compiled code checks it
+    /// between blocks and a compiled self loop stops within one iteration of it. Interrupts are only
+    /// delivered by run(), at the same points, step() leaves them pending.
+    uint32_t run(uint64_t instruction_budget = UINT64_MAX);
+    
+    /// Raises the interrupt reason, TimerInterrupt or HostInterrupt. Safe from any thread, including while run() is
+    /// going on another. Latency is one basic block, or up to JIT_LOOP_LIMIT iterations of a compiled loop.
+    inline void interrupt(uint8_t reason)
+    {
+        pending_interrupts.fetch_or(1u << reason, std::memory_order_relaxed);
+    }
+    /// Makes run() return 0 with halted false at its next block boundary, as if the budget ran out, without the guest
+    /// noticing. Safe from any thread. For stopping runaway guests.
+    inline void preempt()
+    {
+        pending_interrupts.fetch_or(PREEMPT_REQUEST, std::memory_order_relaxed);
+    }
+    /// Starts the instruction count timer, the first TimerInterrupt interval instructions from now, or stops it with 0.
+    void set_timer(uint64_t interval);
+    /// Pending again the interrupts held back while the guest could not take them.
+    void release_held_interrupts();
+    /// What run() does at a block boundary once next_event is reached or an interrupt is pending: raises a due timer
+    /// interrupt, enters the handler for the lowest pending reason if the guest can take it and moves next_event on.
+    /// Returns false when run() has to return, preempted or out of budget.
+    bool service_interrupts(uint64_t instruction_limit, uint64_t& next_event);
+    
+    /// Every instruction dispatched, including ones whose predicate was false.
+    inline uint64_t instructions_retired() const
+    {
+        return decode_cache_hits + decode_cache_misses + jit_instructions;
+    }
+    uint64_t fetch_instruction(uint32_t address) const;
+    void decode_into_cache(DecodedInstruction& inst);
+    /// Decodes the instruction at address into inst, dropping whatever inst held.
+    void decode_at(DecodedInstruction& inst, uint32_t address);
+    /// Turns inst into the longest superinstruction starting with it, decoding the instructions after it as needed.
+    void fuse(DecodedInstruction& inst);
+    /// Drops the superinstructions starting before address that cover it.
+    void drop_fused(uint32_t address);
+    /// The instruction at address through the decode cache, without executing or counting it.
+    const DecodedInstruction& decoded(uint32_t address);
+    void load_program(const std::vector<uint64_t>& program, uint32_t address);
+    void flush_decode_cache();
+    /// Stops the machine with value and lets the output device flush.
+    void halt(uint32_t value);
+    /// The output device, creating the default console on first use.
+    OutputDevice& console();
+    /// Enters the exception handler routine with interrupts disabled, or halts with UNHANDLED_EXCEPTION_HALT_VALUE if
+    /// none is set or the handler itself faulted, leaving exception_reason and errored_program_counter as the fault
+    /// being handled left them.
+    void raise_exception(uint8_t reason);
+    /// raise_exception from inside a handler. Leaves program_counter so the program_counter += 8 after every handler
+    /// lands on the exception handler routine.
+    void trap(uint8_t reason);
+    void jit_invalidate();
+    /// Drops cached decodes and compiled code overlapping [address, address + length), for bulk writes.
+    void invalidate_range(uint32_t address, uint32_t length);
+    /// Marks [address, address + length) as written, for writes that do not go through store().
+    void mark_dirty_range(uint32_t address, uint32_t length);
+    /// Records the pages covering [address, address + length) in read_only_bitmap, after write-protecting them.
+    void mark_read_only_range(uint32_t address, uint32_t length);
+    bool is_read_only(uint32_t page) const
+    {
+        return !read_only_bitmap.empty() && (read_only_bitmap[page >> 6] >> (page & 63) & 1);
+    }
+    
+    /// Captures registers, control and exception state, and memory. Only the pages written since the last snapshot
+    /// or restore are copied, everything else is shared with the snapshots before it. Returns snapshot_base itself
+    /// when nothing changed.
+    std::shared_ptr<const Snapshot> snapshot();
+    /// Puts the CPU back in the state captured by snapshot, which may come from any CPU of the same configuration. Only
+    /// pages that can differ are rewritten: those written since the last snapshot or restore and those captured between
+    /// the two snapshots. Pages past this configuration's physical memory are left out.
+    void restore(const std::shared_ptr<const Snapshot>& snapshot);
+    /// A new CPU in the state of snapshot. Its memory maps the snapshot pages copy-on-write, so the cost grows with
+    /// the number of page runs in the snapshot, not with guest memory. trap_memory_faults and the write-protected
+    /// pages are copied by the member form, the output device and JIT are not.
+    static std::unique_ptr<BasicCPU> fork(const std::shared_ptr<const Snapshot>& snapshot);
+    std::unique_ptr<BasicCPU> fork();
+    
+    /// The big-endian quad held in four consecutive registers starting at first, wrapping past the last register.
+    inline uint32_t register_quad(uint8_t first) const
+    {
+        return (uint32_t(registers[first]) << 24) | (registers[uint8_t(first + 1)] << 16) |
+               (registers[uint8_t(first + 2)] << 8) | registers[uint8_t(first + 3)];
+    }
+    inline void set_register_quad(uint8_t first, uint32_t value)
+    {
+        registers[first] = value >> 24;
+        registers[uint8_t(first + 1)] = value >> 16;
+        registers[uint8_t(first + 2)] = value >> 8;
+        registers[uint8_t(first + 3)] = value;
+    }
+    
+    /// Drops a decode cache entry and every superinstruction it is part of.
+    inline void drop_decoded(DecodedInstruction& inst)
+    {
+        PROFILE(profile_evict(inst));
+        inst.valid = false;
+        if(inst.fused)
+        {
+            inst.fused = false;
+            drop_fused(inst.address);
+        }
+    }
+    
+    /// Drops any cached decode of an instruction overlapping the byte at address.
+    inline void invalidate_decoded(uint32_t address)
+    {
+        DecodedInstruction& low = decode_cache[((address - 7) >> 3) & (Config::decode_cache_size - 1)];
+        if(uint32_t(address - low.address) < 8)
+            drop_decoded(low);
+        
+        DecodedInstruction& high = decode_cache[(address >> 3) & (Config::decode_cache_size - 1)];
+        if(uint32_t(address - high.address) < 8)
+            drop_decoded(high);
+    }
+    
+    inline void mark_dirty(uint32_t address)
+    {
+        uint32_t page = address >> GUEST_PAGE_BITS;
+        uint64_t bit = uint64_t(1) << (page & 63);
+        if(!(dirty_bitmap[page >> 6] & bit))
+        {
+            dirty_bitmap[page >> 6] |= bit;
+            dirty_pages.push_back(page);
+        }
+    }
+    
+    /// Drops whatever was decoded or compiled from the byte at address, before a write to it.
+    inline void invalidate_code(uint32_t address)
+    {
+        invalidate_decoded(address);
+        if(uint32_t(address - jit_code_low) < jit_code_span)
+            jit_invalidate();
+    }
+    
+    /// Guest visible memory write. Keeps the decode cache coherent for self-modifying code. The page is marked
+    /// dirty after the write, so an access that faults never reaches the bitmap.
+    inline void store(uint32_t address, uint8_t value)
+    {
+        invalidate_code(address);
+        memory[address] = value;
+        mark_dirty(address);
+    }
 };
 
-std::vector<uint64_t> parse_asm(FILE* in);
\ No newline at end of file
+typedef BasicCPU<DefaultConfig> CPU;
+
+/// Compiled in CPU.cpp, Snapshot.cpp, JIT.cpp, Profiler.cpp and MemoryTrace.cpp for every configuration.
+#define EXTERN_CPU(Config) extern template class BasicCPU<Config>;
+CPU_CONFIGS(EXTERN_CPU)
+#undef EXTERN_CPU
+
+/// The default configuration's decoder, for code outside the run loop. CPUs decode with decode_instruction<Encoding>.
+void decode_instruction(uint64_t instruction, DecodedInstruction& out);
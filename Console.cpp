@@ -0,0 +1,142 @@
+#include <cerrno>
+#include <cstdio>
+#include <algorithm>
+#include <chrono>
+#if defined(__unix__)
+#include <unistd.h>
+#endif
+#include "Console.h"
+
+ConsoleDevice::ConsoleDevice(int fd, unsigned policy, bool background_writer, size_t capacity)
+    : host_writes(0), fd(fd), policy(policy), capacity(1), head(0), tail(0), pending(false), stopping(false)
+{
+    while(this->capacity < capacity)
+        this->capacity <<= 1;
+    buffer.reset(new uint8_t[this->capacity]);
+    
+    if(background_writer || (policy & ConsoleFlushOnTimer))
+        writer = std::thread(&ConsoleDevice::writer_loop, this);
+}
+
+ConsoleDevice::~ConsoleDevice()
+{
+    if(writer.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            pending = true;
+        }
+        wake.notify_one();
+        writer.join();
+    }
+    drain();
+}
+
+void ConsoleDevice::put(uint8_t byte)
+{
+    uint64_t position = head.load(std::memory_order_relaxed);
+    if(position - tail.load(std::memory_order_acquire) == capacity)
+    {
+        if(writer.joinable())
+        {
+            request_flush();
+            std::unique_lock<std::mutex> lock(mutex);
+            drained.wait(lock, [&] { return position - tail.load(std::memory_order_acquire) < capacity; });
+        }
+        else
+            drain();
+    }
+    
+    buffer[position & (capacity - 1)] = byte;
+    head.store(position + 1, std::memory_order_release);
+    
+    if(((policy & ConsoleFlushOnNewline) && byte == '\n') ||
+       ((policy & ConsoleFlushOnSize) && position + 1 - tail.load(std::memory_order_relaxed) >= capacity / 2))
+        request_flush();
+}
+
+void ConsoleDevice::halt()
+{
+    if(policy & ConsoleFlushOnHalt)
+        flush();
+}
+
+void ConsoleDevice::flush()
+{
+    if(!writer.joinable())
+    {
+        drain();
+        return;
+    }
+    
+    uint64_t target = head.load(std::memory_order_relaxed);
+    request_flush();
+    std::unique_lock<std::mutex> lock(mutex);
+    drained.wait(lock, [&] { return tail.load(std::memory_order_acquire) >= target; });
+}
+
+void ConsoleDevice::request_flush()
+{
+    if(!writer.joinable())
+    {
+        drain();
+        return;
+    }
+    
+    /// Only the first request until the writer picks it up pays for the lock.
+    if(pending.load(std::memory_order_relaxed))
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending = true;
+    }
+    wake.notify_one();
+}
+
+void ConsoleDevice::drain()
+{
+    uint64_t position = tail.load(std::memory_order_relaxed);
+    uint64_t end = head.load(std::memory_order_acquire);
+    while(position != end)
+    {
+        size_t offset = position & (capacity - 1);
+        size_t length = std::min<uint64_t>(end - position, capacity - offset);
+#if defined(__unix__)
+        ssize_t written = write(fd, buffer.get() + offset, length);
+        if(written < 0 && errno == EINTR)
+            continue;
+#else
+        long written = long(fwrite(buffer.get() + offset, 1, length, fd == 2 ? stderr : stdout));
+        fflush(fd == 2 ? stderr : stdout);
+        if(written == 0)
+            written = -1;
+#endif
+        ++host_writes;
+        /// Output the host refuses is dropped rather than stalling the guest forever.
+        position += written < 0 ? end - position : uint64_t(written);
+        tail.store(position, std::memory_order_release);
+    }
+}
+
+void ConsoleDevice::writer_loop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true)
+    {
+        auto ready = [&] { return pending.load(std::memory_order_relaxed) || stopping; };
+        if(policy & ConsoleFlushOnTimer)
+            wake.wait_for(lock, std::chrono::milliseconds(CONSOLE_TIMER_MILLISECONDS), ready);
+        else
+            wake.wait(lock, ready);
+        pending = false;
+        
+        lock.unlock();
+        drain();
+        lock.lock();
+        drained.notify_all();
+        
+        if(stopping)
+            return;
+    }
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#define CONSOLE_BUFFER_SIZE (1 << 16)
+#define CONSOLE_TIMER_MILLISECONDS 10
+
+/// Where the print instructions go. Set CPU::output to replace the default console.
+class OutputDevice
+{
+public:
+    virtual ~OutputDevice() {}
+    virtual void put(uint8_t byte) = 0;
+    /// Called by CPU::halt.
+    virtual void halt() {}
+    /// Returns once everything put so far has reached the host.
+    virtual void flush() {}
+};
+
+enum ConsoleFlushPolicy
+{
+    ConsoleFlushOnNewline = 1,
+    ConsoleFlushOnSize = 2, /// When the buffer is half full.
+    ConsoleFlushOnHalt = 4,
+    ConsoleFlushOnTimer = 8, /// Every CONSOLE_TIMER_MILLISECONDS, implies the background writer.
+    ConsoleFlushDefault = ConsoleFlushOnNewline | ConsoleFlushOnSize | ConsoleFlushOnHalt
+};
+
+/// Ring buffer in front of a host fd. A full buffer is always written out whatever the policy.
+/// With the background writer the guest only hands bytes over, all write() calls happen on the writer thread
+/// and the guest waits only when the buffer is full.
+class ConsoleDevice : public OutputDevice
+{
+public:
+    /// capacity is rounded up to a power of two.
+    ConsoleDevice(int fd = 1, unsigned policy = ConsoleFlushDefault, bool background_writer = false, size_t capacity = CONSOLE_BUFFER_SIZE);
+    ~ConsoleDevice();
+    ConsoleDevice(const ConsoleDevice&) = delete;
+    ConsoleDevice& operator=(const ConsoleDevice&) = delete;
+    
+    void put(uint8_t byte) override;
+    void halt() override;
+    void flush() override;
+    
+    uint64_t host_writes; /// write() calls made so far.
+
+private:
+    void request_flush();
+    void drain();
+    void writer_loop();
+    
+    int fd;
+    unsigned policy;
+    size_t capacity;
+    std::unique_ptr<uint8_t[]> buffer;
+    std::atomic<uint64_t> head; /// Bytes put, only the guest side moves it.
+    std::atomic<uint64_t> tail; /// Bytes written to fd, only the draining side moves it.
+    
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable drained;
+    std::atomic<bool> pending;
+    bool stopping;
+};
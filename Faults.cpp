@@ -0,0 +1,106 @@
+#include <atomic>
+#include <csignal>
+#include <cstring>
+#include "Faults.h"
+
+static thread_local const uint8_t* faulting_memory = nullptr;
+static thread_local sigjmp_buf* fault_resume = nullptr;
+static std::atomic<const FaultRegion*> fault_regions[FAULT_REGIONS];
+
+#if defined(__unix__)
+static struct sigaction previous_segv;
+static struct sigaction previous_bus;
+
+static void forward_fault(int signal, siginfo_t* info, void* context)
+{
+    struct sigaction& previous = signal == SIGSEGV ? previous_segv : previous_bus;
+    
+    if(previous.sa_flags & SA_SIGINFO)
+    {
+        previous.sa_sigaction(signal, info, context);
+    }
+    else if(previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN)
+    {
+        previous.sa_handler(signal);
+    }
+    else
+    {
+        /// Returning re-executes the faulting access, which now kills the process the default way.
+        sigaction(signal, &previous, nullptr);
+    }
+}
+
+static void guest_fault_handler(int signal, siginfo_t* info, void* context)
+{
+    const uint8_t* memory = faulting_memory;
+    const uint8_t* address = static_cast<const uint8_t*>(info->si_addr);
+    
+    for(std::atomic<const FaultRegion*>& slot : fault_regions)
+    {
+        const FaultRegion* region = slot.load(std::memory_order_acquire);
+        if(region && address >= region->begin && address < region->end && region->page_in(region->context, address))
+            return;
+    }
+    if(memory && fault_resume && address >= memory && address < memory + GUEST_RESERVATION_SIZE)
+        siglongjmp(*fault_resume, 1);
+    
+    forward_fault(signal, info, context);
+}
+#endif
+
+#if defined(__unix__)
+static bool register_fault_handler()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = &guest_fault_handler;
+    /// SA_NODEFER keeps SIGSEGV unblocked while jumping out of the handler, so resume points can use the cheap
+    /// sigsetjmp(buffer, 0) that does not save the signal mask.
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previous_segv);
+    sigaction(SIGBUS, &action, &previous_bus);
+    return true;
+}
+#endif
+
+void install_fault_handler()
+{
+#if defined(__unix__)
+    static bool installed = register_fault_handler();
+    (void)installed;
+#endif
+}
+
+bool add_fault_region(const FaultRegion* region)
+{
+    install_fault_handler();
+    for(std::atomic<const FaultRegion*>& slot : fault_regions)
+    {
+        const FaultRegion* empty = nullptr;
+        if(slot.compare_exchange_strong(empty, region))
+            return true;
+    }
+    return false;
+}
+
+void remove_fault_region(const FaultRegion* region)
+{
+    for(std::atomic<const FaultRegion*>& slot : fault_regions)
+    {
+        const FaultRegion* expected = region;
+        slot.compare_exchange_strong(expected, nullptr);
+    }
+}
+
+FaultScope::FaultScope(const uint8_t* memory, sigjmp_buf* resume) : previous_memory(faulting_memory), previous_resume(fault_resume)
+{
+    faulting_memory = memory;
+    fault_resume = resume;
+}
+
+FaultScope::~FaultScope()
+{
+    faulting_memory = previous_memory;
+    fault_resume = previous_resume;
+}
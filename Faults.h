@@ -0,0 +1,40 @@
+#pragma once
+#include <csetjmp>
+#include "CPU.h"
+
+/// Fault regions registered at once.
+#define FAULT_REGIONS 64
+
+/// Turns host SIGSEGV/SIGBUS inside a guest reservation into guest memory faults.
+/// Faults anywhere else go to whatever handler was installed before.
+void install_fault_handler();
+
+/// Host memory whose faults a device resolves itself, on whatever thread touches it. page_in runs inside the signal
+/// handler, so it must be async-signal-safe. It returns true once it has made address accessible, and the access is
+/// retried, or false to treat the fault as any other.
+struct FaultRegion
+{
+    const uint8_t* begin;
+    const uint8_t* end;
+    bool (*page_in)(void* context, const uint8_t* address);
+    void* context;
+};
+
+/// Installs the fault handler and starts resolving faults in region, which must stay alive until removed. Returns false
+/// when FAULT_REGIONS are in use.
+bool add_fault_region(const FaultRegion* region);
+/// Nothing may touch the region while it is removed.
+void remove_fault_region(const FaultRegion* region);
+
+/// Marks the calling thread as running the guest whose reservation starts at memory until destroyed, so a fault can
+/// find its way back to run().
+class FaultScope
+{
+public:
+    FaultScope(const uint8_t* memory, sigjmp_buf* resume);
+    ~FaultScope();
+    
+private:
+    const uint8_t* previous_memory;
+    sigjmp_buf* previous_resume;
+};
@@ -0,0 +1,263 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#if defined(__unix__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "FileDevice.h"
+#include "Profiler.h"
+
+/// The last access the fault handler let this thread retry on a chunk already in, and FileStream::page_ins then. A
+/// chunk that faults twice at the same address with no page-in in between takes a store to a read-only one, not a
+/// race with another hart paging it in.
+struct RetriedAccess
+{
+    const uint8_t* address;
+    uint64_t generation;
+};
+static thread_local RetriedAccess retried = {nullptr, 0};
+
+static uint64_t align_up(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+template<class Config>
+bool map_file(BasicCPU<Config>& cpu, const char* path, uint32_t address, FileMappingMode mode, uint64_t& size, std::string& error)
+{
+    if(address % GUEST_PAGE_SIZE)
+    {
+        error = "mapping address is not page aligned";
+        return false;
+    }
+
+#if defined(__unix__)
+    int fd = open(path, O_RDONLY);
+    struct stat status;
+    if(fd < 0 || fstat(fd, &status) != 0)
+    {
+        if(fd >= 0)
+            close(fd);
+        error = std::string("could not open \"") + path + "\"";
+        return false;
+    }
+    size = uint64_t(status.st_size);
+    if(address + size > Config::physical_memory_size)
+    {
+        close(fd);
+        error = std::string("\"") + path + "\" does not fit in guest memory";
+        return false;
+    }
+    
+    int protection = mode == FileReadOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+    if(size && mmap(cpu.memory + address, align_up(size, GUEST_PAGE_SIZE), protection, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        close(fd);
+        error = std::string("could not map \"") + path + "\"";
+        return false;
+    }
+    close(fd);
+    if(mode == FileReadOnly)
+        cpu.mark_read_only_range(address, uint32_t(align_up(size, GUEST_PAGE_SIZE)));
+#else
+    /// Without mmap the file is copied, and stores to it cannot fault.
+    FILE* in = fopen(path, "rb");
+    if(!in)
+    {
+        error = std::string("could not open \"") + path + "\"";
+        return false;
+    }
+    size = 0;
+    for(std::size_t got; (got = fread(cpu.memory + address + size, 1, std::size_t(Config::physical_memory_size - address - size), in)) > 0; )
+        size += got;
+    bool fits = fgetc(in) == EOF;
+    fclose(in);
+    if(!fits)
+    {
+        error = std::string("\"") + path + "\" does not fit in guest memory";
+        return false;
+    }
+#endif
+
+    cpu.mark_dirty_range(address, uint32_t(size));
+    cpu.invalidate_range(address, uint32_t(size));
+    if(cpu.jit)
+        cpu.jit_invalidate();
+    return true;
+}
+
+FileStream::FileStream() : page_ins(0), fd(-1), base(nullptr), file_size(0), protection(0), profiler(nullptr), slot_count(0)
+{
+}
+
+FileStream::~FileStream()
+{
+    close();
+}
+
+template<class Config>
+bool FileStream::open(BasicCPU<Config>& cpu, const char* path, uint32_t address, uint32_t window, FileMappingMode mode, std::string& error)
+{
+    close();
+    if(address % GUEST_PAGE_SIZE || !window || window % (2 * FILE_STREAM_CHUNK_SIZE) ||
+       uint64_t(address) + window > Config::physical_memory_size)
+    {
+        error = "stream window must be page aligned, an even number of chunks and inside guest memory";
+        return false;
+    }
+
+#if defined(__unix__)
+    fd = ::open(path, O_RDONLY);
+    struct stat status;
+    if(fd < 0 || fstat(fd, &status) != 0)
+    {
+        if(fd >= 0)
+            ::close(fd);
+        fd = -1;
+        error = std::string("could not open \"") + path + "\"";
+        return false;
+    }
+    
+    /// Nothing is mapped until touched, the first lap shows chunk i in slot i.
+    base = cpu.memory + address;
+    slot_count = window / FILE_STREAM_CHUNK_SIZE;
+    slots.reset(new std::atomic<uint64_t>[slot_count]);
+    for(uint32_t i = 0; i < slot_count; ++i)
+        slots[i] = uint64_t(i) << 2;
+    file_size = uint64_t(status.st_size);
+    protection = mode == FileReadOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+#if defined(DERP_PROFILE)
+    profiler = &cpu.profiler;
+#endif
+    page_ins = 0;
+    
+    region.begin = base;
+    region.end = base + window;
+    region.page_in = &FileStream::page_in;
+    region.context = this;
+    if(mmap(base, window, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED || !add_fault_region(&region))
+    {
+        close();
+        error = "could not reserve the stream window";
+        return false;
+    }
+    cpu.invalidate_range(address, window);
+    if(cpu.jit)
+        cpu.jit_invalidate();
+    return true;
+#else
+    (void)cpu;
+    (void)path;
+    (void)mode;
+    error = "file streams need mmap";
+    return false;
+#endif
+}
+
+void FileStream::close()
+{
+#if defined(__unix__)
+    if(fd < 0)
+        return;
+    remove_fault_region(&region);
+    if(base)
+        mmap(base, std::size_t(slot_count) * FILE_STREAM_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    ::close(fd);
+    fd = -1;
+    base = nullptr;
+    slots.reset();
+    slot_count = 0;
+#endif
+}
+
+bool FileStream::map_chunk(uint32_t slot, uint64_t chunk, int protection)
+{
+#if defined(__unix__)
+    uint8_t* target = base + std::size_t(slot) * FILE_STREAM_CHUNK_SIZE;
+    uint64_t offset = chunk * FILE_STREAM_CHUNK_SIZE;
+    /// Mapping the file past its last page would raise SIGBUS on access, the rest of the chunk gets zero pages.
+    uint64_t from_file = protection == PROT_NONE || offset >= file_size ? 0 :
+        std::min<uint64_t>(FILE_STREAM_CHUNK_SIZE, align_up(file_size - offset, GUEST_PAGE_SIZE));
+    if(from_file && mmap(target, from_file, protection, MAP_PRIVATE | MAP_FIXED, fd, off_t(offset)) == MAP_FAILED)
+        return false;
+    return from_file == FILE_STREAM_CHUNK_SIZE ||
+           mmap(target + from_file, FILE_STREAM_CHUNK_SIZE - from_file, protection, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED;
+#else
+    (void)slot;
+    (void)chunk;
+    (void)protection;
+    return false;
+#endif
+}
+
+bool FileStream::page_in(void* context, const uint8_t* address)
+{
+#if defined(__unix__)
+    FileStream& stream = *static_cast<FileStream*>(context);
+    uint32_t slot = uint32_t((address - stream.base) / FILE_STREAM_CHUNK_SIZE);
+    uint64_t state = stream.slots[slot].load(std::memory_order_acquire);
+    uint64_t generation = stream.page_ins.load(std::memory_order_relaxed);
+    
+    /// Another hart is mapping the chunk or moved it on to the next lap. Its page-in finishes without this thread, so
+    /// retrying the access is all there is to do.
+    if((state & FILE_STREAM_BUSY) ||
+       (!(state & FILE_STREAM_RESIDENT) && !stream.slots[slot].compare_exchange_strong(state, state | FILE_STREAM_BUSY)))
+        return true;
+    
+    if(state & FILE_STREAM_RESIDENT)
+    {
+        /// Paged in by another hart since the fault, or a store the chunk does not allow. A second fault at the same
+        /// address with no page-in in between is the store. An earlier retry that succeeded is stale once any chunk
+        /// has been mapped since.
+        bool resolved = retried.address != address || retried.generation != generation;
+        retried.address = resolved ? address : nullptr;
+        retried.generation = generation;
+        return resolved;
+    }
+    
+    retried.address = nullptr;
+    uint64_t chunk = state >> 2;
+    if(!stream.map_chunk(slot, chunk, stream.protection))
+    {
+        stream.slots[slot].store(state, std::memory_order_release);
+        return false;
+    }
+    stream.slots[slot].store(state | FILE_STREAM_RESIDENT, std::memory_order_release);
+    
+    /// The slot half a window ahead moves on to the next lap. This slot is released first, so a hart busy with that
+    /// one never waits for this one and the wait below is short.
+    uint32_t ahead = (slot + stream.slot_count / 2) % stream.slot_count;
+    uint64_t next_lap = chunk + stream.slot_count / 2;
+    uint64_t ahead_state = stream.slots[ahead].load(std::memory_order_acquire);
+    while((ahead_state >> 2) != next_lap)
+    {
+        if(ahead_state & FILE_STREAM_BUSY)
+            ahead_state = stream.slots[ahead].load(std::memory_order_acquire);
+        else if(stream.slots[ahead].compare_exchange_weak(ahead_state, ahead_state | FILE_STREAM_BUSY))
+        {
+            if(ahead_state & FILE_STREAM_RESIDENT)
+                stream.map_chunk(ahead, 0, PROT_NONE);
+            stream.slots[ahead].store(next_lap << 2, std::memory_order_release);
+            break;
+        }
+    }
+    
+    stream.page_ins.fetch_add(1, std::memory_order_relaxed);
+    if(stream.profiler && *stream.profiler)
+        __atomic_fetch_add(&(*stream.profiler)->page_ins, 1, __ATOMIC_RELAXED);
+    return true;
+#else
+    (void)context;
+    (void)address;
+    return false;
+#endif
+}
+
+#define INSTANTIATE_FILE_DEVICE(Config) \
+    template bool map_file(BasicCPU<Config>&, const char*, uint32_t, FileMappingMode, uint64_t&, std::string&); \
+    template bool FileStream::open(BasicCPU<Config>&, const char*, uint32_t, uint32_t, FileMappingMode, std::string&);
+CPU_CONFIGS(INSTANTIATE_FILE_DEVICE)
+#undef INSTANTIATE_FILE_DEVICE
@@ -0,0 +1,71 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "CPU.h"
+#include "Faults.h"
+
+/// Bytes a FileStream maps at once, a multiple of GUEST_PAGE_SIZE.
+#define FILE_STREAM_CHUNK_SIZE (64 << 10)
+/// FileStream slot state bits: the chunk is mapped, or a hart is changing the slot and the others keep off it.
+#define FILE_STREAM_RESIDENT 1
+#define FILE_STREAM_BUSY 2
+
+enum FileMappingMode
+{
+    FileReadOnly, /// Stores to the file's pages fault, after a restore and in a fork as well.
+    FileCopyOnWrite, /// Stores go to private copies of the pages, the file never changes.
+};
+
+/// Maps the file at path into guest memory at address, a multiple of GUEST_PAGE_SIZE, and sets size to its length.
+/// Loads read the host page cache directly and the kernel pages the file in as it is touched, so nothing is copied up
+/// front. The rest of the last page reads zero. The file has to fit below the configuration's physical memory. The
+/// pages count as written, so snapshots capture them. Compiled for every configuration in CPU_CONFIGS.
+template<class Config>
+bool map_file(BasicCPU<Config>& cpu, const char* path, uint32_t address, FileMappingMode mode, uint64_t& size, std::string& error);
+
+/// A window of guest memory onto a file of any size, for inputs larger than guest memory. File offset o reads at
+/// address + o % window. The window is mapped from the file FILE_STREAM_CHUNK_SIZE at a time as the guest first
+/// touches it, and mapping a chunk moves the one half a window ahead of it on to the next lap, so a guest reading
+/// forward sees the whole file go by without the host stepping in. Reads may lag up to half a window behind the newest
+/// chunk touched, further back they see the next lap. Past the end of the file reads zero.
+///
+/// Page-ins happen in the fault handler on whichever hart touches the chunk and are counted in page_ins and, while
+/// one is attached, Profiler::page_ins. The handler takes no lock: a hart that finds a chunk being paged in by
+/// another one retries its access. The window holds data, not code, and is not captured by snapshots.
+class FileStream
+{
+public:
+    FileStream();
+    ~FileStream();
+    FileStream(const FileStream&) = delete;
+    FileStream& operator=(const FileStream&) = delete;
+    
+    /// window is an even number of chunks, a power of two keeps the guest's modulo a mask. The stream must be closed
+    /// or destroyed before cpu.
+    template<class Config>
+    bool open(BasicCPU<Config>& cpu, const char* path, uint32_t address, uint32_t window, FileMappingMode mode, std::string& error);
+    /// Leaves zero pages where the window was. No hart may be running.
+    void close();
+    
+    uint64_t size() const { return file_size; }
+    
+    std::atomic<uint64_t> page_ins; /// Chunks mapped in.
+
+private:
+    static bool page_in(void* context, const uint8_t* address);
+    bool map_chunk(uint32_t slot, uint64_t chunk, int protection);
+    
+    FaultRegion region;
+    int fd;
+    uint8_t* base; /// Host address of the window.
+    uint64_t file_size;
+    int protection; /// Of a chunk once paged in.
+    Profiler* const* profiler; /// The CPU's in a -DDERP_PROFILE build, read at each page-in.
+    /// Per chunk of the window, the file chunk it shows or will show once touched, shifted left by 2 over
+    /// FILE_STREAM_RESIDENT and FILE_STREAM_BUSY. Changed by compare-and-swap only.
+    std::unique_ptr<std::atomic<uint64_t>[]> slots;
+    uint32_t slot_count;
+};
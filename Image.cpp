@@ -0,0 +1,329 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#if defined(__unix__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "Image.h"
+
+void add_code_section(ProgramImage& image, const std::vector<uint64_t>& code, uint32_t load_address)
+{
+    ImageSection section;
+    section.load_address = load_address;
+    section.memory_size = uint32_t(code.size() * 8);
+    section.flags = ImageSectionCode;
+    section.data.resize(code.size() * 8);
+    for(std::size_t i = 0; i < code.size(); ++i)
+        for(int j = 0; j < 8; ++j)
+            section.data[8*i + j] = (code[i] >> (8*j)) & 0xFF;
+    image.sections.push_back(std::move(section));
+}
+
+static uint64_t align_up(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+bool write_image(const char* path, const ProgramImage& image, std::string& error)
+{
+    for(const ImageSection& section : image.sections)
+    {
+        if(section.data.size() > section.memory_size || uint64_t(section.load_address) + section.memory_size > DefaultConfig::physical_memory_size)
+        {
+            error = "section does not fit in guest memory";
+            return false;
+        }
+    }
+    if(image.sections.size() > UINT16_MAX)
+    {
+        error = "too many sections";
+        return false;
+    }
+    
+    /// Sorted so the same program always writes the same bytes.
+    std::vector<std::pair<uint32_t, std::string>> symbols;
+    for(const auto& symbol : image.symbols)
+        symbols.emplace_back(symbol.second, symbol.first);
+    std::sort(symbols.begin(), symbols.end());
+    
+    std::vector<ImageFileSymbol> file_symbols;
+    std::string names;
+    for(const auto& symbol : symbols)
+    {
+        file_symbols.push_back({uint32_t(names.size()), symbol.first});
+        names += symbol.second;
+        names += '\0';
+    }
+    
+    ImageFileHeader header;
+    header.magic = IMAGE_MAGIC;
+    header.version = IMAGE_VERSION;
+    header.section_count = uint16_t(image.sections.size());
+    header.entry = image.entry;
+    header.stack_address = image.stack_address;
+    header.symbol_count = uint32_t(file_symbols.size());
+    header.symbol_offset = uint32_t(sizeof(header) + image.sections.size() * sizeof(ImageFileSection));
+    header.names_offset = uint32_t(header.symbol_offset + file_symbols.size() * sizeof(ImageFileSymbol));
+    header.names_size = uint32_t(names.size());
+    
+    std::vector<ImageFileSection> file_sections;
+    uint64_t offset = align_up(uint64_t(header.names_offset) + names.size(), IMAGE_PAGE_ALIGNMENT);
+    for(const ImageSection& section : image.sections)
+    {
+        file_sections.push_back({uint32_t(offset), uint32_t(section.data.size()), section.load_address, section.memory_size, section.flags});
+        offset = align_up(offset + section.data.size(), IMAGE_PAGE_ALIGNMENT);
+    }
+    if(offset > UINT32_MAX)
+    {
+        error = "image larger than 4GiB";
+        return false;
+    }
+    
+    FILE* out = fopen(path, "wb");
+    if(!out)
+    {
+        error = std::string("could not create \"") + path + "\"";
+        return false;
+    }
+    
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(file_sections.data(), sizeof(ImageFileSection), file_sections.size(), out);
+    fwrite(file_symbols.data(), sizeof(ImageFileSymbol), file_symbols.size(), out);
+    fwrite(names.data(), 1, names.size(), out);
+    
+    static const uint8_t padding[IMAGE_PAGE_ALIGNMENT] = {};
+    uint64_t written = uint64_t(header.names_offset) + names.size();
+    for(std::size_t i = 0; i < image.sections.size(); ++i)
+    {
+        fwrite(padding, 1, file_sections[i].file_offset - written, out);
+        fwrite(image.sections[i].data.data(), 1, image.sections[i].data.size(), out);
+        written = file_sections[i].file_offset + image.sections[i].data.size();
+    }
+    fwrite(padding, 1, offset - written, out);
+    
+    bool ok = !ferror(out);
+    ok = fclose(out) == 0 && ok;
+    if(!ok)
+        error = std::string("could not write \"") + path + "\"";
+    return ok;
+}
+
+/// Checks the header and tables against the file before anything is mapped.
+static bool validate_image(const uint8_t* view, uint64_t size, std::string& error)
+{
+    if(size < sizeof(ImageFileHeader))
+    {
+        error = "file too small for an image header";
+        return false;
+    }
+    
+    ImageFileHeader header;
+    memcpy(&header, view, sizeof(header));
+    if(header.magic != IMAGE_MAGIC)
+    {
+        error = "not an image";
+        return false;
+    }
+    if(header.version != IMAGE_VERSION)
+    {
+        error = "unsupported image version " + std::to_string(header.version);
+        return false;
+    }
+    if(sizeof(header) + uint64_t(header.section_count) * sizeof(ImageFileSection) > size ||
+       uint64_t(header.symbol_offset) + uint64_t(header.symbol_count) * sizeof(ImageFileSymbol) > size ||
+       uint64_t(header.names_offset) + header.names_size > size)
+    {
+        error = "truncated image tables";
+        return false;
+    }
+    
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    for(uint32_t i = 0; i < header.section_count; ++i)
+    {
+        ImageFileSection section;
+        memcpy(&section, view + sizeof(header) + i * sizeof(section), sizeof(section));
+        if(uint64_t(section.file_offset) + section.file_size > size || section.file_size > section.memory_size ||
+           uint64_t(section.load_address) + section.memory_size > DefaultConfig::physical_memory_size)
+        {
+            error = "section " + std::to_string(i) + " out of range";
+            return false;
+        }
+        ranges.emplace_back(section.load_address, section.load_address + section.memory_size);
+    }
+    
+    std::sort(ranges.begin(), ranges.end());
+    for(std::size_t i = 1; i < ranges.size(); ++i)
+    {
+        if(ranges[i].first < ranges[i - 1].second)
+        {
+            error = "sections overlap";
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool read_symbols(const uint8_t* view, std::unordered_map<std::string, uint32_t>& symbols, std::string& error)
+{
+    ImageFileHeader header;
+    memcpy(&header, view, sizeof(header));
+    const char* names = reinterpret_cast<const char*>(view + header.names_offset);
+    
+    symbols.reserve(header.symbol_count);
+    for(uint32_t i = 0; i < header.symbol_count; ++i)
+    {
+        ImageFileSymbol symbol;
+        memcpy(&symbol, view + header.symbol_offset + i * sizeof(symbol), sizeof(symbol));
+        
+        const char* name = names + symbol.name_offset;
+        const char* terminator = symbol.name_offset < header.names_size ?
+            static_cast<const char*>(memchr(name, '\0', header.names_size - symbol.name_offset)) : nullptr;
+        if(!terminator)
+        {
+            error = "bad symbol name";
+            return false;
+        }
+        symbols[std::string(name, terminator)] = symbol.address;
+    }
+    return true;
+}
+
+bool load_image(CPU& cpu, const char* path, std::string& error, std::unordered_map<std::string, uint32_t>* symbols)
+{
+#if defined(__unix__)
+    int fd = open(path, O_RDONLY);
+    struct stat status;
+    if(fd < 0 || fstat(fd, &status) != 0)
+    {
+        if(fd >= 0)
+            close(fd);
+        error = std::string("could not open \"") + path + "\"";
+        return false;
+    }
+    
+    uint64_t size = uint64_t(status.st_size);
+    void* mapping = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if(mapping == MAP_FAILED)
+    {
+        close(fd);
+        error = std::string("could not map \"") + path + "\"";
+        return false;
+    }
+    const uint8_t* view = static_cast<const uint8_t*>(mapping);
+    uint64_t page = uint64_t(sysconf(_SC_PAGESIZE));
+#else
+    std::vector<uint8_t> contents;
+    FILE* in = fopen(path, "rb");
+    if(!in)
+    {
+        error = std::string("could not open \"") + path + "\"";
+        return false;
+    }
+    uint8_t block[1 << 16];
+    for(std::size_t got; (got = fread(block, 1, sizeof(block), in)) > 0; )
+        contents.insert(contents.end(), block, block + got);
+    fclose(in);
+    const uint8_t* view = contents.data();
+    uint64_t size = contents.size();
+#endif
+
+    bool ok = validate_image(view, size, error) && (!symbols || read_symbols(view, *symbols, error));
+    ImageFileHeader header;
+    if(ok)
+        memcpy(&header, view, sizeof(header));
+    
+    std::vector<ImageFileSection> sections(ok ? header.section_count : 0);
+    if(ok)
+        memcpy(sections.data(), view + sizeof(header), sections.size() * sizeof(ImageFileSection));
+    
+    /// Page aligned sections are mapped first, the rest are copied after so a mapping never covers a copy.
+    std::vector<bool> mapped(sections.size(), false);
+#if defined(__unix__)
+    for(std::size_t i = 0; ok && i < sections.size(); ++i)
+    {
+        const ImageFileSection& section = sections[i];
+        uint64_t span = align_up(section.file_size, page);
+        if(section.load_address % page || section.file_offset % page || section.file_offset + span > align_up(size, page))
+            continue;
+        
+        uint8_t* target = cpu.memory + section.load_address;
+        if(span && mmap(target, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, section.file_offset) == MAP_FAILED)
+        {
+            error = "could not map section " + std::to_string(i);
+            ok = false;
+            break;
+        }
+        
+        /// The zero filled tail gets fresh anonymous pages, also free until touched.
+        uint64_t zero_span = align_up(section.memory_size, page) - span;
+        if(zero_span && mmap(target + span, zero_span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+        {
+            error = "could not map section " + std::to_string(i);
+            ok = false;
+            break;
+        }
+        mapped[i] = true;
+    }
+#endif
+
+    for(std::size_t i = 0; ok && i < sections.size(); ++i)
+    {
+        if(mapped[i])
+            continue;
+        const ImageFileSection& section = sections[i];
+        memcpy(cpu.memory + section.load_address, view + section.file_offset, section.file_size);
+        memset(cpu.memory + section.load_address + section.file_size, 0, section.memory_size - section.file_size);
+    }
+
+#if defined(__unix__)
+    /// Read-only at page granularity. Sections never overlap, so only the first and last page can be shared with a
+    /// writable section, and those stay writable.
+    for(std::size_t i = 0; ok && i < sections.size(); ++i)
+    {
+        const ImageFileSection& section = sections[i];
+        if(section.flags & ImageSectionWritable || section.memory_size == 0)
+            continue;
+        
+        uint64_t low = section.load_address / page * page;
+        uint64_t high = align_up(uint64_t(section.load_address) + section.memory_size, page);
+        for(const ImageFileSection& other : sections)
+        {
+            if(!(other.flags & ImageSectionWritable) || other.memory_size == 0)
+                continue;
+            uint64_t other_low = other.load_address / page * page;
+            uint64_t other_high = align_up(uint64_t(other.load_address) + other.memory_size, page);
+            if(other_low < high && low < other_high)
+            {
+                if(other_low <= low)
+                    low += page;
+                else
+                    high -= page;
+            }
+        }
+        if(low < high && mprotect(cpu.memory + low, high - low, PROT_READ) == 0)
+            cpu.mark_read_only_range(uint32_t(low), uint32_t(high - low));
+    }
+    
+    munmap(mapping, size);
+    close(fd);
+#endif
+
+    if(!ok)
+        return false;
+    
+    for(const ImageFileSection& section : sections)
+        cpu.mark_dirty_range(section.load_address, section.memory_size);
+    cpu.flush_decode_cache();
+    if(cpu.jit)
+        cpu.jit_invalidate();
+    cpu.program_counter = header.entry;
+    cpu.stack_address = header.stack_address;
+    cpu.return_stack.clear();
+    return true;
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "CPU.h"
+
+#define IMAGE_MAGIC 0x50524544 /// "DERP" read as a little-endian uint32_t.
+#define IMAGE_VERSION 2 /// 2: memory instructions have 5 function bits.
+/// Section data is padded to this so the loader can map it straight from the file.
+#define IMAGE_PAGE_ALIGNMENT 4096
+
+/// On disk layout, all fields little-endian:
+///     ImageFileHeader
+///     ImageFileSection[section_count]
+///     ImageFileSymbol[symbol_count], then the symbol names, NUL terminated
+///     section data, each starting on an IMAGE_PAGE_ALIGNMENT boundary and zero padded to one
+struct ImageFileHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t section_count;
+    uint32_t entry;
+    uint32_t stack_address;
+    uint32_t symbol_count;
+    uint32_t symbol_offset; /// File offset of the ImageFileSymbol array.
+    uint32_t names_offset; /// File offset of the symbol names.
+    uint32_t names_size;
+};
+
+enum ImageSectionFlags
+{
+    ImageSectionCode = 1, /// Informational, guest memory is always executable.
+    ImageSectionWritable = 2, /// Mapped copy-on-write. Without it the pages are read-only and stores to them fault.
+};
+
+struct ImageFileSection
+{
+    uint32_t file_offset;
+    uint32_t file_size;
+    uint32_t load_address;
+    uint32_t memory_size; /// Bytes past file_size up to memory_size load as zero.
+    uint32_t flags;
+};
+
+struct ImageFileSymbol
+{
+    uint32_t name_offset; /// Offset into the names block.
+    uint32_t address;
+};
+
+static_assert(sizeof(ImageFileHeader) == 32 && sizeof(ImageFileSection) == 20 && sizeof(ImageFileSymbol) == 8,
+              "Image structures must have no padding.");
+
+struct ImageSection
+{
+    uint32_t load_address;
+    uint32_t memory_size; /// At least data.size().
+    uint32_t flags;
+    std::vector<uint8_t> data;
+};
+
+struct ProgramImage
+{
+    uint32_t entry = 0;
+    uint32_t stack_address = 0;
+    std::vector<ImageSection> sections;
+    std::unordered_map<std::string, uint32_t> symbols;
+};
+
+/// Appends instruction words as a read-only code section.
+void add_code_section(ProgramImage& image, const std::vector<uint64_t>& code, uint32_t load_address);
+
+bool write_image(const char* path, const ProgramImage& image, std::string& error);
+
+/// Maps every section into guest memory, sets program_counter and stack_address and empties the return stack. Page
+/// aligned sections are mapped from the file with MAP_PRIVATE and only paged in when touched, so the cost does not
+/// grow with the image. Symbols are only read if asked for.
+bool load_image(CPU& cpu, const char* path, std::string& error, std::unordered_map<std::string, uint32_t>* symbols = nullptr);
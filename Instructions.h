@@ -0,0 +1,316 @@
+#pragma once
+#include "CPU.h"
+
+enum InstructionTypes
+{
+    MemoryInstructionType = 0, /// Eg: Load memory address %X into $A. Things that only reference one memory address and one register
+    RegisterInstructionType, /// Eg: Load an immediate into a register. Things that only reference at least one register.
+    ImmediateInstructionType, /// Reference neither registers nor memory.
+    VectorInstructionType, /// Element-wise operations over ranges of registers.
+    InstructionTypesSize /// Sentinel
+};
+#define NUM_INSTRUCTION_TYPE_SELECTION_BITS 2
+
+#define NUM_PREDICATE_BITS (1 + NUM_REGISTER_BITS)
+
+enum MemoryInstructions
+{
+    LoadMemoryRegister = 0, /// Loads a memory address into the given register. requires: 1 mem, 1 register
+    LoadMemoryImmediate,
+    StoreMemoryRegister,
+    StoreMemoryImmediate, /// Stores a register into a memory address. requires: 1 mem, 1 register
+    BlockCopy, /// Copies a block between two register quad addresses, overlap allowed. requires: 3 register quads
+    BlockFill, /// Fills a block with a register. requires: 2 register quads, 1 register
+    BlockCompare, /// Compares two blocks, memcmp style result in a register. requires: 1 register, 3 register quads
+    BlockSearch, /// Finds the first byte equal to a register, offset into a register quad. requires: 3 register quads, 1 register
+    /// Atomics are sequentially consistent with the atomics and fences of every hart sharing the memory (Machine.h).
+    CompareAndSwap, /// Writes a register to the byte at a register quad if it equals another, the old byte goes to a fourth. requires: 1 register quad, 3 registers
+    FetchAdd, /// Adds a register to the byte at a register quad, the old byte goes to another. requires: 1 register quad, 2 registers
+    FetchAddQuad, /// Adds a register quad to the big-endian quad at a register quad, which must be a multiple of 4. requires: 3 register quads
+    Fence, /// Orders every memory access before it against every one after it.
+    MemoryInstructionsSize /// Sentinel
+};
+
+/// Assembler operand formats, one character per operand in val1-val5 order:
+/// r register, i immediate byte, q absolute quad, j forward relative quad, k backward relative quad.
+/// Quads take four operand bytes. Operands after a * may be left out and assemble as zero.
+/// The block instructions name register quads by their first register, $r holds the high byte and $r+3 the low one.
+static constexpr const char* MI_asm[MemoryInstructionsSize] = {"loadmr", "loadmi", "storemr", "storemi",
+"copymr", "fillmr", "cmpmr", "searchmr", "casmr", "faddmr", "faddmrq", "fence"};
+static constexpr const char* MI_operands[MemoryInstructionsSize] = {"rrrrr", "qr", "rrrrr", "qr",
+"rrr", "rrr", "rrrr", "rrrr", "rrrr", "rrr", "rrr", ""};
+
+#define NUM_MEMORY_INSTRUCTIONS_SELECTION_BITS 5
+static_assert(MemoryInstructionsSize <= (1 << NUM_MEMORY_INSTRUCTIONS_SELECTION_BITS), "NUM_INSTRUCTION_TYPE_SELECTION_BITS too low for number of instructions.");
+static_assert(NUM_INSTRUCTION_TYPE_SELECTION_BITS + 
+              NUM_PREDICATE_BITS + 
+              NUM_MEMORY_INSTRUCTIONS_SELECTION_BITS +
+              4*NUM_WORD_BITS +
+              NUM_REGISTER_BITS <= INSTRUCTION_SIZE_BITS, "Too few bits in instruction for memory instruction.");
+static_assert(NUM_INSTRUCTION_TYPE_SELECTION_BITS + 
+              NUM_PREDICATE_BITS + 
+              NUM_MEMORY_INSTRUCTIONS_SELECTION_BITS +
+              5*NUM_REGISTER_BITS <= INSTRUCTION_SIZE_BITS, "Too few bits in instruction for memory instruction.");
+
+enum RegisterInstructions
+{
+    LoadImmediate = 0, /// Loads an immediate value into a register. requires: 1 register, 1 immediate
+    LoadRegister, ///Copy a register
+    AddImmediate, /// Unsigned adds a immediate value to a register. requires: 1 register, 1 immediate
+    AddRegister, /// Unsigned adds register value to a register. requires: 2 register
+    AddImmediateSaveCarry, /// Unsigned adds an immediate to a register and saves any carry into a another register requires: 3 registers
+    AddRegisterSaveCarry, /// Unsigned adds a register to a register and saves any carry into a another register requires: 3 registers
+    MulImmediate, /// Unsigned multiplies a register and an immediate, High order bits are discarded
+    MulRegister, /// Unsigned multiplies two registers. The high-order bits are discarded.
+    MulImmediateSaveCarry, /// Unsigned multiplies a register and an immediate, High order bits are saved to the specified register.
+    MulRegisterSaveCarry, /// Unsigned multiplies two registers. The high-order bits are saved to the specified register.
+    DivImmediateRegister, /// Performs signed integer division of an immediate and a register. Needs 2 registers and 1 immediate.
+    DivRegisterImmediate, /// Performs signed integer division of a register and an immediate. Needs 2 registers and 1 immediate.
+    DivRegisterRegister, /// Performs unsigned integer division of two registers.
+    ModImmediateRegister, /// Calculates the remainder of unsigned division of an immediate and a register. Needs 2 registers and 1 immediate,
+    ModRegisterImmediate, /// Calculates the remainder of unsigned division of a register and an immediate. Needs 2 registers and 1 immediate,
+    ModRegisterRegister, /// Calculates the remainder of unsigned division of two register. Needs 3 registers.
+    AndImmediate, /// Bitwise-ands a register and immediate. Needs 2 registers and 1 immediate.
+    AndRegister, /// Bitwise-ands two registers. Needs 3 registers.
+    OrImmediate, /// Bitwise-ors a register and immediate. Needs 2 registers and 1 immediate.
+    OrRegister, /// Bitwise-ors two registers. Needs 3 registers.
+    XorImmediate, /// Bitwise-xors a register and immediate. Needs 2 registers and 1 immediate..
+    XorRegister, /// Bitwise-xors two registers. Needs 3 registers.
+    BitwiseComplement, /// Bitwise-complements a register. Needs 2 registers
+    /// Wide forms treat 2, 4 or 8 consecutive registers as one big-endian integer, named by the register holding the
+    /// high byte, the same order as quads. Groups wrap past the last register.
+    AddRegister16, /// Adds two groups, the carry out is discarded. Needs 3 groups.
+    AddRegister32,
+    AddRegister64,
+    SubRegister16, /// Subtracts the third group from the second, the borrow is discarded. Needs 3 groups.
+    SubRegister32,
+    SubRegister64,
+    MulRegister16, /// Multiplies two groups keeping the low half. Needs 3 groups.
+    MulRegister32,
+    MulRegister64,
+    ShiftLeftImmediate16, /// Shifts a group left by an immediate, 0 from the width up. Needs 2 groups and 1 immediate.
+    ShiftLeftImmediate32,
+    ShiftLeftImmediate64,
+    ShiftRightImmediate16, /// Logical right shift of a group by an immediate. Needs 2 groups and 1 immediate.
+    ShiftRightImmediate32,
+    ShiftRightImmediate64,
+    CompareRegister16, /// Unsigned compare of two groups into a register: 0 equal, 1 greater, 255 less. Needs 1 register, 2 groups.
+    CompareRegister32,
+    CompareRegister64,
+    IncrementImmediate16, /// Adds an immediate to a group in place, eg. to step a quad address. Needs 1 group and 1 immediate.
+    IncrementImmediate32,
+    IncrementImmediate64,
+    RegisterInstructionSize
+};
+static constexpr const char* RI_asm[RegisterInstructionSize] = {"loadi", "loadr", "addi", "addr",
+"addic", "addrc", "muli", "mulr", "mulic", "mulrc", "divir", "divri", "divrr", "modir",
+"modri", "modrr", "andi", "andr", "ori", "orr", "xori", "xorr", "bcomp",
+"add16", "add32", "add64", "sub16", "sub32", "sub64", "mul16", "mul32", "mul64", "shl16", "shl32", "shl64",
+"shr16", "shr32", "shr64", "cmp16", "cmp32", "cmp64", "inc16", "inc32", "inc64"};
+static constexpr const char* RI_operands[RegisterInstructionSize] = {"ri", "rr", "rri", "rrr",
+"rrri", "rrrr", "rri", "rrr", "rrir", "rrrr", "rir", "rri", "rrr", "rir",
+"rri", "rrr", "rri", "rrr", "rri", "rrr", "rri", "rrr", "rr",
+"rrr", "rrr", "rrr", "rrr", "rrr", "rrr", "rrr", "rrr", "rrr", "rri", "rri", "rri",
+"rri", "rri", "rri", "rrr", "rrr", "rrr", "ri", "ri", "ri"};
+
+#define NUM_REGISTRY_INSTRUCTIONS_SELECTION_BITS 6
+static_assert(RegisterInstructionSize <= (1 << NUM_REGISTRY_INSTRUCTIONS_SELECTION_BITS), "NUM_REGISTRY_INSTRUCTIONS_SELECTION_BITS too low for number of instructions.");
+static_assert(NUM_INSTRUCTION_TYPE_SELECTION_BITS + 
+              NUM_PREDICATE_BITS + 
+              NUM_MEMORY_INSTRUCTIONS_SELECTION_BITS + 
+              3*NUM_REGISTER_BITS +
+              NUM_WORD_BITS <= INSTRUCTION_SIZE_BITS, "Too few bits in instruction for registry instructions.");
+
+enum ImmediateInstructions
+{
+    JumpImmediateQuad, /// Increment program counter by immediate quad, unsigned
+    JumpRegisterQuad, /// Increment program counter by register quad, unsigned
+    JumpBackImmediateQuad, /// Decrement program counter by immediate quad, unsigned
+    JumpBackRegisterQuad, /// Decrement program counter by register quad, unsigned
+    HaltImmediateQuad, /// Stops execution return the immediate.
+    HaltRegisterQuad, /// Stops execution returning the register quad.
+    SetStackAddressImmediateQuadAddress, /// Sets the stack address to the immediate address
+    SetStackAddressRegisterQuadAddress, /// Sets the stack address to the register quad address
+    PushStackRegisterArguments, /// Pushes an argument frame: the first n (at most 4) registers, then the byte n.
+    PushStackImmediateArguments, /// Pushes an argument frame: the first n (at most 4) immediates, then the byte n.
+    PopStack, /// Pops the frame of the innermost call, with everything pushed since, and jumps to its return address.
+    PrintToScreenImmediate,
+    PrintToScreenRegister,
+    SetInterruptHandlerRoutineImmediate,
+    SaveInterruptReasonRegister,
+    /// Calls push the return address on CPU::return_stack and jump to an absolute address. The immediate byte is the
+    /// number of argument frames on top of the stack that belong to the call, popstk pops them with the call.
+    CallImmediateQuad, /// Calls the immediate address.
+    CallRegisterQuad, /// Calls the register quad address.
+    SaveStackAddressRegisterQuad, /// Copies the stack address into a register quad, to reach the argument frames.
+    /// Harts run side by side in one Machine (Machine.h). A CPU outside a Machine is hart 0 and cannot spawn.
+    SaveHartIdRegister, /// Copies the id of the running hart into a register.
+    SpawnHartImmediateQuad, /// Starts a hart at the immediate address with a copy of the registers, its id or 0 if none started goes to a register.
+    JoinHartRegister, /// Waits for the hart named by a register to halt, its halt value goes to a register quad.
+    /// Leaves the exception handler routine for errored_program_counter plus the immediate in instructions, so 0 retries
+    /// a trapping instruction or resumes an interrupted one and 1 skips the trapping one. Enables interrupts again.
+    ReturnFromInterruptImmediate,
+    ImmediateInstructionSize
+};
+static constexpr const char* II_asm[ImmediateInstructionSize] = {"jumpiq", "jumprq", "bjumpiq", "bjumprq",
+"haltiq", "haltrq", "setstkiq", "setstkrq", "pushstkr", "pushstki",
+"popstk", "prti", "prtr", "setihriq", "saveirr", "calliq", "callrq", "savestkrq", "hartr", "spawniq", "joinr", "reti"};
+static constexpr const char* II_operands[ImmediateInstructionSize] = {"j", "rrrr", "k", "rrrr",
+"q", "rrrr", "q", "rrrr", "i*rrrr", "i*iiii",
+"", "i", "r", "q", "r", "q*i", "rrrr*i", "rrrr", "r", "qr", "rr", "*i"};
+
+#define NUM_IMMEDIATE_INSTRUCTIONS_SELECTION_BITS 5
+static_assert(ImmediateInstructionSize <= (1 << NUM_IMMEDIATE_INSTRUCTIONS_SELECTION_BITS), "NUM_IMMEDIATE_INSTRUCTIONS_SELECTION_BITS too low for number of instructions.");
+static_assert(NUM_INSTRUCTION_TYPE_SELECTION_BITS + 
+              NUM_PREDICATE_BITS + 
+              NUM_IMMEDIATE_INSTRUCTIONS_SELECTION_BITS + 
+              5*NUM_REGISTER_BITS <= INSTRUCTION_SIZE_BITS, "Too few bits in instruction for immediate instruction.");
+static_assert(NUM_INSTRUCTION_TYPE_SELECTION_BITS + 
+              NUM_PREDICATE_BITS + 
+              NUM_IMMEDIATE_INSTRUCTIONS_SELECTION_BITS + 
+              1*NUM_REGISTER_BITS + 
+              4*NUM_WORD_BITS <= INSTRUCTION_SIZE_BITS, "Too few bits in instruction for immediate instruction.");
+static_assert(NUM_INSTRUCTION_TYPE_SELECTION_BITS + 
+              NUM_PREDICATE_BITS + 
+              NUM_IMMEDIATE_INSTRUCTIONS_SELECTION_BITS + 
+              5*NUM_WORD_BITS <= INSTRUCTION_SIZE_BITS, "Too few bits in instruction for immediate instruction.");
+
+/// Vector ranges are a first register and an immediate length, 0 meaning all 256. Ranges wrap past the last register
+/// and every source is read before the destination is written, so ranges may overlap in any way.
+enum VectorInstructions
+{
+    VectorAdd = 0, /// Adds two ranges element-wise. requires: 3 registers, 1 immediate
+    VectorAddSaveCarry, /// Adds two ranges element-wise and saves each carry into a fourth range. requires: 4 registers, 1 immediate
+    VectorAnd, /// Bitwise-ands two ranges. requires: 3 registers, 1 immediate
+    VectorOr, /// Bitwise-ors two ranges. requires: 3 registers, 1 immediate
+    VectorXor, /// Bitwise-xors two ranges. requires: 3 registers, 1 immediate
+    VectorCompareEqual, /// 255 where two ranges are equal, 0 elsewhere. requires: 3 registers, 1 immediate
+    VectorCompareGreater, /// 255 where the first range is unsigned greater, 0 elsewhere. requires: 3 registers, 1 immediate
+    VectorMin, /// Unsigned element-wise minimum. requires: 3 registers, 1 immediate
+    VectorMax, /// Unsigned element-wise maximum. requires: 3 registers, 1 immediate
+    VectorSum, /// Sums a range into a register quad. requires: 2 registers, 1 immediate
+    VectorLoadMemory, /// Loads a range from the address in a register quad. requires: 2 registers, 1 immediate
+    VectorStoreMemory, /// Stores a range to the address in a register quad. requires: 2 registers, 1 immediate
+    VectorInstructionSize
+};
+static constexpr const char* VI_asm[VectorInstructionSize] = {"vadd", "vaddc", "vand", "vor",
+"vxor", "vcmpeq", "vcmpgt", "vmin", "vmax", "vsum", "vloadm", "vstorem"};
+static constexpr const char* VI_operands[VectorInstructionSize] = {"rrri", "rrrri", "rrri", "rrri",
+"rrri", "rrri", "rrri", "rrri", "rrri", "rri", "rri", "rri"};
+
+#define NUM_VECTOR_INSTRUCTIONS_SELECTION_BITS 5
+static_assert(VectorInstructionSize <= (1 << NUM_VECTOR_INSTRUCTIONS_SELECTION_BITS), "NUM_VECTOR_INSTRUCTIONS_SELECTION_BITS too low for number of instructions.");
+static_assert(NUM_INSTRUCTION_TYPE_SELECTION_BITS + 
+              NUM_PREDICATE_BITS + 
+              NUM_VECTOR_INSTRUCTIONS_SELECTION_BITS + 
+              4*NUM_REGISTER_BITS +
+              NUM_WORD_BITS <= INSTRUCTION_SIZE_BITS, "Too few bits in instruction for vector instruction.");
+static_assert(InstructionTypesSize <= (1 << NUM_INSTRUCTION_TYPE_SELECTION_BITS), "NUM_INSTRUCTION_TYPE_SELECTION_BITS too low for number of types.");
+
+static_assert(NUM_REGISTER_BITS <= 8, "Too many bits for register.");
+
+/// Flat numbering of every instruction, used by the run loop to dispatch without the function tables.
+enum Opcodes
+{
+    MemoryOpcodeBase = 0,
+    RegisterOpcodeBase = MemoryOpcodeBase + MemoryInstructionsSize,
+    ImmediateOpcodeBase = RegisterOpcodeBase + RegisterInstructionSize,
+    VectorOpcodeBase = ImmediateOpcodeBase + ImmediateInstructionSize,
+    InvalidOpcode = VectorOpcodeBase + VectorInstructionSize,
+    OpcodesSize
+};
+static_assert(OpcodesSize <= 256, "Opcodes must fit in DecodedInstruction::opcode.");
+
+/// Where one instruction type keeps its function, and the opcodes its functions map to.
+struct InstructionTypeFields
+{
+    uint8_t function_bits;
+    uint8_t function_count; /// Functions past it decode to InvalidOpcode.
+    uint8_t opcode_base;
+};
+
+/// The layout above as constants, low bits first: the predicate enable bit and register, the type, the function within
+/// the type and then val1-val5. The decoder is a template over a type like this one, so a CPU configuration gets
+/// a decoder with every shift and mask folded in.
+struct InstructionEncoding
+{
+    static constexpr unsigned predicate_bits = NUM_PREDICATE_BITS;
+    static constexpr unsigned type_bits = NUM_INSTRUCTION_TYPE_SELECTION_BITS;
+    static constexpr unsigned operand_bits = NUM_REGISTER_BITS;
+    static constexpr InstructionTypeFields types[1 << NUM_INSTRUCTION_TYPE_SELECTION_BITS] = {
+        {NUM_MEMORY_INSTRUCTIONS_SELECTION_BITS, MemoryInstructionsSize, MemoryOpcodeBase},
+        {NUM_REGISTRY_INSTRUCTIONS_SELECTION_BITS, RegisterInstructionSize, RegisterOpcodeBase},
+        {NUM_IMMEDIATE_INSTRUCTIONS_SELECTION_BITS, ImmediateInstructionSize, ImmediateOpcodeBase},
+        {NUM_VECTOR_INSTRUCTIONS_SELECTION_BITS, VectorInstructionSize, VectorOpcodeBase}};
+};
+static_assert(InstructionTypesSize == 1 << NUM_INSTRUCTION_TYPE_SELECTION_BITS, "InstructionEncoding::types lists every type.");
+
+/// Decodes instruction laid out as Encoding into out, all but address and valid. Straight-line code, the type only
+/// picks an entry of Encoding::types.
+template<class Encoding>
+inline void decode_instruction(uint64_t instruction, DecodedInstruction& out)
+{
+    constexpr uint64_t operand_mask = (uint64_t(1) << Encoding::operand_bits) - 1;
+    out.has_predicate = instruction & 1;
+    out.predicate_register = (instruction >> 1) & operand_mask;
+    
+    uint64_t fields = instruction >> Encoding::predicate_bits;
+    const InstructionTypeFields& type = Encoding::types[fields & ((1 << Encoding::type_bits) - 1)];
+    fields >>= Encoding::type_bits;
+    uint32_t func = fields & ((1 << type.function_bits) - 1);
+    out.opcode = func < type.function_count ? type.opcode_base + func : unsigned(InvalidOpcode);
+    
+    uint64_t args = fields >> type.function_bits;
+    out.val1 = args & operand_mask;
+    out.val2 = (args >> Encoding::operand_bits) & operand_mask;
+    out.val3 = (args >> 2*Encoding::operand_bits) & operand_mask;
+    out.val4 = (args >> 3*Encoding::operand_bits) & operand_mask;
+    out.val5 = (args >> 4*Encoding::operand_bits) & operand_mask;
+    out.quad = (out.val1 << 24) | (out.val2 << 16) | (out.val3 << 8) | (out.val4);
+    out.dispatch = out.opcode;
+    out.fused = false;
+}
+
+#define NO_PREDICATE -1
+
+/// Packs an instruction word. Operands are the handler's val1-val5 in order, predicate is a register or NO_PREDICATE.
+inline uint64_t encode_instruction(uint32_t type, uint32_t func, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5, int predicate = NO_PREDICATE)
+{
+    int func_bits = type == MemoryInstructionType ? NUM_MEMORY_INSTRUCTIONS_SELECTION_BITS :
+                    type == RegisterInstructionType ? NUM_REGISTRY_INSTRUCTIONS_SELECTION_BITS :
+                    type == ImmediateInstructionType ? NUM_IMMEDIATE_INSTRUCTIONS_SELECTION_BITS :
+                    NUM_VECTOR_INSTRUCTIONS_SELECTION_BITS;
+    uint64_t operands = uint64_t(val1) | (uint64_t(val2) << 8) | (uint64_t(val3) << 16) | (uint64_t(val4) << 24) | (uint64_t(val5) << 32);
+    uint64_t instruction = type | (uint64_t(func) << NUM_INSTRUCTION_TYPE_SELECTION_BITS) | (operands << (NUM_INSTRUCTION_TYPE_SELECTION_BITS + func_bits));
+    instruction <<= NUM_PREDICATE_BITS;
+    
+    if(predicate != NO_PREDICATE)
+        instruction |= 1 | (uint64_t(predicate) << 1);
+    return instruction;
+}
+
+inline uint64_t encode_memory_instruction(MemoryInstructions func, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5, int predicate = NO_PREDICATE)
+{
+    return encode_instruction(MemoryInstructionType, func, val1, val2, val3, val4, val5, predicate);
+}
+
+inline uint64_t encode_register_instruction(RegisterInstructions func, uint8_t val1, uint8_t val2, uint8_t val3 = 0, uint8_t val4 = 0, int predicate = NO_PREDICATE)
+{
+    return encode_instruction(RegisterInstructionType, func, val1, val2, val3, val4, 0, predicate);
+}
+
+inline uint64_t encode_immediate_instruction(ImmediateInstructions func, uint8_t val1 = 0, uint8_t val2 = 0, uint8_t val3 = 0, uint8_t val4 = 0, uint8_t val5 = 0, int predicate = NO_PREDICATE)
+{
+    return encode_instruction(ImmediateInstructionType, func, val1, val2, val3, val4, val5, predicate);
+}
+
+inline uint64_t encode_vector_instruction(VectorInstructions func, uint8_t val1, uint8_t val2, uint8_t val3, uint8_t val4, uint8_t val5 = 0, int predicate = NO_PREDICATE)
+{
+    return encode_instruction(VectorInstructionType, func, val1, val2, val3, val4, val5, predicate);
+}
+
+/// Immediate quad forms take the quad big-endian in val1-val4.
+inline uint64_t encode_immediate_quad_instruction(ImmediateInstructions func, uint32_t quad, int predicate = NO_PREDICATE)
+{
+    return encode_immediate_instruction(func, quad >> 24, quad >> 16, quad >> 8, quad, 0, predicate);
+}
@@ -0,0 +1,32 @@
+#include "Interrupts.h"
+
+InterruptTimer::InterruptTimer(std::atomic<uint32_t>& pending, uint32_t bits, std::chrono::microseconds period, bool repeat)
+    : fired(0), pending(pending), bits(bits), period(period), repeat(repeat), stopping(false)
+{
+    thread = std::thread(&InterruptTimer::timer_loop, this);
+}
+
+InterruptTimer::~InterruptTimer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+}
+
+void InterruptTimer::timer_loop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    /// Ticks are due on a fixed schedule, so time spent raising one does not push the next back.
+    auto due = std::chrono::steady_clock::now() + period;
+    while(!wake.wait_until(lock, due, [&] { return stopping; }))
+    {
+        pending.fetch_or(bits, std::memory_order_relaxed);
+        fired.fetch_add(1, std::memory_order_relaxed);
+        if(!repeat)
+            return;
+        due += period;
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+/// Raises interrupts on a CPU from a host thread by the wall clock: a TimerInterrupt following real time rather than
+/// the instruction count of CPU::timer_interval, or a PREEMPT_REQUEST to take a runaway guest back within one basic
+/// block. Nothing runs on the CPU's thread, the request is one atomic or into its pending_interrupts, which the run
+/// loop already tests at every block boundary.
+class InterruptTimer
+{
+public:
+    /// ORs bits, 1 << reason or PREEMPT_REQUEST, into pending, a CPU's pending_interrupts, every period or only once
+    /// after it when repeat is false. The CPU must outlive the timer.
+    InterruptTimer(std::atomic<uint32_t>& pending, uint32_t bits, std::chrono::microseconds period, bool repeat = true);
+    /// Stops the thread, a tick not yet due never fires.
+    ~InterruptTimer();
+    InterruptTimer(const InterruptTimer&) = delete;
+    InterruptTimer& operator=(const InterruptTimer&) = delete;
+    
+    std::atomic<uint64_t> fired; /// Times bits were raised.
+
+private:
+    void timer_loop();
+    
+    std::atomic<uint32_t>& pending;
+    uint32_t bits;
+    std::chrono::microseconds period;
+    bool repeat;
+    
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping;
+};
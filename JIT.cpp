@@ -0,0 +1,439 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "JIT.h"
+#include "Instructions.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+#define DERP_JIT_SUPPORTED 1
+#endif
+
+#if DERP_JIT_SUPPORTED
+/// Appends x86-64 machine code. Registers: rdi = guest register file, rsi = retired counter,
+/// edx = loop budget on entry, eax/ecx/edx = scratch, r8d = loop budget.
+class Emitter
+{
+public:
+    Emitter(uint8_t* out, std::size_t capacity) : out(out), capacity(capacity), size(0) {}
+    
+    bool overflowed() const { return size > capacity; }
+    std::size_t position() const { return size; }
+    
+    void byte(uint8_t value)
+    {
+        if(size < capacity)
+            out[size] = value;
+        ++size;
+    }
+    
+    void dword(uint32_t value)
+    {
+        for(int i = 0; i < 4; ++i)
+            byte((value >> (8*i)) & 0xFF);
+    }
+    
+    void patch_rel32(std::size_t at, std::size_t target)
+    {
+        uint32_t rel = uint32_t(target - (at + 4));
+        for(int i = 0; i < 4 && at + i < capacity; ++i)
+            out[at + i] = (rel >> (8*i)) & 0xFF;
+    }
+    
+    /// movzx reg, byte [rdi + guest_register]
+    void load_register(int reg, uint8_t guest_register) { byte(0x0F); byte(0xB6); byte(0x87 | (reg << 3)); dword(guest_register); }
+    /// mov byte [rdi + guest_register], low byte of reg
+    void store_register(int reg, uint8_t guest_register) { byte(0x88); byte(0x87 | (reg << 3)); dword(guest_register); }
+    /// cmp byte [rdi + guest_register], 0
+    void test_register(uint8_t guest_register) { byte(0x80); byte(0xBF); dword(guest_register); byte(0x00); }
+    /// mov reg, imm32
+    void move_immediate(int reg, uint32_t value) { byte(0xB8 | reg); dword(value); }
+    /// mov dst, src
+    void move(int dst, int src) { byte(0x89); byte(0xC0 | (src << 3) | dst); }
+    /// <op> dst, src for the ALU group encoded as 01/09/21/31
+    void alu(uint8_t opcode, int dst, int src) { byte(opcode); byte(0xC0 | (src << 3) | dst); }
+    /// <op> eax, imm32 for the short accumulator forms 05/0D/25/35
+    void alu_eax_immediate(uint8_t opcode, uint32_t value) { byte(opcode); dword(value); }
+    void imul(int dst, int src) { byte(0x0F); byte(0xAF); byte(0xC0 | (dst << 3) | src); }
+    void imul_immediate(int dst, uint32_t value) { byte(0x69); byte(0xC0 | (dst << 3) | dst); dword(value); }
+    void shr(int reg, uint8_t amount) { byte(0xC1); byte(0xE8 | reg); byte(amount); }
+    void bitwise_not(int reg) { byte(0xF7); byte(0xD0 | reg); }
+    /// cmovcc dst, src
+    void cmov(uint8_t condition, int dst, int src) { byte(0x0F); byte(0x40 | condition); byte(0xC0 | (dst << 3) | src); }
+    /// add qword [rsi], imm32
+    void add_retired(uint32_t value) { byte(0x48); byte(0x81); byte(0x06); dword(value); }
+    /// mov r8d, edx
+    void move_loop_budget() { byte(0x41); byte(0x89); byte(0xD0); }
+    void decrement_loop_budget() { byte(0x41); byte(0xFF); byte(0xC8); }
+    /// jcc rel32, returns the offset of the displacement for patching.
+    std::size_t jump_if(uint8_t condition) { byte(0x0F); byte(0x80 | condition); std::size_t at = size; dword(0); return at; }
+    void ret() { byte(0xC3); }
+    
+private:
+    uint8_t* out;
+    std::size_t capacity;
+    std::size_t size;
+};
+
+enum HostRegisters { EAX = 0, ECX = 1, EDX = 2 };
+enum Conditions { ConditionEqual = 0x4, ConditionNotEqual = 0x5 };
+enum AluOpcodes { AluAdd = 0x01, AluOr = 0x09, AluAnd = 0x21, AluXor = 0x31 };
+
+/// Writes result (and high, for the save-carry forms) into the guest registers. A predicated instruction
+/// keeps the old values through cmov, the predicate is read once before either store like the interpreter.
+static void emit_writeback(Emitter& e, const DecodedInstruction& inst, bool has_high)
+{
+    if(has_high)
+    {
+        e.move(EDX, EAX);
+        e.shr(EDX, 8);
+    }
+    
+    if(inst.has_predicate)
+        e.test_register(inst.predicate_register);
+    
+    if(inst.has_predicate)
+    {
+        e.load_register(ECX, inst.val1);
+        e.cmov(ConditionEqual, EAX, ECX);
+    }
+    e.store_register(EAX, inst.val1);
+    
+    if(has_high)
+    {
+        if(inst.has_predicate)
+        {
+            e.load_register(ECX, inst.val2);
+            e.cmov(ConditionEqual, EDX, ECX);
+        }
+        e.store_register(EDX, inst.val2);
+    }
+}
+
+/// Emits one register instruction. Returns false for instructions left to the interpreter.
+static bool emit_register_instruction(Emitter& e, const DecodedInstruction& inst)
+{
+    switch(inst.opcode - RegisterOpcodeBase)
+    {
+        case LoadImmediate:
+            e.move_immediate(EAX, inst.val2);
+            emit_writeback(e, inst, false);
+            return true;
+        case LoadRegister:
+            e.load_register(EAX, inst.val2);
+            emit_writeback(e, inst, false);
+            return true;
+        case AddImmediate:
+        case AndImmediate:
+        case OrImmediate:
+        case XorImmediate:
+        {
+            static const uint8_t eax_forms[] = {0x05, 0x25, 0x0D, 0x35};
+            int form = inst.opcode - RegisterOpcodeBase == AddImmediate ? 0 :
+                       inst.opcode - RegisterOpcodeBase == AndImmediate ? 1 :
+                       inst.opcode - RegisterOpcodeBase == OrImmediate ? 2 : 3;
+            e.load_register(EAX, inst.val2);
+            e.alu_eax_immediate(eax_forms[form], inst.val3);
+            emit_writeback(e, inst, false);
+            return true;
+        }
+        case AddRegister:
+        case AndRegister:
+        case OrRegister:
+        case XorRegister:
+        {
+            uint8_t op = inst.opcode - RegisterOpcodeBase == AddRegister ? AluAdd :
+                         inst.opcode - RegisterOpcodeBase == AndRegister ? AluAnd :
+                         inst.opcode - RegisterOpcodeBase == OrRegister ? AluOr : AluXor;
+            e.load_register(EAX, inst.val2);
+            e.load_register(ECX, inst.val3);
+            e.alu(op, EAX, ECX);
+            emit_writeback(e, inst, false);
+            return true;
+        }
+        case AddImmediateSaveCarry:
+            e.load_register(EAX, inst.val3);
+            e.alu_eax_immediate(0x05, inst.val4);
+            emit_writeback(e, inst, true);
+            return true;
+        case AddRegisterSaveCarry:
+            e.load_register(EAX, inst.val3);
+            e.load_register(ECX, inst.val4);
+            e.alu(AluAdd, EAX, ECX);
+            emit_writeback(e, inst, true);
+            return true;
+        case MulImmediate:
+            e.load_register(EAX, inst.val2);
+            e.imul_immediate(EAX, inst.val3);
+            emit_writeback(e, inst, false);
+            return true;
+        case MulRegister:
+            e.load_register(EAX, inst.val2);
+            e.load_register(ECX, inst.val3);
+            e.imul(EAX, ECX);
+            emit_writeback(e, inst, false);
+            return true;
+        case MulImmediateSaveCarry:
+            e.load_register(EAX, inst.val4);
+            e.imul_immediate(EAX, inst.val3);
+            emit_writeback(e, inst, true);
+            return true;
+        case MulRegisterSaveCarry:
+            e.load_register(EAX, inst.val4);
+            e.load_register(ECX, inst.val3);
+            e.imul(EAX, ECX);
+            emit_writeback(e, inst, true);
+            return true;
+        case BitwiseComplement:
+            e.load_register(EAX, inst.val2);
+            e.bitwise_not(EAX);
+            emit_writeback(e, inst, false);
+            return true;
+        default:
+            /// Division, modulo and the wide forms stay in the interpreter.
+            return false;
+    }
+}
+#endif
+
+JIT::JIT(JitModes mode) : mode(mode), blocks_compiled(0), invalidations(0),
+    code_buffer(nullptr), code_used(0), guest_low(0), guest_high(0)
+{
+    memset(blocks, 0, sizeof(blocks));
+    
+#if DERP_JIT_SUPPORTED
+    void* buffer = mmap(nullptr, JIT_CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(buffer != MAP_FAILED)
+        code_buffer = static_cast<uint8_t*>(buffer);
+#endif
+    
+    if(!code_buffer)
+        this->mode = JitOff;
+}
+
+JIT::~JIT()
+{
+#if DERP_JIT_SUPPORTED
+    if(code_buffer)
+        munmap(code_buffer, JIT_CODE_BUFFER_SIZE);
+#endif
+}
+
+template<class Config>
+void JIT::invalidate(BasicCPU<Config>& cpu)
+{
+    memset(blocks, 0, sizeof(blocks));
+    code_used = 0;
+    guest_low = guest_high = 0;
+    cpu.jit_code_low = 0;
+    cpu.jit_code_span = 0;
+    ++invalidations;
+}
+
+template<class Config>
+JitBlock* JIT::compile(BasicCPU<Config>& cpu, JitBlock& block)
+{
+#if DERP_JIT_SUPPORTED
+    uint32_t start = block.address;
+    if(JIT_CODE_BUFFER_SIZE - code_used < 64 * 1024)
+    {
+        invalidate(cpu);
+        block.valid = true;
+        block.address = start;
+    }
+    
+    Emitter e(code_buffer + code_used, JIT_CODE_BUFFER_SIZE - code_used);
+    uint32_t pc = start;
+    uint32_t count = 0;
+    
+    e.move_loop_budget();
+    std::size_t top = e.position();
+    
+    DecodedInstruction inst;
+    inst.opcode = InvalidOpcode;
+    for(; count < JIT_MAX_BLOCK_INSTRUCTIONS && pc <= Config::physical_memory_size - 8; ++count, pc += 8)
+    {
+        decode_instruction<typename Config::Encoding>(cpu.fetch_instruction(pc), inst);
+        if(inst.opcode < RegisterOpcodeBase || inst.opcode >= ImmediateOpcodeBase)
+            break;
+        if(!emit_register_instruction(e, inst))
+            break;
+    }
+    
+    bool terminated = false;
+    bool self_loop = false;
+    if(inst.opcode == ImmediateOpcodeBase + JumpImmediateQuad || inst.opcode == ImmediateOpcodeBase + JumpBackImmediateQuad)
+    {
+        uint32_t target = inst.opcode == ImmediateOpcodeBase + JumpImmediateQuad ? pc + inst.quad : pc - inst.quad;
+        uint32_t fallthrough = pc + 8;
+        ++count;
+        pc += 8;
+        terminated = true;
+        self_loop = target == start;
+        e.add_retired(count);
+        
+        if(self_loop)
+        {
+            /// Self loop: branch back natively until the predicate fails or the budget runs out.
+            std::size_t exit_at = 0;
+            if(inst.has_predicate)
+            {
+                e.test_register(inst.predicate_register);
+                exit_at = e.jump_if(ConditionEqual);
+            }
+            e.decrement_loop_budget();
+            std::size_t loop_at = e.jump_if(ConditionNotEqual);
+            e.patch_rel32(loop_at, top);
+            e.move_immediate(EAX, start);
+            e.ret();
+            if(inst.has_predicate)
+            {
+                e.patch_rel32(exit_at, e.position());
+                e.move_immediate(EAX, fallthrough);
+                e.ret();
+            }
+        }
+        else if(inst.has_predicate)
+        {
+            e.move_immediate(EAX, fallthrough);
+            e.move_immediate(EDX, target);
+            e.test_register(inst.predicate_register);
+            e.cmov(ConditionNotEqual, EAX, EDX);
+            e.ret();
+        }
+        else
+        {
+            e.move_immediate(EAX, target);
+            e.ret();
+        }
+    }
+    
+    if(count == 0 || (count < JIT_MIN_BLOCK_INSTRUCTIONS && !self_loop))
+    {
+        block.uncompilable = true;
+        return nullptr;
+    }
+    
+    if(!terminated)
+    {
+        e.add_retired(count);
+        e.move_immediate(EAX, pc);
+        e.ret();
+    }
+    
+    if(e.overflowed())
+        return nullptr;
+    
+    block.code = reinterpret_cast<JitBlockFunction>(code_buffer + code_used);
+    block.guest_end = pc;
+    code_used += (e.position() + 15) & ~std::size_t(15);
+    ++blocks_compiled;
+    
+    if(guest_low == guest_high)
+    {
+        guest_low = start;
+        guest_high = pc;
+    }
+    else
+    {
+        if(start < guest_low)
+            guest_low = start;
+        if(pc > guest_high)
+            guest_high = pc;
+    }
+    cpu.jit_code_low = guest_low;
+    cpu.jit_code_span = guest_high - guest_low;
+    return &block;
+#else
+    block.uncompilable = true;
+    return nullptr;
+#endif
+}
+
+template<class Config>
+uint32_t JIT::execute(BasicCPU<Config>& cpu, const JitBlock& block, uint32_t loop_budget)
+{
+    if(mode != JitVerify)
+        return block.code(cpu.registers, &cpu.jit_instructions, loop_budget);
+    
+    uint8_t native_registers[NUM_REGISTERS];
+    memcpy(native_registers, cpu.registers, NUM_REGISTERS);
+    uint64_t retired = 0;
+    uint32_t native_pc = block.code(native_registers, &retired, loop_budget);
+    
+    /// The steps count the instructions themselves, adding retired to jit_instructions as well would count them twice
+    /// and move the timer, so the program being checked would no longer be the one run without verification.
+    uint32_t start = cpu.program_counter;
+    for(uint64_t i = 0; i < retired; ++i)
+        cpu.step();
+    
+    if(cpu.program_counter != native_pc || memcmp(native_registers, cpu.registers, NUM_REGISTERS) != 0)
+    {
+        fprintf(stderr, "JIT mismatch in block at 0x%08x after %llu instructions: pc 0x%08x native, 0x%08x interpreted\n",
+                start, (unsigned long long)retired, native_pc, cpu.program_counter);
+        for(int i = 0; i < NUM_REGISTERS; ++i)
+            if(native_registers[i] != cpu.registers[i])
+                fprintf(stderr, "  $%d: %d native, %d interpreted\n", i, native_registers[i], cpu.registers[i]);
+        abort();
+    }
+    
+    return native_pc;
+}
+
+template<class Config>
+uint8_t JIT::enter(BasicCPU<Config>& cpu, uint64_t next_event)
+{
+    if(mode == JitOff)
+        return JIT_NEVER;
+    
+    /// The first block was counted hot by the run loop, the ones chained to count their own entries.
+    bool first = true;
+    while(true)
+    {
+        JitBlock& block = blocks[(cpu.program_counter >> 3) & (JIT_TABLE_SIZE - 1)];
+        if(!block.valid || block.address != cpu.program_counter)
+        {
+            block.valid = true;
+            block.address = cpu.program_counter;
+            block.entries = 0;
+            block.code = nullptr;
+            block.uncompilable = false;
+        }
+        
+        if(!block.code)
+        {
+            if(block.uncompilable || (!first && ++block.entries < JIT_HOT_THRESHOLD) || !compile(cpu, block))
+                return !first ? JIT_COMPILED : block.uncompilable ? JIT_NEVER : 0;
+        }
+        
+        /// Enough iterations for a self loop to reach next_event, one once it is reached or an interrupt is pending.
+        uint64_t retired = cpu.instructions_retired();
+        bool pending = cpu.pending_interrupts.load(std::memory_order_relaxed) != 0;
+        uint64_t left = pending || retired >= next_event ? 0 : next_event - retired;
+        uint32_t length = (block.guest_end - block.address) >> 3;
+        uint32_t loop_budget = left >= uint64_t(JIT_LOOP_LIMIT) * length ? JIT_LOOP_LIMIT :
+                               left ? uint32_t((left + length - 1) / length) : 1;
+        
+        uint32_t start = cpu.program_counter;
+        cpu.program_counter = execute(cpu, block, loop_budget);
+        first = false;
+        
+        /// A self loop that ran out of budget goes back through the interpreter so the run loop gets control, and so
+        /// does a chain of blocks once the budget or the timer runs out or an interrupt is raised.
+        if(cpu.program_counter == start || cpu.instructions_retired() >= next_event ||
+           cpu.pending_interrupts.load(std::memory_order_relaxed) != 0)
+            return JIT_COMPILED;
+    }
+}
+
+template<class Config>
+void BasicCPU<Config>::jit_invalidate()
+{
+    jit->invalidate(*this);
+}
+
+#define INSTANTIATE_JIT(Config) \
+    template uint8_t JIT::enter(BasicCPU<Config>& cpu, uint64_t next_event); \
+    template void BasicCPU<Config>::jit_invalidate();
+CPU_CONFIGS(INSTANTIATE_JIT)
+#undef INSTANTIATE_JIT
@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include "CPU.h"
+
+#define JIT_TABLE_BITS 12
+#define JIT_TABLE_SIZE (1 << JIT_TABLE_BITS)
+#define JIT_CODE_BUFFER_SIZE (16 << 20)
+#define JIT_HOT_THRESHOLD 16 /// Number of entries through a jump before a block is compiled.
+#define JIT_MAX_BLOCK_INSTRUCTIONS 64
+/// Shortest block compiled unless it loops to itself. Fewer instructions run faster interpreted than entering
+/// compiled code costs.
+#define JIT_MIN_BLOCK_INSTRUCTIONS 8
+/// DecodedInstruction::jit_state past the counts: code is compiled at the address, or none will be.
+#define JIT_COMPILED 254
+#define JIT_NEVER 255
+#define JIT_LOOP_LIMIT 4096 /// Most iterations a self-looping block runs before returning to the interpreter.
+
+/// Compiled code for one guest basic block. Takes the register file, a counter of retired guest instructions and
+/// the iterations a self loop may run, at least 1, and returns the program counter to continue at.
+typedef uint32_t (*JitBlockFunction)(uint8_t* registers, uint64_t* retired, uint32_t loop_budget);
+
+enum JitModes
+{
+    JitOff = 0,
+    JitOn, /// Hot blocks run as native code.
+    JitVerify, /// Every native block is replayed through the interpreter and the results compared.
+    JitModesSize
+};
+
+struct JitBlock
+{
+    uint32_t address; /// Guest address of the first instruction. Tag for JIT::blocks.
+    uint32_t entries; /// Times the block was entered before being compiled.
+    uint32_t guest_end; /// Address one past the last guest instruction covered.
+    JitBlockFunction code; /// Null until compiled.
+    bool valid;
+    bool uncompilable; /// The first instruction is not supported or the block is too short, stay in the interpreter.
+};
+
+/// Basic-block compiler from the register instructions to x86-64.
+/// Blocks are runs of RI instructions (no division) ended by an immediate jump. Everything else is left to
+/// the interpreter, so blocks never touch guest memory and a store can only invalidate them from outside.
+class JIT
+{
+public:
+    JIT(JitModes mode);
+    ~JIT();
+    
+    /// Runs compiled code starting at cpu.program_counter, compiling it first if needed, chaining from block to
+    /// block until a cold block, a self loop running out of its budget, cpu.instructions_retired() reaching
+    /// next_event or an interrupt pending. A self loop stops within an iteration of next_event and after at most
+    /// JIT_LOOP_LIMIT iterations. The run loop calls in once a target is hot, and keeps the result as the target's
+    /// DecodedInstruction::jit_state: JIT_COMPILED, JIT_NEVER, or 0 to count again when compiling failed for lack
+    /// of space. Compiled for every configuration in CPU_CONFIGS, one JIT serves one CPU.
+    template<class Config>
+    uint8_t enter(BasicCPU<Config>& cpu, uint64_t next_event);
+    /// Throws away all compiled code, called when a store hits a compiled guest range.
+    template<class Config>
+    void invalidate(BasicCPU<Config>& cpu);
+    
+    JitModes mode;
+    uint64_t blocks_compiled;
+    uint64_t invalidations;
+    
+private:
+    template<class Config>
+    JitBlock* compile(BasicCPU<Config>& cpu, JitBlock& block);
+    template<class Config>
+    uint32_t execute(BasicCPU<Config>& cpu, const JitBlock& block, uint32_t loop_budget);
+    
+    JitBlock blocks[JIT_TABLE_SIZE];
+    uint8_t* code_buffer;
+    std::size_t code_used;
+    uint32_t guest_low; /// Guest address range covered by compiled blocks.
+    uint32_t guest_high;
+};
@@ -0,0 +1,372 @@
+#include <cstring>
+#include <csetjmp>
+#include "Lockstep.h"
+#include "Instructions.h"
+#include "Faults.h"
+
+LockstepGroup::LockstepGroup(unsigned lanes) : lockstep_instructions(0), scalarized_instructions(0), diverged_lanes(0), active(0)
+{
+    if(lanes > LOCKSTEP_LANES)
+        lanes = LOCKSTEP_LANES;
+    
+    for(unsigned i = 0; i < lanes; ++i)
+        cpus.emplace_back(new CPU());
+    memset(registers, 0, sizeof(registers));
+}
+
+void LockstepGroup::load_program(const std::vector<uint64_t>& program, uint32_t address)
+{
+    for(std::unique_ptr<CPU>& cpu : cpus)
+        cpu->load_program(program, address);
+}
+
+void LockstepGroup::export_lane(unsigned lane)
+{
+    for(int r = 0; r < NUM_REGISTERS; ++r)
+        cpus[lane]->registers[r] = registers[r][lane];
+}
+
+void LockstepGroup::import_lane(unsigned lane)
+{
+    for(int r = 0; r < NUM_REGISTERS; ++r)
+        registers[r][lane] = cpus[lane]->registers[r];
+}
+
+void LockstepGroup::leave(unsigned lane, uint32_t program_counter)
+{
+    export_lane(lane);
+    cpus[lane]->program_counter = program_counter;
+    active &= ~(1u << lane);
+    ++diverged_lanes;
+}
+
+void LockstepGroup::finish(unsigned lane, uint32_t program_counter, uint32_t halt_value)
+{
+    export_lane(lane);
+    CPU& cpu = *cpus[lane];
+    cpu.program_counter = program_counter;
+    cpu.halt(halt_value);
+    active &= ~(1u << lane);
+}
+
+/// Runs one instruction for one lane through the normal handler, with guest faults delivered the same way
+/// CPU::run() would. Returns false if the lane halted.
+bool LockstepGroup::scalarize(unsigned lane, const DecodedInstruction& inst, uint32_t program_counter, bool predicate)
+{
+    CPU& cpu = *cpus[lane];
+    export_lane(lane);
+    cpu.program_counter = program_counter;
+    ++scalarized_instructions;
+    
+#if defined(__unix__)
+    sigjmp_buf fault_resume;
+    FaultScope fault_scope(cpu.memory, cpu.trap_memory_faults ? &fault_resume : nullptr);
+    if(cpu.trap_memory_faults && sigsetjmp(fault_resume, 0))
+    {
+        cpu.raise_exception(MemoryFault);
+    }
+    else
+#endif
+    {
+        if(predicate)
+            cpu.execute(inst);
+        cpu.program_counter += 8;
+    }
+    
+    import_lane(lane);
+    if(cpu.halted)
+    {
+        active &= ~(1u << lane);
+        return false;
+    }
+    return true;
+}
+
+#if defined(__GNUC__)
+/// The vector helpers are all internal, so the AVX return ABI warning does not apply to them. Lane vectors are
+/// passed by reference, GCC notes the changed argument ABI whatever the pragma says.
+#pragma GCC diagnostic ignored "-Wpsabi"
+typedef uint8_t LaneVector __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef uint16_t WideLaneVector __attribute__((vector_size(2*LOCKSTEP_LANES)));
+
+static inline LaneVector load_row(const uint8_t* row)
+{
+    LaneVector value;
+    memcpy(&value, row, sizeof(value));
+    return value;
+}
+
+/// Writes value into the lanes selected by mask, the rest keep their old contents.
+static inline void store_row(uint8_t* row, const LaneVector& value, const LaneVector& mask)
+{
+    LaneVector old = load_row(row);
+    LaneVector merged = (value & mask) | (old & ~mask);
+    memcpy(row, &merged, sizeof(merged));
+}
+
+static inline LaneVector mask_of(uint32_t bits)
+{
+    LaneVector mask;
+    for(int i = 0; i < LOCKSTEP_LANES; ++i)
+        mask[i] = (bits >> i) & 1 ? 0xFF : 0;
+    return mask;
+}
+
+static inline uint32_t bits_of(const LaneVector& mask)
+{
+    uint32_t bits = 0;
+    for(int i = 0; i < LOCKSTEP_LANES; ++i)
+        bits |= uint32_t(mask[i] >> 7) << i;
+    return bits;
+}
+
+static inline uint32_t lowest_lane(uint32_t bits)
+{
+    return __builtin_ctz(bits);
+}
+
+/// Low and high bytes of the 16-bit lane-wise product.
+static inline void multiply_wide(const LaneVector& a, const LaneVector& b, LaneVector& low, LaneVector& high)
+{
+    WideLaneVector product = __builtin_convertvector(a, WideLaneVector) * __builtin_convertvector(b, WideLaneVector);
+    low = __builtin_convertvector(product, LaneVector);
+    high = __builtin_convertvector(product >> 8, LaneVector);
+}
+
+/// Executes a register instruction for every lane in mask. Returns false for the ones done lane by lane.
+static bool vector_register_instruction(uint8_t (*registers)[LOCKSTEP_LANES], const DecodedInstruction& inst, const LaneVector& mask)
+{
+    LaneVector result, high;
+    
+    switch(inst.opcode - RegisterOpcodeBase)
+    {
+        case LoadImmediate:
+            result = LaneVector{} + inst.val2;
+            break;
+        case LoadRegister:
+            result = load_row(registers[inst.val2]);
+            break;
+        case AddImmediate:
+            result = load_row(registers[inst.val2]) + inst.val3;
+            break;
+        case AddRegister:
+            result = load_row(registers[inst.val2]) + load_row(registers[inst.val3]);
+            break;
+        case AddImmediateSaveCarry:
+        case AddRegisterSaveCarry:
+        {
+            LaneVector a = load_row(registers[inst.val3]);
+            LaneVector b = inst.opcode - RegisterOpcodeBase == AddImmediateSaveCarry ? LaneVector{} + inst.val4 : load_row(registers[inst.val4]);
+            result = a + b;
+            high = (LaneVector)(result < a) & 1;
+            store_row(registers[inst.val1], result, mask);
+            store_row(registers[inst.val2], high, mask);
+            return true;
+        }
+        case MulImmediate:
+            result = load_row(registers[inst.val2]) * inst.val3;
+            break;
+        case MulRegister:
+            result = load_row(registers[inst.val2]) * load_row(registers[inst.val3]);
+            break;
+        case MulImmediateSaveCarry:
+        case MulRegisterSaveCarry:
+        {
+            LaneVector a = load_row(registers[inst.val4]);
+            LaneVector b = inst.opcode - RegisterOpcodeBase == MulImmediateSaveCarry ? LaneVector{} + inst.val3 : load_row(registers[inst.val3]);
+            multiply_wide(a, b, result, high);
+            store_row(registers[inst.val1], result, mask);
+            store_row(registers[inst.val2], high, mask);
+            return true;
+        }
+        case AndImmediate:
+            result = load_row(registers[inst.val2]) & inst.val3;
+            break;
+        case AndRegister:
+            result = load_row(registers[inst.val2]) & load_row(registers[inst.val3]);
+            break;
+        case OrImmediate:
+            result = load_row(registers[inst.val2]) | inst.val3;
+            break;
+        case OrRegister:
+            result = load_row(registers[inst.val2]) | load_row(registers[inst.val3]);
+            break;
+        case XorImmediate:
+            result = load_row(registers[inst.val2]) ^ inst.val3;
+            break;
+        case XorRegister:
+            result = load_row(registers[inst.val2]) ^ load_row(registers[inst.val3]);
+            break;
+        case BitwiseComplement:
+            result = ~load_row(registers[inst.val2]);
+            break;
+        default:
+            /// Division and modulo have no vector form and keep the scalar divide-by-zero trap.
+            return false;
+    }
+    
+    store_row(registers[inst.val1], result, mask);
+    return true;
+}
+
+void LockstepGroup::run()
+{
+    diverged_lanes = 0;
+    active = 0;
+    uint32_t program_counter = cpus[0]->program_counter;
+    
+    for(unsigned i = 0; i < cpus.size(); ++i)
+    {
+        CPU& cpu = *cpus[i];
+        cpu.halted = false;
+        if(cpu.trap_memory_faults)
+            install_fault_handler();
+        
+        if(cpu.program_counter == program_counter)
+        {
+            import_lane(i);
+            active |= 1u << i;
+        }
+        else
+        {
+            ++diverged_lanes;
+        }
+    }
+    
+    LaneVector active_mask = mask_of(active);
+    
+    while(active)
+    {
+        const DecodedInstruction& inst = cpus[lowest_lane(active)]->decoded(program_counter);
+        LaneVector mask = active_mask;
+        if(inst.has_predicate)
+            mask &= (LaneVector)(load_row(registers[inst.predicate_register]) != 0);
+        uint32_t executing = inst.has_predicate ? bits_of(mask) : active;
+        uint32_t before = active;
+        uint32_t next = program_counter + 8;
+        ++lockstep_instructions;
+        
+        if(inst.opcode >= RegisterOpcodeBase && inst.opcode < ImmediateOpcodeBase && vector_register_instruction(registers, inst, mask))
+        {
+            program_counter = next;
+            continue;
+        }
+        
+        switch(inst.opcode)
+        {
+            case MemoryOpcodeBase + LoadMemoryRegister:
+            case MemoryOpcodeBase + StoreMemoryRegister:
+            case MemoryOpcodeBase + LoadMemoryImmediate:
+            case MemoryOpcodeBase + StoreMemoryImmediate:
+            {
+                bool register_quad = inst.opcode == MemoryOpcodeBase + LoadMemoryRegister || inst.opcode == MemoryOpcodeBase + StoreMemoryRegister;
+                bool load = inst.opcode == MemoryOpcodeBase + LoadMemoryRegister || inst.opcode == MemoryOpcodeBase + LoadMemoryImmediate;
+                uint32_t addresses[LOCKSTEP_LANES];
+                bool in_range = true;
+                
+                for(uint32_t lanes = executing; lanes; lanes &= lanes - 1)
+                {
+                    uint32_t lane = lowest_lane(lanes);
+                    addresses[lane] = register_quad ? (uint32_t(registers[inst.val1][lane]) << 24) | (registers[inst.val2][lane] << 16) |
+                                                      (registers[inst.val3][lane] << 8) | registers[inst.val4][lane] : inst.quad;
+                    in_range &= addresses[lane] < DefaultConfig::physical_memory_size;
+                }
+                
+                if(!in_range)
+                    break;
+                
+                /// Gather or scatter, one lane's memory at a time.
+                for(uint32_t lanes = executing; lanes; lanes &= lanes - 1)
+                {
+                    uint32_t lane = lowest_lane(lanes);
+                    if(load)
+                        registers[inst.val5][lane] = cpus[lane]->memory[addresses[lane]];
+                    else
+                        cpus[lane]->store(addresses[lane], registers[inst.val5][lane]);
+                }
+                program_counter = next;
+                continue;
+            }
+            case ImmediateOpcodeBase + JumpImmediateQuad:
+            case ImmediateOpcodeBase + JumpBackImmediateQuad:
+            {
+                uint32_t target = inst.opcode == ImmediateOpcodeBase + JumpImmediateQuad ? program_counter + inst.quad : program_counter - inst.quad;
+                uint32_t staying = active & ~executing;
+                
+                /// The bigger half stays in the group, the other lanes carry on alone.
+                if(__builtin_popcount(executing) >= __builtin_popcount(staying))
+                {
+                    for(uint32_t lanes = staying; lanes; lanes &= lanes - 1)
+                        leave(lowest_lane(lanes), next);
+                    program_counter = target;
+                }
+                else
+                {
+                    for(uint32_t lanes = executing; lanes; lanes &= lanes - 1)
+                        leave(lowest_lane(lanes), target);
+                    program_counter = next;
+                }
+                
+                if(active != before)
+                    active_mask = mask_of(active);
+                continue;
+            }
+            case ImmediateOpcodeBase + HaltImmediateQuad:
+            case ImmediateOpcodeBase + HaltRegisterQuad:
+            {
+                for(uint32_t lanes = executing; lanes; lanes &= lanes - 1)
+                {
+                    uint32_t lane = lowest_lane(lanes);
+                    uint32_t value = inst.opcode == ImmediateOpcodeBase + HaltImmediateQuad ? inst.quad :
+                                     (uint32_t(registers[inst.val1][lane]) << 24) | (registers[inst.val2][lane] << 16) |
+                                     (registers[inst.val3][lane] << 8) | registers[inst.val4][lane];
+                    finish(lane, next, value);
+                }
+                
+                program_counter = next;
+                if(active != before)
+                    active_mask = mask_of(active);
+                continue;
+            }
+        }
+        
+        /// Everything else runs lane by lane. Lanes that end up somewhere other than the lowest remaining
+        /// lane's next instruction leave the group.
+        uint32_t group_next = 0;
+        bool have_group = false;
+        for(uint32_t lanes = active; lanes; lanes &= lanes - 1)
+        {
+            uint32_t lane = lowest_lane(lanes);
+            if(!scalarize(lane, inst, program_counter, (executing >> lane) & 1))
+                continue;
+            
+            uint32_t lane_next = cpus[lane]->program_counter;
+            if(!have_group)
+            {
+                group_next = lane_next;
+                have_group = true;
+            }
+            else if(lane_next != group_next)
+            {
+                active &= ~(1u << lane);
+                ++diverged_lanes;
+            }
+        }
+        
+        program_counter = group_next;
+        if(active != before)
+            active_mask = mask_of(active);
+    }
+    
+    for(std::unique_ptr<CPU>& cpu : cpus)
+        if(!cpu->halted)
+            cpu->run();
+}
+#else
+void LockstepGroup::run()
+{
+    /// Without vector extensions every lane simply runs alone.
+    for(std::unique_ptr<CPU>& cpu : cpus)
+        cpu->run();
+}
+#endif
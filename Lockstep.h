@@ -0,0 +1,45 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "CPU.h"
+
+#define LOCKSTEP_LANES 32
+
+/// Runs up to LOCKSTEP_LANES copies of one program over different inputs with a structure of arrays register
+/// file, so each register instruction is one vector operation for all lanes and predicates become lane masks.
+/// Every lane owns a normal CPU for its memory, stack and final state. Lanes whose control flow leaves the
+/// group (a divergent jump or an out of range access) are handed to that CPU and finish in the interpreter.
+/// The code itself is fetched once for the group, so lanes must not modify it.
+class LockstepGroup
+{
+public:
+    LockstepGroup(unsigned lanes = LOCKSTEP_LANES);
+    
+    CPU& lane(unsigned index) { return *cpus[index]; }
+    unsigned lane_count() const { return unsigned(cpus.size()); }
+    
+    /// Loads the program into every lane's memory.
+    void load_program(const std::vector<uint64_t>& program, uint32_t address);
+    /// Runs every lane until it halts. Lanes starting at a different program_counter from lane 0 run alone.
+    /// Inside the group lanes take no pending or timer interrupts and the instructions run there are not added to
+    /// a lane's instructions_retired(), so lanes that use either should be run on their own CPU instead. Lanes that
+    /// leave the group do both again from there on.
+    void run();
+    
+    uint64_t lockstep_instructions; /// Instructions executed once for the whole group.
+    uint64_t scalarized_instructions; /// Instructions executed lane by lane inside the group.
+    unsigned diverged_lanes; /// Lanes that left the group during the last run.
+    
+private:
+    void export_lane(unsigned lane);
+    void import_lane(unsigned lane);
+    void leave(unsigned lane, uint32_t program_counter);
+    void finish(unsigned lane, uint32_t program_counter, uint32_t halt_value);
+    bool scalarize(unsigned lane, const DecodedInstruction& inst, uint32_t program_counter, bool predicate);
+    
+    std::vector<std::unique_ptr<CPU>> cpus;
+    /// registers[r][lane], one row per guest register so a row is one host vector.
+    alignas(LOCKSTEP_LANES) uint8_t registers[NUM_REGISTERS][LOCKSTEP_LANES];
+    uint32_t active; /// Bit per lane still executing in the group.
+};
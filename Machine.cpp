@@ -0,0 +1,141 @@
+#include <cstring>
+#include "Machine.h"
+
+template<class Config>
+void BasicMachine<Config>::SharedOutput::put(uint8_t byte)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    target->put(byte);
+}
+
+template<class Config>
+void BasicMachine<Config>::SharedOutput::halt()
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    target->halt();
+}
+
+template<class Config>
+void BasicMachine<Config>::SharedOutput::flush()
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    target->flush();
+}
+
+template<class Config>
+BasicMachine<Config>::BasicMachine(BasicCPU<Config>& boot) : boot(boot), stopping(false)
+{
+    harts.reserve(MACHINE_MAX_HARTS - 1);
+}
+
+template<class Config>
+BasicMachine<Config>::~BasicMachine()
+{
+    stop();
+}
+
+template<class Config>
+uint32_t BasicMachine<Config>::run()
+{
+    output.target = &boot.console();
+    boot.output = &output;
+    boot.machine = this;
+    boot.hart_id = 0;
+    
+    uint32_t value = boot.run();
+    stop();
+    
+    boot.output = output.target;
+    boot.machine = nullptr;
+    for(std::unique_ptr<Hart>& hart : harts)
+    {
+        for(uint32_t page : hart->cpu->dirty_pages)
+        {
+            boot.invalidate_range(page << GUEST_PAGE_BITS, GUEST_PAGE_SIZE);
+            boot.mark_dirty(page << GUEST_PAGE_BITS);
+        }
+    }
+    return value;
+}
+
+template<class Config>
+uint8_t BasicMachine<Config>::spawn(const BasicCPU<Config>& parent, uint32_t address)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    if(stopping || harts.size() + 1 >= MACHINE_MAX_HARTS)
+        return 0;
+    
+    harts.emplace_back(new Hart());
+    Hart& hart = *harts.back();
+    hart.cpu.reset(new BasicCPU<Config>(boot.memory));
+    BasicCPU<Config>& cpu = *hart.cpu;
+    memcpy(cpu.registers, parent.registers, NUM_REGISTERS);
+    cpu.program_counter = address;
+    cpu.exception_handler_routine_address = parent.exception_handler_routine_address;
+    cpu.trap_memory_faults = parent.trap_memory_faults;
+    cpu.superinstructions = parent.superinstructions;
+    cpu.output = &output;
+    cpu.machine = this;
+    cpu.hart_id = uint8_t(harts.size());
+    hart.thread = std::thread(&BasicMachine::run_hart, this, std::ref(hart));
+    return cpu.hart_id;
+}
+
+template<class Config>
+bool BasicMachine<Config>::join(const BasicCPU<Config>& waiter, uint8_t id, uint32_t& halt_value)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if(id == 0 || id > harts.size() || id == waiter.hart_id)
+    {
+        halt_value = UNHANDLED_EXCEPTION_HALT_VALUE;
+        return true;
+    }
+    
+    Hart& hart = *harts[id - 1];
+    /// Polled, interrupts are raised straight into pending_interrupts from any thread with nothing to notify.
+    while(!hart.finished && !stopping && !waiter.pending_interrupts.load(std::memory_order_relaxed))
+        hart_finished.wait_for(lock, JOIN_POLL_INTERVAL);
+    if(!hart.finished)
+        return false;
+    halt_value = hart.cpu->halted ? hart.cpu->halt_value : UNHANDLED_EXCEPTION_HALT_VALUE;
+    return true;
+}
+
+template<class Config>
+unsigned BasicMachine<Config>::hart_count()
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    return unsigned(harts.size() + 1);
+}
+
+template<class Config>
+void BasicMachine<Config>::run_hart(Hart& hart)
+{
+    BasicCPU<Config>& cpu = *hart.cpu;
+    while(!cpu.halted && !stopping.load(std::memory_order_relaxed))
+        cpu.run(HART_SLICE_INSTRUCTIONS);
+    
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        hart.finished = true;
+    }
+    hart_finished.notify_all();
+}
+
+template<class Config>
+void BasicMachine<Config>::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+    }
+    hart_finished.notify_all();
+    /// No hart can be spawned once stopping is set, so harts no longer changes.
+    for(std::unique_ptr<Hart>& hart : harts)
+        if(hart->thread.joinable())
+            hart->thread.join();
+}
+
+#define INSTANTIATE_MACHINE(Config) template class BasicMachine<Config>;
+CPU_CONFIGS(INSTANTIATE_MACHINE)
+#undef INSTANTIATE_MACHINE
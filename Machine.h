@@ -0,0 +1,94 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "CPU.h"
+#include "Console.h"
+
+/// Harts one machine can have, hart 0 included. Hart ids are never reused within a run.
+#define MACHINE_MAX_HARTS 64
+/// Instructions a spawned hart runs between checks for the machine stopping.
+#define HART_SLICE_INSTRUCTIONS (1 << 16)
+/// How often a hart waiting in joinr looks for interrupts raised on it.
+#define JOIN_POLL_INTERVAL std::chrono::milliseconds(1)
+
+/// Several harts sharing one guest memory, each on its own host thread. Hart 0 is the CPU the machine is built
+/// around and runs on the calling thread. The others are started by spawniq with a copy of the spawning hart's
+/// registers and exception handler, stack address 0 and an empty return stack. When hart 0 halts the machine stops:
+/// the other harts are stopped within HART_SLICE_INSTRUCTIONS and joined, and the pages they wrote are marked dirty
+/// in hart 0, so its snapshots and decode cache see them.
+///
+/// Memory model: casmr, faddmr, faddmrq and fence are sequentially consistent across harts. Plain loads, stores,
+/// block and vector accesses are unordered byte accesses, made visible to other harts only through an atomic or
+/// fence after them on the writing hart and one before the read on the reading hart, as with C++ relaxed accesses
+/// and seq_cst fences. Each hart decodes and compiles code for itself, so code must not be written while another
+/// hart may run it. Spawned harts run without the JIT, the profiler and the memory tracer. Every hart has the
+/// configuration of hart 0.
+template<class Config>
+class BasicMachine
+{
+public:
+    explicit BasicMachine(BasicCPU<Config>& boot);
+    ~BasicMachine();
+    BasicMachine(const BasicMachine&) = delete;
+    BasicMachine& operator=(const BasicMachine&) = delete;
+    
+    /// Runs hart 0 from its program_counter until it halts, then stops the others. Returns hart 0's halt value.
+    /// A machine runs once.
+    uint32_t run();
+    
+    /// Starts a hart at address, what spawniq does. Returns its id, or 0 when MACHINE_MAX_HARTS are in use or the
+    /// machine is stopping.
+    uint8_t spawn(const BasicCPU<Config>& parent, uint32_t address);
+    /// Waits for hart to halt and sets halt_value, what joinr does. A hart joining itself, hart 0 or an id never
+    /// spawned gets UNHANDLED_EXCEPTION_HALT_VALUE at once. Returns false once the machine stops, or within
+    /// JOIN_POLL_INTERVAL of an interrupt or preempt request pending on waiter, so its run() can take it.
+    bool join(const BasicCPU<Config>& waiter, uint8_t hart, uint32_t& halt_value);
+    
+    /// Harts started so far, hart 0 included.
+    unsigned hart_count();
+    /// A spawned hart, 1 <= id < hart_count(). Only safe to look at once run() has returned.
+    BasicCPU<Config>& hart(uint8_t id) { return *harts[id - 1]->cpu; }
+    
+    BasicCPU<Config>& boot;
+
+private:
+    struct Hart
+    {
+        std::unique_ptr<BasicCPU<Config>> cpu;
+        std::thread thread;
+        bool finished = false;
+    };
+    
+    /// Serializes the harts' output into hart 0's device.
+    class SharedOutput : public OutputDevice
+    {
+    public:
+        void put(uint8_t byte) override;
+        void halt() override;
+        void flush() override;
+        
+        OutputDevice* target = nullptr;
+        std::mutex mutex;
+    };
+    
+    void run_hart(Hart& hart);
+    void stop();
+    
+    std::vector<std::unique_ptr<Hart>> harts; /// Spawned harts, hart id - 1.
+    std::mutex mutex;
+    std::condition_variable hart_finished;
+    std::atomic<bool> stopping;
+    SharedOutput output;
+};
+
+typedef BasicMachine<DefaultConfig> Machine;
+
+#define EXTERN_MACHINE(Config) extern template class BasicMachine<Config>;
+CPU_CONFIGS(EXTERN_MACHINE)
+#undef EXTERN_MACHINE
@@ -0,0 +1,435 @@
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+#include "MemoryTrace.h"
+
+static void put_varint(std::vector<uint8_t>& out, uint64_t value)
+{
+    for(; value >= 0x80; value >>= 7)
+        out.push_back(uint8_t(value) | 0x80);
+    out.push_back(uint8_t(value));
+}
+
+/// False at the end of the file, with at_end set when no byte of the varint was read, or on one longer than 64 bits.
+static bool get_varint(FILE* in, uint64_t& value, bool& at_end)
+{
+    value = 0;
+    at_end = false;
+    for(unsigned shift = 0; shift < 64; shift += 7)
+    {
+        int byte = getc(in);
+        if(byte == EOF)
+        {
+            at_end = shift == 0;
+            return false;
+        }
+        value |= uint64_t(byte & 0x7F) << shift;
+        if(!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static bool parse_size(const std::string& text, uint32_t& size)
+{
+    char* end;
+    unsigned long long value = strtoull(text.c_str(), &end, 0);
+    if(*end == 'k' || *end == 'K')
+        value <<= 10, ++end;
+    else if(*end == 'm' || *end == 'M')
+        value <<= 20, ++end;
+    if(end == text.c_str() || *end || value > UINT32_MAX)
+        return false;
+    size = uint32_t(value);
+    return true;
+}
+
+bool parse_cache_geometry(const char* text, CacheGeometry& geometry, std::string& error)
+{
+    std::vector<std::string> fields(1);
+    for(const char* c = text; *c; ++c)
+    {
+        if(*c == ':')
+            fields.emplace_back();
+        else
+            fields.back() += *c;
+    }
+    if(fields.size() != 5)
+    {
+        error = std::string("\"") + text + "\" is not name:size:line_size:ways:kinds";
+        return false;
+    }
+    
+    geometry.name = fields[0];
+    geometry.kinds = 0;
+    for(char kind : fields[4])
+    {
+        const char* found = strchr("rwx", kind);
+        if(!found)
+        {
+            error = std::string("cache kinds are made of r, w and x, not \"") + fields[4] + "\"";
+            return false;
+        }
+        geometry.kinds |= 1 << (found - "rwx");
+    }
+    if(!parse_size(fields[1], geometry.size) || !parse_size(fields[2], geometry.line_size) || !parse_size(fields[3], geometry.ways))
+    {
+        error = std::string("bad number in \"") + text + "\"";
+        return false;
+    }
+    return CacheSimulator::check(geometry, error);
+}
+
+CacheSimulator::CacheSimulator(const CacheGeometry& geometry) : geometry(geometry), line_bits(__builtin_ctz(geometry.line_size)),
+    set_mask(geometry.size / geometry.line_size / geometry.ways - 1), lines(geometry.size / geometry.line_size, 0)
+{
+    memset(accesses, 0, sizeof(accesses));
+    memset(misses, 0, sizeof(misses));
+}
+
+bool CacheSimulator::check(const CacheGeometry& geometry, std::string& error)
+{
+    uint64_t set_size = uint64_t(geometry.line_size) * geometry.ways;
+    uint64_t sets = set_size ? geometry.size / set_size : 0;
+    if(geometry.name.empty() || std::any_of(geometry.name.begin(), geometry.name.end(), [](char c) { return !isalnum(c) && c != '_' && c != '-'; }))
+        error = "cache names are letters, digits, '_' and '-'";
+    else if(geometry.line_size < 4 || (geometry.line_size & (geometry.line_size - 1)))
+        error = "cache line size must be a power of two of at least 4";
+    else if(!sets || sets * set_size != geometry.size || (sets & (sets - 1)))
+        error = "cache size must be line_size * ways times a power of two";
+    else if(!geometry.kinds || geometry.kinds >= 1 << MemoryAccessKindsSize)
+        error = "a cache has to see some kind of access";
+    else
+        return true;
+    error = geometry.name + ": " + error;
+    return false;
+}
+
+void CacheSimulator::access(uint32_t address, uint32_t length, uint8_t kind)
+{
+    uint32_t ways = geometry.ways;
+    uint32_t last = uint32_t((uint64_t(address) + length - 1) >> line_bits);
+    for(uint32_t line = address >> line_bits; ; ++line)
+    {
+        /// Move to front: the way found, or the least recently used one on a miss, becomes the first.
+        uint32_t* set = &lines[std::size_t(line & set_mask) * ways];
+        uint32_t tag = line + 1;
+        uint32_t way = 0;
+        while(way < ways - 1 && set[way] != tag)
+            ++way;
+        ++accesses[kind];
+        if(set[way] != tag)
+            ++misses[kind];
+        memmove(set + 1, set, way * sizeof(uint32_t));
+        set[0] = tag;
+        if(line == last)
+            break;
+    }
+}
+
+MemoryTracer::MemoryTracer(uint32_t sample_period) : sample_period(sample_period ? sample_period : 1), window(MEMORY_TRACE_WINDOW),
+    last_instructions(0), page_chunks((uint64_t(1) << (32 - GUEST_PAGE_BITS)) / MEMORY_TRACE_CHUNK_PAGES), current_window(0),
+    window_pages(0), window_code_pages(0), random_state(0x9E3779B97F4A7C15ull), log(nullptr), log_failed(false), log_instructions(0)
+{
+    memset(accesses, 0, sizeof(accesses));
+    memset(bytes, 0, sizeof(bytes));
+    memset(log_addresses, 0, sizeof(log_addresses));
+}
+
+MemoryTracer::~MemoryTracer()
+{
+    std::string error;
+    close_log(error);
+}
+
+bool MemoryTracer::add_cache(const CacheGeometry& geometry, std::string& error)
+{
+    if(!CacheSimulator::check(geometry, error))
+        return false;
+    caches.emplace_back(geometry);
+    return true;
+}
+
+void MemoryTracer::add_default_caches()
+{
+    caches.emplace_back(CacheGeometry{"l1i", 32 << 10, 64, 8, 1 << MemoryExecute});
+    caches.emplace_back(CacheGeometry{"l1d", 32 << 10, 64, 8, 1 << MemoryRead | 1 << MemoryWrite});
+    caches.emplace_back(CacheGeometry{"l2", 1 << 20, 64, 16, 1 << MemoryRead | 1 << MemoryWrite | 1 << MemoryExecute});
+}
+
+bool MemoryTracer::open_log(const char* path, std::string& error)
+{
+    if(log)
+    {
+        error = "a memory trace log is already open";
+        return false;
+    }
+    log = fopen(path, "wb");
+    if(!log)
+    {
+        error = std::string("could not create \"") + path + "\"";
+        return false;
+    }
+    
+    MemoryTraceFileHeader header;
+    header.magic = MEMORY_TRACE_MAGIC;
+    header.version = MEMORY_TRACE_VERSION;
+    header.flags = 0;
+    header.sample_period = sample_period;
+    log_failed = fwrite(&header, sizeof(header), 1, log) != 1;
+    memset(log_addresses, 0, sizeof(log_addresses));
+    log_instructions = 0;
+    log_buffer.reserve(MEMORY_TRACE_BUFFER_SIZE + 32);
+    return true;
+}
+
+bool MemoryTracer::close_log(std::string& error)
+{
+    if(!log)
+        return true;
+    flush_log();
+    bool ok = fclose(log) == 0 && !log_failed;
+    log = nullptr;
+    if(!ok)
+        error = "could not write the memory trace log";
+    return ok;
+}
+
+void MemoryTracer::flush_log()
+{
+    if(!log_buffer.empty() && fwrite(log_buffer.data(), 1, log_buffer.size(), log) != log_buffer.size())
+        log_failed = true;
+    log_buffer.clear();
+}
+
+template<class Config>
+void MemoryTracer::attach(BasicCPU<Config>& cpu)
+{
+#if defined(DERP_TRACE_MEMORY)
+    cpu.memory_tracer = this;
+    cpu.trace_countdown = next_countdown();
+#else
+    (void)cpu;
+#endif
+}
+
+template<class Config>
+void MemoryTracer::collect(BasicCPU<Config>& cpu)
+{
+#if defined(DERP_TRACE_MEMORY)
+    cpu.memory_tracer = nullptr;
+#endif
+    last_instructions = std::max(last_instructions, cpu.instructions_retired());
+    end_window(cpu.instructions_retired());
+}
+
+#if defined(DERP_TRACE_MEMORY)
+template<class Config>
+void BasicCPU<Config>::trace_sampled(uint32_t address, uint32_t length, uint8_t kind)
+{
+    memory_tracer->record(address, length, kind, instructions_retired());
+    trace_countdown = memory_tracer->next_countdown();
+}
+
+#define INSTANTIATE_TRACE_SAMPLED(Config) template void BasicCPU<Config>::trace_sampled(uint32_t address, uint32_t length, uint8_t kind);
+CPU_CONFIGS(INSTANTIATE_TRACE_SAMPLED)
+#undef INSTANTIATE_TRACE_SAMPLED
+#endif
+
+#define INSTANTIATE_MEMORY_TRACER(Config) \
+    template void MemoryTracer::attach(BasicCPU<Config>& cpu); \
+    template void MemoryTracer::collect(BasicCPU<Config>& cpu);
+CPU_CONFIGS(INSTANTIATE_MEMORY_TRACER)
+#undef INSTANTIATE_MEMORY_TRACER
+
+uint32_t MemoryTracer::next_countdown()
+{
+    if(sample_period == 1)
+        return 1;
+    /// xorshift64, uniform over [1, 2 * sample_period - 1].
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return uint32_t(1 + random_state % (2 * uint64_t(sample_period) - 1));
+}
+
+MemoryTracer::PageCounts& MemoryTracer::page(uint32_t number)
+{
+    std::unique_ptr<PageCounts[]>& chunk = page_chunks[number / MEMORY_TRACE_CHUNK_PAGES];
+    if(!chunk)
+        chunk.reset(new PageCounts[MEMORY_TRACE_CHUNK_PAGES]());
+    return chunk[number % MEMORY_TRACE_CHUNK_PAGES];
+}
+
+void MemoryTracer::record(uint32_t address, uint32_t length, uint8_t kind, uint64_t instructions)
+{
+    if(!length)
+        return;
+    ++accesses[kind];
+    bytes[kind] += length;
+    last_instructions = instructions;
+    
+    uint64_t this_window = instructions / window + 1;
+    if(this_window != current_window)
+    {
+        end_window(current_window * window);
+        current_window = this_window;
+    }
+    uint32_t last = uint32_t((uint64_t(address) + length - 1) >> GUEST_PAGE_BITS);
+    for(uint32_t number = address >> GUEST_PAGE_BITS; ; ++number)
+    {
+        PageCounts& counts = page(number);
+        ++counts.accesses[kind];
+        if(counts.window != current_window)
+        {
+            counts.window = current_window;
+            ++window_pages;
+        }
+        if(kind == MemoryExecute && counts.code_window != current_window)
+        {
+            counts.code_window = current_window;
+            ++window_code_pages;
+        }
+        if(number == last)
+            break;
+    }
+    
+    for(CacheSimulator& cache : caches)
+        if(cache.geometry.kinds & (1 << kind))
+            cache.access(address, length, kind);
+    
+    if(log)
+    {
+        int32_t delta = int32_t(address - log_addresses[kind]);
+        put_varint(log_buffer, uint64_t(length) << 2 | kind);
+        put_varint(log_buffer, (uint32_t(delta) << 1) ^ uint32_t(delta >> 31));
+        put_varint(log_buffer, instructions - log_instructions);
+        log_addresses[kind] = address;
+        log_instructions = instructions;
+        if(log_buffer.size() >= MEMORY_TRACE_BUFFER_SIZE)
+            flush_log();
+    }
+}
+
+void MemoryTracer::end_window(uint64_t instructions)
+{
+    if(current_window)
+        working_set.push_back({instructions, window_pages, window_code_pages});
+    current_window = 0;
+    window_pages = 0;
+    window_code_pages = 0;
+}
+
+void MemoryTracer::write_json(FILE* out) const
+{
+    static const char* kind_names[MemoryAccessKindsSize] = {"read", "write", "execute"};
+    
+    fprintf(out, "{\n  \"sample_period\": %u,\n  \"instructions\": %llu,\n  \"page_size\": %u,\n", sample_period,
+            (unsigned long long)last_instructions, unsigned(GUEST_PAGE_SIZE));
+    fprintf(out, "  \"accesses\": {");
+    for(int kind = 0; kind < MemoryAccessKindsSize; ++kind)
+        fprintf(out, "%s\n    \"%s\": {\"count\": %llu, \"bytes\": %llu}", kind ? "," : "", kind_names[kind],
+                (unsigned long long)accesses[kind], (unsigned long long)bytes[kind]);
+    fprintf(out, "\n  },\n");
+    
+    fprintf(out, "  \"caches\": [");
+    for(std::size_t i = 0; i < caches.size(); ++i)
+    {
+        const CacheSimulator& cache = caches[i];
+        uint64_t total_accesses = 0, total_misses = 0;
+        for(int kind = 0; kind < MemoryAccessKindsSize; ++kind)
+        {
+            total_accesses += cache.accesses[kind];
+            total_misses += cache.misses[kind];
+        }
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"size\": %u, \"line_size\": %u, \"ways\": %u, "
+                "\"accesses\": %llu, \"misses\": %llu, \"miss_rate\": %.6f", i ? "," : "", cache.geometry.name.c_str(), cache.geometry.size, cache.geometry.line_size, cache.geometry.ways,
+                (unsigned long long)total_accesses, (unsigned long long)total_misses, total_accesses ? double(total_misses) / total_accesses : 0.0);
+        for(int kind = 0; kind < MemoryAccessKindsSize; ++kind)
+            if(cache.geometry.kinds & (1 << kind))
+                fprintf(out, ", \"%s\": {\"accesses\": %llu, \"misses\": %llu}", kind_names[kind], (unsigned long long)cache.accesses[kind],
+                        (unsigned long long)cache.misses[kind]);
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n  ],\n");
+    
+    /// Samples are [instructions, pages, code_pages].
+    uint32_t max_pages = 0;
+    for(const WorkingSetSample& sample : working_set)
+        max_pages = std::max(max_pages, sample.pages);
+    fprintf(out, "  \"working_set\": {\"window\": %llu, \"max_pages\": %u, \"samples\": [", (unsigned long long)window, max_pages);
+    for(std::size_t i = 0; i < working_set.size(); ++i)
+        fprintf(out, "%s[%llu, %u, %u]", i ? ", " : "", (unsigned long long)working_set[i].instructions, working_set[i].pages,
+                working_set[i].code_pages);
+    fprintf(out, "]},\n");
+    
+    /// The heatmap, one [page, reads, writes, executes] per page touched, in address order.
+    fprintf(out, "  \"pages\": [");
+    bool first = true;
+    for(std::size_t chunk = 0; chunk < page_chunks.size(); ++chunk)
+    {
+        if(!page_chunks[chunk])
+            continue;
+        for(uint32_t i = 0; i < MEMORY_TRACE_CHUNK_PAGES; ++i)
+        {
+            const PageCounts& counts = page_chunks[chunk][i];
+            if(!counts.window)
+                continue;
+            fprintf(out, "%s\n    [%llu, %llu, %llu, %llu]", first ? "" : ",", (unsigned long long)(chunk * MEMORY_TRACE_CHUNK_PAGES + i),
+                    (unsigned long long)counts.accesses[MemoryRead], (unsigned long long)counts.accesses[MemoryWrite],
+                    (unsigned long long)counts.accesses[MemoryExecute]);
+            first = false;
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+bool replay_memory_trace(const char* path, MemoryTracer& tracer, std::string& error)
+{
+    FILE* in = fopen(path, "rb");
+    if(!in)
+    {
+        error = std::string("could not open \"") + path + "\"";
+        return false;
+    }
+    
+    MemoryTraceFileHeader header;
+    bool ok = fread(&header, sizeof(header), 1, in) == 1 && header.magic == MEMORY_TRACE_MAGIC;
+    if(!ok)
+        error = "not a memory trace";
+    else if(header.version != MEMORY_TRACE_VERSION)
+    {
+        ok = false;
+        error = "unsupported memory trace version " + std::to_string(header.version);
+    }
+    
+    uint32_t addresses[MemoryAccessKindsSize] = {};
+    uint64_t instructions = 0;
+    if(ok)
+        tracer.sample_period = uint32_t(std::max<uint64_t>(header.sample_period, 1));
+    for(uint64_t head, offset, delta; ok; )
+    {
+        bool at_end;
+        if(!get_varint(in, head, at_end))
+        {
+            ok = at_end;
+            break;
+        }
+        ok = get_varint(in, offset, at_end) && get_varint(in, delta, at_end) && (head & 3) < MemoryAccessKindsSize &&
+             (head >> 2) <= UINT32_MAX && offset <= UINT32_MAX;
+        if(!ok)
+            break;
+        
+        uint8_t kind = uint8_t(head & 3);
+        uint32_t zigzag = uint32_t(offset);
+        addresses[kind] += (zigzag >> 1) ^ (0u - (zigzag & 1));
+        instructions += delta;
+        tracer.record(addresses[kind], uint32_t(head >> 2), kind, instructions);
+    }
+    if(!ok && error.empty())
+        error = "truncated or corrupt record";
+    fclose(in);
+    tracer.end_window(instructions);
+    return ok;
+}
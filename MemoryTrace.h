@@ -0,0 +1,154 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include "CPU.h"
+
+#define MEMORY_TRACE_MAGIC 0x4D525444 /// "DTRM" read as a little-endian uint32_t.
+#define MEMORY_TRACE_VERSION 1
+/// Instructions per working set sample.
+#define MEMORY_TRACE_WINDOW (1 << 20)
+/// Guest pages per piece of the heatmap, allocated when one of them is first touched.
+#define MEMORY_TRACE_CHUNK_PAGES 1024
+/// Log bytes gathered before they are written.
+#define MEMORY_TRACE_BUFFER_SIZE (1 << 16)
+
+/// On disk layout of the access log, all fields little-endian:
+///     MemoryTraceFileHeader
+///     one record per recorded access until the end of the file, three varints each:
+///         length << 2 | MemoryAccessKind
+///         address minus the previous address of the same kind, zigzag encoded
+///         instructions retired since the previous record
+/// Straight line code logs in 3 bytes an instruction.
+struct MemoryTraceFileHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint64_t sample_period;
+};
+
+/// One simulated cache.
+struct CacheGeometry
+{
+    std::string name;
+    uint32_t size; /// Bytes, line_size * ways times a power of two.
+    uint32_t line_size; /// A power of two, at least 4.
+    uint32_t ways;
+    uint8_t kinds; /// 1 << MemoryAccessKind for each kind of access the cache sees.
+};
+
+/// Parses "name:size:line_size:ways:kinds", sizes in bytes or with a k or m suffix and kinds any of r, w and x, as
+/// in "l1d:32k:64:8:rw".
+bool parse_cache_geometry(const char* text, CacheGeometry& geometry, std::string& error);
+
+/// A set-associative cache with LRU replacement that allocates on every access, reads and writes alike. An access
+/// spanning several lines looks each of them up.
+class CacheSimulator
+{
+public:
+    /// geometry has passed check().
+    explicit CacheSimulator(const CacheGeometry& geometry);
+    
+    static bool check(const CacheGeometry& geometry, std::string& error);
+    void access(uint32_t address, uint32_t length, uint8_t kind);
+    
+    CacheGeometry geometry;
+    uint64_t accesses[MemoryAccessKindsSize]; /// Line lookups.
+    uint64_t misses[MemoryAccessKindsSize];
+
+private:
+    uint32_t line_bits;
+    uint32_t set_mask;
+    /// ways entries per set, most recently used first, each a line number + 1 or 0 when empty.
+    std::vector<uint32_t> lines;
+};
+
+/// Distinct pages the guest touched in one window of MemoryTracer::window instructions.
+struct WorkingSetSample
+{
+    uint64_t instructions; /// instructions_retired() at the end of the window.
+    uint32_t pages;
+    uint32_t code_pages; /// Of pages, those instructions were fetched from.
+};
+
+/// Guest memory behaviour of one CPU, needs a -DDERP_TRACE_MEMORY build to be fed: a read/write/execute heatmap per
+/// page, the working set over time, simulated caches and optionally a log of every recorded access.
+///
+/// One access in every sample_period on average is recorded, the gaps drawn at random so loops cannot alias with the
+/// period, and skipped accesses cost the CPU one decrement. Counts are of recorded accesses, multiply by sample_period
+/// for estimates. Sampling thins the stream the caches see, which overstates their miss rates, and the working set
+/// only counts pages with a recorded access, so cache and working set studies want sample_period 1 or a log taken
+/// with it and replayed through other caches with replay_memory_trace.
+class MemoryTracer
+{
+public:
+    explicit MemoryTracer(uint32_t sample_period = 1);
+    ~MemoryTracer();
+    MemoryTracer(const MemoryTracer&) = delete;
+    MemoryTracer& operator=(const MemoryTracer&) = delete;
+    
+    /// Simulates one more cache. Before attach.
+    bool add_cache(const CacheGeometry& geometry, std::string& error);
+    /// A 32 KiB 8-way instruction and data cache and a 1 MiB 16-way unified one, 64-byte lines.
+    void add_default_caches();
+    /// Logs every recorded access to path from now on.
+    bool open_log(const char* path, std::string& error);
+    /// Writes what the log still buffers and closes it. False if any write failed.
+    bool close_log(std::string& error);
+    
+    /// Sets cpu.memory_tracer, so run() and step() hand over their accesses. The CPU members are compiled for every
+    /// configuration in CPU_CONFIGS.
+    template<class Config>
+    void attach(BasicCPU<Config>& cpu);
+    /// Clears cpu.memory_tracer and closes the working set window running at cpu's instruction count. Call before
+    /// writing.
+    template<class Config>
+    void collect(BasicCPU<Config>& cpu);
+    
+    /// One access of length bytes at address with instructions_retired() at instructions.
+    void record(uint32_t address, uint32_t length, uint8_t kind, uint64_t instructions);
+    /// Accesses until the next one recorded, averaging sample_period.
+    uint32_t next_countdown();
+    /// Closes the window running at instructions.
+    void end_window(uint64_t instructions);
+    
+    void write_json(FILE* out) const;
+    
+    uint32_t sample_period;
+    uint64_t window; /// Instructions per working set sample, MEMORY_TRACE_WINDOW unless changed before attach.
+    uint64_t accesses[MemoryAccessKindsSize]; /// Recorded ones.
+    uint64_t bytes[MemoryAccessKindsSize];
+    uint64_t last_instructions; /// Instruction count of the newest record.
+    std::vector<CacheSimulator> caches;
+    std::vector<WorkingSetSample> working_set;
+
+private:
+    struct PageCounts
+    {
+        uint64_t accesses[MemoryAccessKindsSize];
+        uint64_t window; /// Window + 1 the page was last touched in, 0 for never.
+        uint64_t code_window;
+    };
+    
+    PageCounts& page(uint32_t number);
+    void flush_log();
+    
+    std::vector<std::unique_ptr<PageCounts[]>> page_chunks;
+    uint64_t current_window; /// Of the newest record, + 1 like PageCounts::window.
+    uint32_t window_pages;
+    uint32_t window_code_pages;
+    uint64_t random_state;
+    
+    FILE* log;
+    bool log_failed;
+    std::vector<uint8_t> log_buffer;
+    uint32_t log_addresses[MemoryAccessKindsSize];
+    uint64_t log_instructions;
+};
+
+/// Feeds the access log at path through tracer as if the accesses were happening now, taking over the log's
+/// sample_period. For trying other caches on one run.
+bool replay_memory_trace(const char* path, MemoryTracer& tracer, std::string& error);
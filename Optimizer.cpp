@@ -0,0 +1,1082 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <bitset>
+#include "Optimizer.h"
+#include "Instructions.h"
+#include "Superinstructions.h"
+
+typedef std::bitset<NUM_REGISTERS> RegisterSet;
+
+/// Registers an instruction reads and writes when it executes, predicate aside. A write the handler can skip at run
+/// time, a block or vector access out of range without trapping, is in writes but not in kills.
+struct InstructionEffects
+{
+    RegisterSet reads;
+    RegisterSet writes;
+    RegisterSet kills;
+    bool side_effects = false; /// Touches memory, the stack, output, control flow or exception state.
+    bool may_fault = false;
+};
+
+/// count consecutive registers from first, wrapping past the last one like groups and vector ranges do.
+static void add_registers(RegisterSet& set, uint8_t first, unsigned count)
+{
+    for(unsigned i = 0; i < count; ++i)
+        set.set(uint8_t(first + i));
+}
+
+static unsigned range_length(uint8_t immediate)
+{
+    return immediate ? immediate : NUM_REGISTERS;
+}
+
+static InstructionEffects instruction_effects(const DecodedInstruction& inst)
+{
+    InstructionEffects effects;
+    if(inst.opcode < RegisterOpcodeBase)
+    {
+        effects.side_effects = true;
+        effects.may_fault = true;
+        switch(inst.opcode - MemoryOpcodeBase)
+        {
+            case LoadMemoryRegister:
+                add_registers(effects.reads, inst.val1, 1);
+                add_registers(effects.reads, inst.val2, 1);
+                add_registers(effects.reads, inst.val3, 1);
+                add_registers(effects.reads, inst.val4, 1);
+                add_registers(effects.kills, inst.val5, 1);
+                break;
+            case LoadMemoryImmediate:
+                add_registers(effects.kills, inst.val5, 1);
+                break;
+            case StoreMemoryRegister:
+                add_registers(effects.reads, inst.val1, 1);
+                add_registers(effects.reads, inst.val2, 1);
+                add_registers(effects.reads, inst.val3, 1);
+                add_registers(effects.reads, inst.val4, 1);
+                add_registers(effects.reads, inst.val5, 1);
+                break;
+            case StoreMemoryImmediate:
+                add_registers(effects.reads, inst.val5, 1);
+                break;
+            case BlockCopy:
+                add_registers(effects.reads, inst.val1, 4);
+                add_registers(effects.reads, inst.val2, 4);
+                add_registers(effects.reads, inst.val3, 4);
+                break;
+            case BlockFill:
+                add_registers(effects.reads, inst.val1, 4);
+                add_registers(effects.reads, inst.val2, 4);
+                add_registers(effects.reads, inst.val3, 1);
+                break;
+            case BlockCompare:
+                add_registers(effects.reads, inst.val2, 4);
+                add_registers(effects.reads, inst.val3, 4);
+                add_registers(effects.reads, inst.val4, 4);
+                add_registers(effects.writes, inst.val1, 1);
+                break;
+            case BlockSearch:
+                add_registers(effects.reads, inst.val2, 4);
+                add_registers(effects.reads, inst.val3, 4);
+                add_registers(effects.reads, inst.val4, 1);
+                add_registers(effects.writes, inst.val1, 4);
+                break;
+            case CompareAndSwap:
+                add_registers(effects.reads, inst.val1, 4);
+                add_registers(effects.reads, inst.val2, 1);
+                add_registers(effects.reads, inst.val3, 1);
+                add_registers(effects.kills, inst.val4, 1);
+                break;
+            case FetchAdd:
+                add_registers(effects.reads, inst.val1, 4);
+                add_registers(effects.reads, inst.val2, 1);
+                add_registers(effects.kills, inst.val3, 1);
+                break;
+            case FetchAddQuad:
+                add_registers(effects.reads, inst.val1, 4);
+                add_registers(effects.reads, inst.val2, 4);
+                add_registers(effects.kills, inst.val3, 4);
+                break;
+        }
+    }
+    else if(inst.opcode < ImmediateOpcodeBase)
+    {
+        unsigned func = inst.opcode - RegisterOpcodeBase;
+        switch(func)
+        {
+            case LoadImmediate:
+                break;
+            case AddImmediateSaveCarry:
+            case MulImmediateSaveCarry:
+                add_registers(effects.reads, func == AddImmediateSaveCarry ? inst.val3 : inst.val4, 1);
+                add_registers(effects.kills, inst.val2, 1);
+                break;
+            case AddRegisterSaveCarry:
+            case MulRegisterSaveCarry:
+                add_registers(effects.reads, inst.val3, 1);
+                add_registers(effects.reads, inst.val4, 1);
+                add_registers(effects.kills, inst.val2, 1);
+                break;
+            case DivImmediateRegister:
+            case ModImmediateRegister:
+                add_registers(effects.reads, inst.val3, 1);
+                break;
+            case AddRegister: case MulRegister: case DivRegisterRegister: case ModRegisterRegister:
+            case AndRegister: case OrRegister: case XorRegister:
+                add_registers(effects.reads, inst.val3, 1);
+                add_registers(effects.reads, inst.val2, 1);
+                break;
+            case LoadRegister: case AddImmediate: case MulImmediate: case DivRegisterImmediate: case ModRegisterImmediate:
+            case AndImmediate: case OrImmediate: case XorImmediate: case BitwiseComplement:
+                add_registers(effects.reads, inst.val2, 1);
+                break;
+            default:
+            {
+                /// The wide forms come in threes, 16, 32 and 64 bits.
+                unsigned bytes = 2 << (func - AddRegister16) % 3;
+                if(func >= IncrementImmediate16)
+                {
+                    add_registers(effects.reads, inst.val1, bytes);
+                    add_registers(effects.kills, inst.val1, bytes);
+                    break;
+                }
+                add_registers(effects.reads, inst.val2, bytes);
+                if(func < ShiftLeftImmediate16 || func >= CompareRegister16)
+                    add_registers(effects.reads, inst.val3, bytes);
+                add_registers(effects.kills, inst.val1, func >= CompareRegister16 ? 1 : bytes);
+                break;
+            }
+        }
+        if(func < AddRegister16)
+            add_registers(effects.kills, inst.val1, 1);
+        /// A divisor that can be zero traps.
+        bool immediate_divisor = func == DivRegisterImmediate || func == ModRegisterImmediate;
+        if(func >= DivImmediateRegister && func <= ModRegisterRegister && (!immediate_divisor || !inst.val3))
+        {
+            effects.side_effects = true;
+            effects.may_fault = true;
+        }
+    }
+    else if(inst.opcode < VectorOpcodeBase)
+    {
+        effects.side_effects = true;
+        switch(inst.opcode - ImmediateOpcodeBase)
+        {
+            case JumpRegisterQuad: case JumpBackRegisterQuad: case HaltRegisterQuad: case SetStackAddressRegisterQuadAddress:
+                add_registers(effects.reads, inst.val1, 1);
+                add_registers(effects.reads, inst.val2, 1);
+                add_registers(effects.reads, inst.val3, 1);
+                add_registers(effects.reads, inst.val4, 1);
+                break;
+            case PushStackRegisterArguments:
+            {
+                const uint8_t arguments[4] = {inst.val2, inst.val3, inst.val4, inst.val5};
+                for(unsigned i = 0; i < inst.val1 && i < 4; ++i)
+                    add_registers(effects.reads, arguments[i], 1);
+                effects.may_fault = true;
+                break;
+            }
+            case PushStackImmediateArguments:
+                effects.may_fault = true;
+                break;
+            case PopStack:
+                /// Every register goes back to the caller.
+                effects.reads.set();
+                effects.may_fault = true;
+                break;
+            case CallImmediateQuad: case CallRegisterQuad:
+                /// The callee may read and write any register.
+                effects.reads.set();
+                effects.writes.set();
+                effects.may_fault = true;
+                break;
+            case SaveStackAddressRegisterQuad:
+                add_registers(effects.kills, inst.val1, 1);
+                add_registers(effects.kills, inst.val2, 1);
+                add_registers(effects.kills, inst.val3, 1);
+                add_registers(effects.kills, inst.val4, 1);
+                break;
+            case PrintToScreenRegister:
+                add_registers(effects.reads, inst.val1, 1);
+                break;
+            case SaveInterruptReasonRegister: case SaveHartIdRegister:
+                add_registers(effects.kills, inst.val1, 1);
+                break;
+            case SpawnHartImmediateQuad:
+                /// The new hart starts with a copy of every register.
+                effects.reads.set();
+                add_registers(effects.kills, inst.val5, 1);
+                break;
+            case JoinHartRegister:
+                add_registers(effects.reads, inst.val1, 1);
+                add_registers(effects.kills, inst.val2, 4);
+                effects.may_fault = true;
+                break;
+        }
+        /// Interrupts are delivered after jumps, which may enter the handler like a fault.
+        if(ends_basic_block(inst.opcode))
+            effects.may_fault = true;
+    }
+    else if(inst.opcode < InvalidOpcode)
+    {
+        switch(inst.opcode - VectorOpcodeBase)
+        {
+            case VectorAddSaveCarry:
+                add_registers(effects.reads, inst.val3, range_length(inst.val5));
+                add_registers(effects.reads, inst.val4, range_length(inst.val5));
+                add_registers(effects.kills, inst.val1, range_length(inst.val5));
+                add_registers(effects.kills, inst.val2, range_length(inst.val5));
+                break;
+            case VectorSum:
+                add_registers(effects.reads, inst.val2, range_length(inst.val3));
+                add_registers(effects.kills, inst.val1, 4);
+                break;
+            case VectorLoadMemory:
+                add_registers(effects.reads, inst.val2, 4);
+                add_registers(effects.writes, inst.val1, range_length(inst.val3));
+                effects.side_effects = true;
+                effects.may_fault = true;
+                break;
+            case VectorStoreMemory:
+                add_registers(effects.reads, inst.val1, 4);
+                add_registers(effects.reads, inst.val2, range_length(inst.val3));
+                effects.side_effects = true;
+                effects.may_fault = true;
+                break;
+            default:
+                add_registers(effects.reads, inst.val2, range_length(inst.val4));
+                add_registers(effects.reads, inst.val3, range_length(inst.val4));
+                add_registers(effects.kills, inst.val1, range_length(inst.val4));
+                break;
+        }
+    }
+    else
+    {
+        /// Raises IllegalInstruction.
+        effects.side_effects = true;
+        effects.may_fault = true;
+    }
+    effects.writes |= effects.kills;
+    return effects;
+}
+
+static bool is_relative_jump(const DecodedInstruction& inst)
+{
+    return inst.opcode == ImmediateOpcodeBase + JumpImmediateQuad || inst.opcode == ImmediateOpcodeBase + JumpBackImmediateQuad;
+}
+
+static bool is_halt(const DecodedInstruction& inst)
+{
+    return inst.opcode == ImmediateOpcodeBase + HaltImmediateQuad || inst.opcode == ImmediateOpcodeBase + HaltRegisterQuad;
+}
+
+static bool is_return(const DecodedInstruction& inst)
+{
+    return inst.opcode == ImmediateOpcodeBase + PopStack;
+}
+
+/// calliq and spawniq, which start running their target with registers the optimizer cannot follow.
+static bool enters_code(const DecodedInstruction& inst)
+{
+    return inst.opcode == ImmediateOpcodeBase + CallImmediateQuad || inst.opcode == ImmediateOpcodeBase + SpawnHartImmediateQuad;
+}
+
+/// setihriq 0 clears the handler, it does not point one at address 0.
+static bool is_handler_set(const DecodedInstruction& inst)
+{
+    return inst.opcode == ImmediateOpcodeBase + SetInterruptHandlerRoutineImmediate && inst.quad;
+}
+
+static int predicate_of(const DecodedInstruction& inst)
+{
+    return inst.has_predicate ? inst.predicate_register : NO_PREDICATE;
+}
+
+/// The known bytes of the register file at one point of the program.
+struct ConstantState
+{
+    RegisterSet known;
+    uint8_t values[NUM_REGISTERS];
+    
+    /// Keeps what both states agree on. Returns true if anything became unknown.
+    bool join(const ConstantState& other)
+    {
+        RegisterSet agreed = known & other.known;
+        for(unsigned r = 0; r < NUM_REGISTERS; ++r)
+            if(agreed[r] && values[r] != other.values[r])
+                agreed.reset(r);
+        bool changed = agreed != known;
+        known = agreed;
+        return changed;
+    }
+};
+
+/// One instruction of the program being optimized. Jumps, calls and handler addresses into the code hold the index of
+/// their target so they can be recomputed once the layout changes.
+struct OptimizerNode
+{
+    uint64_t word;
+    DecodedInstruction inst;
+    bool removed;
+    bool sentinel; /// Appended jump to the old end of the code, for paths that ran off the end.
+    int64_t target; /// Index of the jump or handler target, -1 when it lies outside the code.
+    uint32_t address; /// Absolute jump target when target is -1.
+};
+
+struct OptimizerBlock
+{
+    std::size_t first;
+    std::size_t end;
+    bool reached;
+    bool queued;
+    ConstantState in;
+    RegisterSet live_in;
+};
+
+#define OPTIMIZER_EXIT SIZE_MAX
+
+class ProgramOptimizer
+{
+public:
+    ProgramOptimizer(uint32_t origin, std::size_t size, OptimizerReport& report) : origin(origin),
+        end_address(uint32_t(origin + 8*size)), report(report), has_handlers(false) {}
+    
+    bool load(const std::vector<uint64_t>& code, uint32_t entry, std::string& error);
+    /// One pass of every rewrite, returns the number of changes made.
+    std::size_t round();
+    bool store(std::vector<uint64_t>& code, uint32_t& entry, std::unordered_map<std::string, uint32_t>* symbols, std::string& error);
+
+private:
+    void replace(OptimizerNode& node, uint64_t word);
+    void remove(std::size_t index, std::size_t& counter);
+    void compact();
+    void build_blocks();
+    void successors(std::size_t block, const ConstantState* state, std::size_t* out, std::size_t& count) const;
+    bool evaluate(ConstantState& state, const DecodedInstruction& inst, const InstructionEffects& effects);
+    void apply(ConstantState& state, const DecodedInstruction& inst);
+    void propagate_constants();
+    void rewrite(std::size_t index, ConstantState& state);
+    void rewrite_blocks();
+    void remove_dead_stores();
+    void thread_jumps();
+    
+    uint32_t origin;
+    uint32_t end_address; /// First address past the original code.
+    OptimizerReport& report;
+    std::vector<OptimizerNode> nodes;
+    std::vector<OptimizerBlock> blocks;
+    std::vector<std::size_t> block_of;
+    std::vector<std::size_t> original_index; /// Current index of every original instruction, and of the end.
+    std::size_t entry_index;
+    std::size_t changes;
+    bool has_handlers;
+    CPU scratch; /// Runs the register handlers to fold constants, so folding matches execution exactly.
+};
+
+bool ProgramOptimizer::load(const std::vector<uint64_t>& code, uint32_t entry, std::string& error)
+{
+    char message[128];
+    std::size_t size = code.size();
+    if(uint32_t(entry - origin) >= 8*size || (entry - origin) % 8)
+    {
+        error = "the entry point is not an instruction of the code";
+        return false;
+    }
+    entry_index = (entry - origin) / 8;
+    
+    nodes.resize(size + 1);
+    for(std::size_t i = 0; i <= size; ++i)
+    {
+        OptimizerNode& node = nodes[i];
+        uint32_t address = uint32_t(origin + 8*i);
+        node.sentinel = i == size;
+        node.removed = false;
+        node.target = -1;
+        node.address = 0;
+        replace(node, node.sentinel ? encode_immediate_quad_instruction(JumpImmediateQuad, 0) : code[i]);
+        if(node.sentinel)
+        {
+            node.address = end_address;
+            break;
+        }
+        
+        const DecodedInstruction& inst = node.inst;
+        unsigned func = inst.opcode - ImmediateOpcodeBase;
+        uint32_t target = 0;
+        if(inst.opcode == ImmediateOpcodeBase + JumpRegisterQuad || inst.opcode == ImmediateOpcodeBase + JumpBackRegisterQuad ||
+           inst.opcode == ImmediateOpcodeBase + CallRegisterQuad)
+        {
+            snprintf(message, sizeof(message), "the register quad %s at 0x%08x can land anywhere",
+                     inst.opcode == ImmediateOpcodeBase + CallRegisterQuad ? "call" : "jump", address);
+            error = message;
+            return false;
+        }
+        else if(inst.opcode == ImmediateOpcodeBase + ReturnFromInterruptImmediate)
+        {
+            /// Back to wherever the handler was entered from, after any instruction that can fault or jump.
+            snprintf(message, sizeof(message), "the reti at 0x%08x can land anywhere", address);
+            error = message;
+            return false;
+        }
+        else if(is_relative_jump(inst))
+            target = func == JumpImmediateQuad ? address + inst.quad : address - inst.quad;
+        else if(is_handler_set(inst) || enters_code(inst))
+            target = inst.quad;
+        else
+        {
+            bool addresses_code = (inst.opcode == MemoryOpcodeBase + LoadMemoryImmediate || inst.opcode == MemoryOpcodeBase + StoreMemoryImmediate ||
+                                   inst.opcode == ImmediateOpcodeBase + SetStackAddressImmediateQuadAddress) && inst.quad - origin < 8*size;
+            if(addresses_code)
+            {
+                snprintf(message, sizeof(message), "the instruction at 0x%08x uses the code as data", address);
+                error = message;
+                return false;
+            }
+            continue;
+        }
+        
+        if(target - origin < 8*size)
+        {
+            if((target - origin) % 8)
+            {
+                snprintf(message, sizeof(message), "the instruction at 0x%08x points inside another instruction", address);
+                error = message;
+                return false;
+            }
+            node.target = (target - origin) / 8;
+        }
+        else
+            node.address = target;
+        has_handlers |= is_handler_set(inst);
+    }
+    
+    original_index.resize(size + 1);
+    for(std::size_t i = 0; i <= size; ++i)
+        original_index[i] = i;
+    report.instructions_before = size;
+    return true;
+}
+
+void ProgramOptimizer::replace(OptimizerNode& node, uint64_t word)
+{
+    node.word = word;
+    decode_instruction(word, node.inst);
+}
+
+void ProgramOptimizer::remove(std::size_t index, std::size_t& counter)
+{
+    nodes[index].removed = true;
+    ++counter;
+    ++changes;
+}
+
+void ProgramOptimizer::compact()
+{
+    /// A removed instruction did nothing, so reaching it means reaching the next one kept.
+    std::vector<std::size_t> remap(nodes.size() + 1);
+    std::size_t kept = std::count_if(nodes.begin(), nodes.end(), [](const OptimizerNode& node) { return !node.removed; });
+    remap[nodes.size()] = kept;
+    for(std::size_t i = nodes.size(); i-- > 0;)
+        remap[i] = nodes[i].removed ? remap[i + 1] : --kept;
+    
+    std::vector<OptimizerNode> compacted;
+    for(OptimizerNode& node : nodes)
+    {
+        if(node.removed)
+            continue;
+        if(node.target >= 0)
+            node.target = remap[node.target];
+        if(node.target == int64_t(remap[nodes.size()]))
+        {
+            node.target = -1;
+            node.address = end_address;
+        }
+        compacted.push_back(node);
+    }
+    nodes.swap(compacted);
+    entry_index = remap[entry_index];
+    for(std::size_t& index : original_index)
+        index = remap[index];
+}
+
+void ProgramOptimizer::build_blocks()
+{
+    std::vector<bool> leader(nodes.size() + 1, false);
+    leader[0] = true;
+    leader[entry_index] = true;
+    for(std::size_t i = 0; i < nodes.size(); ++i)
+    {
+        const DecodedInstruction& inst = nodes[i].inst;
+        if(nodes[i].target >= 0)
+            leader[nodes[i].target] = true;
+        if(is_relative_jump(inst) || is_halt(inst) || is_return(inst))
+            leader[i + 1] = true;
+    }
+    
+    blocks.clear();
+    block_of.resize(nodes.size());
+    for(std::size_t i = 0; i < nodes.size(); ++i)
+    {
+        if(leader[i])
+        {
+            OptimizerBlock block;
+            block.first = i;
+            block.reached = false;
+            block.queued = false;
+            blocks.push_back(block);
+        }
+        blocks.back().end = i + 1;
+        block_of[i] = blocks.size() - 1;
+    }
+}
+
+/// Blocks control can go to after block, OPTIMIZER_EXIT for leaving the code. With state, the predicate of the
+/// last instruction is taken into account where it is known.
+void ProgramOptimizer::successors(std::size_t block, const ConstantState* state, std::size_t* out, std::size_t& count) const
+{
+    const OptimizerNode& last = nodes[blocks[block].end - 1];
+    const DecodedInstruction& inst = last.inst;
+    bool may_run = true, may_skip = inst.has_predicate;
+    if(inst.has_predicate && state && state->known[inst.predicate_register])
+    {
+        may_run = state->values[inst.predicate_register];
+        may_skip = !may_run;
+    }
+    
+    count = 0;
+    bool transfers = is_relative_jump(inst) || is_halt(inst) || is_return(inst);
+    if(transfers && may_run && is_relative_jump(inst))
+        out[count++] = last.target >= 0 ? block_of[last.target] : OPTIMIZER_EXIT;
+    if(!transfers || may_skip)
+        out[count++] = blocks[block].end < nodes.size() ? block + 1 : OPTIMIZER_EXIT;
+}
+
+/// Sets what is known about the registers inst writes if it runs, false if that is nothing.
+bool ProgramOptimizer::evaluate(ConstantState& state, const DecodedInstruction& inst, const InstructionEffects& effects)
+{
+    if(effects.side_effects || effects.writes.none())
+        return false;
+    
+    unsigned func = inst.opcode - RegisterOpcodeBase;
+    if((effects.reads & ~state.known).any())
+    {
+        /// Results some unknown operands cannot change.
+        int value = -1;
+        bool register_op = inst.opcode < ImmediateOpcodeBase;
+        auto known_as = [&](uint8_t r, uint8_t v) { return state.known[r] && state.values[r] == v; };
+        if(register_op && ((func == AndImmediate && inst.val3 == 0) || (func == MulImmediate && inst.val3 == 0) ||
+                           (func == ModRegisterImmediate && inst.val3 == 1) || (func == XorRegister && inst.val2 == inst.val3) ||
+                           ((func == AndRegister || func == MulRegister) && (known_as(inst.val2, 0) || known_as(inst.val3, 0)))))
+            value = 0;
+        else if(register_op && ((func == OrImmediate && inst.val3 == 255) || (func == OrRegister && (known_as(inst.val2, 255) || known_as(inst.val3, 255)))))
+            value = 255;
+        else if(register_op && func >= CompareRegister16 && func <= CompareRegister64 && inst.val2 == inst.val3)
+            value = 0;
+        if(value < 0)
+            return false;
+        state.known.set(inst.val1);
+        state.values[inst.val1] = value;
+        return true;
+    }
+    
+    memcpy(scratch.registers, state.values, NUM_REGISTERS);
+    scratch.execute(inst);
+    for(unsigned r = 0; r < NUM_REGISTERS; ++r)
+    {
+        if(effects.writes[r])
+        {
+            state.known.set(r);
+            state.values[r] = scratch.registers[r];
+        }
+    }
+    return true;
+}
+
+void ProgramOptimizer::apply(ConstantState& state, const DecodedInstruction& inst)
+{
+    bool predicate_known = inst.has_predicate && state.known[inst.predicate_register];
+    if(predicate_known && !state.values[inst.predicate_register])
+        return;
+    
+    InstructionEffects effects = instruction_effects(inst);
+    ConstantState after = state;
+    if(!evaluate(after, inst, effects))
+        after.known &= ~effects.writes;
+    if(inst.has_predicate && !predicate_known)
+        state.join(after);
+    else
+        state = after;
+}
+
+/// Forward propagation from the entry, the handlers and the call targets, following only edges the known predicates
+/// allow, so code behind a jump that is never taken is never reached. A call goes on to the instruction after it with
+/// every register unknown, as if the callee had returned.
+void ProgramOptimizer::propagate_constants()
+{
+    std::vector<std::size_t> worklist;
+    ConstantState unknown;
+    unknown.known.reset();
+    memset(unknown.values, 0, sizeof(unknown.values));
+    
+    auto enter = [&](std::size_t block, const ConstantState& state)
+    {
+        OptimizerBlock& target = blocks[block];
+        bool changed = !target.reached;
+        if(!target.reached)
+        {
+            target.reached = true;
+            target.in = state;
+        }
+        else
+            changed = target.in.join(state);
+        if(changed && !target.queued)
+        {
+            target.queued = true;
+            worklist.push_back(block);
+        }
+    };
+    
+    enter(block_of[entry_index], unknown);
+    for(const OptimizerNode& node : nodes)
+        if((is_handler_set(node.inst) || enters_code(node.inst)) && node.target >= 0)
+            enter(block_of[node.target], unknown);
+    
+    while(!worklist.empty())
+    {
+        std::size_t block = worklist.back();
+        worklist.pop_back();
+        blocks[block].queued = false;
+        
+        ConstantState state = blocks[block].in;
+        for(std::size_t i = blocks[block].first; i + 1 < blocks[block].end; ++i)
+            apply(state, nodes[i].inst);
+        std::size_t next[2], count;
+        successors(block, &state, next, count);
+        apply(state, nodes[blocks[block].end - 1].inst);
+        for(std::size_t i = 0; i < count; ++i)
+            if(next[i] != OPTIMIZER_EXIT)
+                enter(next[i], state);
+    }
+}
+
+/// Instructions that leave every register as it was, whatever the registers hold.
+static bool is_identity(const DecodedInstruction& inst)
+{
+    if(inst.opcode >= RegisterOpcodeBase && inst.opcode < ImmediateOpcodeBase)
+    {
+        unsigned func = inst.opcode - RegisterOpcodeBase;
+        bool same = inst.val1 == inst.val2;
+        switch(func)
+        {
+            case LoadRegister:
+                return same;
+            case AddImmediate: case OrImmediate: case XorImmediate:
+                return same && inst.val3 == 0;
+            case AndImmediate:
+                return same && inst.val3 == 255;
+            case MulImmediate: case DivRegisterImmediate:
+                return same && inst.val3 == 1;
+            case AndRegister: case OrRegister:
+                return same && inst.val2 == inst.val3;
+            case IncrementImmediate16: case IncrementImmediate32: case IncrementImmediate64:
+                return inst.val2 == 0;
+            default:
+                return func >= ShiftLeftImmediate16 && func <= ShiftRightImmediate64 && same && inst.val3 == 0;
+        }
+    }
+    if(inst.opcode >= VectorOpcodeBase && inst.opcode < InvalidOpcode)
+    {
+        unsigned func = inst.opcode - VectorOpcodeBase;
+        bool and_like = func == VectorAnd || func == VectorOr || func == VectorMin || func == VectorMax;
+        return and_like && inst.val1 == inst.val2 && inst.val2 == inst.val3;
+    }
+    return false;
+}
+
+/// The immediate form of a register instruction with a known operand, or 0 if there is none.
+static uint64_t fold_operand(const DecodedInstruction& inst, const ConstantState& state)
+{
+    if(inst.opcode < RegisterOpcodeBase || inst.opcode >= ImmediateOpcodeBase)
+        return 0;
+    int predicate = predicate_of(inst);
+    bool known2 = state.known[inst.val2], known3 = state.known[inst.val3], known4 = state.known[inst.val4];
+    uint8_t value2 = state.values[inst.val2], value3 = state.values[inst.val3], value4 = state.values[inst.val4];
+    switch(inst.opcode - RegisterOpcodeBase)
+    {
+        case LoadRegister:
+            if(known2)
+                return encode_register_instruction(LoadImmediate, inst.val1, value2, 0, 0, predicate);
+            break;
+        case AddRegister: case MulRegister: case AndRegister: case OrRegister: case XorRegister:
+        {
+            /// Each of these is commutative and its immediate form comes just before it.
+            RegisterInstructions immediate = RegisterInstructions(inst.opcode - RegisterOpcodeBase - 1);
+            if(known3)
+                return encode_register_instruction(immediate, inst.val1, inst.val2, value3, 0, predicate);
+            if(known2)
+                return encode_register_instruction(immediate, inst.val1, inst.val3, value2, 0, predicate);
+            break;
+        }
+        case DivRegisterRegister: case ModRegisterRegister:
+        {
+            bool divide = inst.opcode == RegisterOpcodeBase + DivRegisterRegister;
+            if(known3 && value3)
+                return encode_register_instruction(divide ? DivRegisterImmediate : ModRegisterImmediate, inst.val1, inst.val2, value3, 0, predicate);
+            if(known2)
+                return encode_register_instruction(divide ? DivImmediateRegister : ModImmediateRegister, inst.val1, value2, inst.val3, 0, predicate);
+            break;
+        }
+        case AddRegisterSaveCarry:
+            if(known4)
+                return encode_register_instruction(AddImmediateSaveCarry, inst.val1, inst.val2, inst.val3, value4, predicate);
+            if(known3)
+                return encode_register_instruction(AddImmediateSaveCarry, inst.val1, inst.val2, inst.val4, value3, predicate);
+            break;
+        case MulRegisterSaveCarry:
+            if(known3)
+                return encode_register_instruction(MulImmediateSaveCarry, inst.val1, inst.val2, value3, inst.val4, predicate);
+            if(known4)
+                return encode_register_instruction(MulImmediateSaveCarry, inst.val1, inst.val2, value4, inst.val3, predicate);
+            break;
+    }
+    return 0;
+}
+
+/// Simplifies the instruction at index given the registers before it, then moves state past it.
+void ProgramOptimizer::rewrite(std::size_t index, ConstantState& state)
+{
+    OptimizerNode& node = nodes[index];
+    if(node.inst.has_predicate && state.known[node.inst.predicate_register])
+    {
+        if(!state.values[node.inst.predicate_register])
+        {
+            remove(index, report.never_executed);
+            return;
+        }
+        replace(node, node.word & ~uint64_t((1 << NUM_PREDICATE_BITS) - 1));
+        ++report.predicates_removed;
+        ++changes;
+    }
+    InstructionEffects effects = instruction_effects(node.inst);
+    ConstantState after = state;
+    bool known = false;
+    if(!effects.side_effects)
+    {
+        known = evaluate(after, node.inst, effects);
+        bool unchanged = known;
+        for(unsigned r = 0; r < NUM_REGISTERS && unchanged; ++r)
+            if(effects.writes[r])
+                unchanged = state.known[r] && state.values[r] == after.values[r];
+        if(unchanged || is_identity(node.inst))
+        {
+            remove(index, report.no_effect);
+            return;
+        }
+    }
+    
+    if(known && effects.writes.count() == 1 && node.inst.opcode != RegisterOpcodeBase + LoadImmediate)
+    {
+        uint8_t r = node.inst.val1;
+        replace(node, encode_register_instruction(LoadImmediate, r, after.values[r], 0, 0, predicate_of(node.inst)));
+        ++report.constants_folded;
+        ++changes;
+    }
+    else if(!effects.side_effects || is_division(node.inst.opcode))
+    {
+        /// A division by a register known to be non-zero becomes the immediate form, which cannot trap and folds next round.
+        if(uint64_t folded = fold_operand(node.inst, state))
+        {
+            replace(node, folded);
+            ++report.operands_folded;
+            ++changes;
+            if(is_identity(node.inst))
+            {
+                remove(index, report.no_effect);
+                return;
+            }
+        }
+    }
+    apply(state, node.inst);
+}
+
+void ProgramOptimizer::rewrite_blocks()
+{
+    for(OptimizerBlock& block : blocks)
+    {
+        if(!block.reached)
+        {
+            for(std::size_t i = block.first; i < block.end; ++i)
+            {
+                /// The sentinel was never part of the program, dropping it is not a change.
+                if(nodes[i].sentinel)
+                    nodes[i].removed = true;
+                else
+                    remove(i, report.unreachable);
+            }
+            continue;
+        }
+        ConstantState state = block.in;
+        for(std::size_t i = block.first; i < block.end; ++i)
+            rewrite(i, state);
+    }
+}
+
+/// Backward liveness over every edge, then removal of the side effect free instructions whose writes are all dead.
+void ProgramOptimizer::remove_dead_stores()
+{
+    RegisterSet all;
+    all.set();
+    
+    auto live_before = [&](const DecodedInstruction& inst, RegisterSet live)
+    {
+        InstructionEffects effects = instruction_effects(inst);
+        if(!inst.has_predicate)
+            live &= ~effects.kills;
+        live |= effects.reads;
+        if(inst.has_predicate)
+            live.set(inst.predicate_register);
+        /// A halt hands every register to the host, a fault hands them to the handler.
+        if(is_halt(inst) || (effects.may_fault && has_handlers))
+            live = all;
+        return live;
+    };
+    auto live_out = [&](std::size_t block)
+    {
+        RegisterSet live;
+        std::size_t next[2], count;
+        successors(block, nullptr, next, count);
+        for(std::size_t i = 0; i < count; ++i)
+            live |= next[i] == OPTIMIZER_EXIT ? all : blocks[next[i]].live_in;
+        return live;
+    };
+    
+    for(OptimizerBlock& block : blocks)
+        block.live_in.reset();
+    for(bool changed = true; changed;)
+    {
+        changed = false;
+        for(std::size_t b = blocks.size(); b-- > 0;)
+        {
+            RegisterSet live = live_out(b);
+            for(std::size_t i = blocks[b].end; i-- > blocks[b].first;)
+                live = live_before(nodes[i].inst, live);
+            if(live != blocks[b].live_in)
+            {
+                blocks[b].live_in = live;
+                changed = true;
+            }
+        }
+    }
+    
+    for(std::size_t b = 0; b < blocks.size(); ++b)
+    {
+        RegisterSet live = live_out(b);
+        for(std::size_t i = blocks[b].end; i-- > blocks[b].first;)
+        {
+            const DecodedInstruction& inst = nodes[i].inst;
+            InstructionEffects effects = instruction_effects(inst);
+            if(!effects.side_effects && (effects.writes & live).none())
+                remove(i, report.dead_stores);
+            else
+                live = live_before(inst, live);
+        }
+    }
+}
+
+/// Jumps to an unconditional jump go straight to its target, jumps to a halt become the halt and jumps to the next
+/// instruction go away.
+void ProgramOptimizer::thread_jumps()
+{
+    for(std::size_t i = 0; i < nodes.size(); ++i)
+    {
+        OptimizerNode& node = nodes[i];
+        if(!is_relative_jump(node.inst) || node.target < 0)
+            continue;
+        
+        std::size_t steps = 0;
+        while(node.target >= 0 && steps++ < nodes.size())
+        {
+            const OptimizerNode& target = nodes[node.target];
+            if(&target == &node || !is_relative_jump(target.inst) || target.inst.has_predicate)
+                break;
+            node.target = target.target;
+            node.address = target.address;
+            ++report.jumps_threaded;
+            ++changes;
+        }
+        
+        if(node.target >= 0 && is_halt(nodes[node.target].inst) && !nodes[node.target].inst.has_predicate)
+        {
+            /// The jump does not touch the registers, so the halt sees the same ones here.
+            uint64_t halt = nodes[node.target].word & ~uint64_t((1 << NUM_PREDICATE_BITS) - 1);
+            if(node.inst.has_predicate)
+                halt |= 1 | (uint64_t(node.inst.predicate_register) << 1);
+            replace(node, halt);
+            node.target = -1;
+            ++report.jumps_threaded;
+            ++changes;
+        }
+        else if(node.target == int64_t(i + 1))
+            remove(i, report.jumps_removed);
+    }
+}
+
+std::size_t ProgramOptimizer::round()
+{
+    changes = 0;
+    if(nodes.empty())
+        return 0;
+    build_blocks();
+    propagate_constants();
+    rewrite_blocks();
+    compact();
+    
+    build_blocks();
+    remove_dead_stores();
+    compact();
+    
+    thread_jumps();
+    compact();
+    return changes;
+}
+
+bool ProgramOptimizer::store(std::vector<uint64_t>& code, uint32_t& entry, std::unordered_map<std::string, uint32_t>* symbols, std::string& error)
+{
+    /// The sentinel is only needed if something reaches it from a new address.
+    std::size_t size = nodes.size();
+    if(size && nodes.back().sentinel && uint32_t(origin + 8*(size - 1)) == end_address)
+        --size;
+    
+    for(std::size_t i = 0; i < size; ++i)
+    {
+        OptimizerNode& node = nodes[i];
+        uint32_t address = uint32_t(origin + 8*i);
+        if(is_relative_jump(node.inst))
+        {
+            uint32_t target = node.target >= 0 ? uint32_t(origin + 8*node.target) : node.address;
+            bool forward = target >= address;
+            replace(node, encode_immediate_quad_instruction(forward ? JumpImmediateQuad : JumpBackImmediateQuad,
+                                                            forward ? target - address : address - target, predicate_of(node.inst)));
+        }
+        else if(is_handler_set(node.inst) && node.target >= 0)
+        {
+            uint32_t target = uint32_t(origin + 8*node.target);
+            if(!target)
+            {
+                error = "an exception handler would move to address 0, which setihriq cannot name";
+                return false;
+            }
+            replace(node, encode_immediate_quad_instruction(SetInterruptHandlerRoutineImmediate, target, predicate_of(node.inst)));
+        }
+        else if(enters_code(node.inst) && node.target >= 0)
+        {
+            uint32_t target = uint32_t(origin + 8*node.target);
+            ImmediateInstructions func = ImmediateInstructions(node.inst.opcode - ImmediateOpcodeBase);
+            replace(node, encode_immediate_instruction(func, target >> 24, target >> 16, target >> 8, target, node.inst.val5,
+                                                       predicate_of(node.inst)));
+        }
+    }
+    
+    code.resize(size);
+    for(std::size_t i = 0; i < size; ++i)
+        code[i] = nodes[i].word;
+    entry = uint32_t(origin + 8*entry_index);
+    if(symbols)
+    {
+        for(auto& symbol : *symbols)
+        {
+            uint32_t offset = symbol.second - origin;
+            if(offset < original_index.size() * 8 && offset % 8 == 0)
+                symbol.second = uint32_t(origin + 8*std::min(original_index[offset / 8], size));
+        }
+    }
+    report.instructions_after = size;
+    return true;
+}
+
+bool optimize_program(std::vector<uint64_t>& code, uint32_t origin, uint32_t& entry, OptimizerReport& report, std::string& error,
+                      std::unordered_map<std::string, uint32_t>* symbols)
+{
+    report = OptimizerReport();
+    ProgramOptimizer optimizer(origin, code.size(), report);
+    if(!optimizer.load(code, entry, error))
+        return false;
+    
+    while(report.rounds < OPTIMIZER_MAX_ROUNDS)
+    {
+        ++report.rounds;
+        if(!optimizer.round())
+            break;
+    }
+    
+    /// Written to copies so a failure leaves the program untouched.
+    std::vector<uint64_t> optimized;
+    uint32_t optimized_entry = entry;
+    std::unordered_map<std::string, uint32_t> optimized_symbols;
+    if(symbols)
+        optimized_symbols = *symbols;
+    if(!optimizer.store(optimized, optimized_entry, symbols ? &optimized_symbols : nullptr, error))
+        return false;
+    code.swap(optimized);
+    entry = optimized_entry;
+    if(symbols)
+        symbols->swap(optimized_symbols);
+    return true;
+}
+
+bool optimize_image(ProgramImage& image, OptimizerReport& report, std::string& error)
+{
+    ImageSection* code_section = nullptr;
+    for(ImageSection& section : image.sections)
+    {
+        if(!(section.flags & ImageSectionCode))
+            continue;
+        if(code_section)
+        {
+            error = "more than one code section";
+            return false;
+        }
+        code_section = &section;
+    }
+    if(!code_section || code_section->data.size() % 8)
+    {
+        error = code_section ? "the code section is not a whole number of instructions" : "no code section";
+        return false;
+    }
+    
+    std::vector<uint64_t> code(code_section->data.size() / 8);
+    for(std::size_t i = 0; i < code.size(); ++i)
+        for(int j = 7; j >= 0; --j)
+            code[i] = (code[i] << 8) | code_section->data[8*i + j];
+    if(!optimize_program(code, code_section->load_address, image.entry, report, error, &image.symbols))
+        return false;
+    
+    bool only_code = code_section->memory_size == code_section->data.size();
+    code_section->data.resize(code.size() * 8);
+    for(std::size_t i = 0; i < code.size(); ++i)
+        for(int j = 0; j < 8; ++j)
+            code_section->data[8*i + j] = (code[i] >> (8*j)) & 0xFF;
+    if(only_code)
+        code_section->memory_size = uint32_t(code_section->data.size());
+    return true;
+}
+
+void write_optimizer_report(FILE* out, const OptimizerReport& report)
+{
+    fprintf(out, "optimizer: %zu -> %zu instructions in %zu rounds\n", report.instructions_before, report.instructions_after, report.rounds);
+    const std::pair<const char*, std::size_t> counts[] = {
+        {"unreachable", report.unreachable},
+        {"never executed", report.never_executed},
+        {"predicates removed", report.predicates_removed},
+        {"constants folded", report.constants_folded},
+        {"operands folded", report.operands_folded},
+        {"no effect", report.no_effect},
+        {"dead stores", report.dead_stores},
+        {"jumps threaded", report.jumps_threaded},
+        {"jumps removed", report.jumps_removed},
+    };
+    for(const auto& count : counts)
+        if(count.second)
+            fprintf(out, "    %-20s %zu\n", count.first, count.second);
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "CPU.h"
+#include "Image.h"
+
+/// Rounds of analysis and rewriting before the optimizer stops even if the last round still changed something.
+#define OPTIMIZER_MAX_ROUNDS 16
+
+/// What the optimizer did, instruction counts per rewrite. An instruction rewritten by one round and removed by a
+/// later one is counted under both.
+struct OptimizerReport
+{
+    std::size_t instructions_before = 0;
+    std::size_t instructions_after = 0;
+    std::size_t rounds = 0;
+    std::size_t unreachable = 0; /// Removed, no path from the entry or an exception handler reaches them.
+    std::size_t never_executed = 0; /// Removed, their predicate register is provably zero.
+    std::size_t predicates_removed = 0; /// Predicate register provably non-zero, now unconditional.
+    std::size_t constants_folded = 0; /// Result provably constant, now a loadi.
+    std::size_t operands_folded = 0; /// A register operand provably constant, now the immediate form.
+    std::size_t no_effect = 0; /// Removed, they leave every register as it was.
+    std::size_t dead_stores = 0; /// Removed, every register they write is overwritten before it is read.
+    std::size_t jumps_threaded = 0; /// Retargeted past an unconditional jump, or replaced by the halt they jump to.
+    std::size_t jumps_removed = 0; /// Removed, they jump to the instruction after them.
+};
+
+/// Rewrites code loaded at origin and entered at entry so it runs fewer instructions with the same effect: basic
+/// blocks are found from the entry, the exception handlers set with setihriq and the calliq and spawniq targets,
+/// register values are propagated as constants through them, and instructions that then do nothing, only write
+/// registers nobody reads or jump somewhere they could skip are removed. Relative jumps and setihriq, calliq and
+/// spawniq addresses are recomputed for the new layout, and so are entry and the symbols pointing into the code.
+///
+/// Registers are unknown at the entry, at handlers, at call and spawn targets and after calls, and all of them count
+/// as read at halts, calls, returns, spawns, jumps leaving the code and, when a handler is set, at every instruction
+/// that can fault and every jump, where interrupts are delivered, so what the host sees is unchanged. The code must
+/// not be read or written as data: programs using the code addresses as data with immediate quads, jumping or calling
+/// by register quads or returning from the handler with reti are left alone and false is returned with the reason in
+/// error.
+bool optimize_program(std::vector<uint64_t>& code, uint32_t origin, uint32_t& entry, OptimizerReport& report, std::string& error,
+                      std::unordered_map<std::string, uint32_t>* symbols = nullptr);
+
+/// optimize_program over the one ImageSectionCode section of image. Sections that only held code shrink with it,
+/// the others keep their memory_size so what follows the code stays where it was.
+bool optimize_image(ProgramImage& image, OptimizerReport& report, std::string& error);
+
+/// One line per non-zero count.
+void write_optimizer_report(FILE* out, const OptimizerReport& report);
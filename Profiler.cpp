@@ -0,0 +1,301 @@
+#include <cstring>
+#include <algorithm>
+#include "Profiler.h"
+
+Profiler::Profiler(uint64_t sample_period) : sample_period(sample_period), next_sample(sample_period), max_call_depth(0),
+    unmatched_pops(0), page_ins(0), last_sample(0)
+{
+    memset(opcode_hits, 0, sizeof(opcode_hits));
+    memset(opcode_skips, 0, sizeof(opcode_skips));
+}
+
+template<class Config>
+void Profiler::attach(BasicCPU<Config>& cpu)
+{
+#if defined(DERP_PROFILE)
+    for(uint32_t i = 0; i < Config::decode_cache_size; ++i)
+    {
+        cpu.decode_cache[i].profile_hits = 0;
+        cpu.decode_cache[i].profile_skips = 0;
+    }
+    cpu.profiler = this;
+#endif
+    last_sample = cpu.instructions_retired();
+    next_sample = last_sample + sample_period;
+}
+
+void Profiler::record(uint32_t address, uint8_t opcode, uint64_t hits, uint64_t skips)
+{
+    opcode_hits[opcode] += hits;
+    opcode_skips[opcode] += skips;
+    ProfiledAddress& counts = addresses[address];
+    counts.hits += hits;
+    counts.skips += skips;
+    counts.opcode = opcode;
+}
+
+void Profiler::push_frame(uint32_t call_site)
+{
+    call_stack.push_back(call_site);
+    max_call_depth = std::max(max_call_depth, call_stack.size());
+}
+
+void Profiler::pop_frame()
+{
+    if(call_stack.empty())
+        ++unmatched_pops;
+    else
+        call_stack.pop_back();
+}
+
+template<class Config>
+void Profiler::sample(BasicCPU<Config>& cpu)
+{
+    uint64_t retired = cpu.instructions_retired();
+    if(retired > last_sample)
+    {
+        std::vector<uint32_t> stack(call_stack);
+        stack.push_back(cpu.program_counter);
+        stacks[stack] += retired - last_sample;
+    }
+    last_sample = retired;
+    next_sample = retired + sample_period;
+}
+
+template<class Config>
+void Profiler::collect(BasicCPU<Config>& cpu)
+{
+#if defined(DERP_PROFILE)
+    for(uint32_t i = 0; i < Config::decode_cache_size; ++i)
+        cpu.profile_evict(cpu.decode_cache[i]);
+#endif
+    sample(cpu);
+}
+
+#if defined(DERP_PROFILE)
+template<class Config>
+void BasicCPU<Config>::profile_evict(DecodedInstruction& inst)
+{
+    if(profiler && inst.valid && inst.profile_hits)
+        profiler->record(inst.address, inst.opcode, inst.profile_hits, inst.profile_skips);
+    inst.profile_hits = 0;
+    inst.profile_skips = 0;
+}
+
+#define INSTANTIATE_PROFILE_EVICT(Config) template void BasicCPU<Config>::profile_evict(DecodedInstruction& inst);
+CPU_CONFIGS(INSTANTIATE_PROFILE_EVICT)
+#undef INSTANTIATE_PROFILE_EVICT
+#endif
+
+#define INSTANTIATE_PROFILER(Config) \
+    template void Profiler::attach(BasicCPU<Config>& cpu); \
+    template void Profiler::sample(BasicCPU<Config>& cpu); \
+    template void Profiler::collect(BasicCPU<Config>& cpu);
+CPU_CONFIGS(INSTANTIATE_PROFILER)
+#undef INSTANTIATE_PROFILER
+
+uint32_t Profiler::estimated_cycles(uint8_t opcode)
+{
+    if(opcode < RegisterOpcodeBase)
+    {
+        unsigned func = opcode - MemoryOpcodeBase;
+        return func >= CompareAndSwap ? 20 : func >= BlockCopy ? 32 : 4;
+    }
+    if(opcode < ImmediateOpcodeBase)
+    {
+        switch(opcode - RegisterOpcodeBase)
+        {
+            case MulImmediate: case MulRegister: case MulImmediateSaveCarry: case MulRegisterSaveCarry:
+            case MulRegister16: case MulRegister32: case MulRegister64:
+                return 3;
+            case DivImmediateRegister: case DivRegisterImmediate: case DivRegisterRegister:
+            case ModImmediateRegister: case ModRegisterImmediate: case ModRegisterRegister:
+                return 25;
+            default:
+                return 1;
+        }
+    }
+    if(opcode >= VectorOpcodeBase)
+        return opcode - VectorOpcodeBase == VectorLoadMemory || opcode - VectorOpcodeBase == VectorStoreMemory ? 16 : 8;
+    switch(opcode - ImmediateOpcodeBase)
+    {
+        case JumpImmediateQuad: case JumpRegisterQuad: case JumpBackImmediateQuad: case JumpBackRegisterQuad:
+            return 2;
+        case PushStackRegisterArguments: case PushStackImmediateArguments:
+            return 8;
+        case PopStack: case CallImmediateQuad: case CallRegisterQuad:
+            return 4;
+        case PrintToScreenImmediate: case PrintToScreenRegister:
+            return 20;
+        default:
+            return 1;
+    }
+}
+
+static const char* opcode_name(uint8_t opcode)
+{
+    if(opcode < RegisterOpcodeBase)
+        return MI_asm[opcode - MemoryOpcodeBase];
+    if(opcode < ImmediateOpcodeBase)
+        return RI_asm[opcode - RegisterOpcodeBase];
+    if(opcode < VectorOpcodeBase)
+        return II_asm[opcode - ImmediateOpcodeBase];
+    if(opcode < InvalidOpcode)
+        return VI_asm[opcode - VectorOpcodeBase];
+    return "invalid";
+}
+
+static int opcode_type(uint8_t opcode)
+{
+    return opcode < RegisterOpcodeBase ? MemoryInstructionType : opcode < ImmediateOpcodeBase ? RegisterInstructionType :
+           opcode < VectorOpcodeBase ? ImmediateInstructionType : opcode < InvalidOpcode ? VectorInstructionType : InstructionTypesSize;
+}
+
+void Profiler::set_symbols(const std::unordered_map<std::string, uint32_t>& labels)
+{
+    symbols.clear();
+    for(const auto& label : labels)
+    {
+        /// Several labels on one address: keep the alphabetically first so output is stable.
+        auto found = symbols.find(label.second);
+        if(found == symbols.end() || label.first < found->second)
+            symbols[label.second] = label.first;
+    }
+}
+
+std::string Profiler::frame_name(uint32_t address) const
+{
+    auto found = symbols.upper_bound(address);
+    if(found != symbols.begin())
+        return std::prev(found)->second;
+    
+    char hex[16];
+    snprintf(hex, sizeof(hex), "0x%08x", address);
+    return hex;
+}
+
+void Profiler::write_json(FILE* out) const
+{
+    static const char* type_names[InstructionTypesSize + 1] = {"memory", "register", "immediate", "vector", "invalid"};
+    uint64_t type_hits[InstructionTypesSize + 1] = {};
+    uint64_t type_skips[InstructionTypesSize + 1] = {};
+    uint64_t type_cycles[InstructionTypesSize + 1] = {};
+    uint64_t total_hits = 0, total_skips = 0, total_cycles = 0;
+    
+    for(int opcode = 0; opcode < OpcodesSize; ++opcode)
+    {
+        uint64_t cycles = (opcode_hits[opcode] - opcode_skips[opcode]) * estimated_cycles(opcode) + opcode_skips[opcode];
+        int type = opcode_type(opcode);
+        type_hits[type] += opcode_hits[opcode];
+        type_skips[type] += opcode_skips[opcode];
+        type_cycles[type] += cycles;
+        total_hits += opcode_hits[opcode];
+        total_skips += opcode_skips[opcode];
+        total_cycles += cycles;
+    }
+    
+    fprintf(out, "{\n  \"instructions\": %llu,\n  \"predicate_skipped\": %llu,\n  \"estimated_cycles\": %llu,\n",
+            (unsigned long long)total_hits, (unsigned long long)total_skips, (unsigned long long)total_cycles);
+    fprintf(out, "  \"max_call_depth\": %zu,\n  \"unmatched_pops\": %llu,\n  \"distinct_stacks\": %zu,\n", max_call_depth,
+            (unsigned long long)unmatched_pops, stacks.size());
+    fprintf(out, "  \"page_ins\": %llu,\n", (unsigned long long)page_ins);
+    
+    fprintf(out, "  \"types\": {");
+    for(int type = 0; type <= InstructionTypesSize; ++type)
+        fprintf(out, "%s\n    \"%s\": {\"count\": %llu, \"skipped\": %llu, \"estimated_cycles\": %llu}", type ? "," : "",
+                type_names[type], (unsigned long long)type_hits[type], (unsigned long long)type_skips[type], (unsigned long long)type_cycles[type]);
+    fprintf(out, "\n  },\n");
+    
+    fprintf(out, "  \"opcodes\": [");
+    bool first = true;
+    for(int opcode = 0; opcode < OpcodesSize; ++opcode)
+    {
+        if(!opcode_hits[opcode])
+            continue;
+        uint64_t cycles = (opcode_hits[opcode] - opcode_skips[opcode]) * estimated_cycles(opcode) + opcode_skips[opcode];
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"type\": \"%s\", \"count\": %llu, \"skipped\": %llu, \"estimated_cycles\": %llu}",
+                first ? "" : ",", opcode_name(opcode), type_names[opcode_type(opcode)], (unsigned long long)opcode_hits[opcode],
+                (unsigned long long)opcode_skips[opcode], (unsigned long long)cycles);
+        first = false;
+    }
+    fprintf(out, "\n  ],\n");
+    
+    std::vector<std::pair<uint64_t, uint32_t>> hot;
+    for(const auto& address : addresses)
+        hot.emplace_back(address.second.hits, address.first);
+    size_t shown = std::min<size_t>(hot.size(), PROFILE_HOT_PCS);
+    std::partial_sort(hot.begin(), hot.begin() + shown, hot.end(), std::greater<std::pair<uint64_t, uint32_t>>());
+    
+    fprintf(out, "  \"hot_pcs\": [");
+    for(size_t i = 0; i < shown; ++i)
+        fprintf(out, "%s\n    {\"pc\": %u, \"count\": %llu, \"symbol\": \"%s\"}", i ? "," : "", hot[i].second,
+                (unsigned long long)hot[i].first, frame_name(hot[i].second).c_str());
+    fprintf(out, "\n  ]\n}\n");
+}
+
+void Profiler::write_folded(FILE* out) const
+{
+    /// Stacks that differ only in PCs inside the same frames fold into one line.
+    std::map<std::string, uint64_t> folded;
+    for(const auto& stack : stacks)
+    {
+        std::string line;
+        for(size_t i = 0; i < stack.first.size(); ++i)
+        {
+            if(i)
+                line += ';';
+            line += frame_name(stack.first[i]);
+        }
+        folded[line] += stack.second;
+    }
+    
+    for(const auto& line : folded)
+        fprintf(out, "%s %llu\n", line.first.c_str(), (unsigned long long)line.second);
+}
+
+void Profiler::write_superinstructions(FILE* out, size_t count) const
+{
+    std::map<std::vector<uint8_t>, uint64_t> saved;
+    for(const auto& address : addresses)
+    {
+        uint64_t runs = address.second.hits - address.second.skips;
+        if(!runs || !fusable_leader(address.second.opcode))
+            continue;
+        
+        std::vector<uint8_t> sequence(1, address.second.opcode);
+        for(uint32_t next = address.first + 8; sequence.size() < SUPERINSTRUCTION_MAX_LENGTH; next += 8)
+        {
+            auto found = addresses.find(next);
+            if(found == addresses.end() || !fusable_last(found->second.opcode))
+                break;
+            sequence.push_back(found->second.opcode);
+            saved[sequence] += runs * (sequence.size() - 1);
+            if(!fusable_leader(found->second.opcode))
+                break;
+        }
+    }
+    
+    std::vector<std::pair<uint64_t, const std::vector<uint8_t>*>> ranked;
+    for(const auto& sequence : saved)
+        ranked.emplace_back(sequence.second, &sequence.first);
+    size_t shown = std::min(ranked.size(), count);
+    std::partial_sort(ranked.begin(), ranked.begin() + shown, ranked.end(),
+                      [](const std::pair<uint64_t, const std::vector<uint8_t>*>& a, const std::pair<uint64_t, const std::vector<uint8_t>*>& b)
+                      {
+                          return a.first != b.first ? a.first > b.first : *a.second < *b.second;
+                      });
+    
+    fprintf(out, "/// Dispatches saved in the profiled run:");
+    for(size_t i = 0; i < shown; ++i)
+        fprintf(out, " %llu", (unsigned long long)ranked[i].first);
+    fprintf(out, "\n#define SUPERINSTRUCTIONS(PAIR, TRIPLE)");
+    for(size_t i = 0; i < shown; ++i)
+    {
+        const std::vector<uint8_t>& sequence = *ranked[i].second;
+        fprintf(out, " \\\n    %s(", sequence.size() == 2 ? "PAIR" : "TRIPLE");
+        for(size_t j = 0; j < sequence.size(); ++j)
+            fprintf(out, "%s%s", j ? ", " : "", handler_name(sequence[j]));
+        fprintf(out, ")");
+    }
+    fprintf(out, "\n");
+}
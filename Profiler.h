@@ -0,0 +1,78 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "CPU.h"
+#include "Instructions.h"
+#include "Superinstructions.h"
+
+/// Instructions between call stack samples.
+#define PROFILE_SAMPLE_PERIOD 4096
+/// Entries in the JSON hot_pcs list.
+#define PROFILE_HOT_PCS 32
+
+/// Counts of the instructions decoded at one address. opcode is the last one seen there.
+struct ProfiledAddress
+{
+    uint64_t hits;
+    uint64_t skips;
+    uint8_t opcode;
+};
+
+/// Execution profile of one CPU, needs a -DDERP_PROFILE build to be fed. Per-PC counts live in the decode cache
+/// entries while they run and are folded in here when an entry is dropped or on collect(), so the run loop only
+/// pays one increment per instruction.
+class Profiler
+{
+public:
+    Profiler(uint64_t sample_period = PROFILE_SAMPLE_PERIOD);
+    
+    /// Sets cpu.profiler and drops whatever the decode cache counted before. The CPU members are compiled for every
+    /// configuration in CPU_CONFIGS.
+    template<class Config>
+    void attach(BasicCPU<Config>& cpu);
+    /// Adds the counts of one decode cache entry. hits includes skips.
+    void record(uint32_t address, uint8_t opcode, uint64_t hits, uint64_t skips);
+    /// Call depth follows the calls, calliq and callrq enter and popstk leaves.
+    void push_frame(uint32_t call_site);
+    void pop_frame();
+    template<class Config>
+    void sample(BasicCPU<Config>& cpu);
+    /// Folds in the counts still held by cpu's decode cache and takes a last sample. Call before writing.
+    template<class Config>
+    void collect(BasicCPU<Config>& cpu);
+    
+    /// Names frames and hot PCs after the nearest label at or below them, as produced by the assembler.
+    void set_symbols(const std::unordered_map<std::string, uint32_t>& labels);
+    void write_json(FILE* out) const;
+    /// One "frame;frame;leaf count" line per distinct sampled stack, for flamegraph.pl and similar tools.
+    void write_folded(FILE* out) const;
+    /// Up to count sequences that would save the most dispatches as superinstructions, as a SUPERINSTRUCTIONS list
+    /// for Superinstructions.h. An instruction that is not a jump always runs before the one after it, so a
+    /// sequence runs as often as its first instruction ran with its predicate true. Overlapping sequences are each
+    /// counted in full.
+    void write_superinstructions(FILE* out, size_t count = PROFILE_SUPERINSTRUCTIONS) const;
+    
+    /// Rough host cost of one instruction, used for the cycle estimates. Skipped instructions cost one cycle.
+    static uint32_t estimated_cycles(uint8_t opcode);
+    
+    uint64_t sample_period;
+    uint64_t next_sample; /// instructions_retired() at which run() takes the next sample.
+    uint64_t opcode_hits[OpcodesSize];
+    uint64_t opcode_skips[OpcodesSize];
+    std::unordered_map<uint32_t, ProfiledAddress> addresses;
+    std::vector<uint32_t> call_stack;
+    size_t max_call_depth;
+    uint64_t unmatched_pops; /// popstk with no call seen, returning from calls made before the profiler was attached.
+    uint64_t page_ins; /// FileStream chunks mapped in by any hart, counted atomically from the fault handler.
+    std::map<std::vector<uint32_t>, uint64_t> stacks; /// Call sites then the sampled PC, to instructions.
+
+private:
+    std::string frame_name(uint32_t address) const;
+    
+    uint64_t last_sample;
+    std::map<uint32_t, std::string> symbols;
+};
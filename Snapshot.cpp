@@ -0,0 +1,578 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#if defined(__unix__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include "Snapshot.h"
+
+/// splitmix64 over a per-process random seed, so ids from different runs do not collide either.
+static uint64_t next_snapshot_id()
+{
+    static const uint64_t seed = (uint64_t(std::random_device()()) << 32) ^ std::random_device()() ^
+                                 uint64_t(std::chrono::steady_clock::now().time_since_epoch().count());
+    static std::atomic<uint64_t> counter(0);
+    uint64_t id = seed + (counter.fetch_add(1) + 1) * 0x9E3779B97F4A7C15ull;
+    id = (id ^ (id >> 30)) * 0xBF58476D1CE4E5B9ull;
+    id = (id ^ (id >> 27)) * 0x94D049BB133111EBull;
+    id ^= id >> 31;
+    return id ? id : 1;
+}
+
+Snapshot::Snapshot() : id(next_snapshot_id()), depth(0), stack_address(0), program_counter(0), exception_handler_routine_address(0),
+    exception_reason(0), errored_program_counter(0), interrupts_enabled(true), in_exception_handler(false), held_interrupts(0), halted(false), halt_value(0), data(nullptr), fd(-1)
+{
+    memset(registers, 0, sizeof(registers));
+}
+
+Snapshot::~Snapshot()
+{
+#if defined(__linux__)
+    if(fd >= 0)
+    {
+        munmap(data, pages.size() * GUEST_PAGE_SIZE);
+        close(fd);
+        return;
+    }
+#endif
+    delete[] data;
+}
+
+void Snapshot::allocate_pages()
+{
+    std::size_t size = pages.size() * GUEST_PAGE_SIZE;
+    if(!size)
+        return;
+#if defined(__linux__)
+    /// Pages in a memfd can be mapped straight into a fork. Needs the host page to match the guest page.
+    if(sysconf(_SC_PAGESIZE) == GUEST_PAGE_SIZE)
+    {
+        int file = memfd_create("derp-snapshot", MFD_CLOEXEC);
+        void* mapping = MAP_FAILED;
+        if(file >= 0 && ftruncate(file, off_t(size)) == 0)
+            mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+        if(mapping != MAP_FAILED)
+        {
+            data = static_cast<uint8_t*>(mapping);
+            fd = file;
+            return;
+        }
+        if(file >= 0)
+            close(file);
+    }
+#endif
+    data = new uint8_t[size]();
+}
+
+const std::vector<SnapshotPage>& Snapshot::page_table() const
+{
+    std::call_once(table_built, [this]
+    {
+        /// A chain of one is already in order.
+        if(!parent)
+        {
+            table.reserve(pages.size());
+            for(std::size_t i = 0; i < pages.size(); ++i)
+                table.push_back({pages[i], uint32_t(i), this});
+            return;
+        }
+        
+        std::vector<uint64_t> seen(MAX_GUEST_PAGE_COUNT / 64);
+        for(const Snapshot* snapshot = this; snapshot; snapshot = snapshot->parent.get())
+        {
+            for(std::size_t i = 0; i < snapshot->pages.size(); ++i)
+            {
+                uint32_t page = snapshot->pages[i];
+                uint64_t bit = uint64_t(1) << (page & 63);
+                if(seen[page >> 6] & bit)
+                    continue;
+                seen[page >> 6] |= bit;
+                table.push_back({page, uint32_t(i), snapshot});
+            }
+        }
+        std::sort(table.begin(), table.end(), [](const SnapshotPage& a, const SnapshotPage& b) { return a.page < b.page; });
+    });
+    return table;
+}
+
+/// The snapshot holding the newest copy of page, and its index there.
+static const Snapshot* find_owner(const Snapshot* snapshot, uint32_t page, std::size_t& index)
+{
+    for(; snapshot; snapshot = snapshot->parent.get())
+    {
+        auto found = std::lower_bound(snapshot->pages.begin(), snapshot->pages.end(), page);
+        if(found != snapshot->pages.end() && *found == page)
+        {
+            index = std::size_t(found - snapshot->pages.begin());
+            return snapshot;
+        }
+    }
+    return nullptr;
+}
+
+const uint8_t* Snapshot::find_page(uint32_t page) const
+{
+    std::size_t index;
+    const Snapshot* owner = find_owner(this, page, index);
+    return owner ? owner->data + index * GUEST_PAGE_SIZE : nullptr;
+}
+
+template<class Config>
+static void capture_state(const BasicCPU<Config>& cpu, Snapshot& snapshot)
+{
+    memcpy(snapshot.registers, cpu.registers, NUM_REGISTERS);
+    snapshot.stack_address = cpu.stack_address;
+    snapshot.return_stack = cpu.return_stack;
+    snapshot.program_counter = cpu.program_counter;
+    snapshot.exception_handler_routine_address = cpu.exception_handler_routine_address;
+    snapshot.exception_reason = cpu.exception_reason;
+    snapshot.errored_program_counter = cpu.errored_program_counter;
+    snapshot.interrupts_enabled = cpu.interrupts_enabled;
+    snapshot.in_exception_handler = cpu.in_exception_handler;
+    snapshot.held_interrupts = cpu.held_interrupts;
+    snapshot.halted = cpu.halted;
+    snapshot.halt_value = cpu.halt_value;
+}
+
+template<class Config>
+static void apply_state(const Snapshot& snapshot, BasicCPU<Config>& cpu)
+{
+    memcpy(cpu.registers, snapshot.registers, NUM_REGISTERS);
+    cpu.stack_address = snapshot.stack_address;
+    cpu.return_stack = snapshot.return_stack;
+    cpu.program_counter = snapshot.program_counter;
+    cpu.exception_handler_routine_address = snapshot.exception_handler_routine_address;
+    cpu.exception_reason = snapshot.exception_reason;
+    cpu.errored_program_counter = snapshot.errored_program_counter;
+    cpu.interrupts_enabled = snapshot.interrupts_enabled;
+    cpu.in_exception_handler = snapshot.in_exception_handler;
+    cpu.held_interrupts = snapshot.held_interrupts;
+    cpu.halted = snapshot.halted;
+    cpu.halt_value = snapshot.halt_value;
+}
+
+template<class Config>
+static bool same_state(const BasicCPU<Config>& cpu, const Snapshot& snapshot)
+{
+    return memcmp(cpu.registers, snapshot.registers, NUM_REGISTERS) == 0 && cpu.stack_address == snapshot.stack_address &&
+           cpu.return_stack == snapshot.return_stack &&
+           cpu.program_counter == snapshot.program_counter &&
+           cpu.exception_handler_routine_address == snapshot.exception_handler_routine_address &&
+           cpu.exception_reason == snapshot.exception_reason && cpu.errored_program_counter == snapshot.errored_program_counter &&
+           cpu.interrupts_enabled == snapshot.interrupts_enabled && cpu.in_exception_handler == snapshot.in_exception_handler &&
+           cpu.held_interrupts == snapshot.held_interrupts &&
+           cpu.halted == snapshot.halted && cpu.halt_value == snapshot.halt_value;
+}
+
+/// Adds the pages of snapshot not yet in the bitmap to pages.
+/// Pages from page_count on are past this CPU's memory, from a snapshot of a larger configuration, and are left out.
+static void add_pages(const Snapshot& snapshot, uint32_t page_count, std::vector<uint64_t>& bitmap, std::vector<uint32_t>& pages)
+{
+    for(uint32_t page : snapshot.pages)
+    {
+        if(page >= page_count)
+            break;
+        uint64_t bit = uint64_t(1) << (page & 63);
+        if(!(bitmap[page >> 6] & bit))
+        {
+            bitmap[page >> 6] |= bit;
+            pages.push_back(page);
+        }
+    }
+}
+
+template<class Config>
+std::shared_ptr<const Snapshot> BasicCPU<Config>::snapshot()
+{
+    if(snapshot_base && dirty_pages.empty() && same_state(*this, *snapshot_base))
+        return snapshot_base;
+    
+    std::shared_ptr<Snapshot> taken = std::make_shared<Snapshot>();
+    taken->parent = snapshot_base;
+    taken->depth = snapshot_base ? snapshot_base->depth + 1 : 0;
+    capture_state(*this, *taken);
+    
+    std::sort(dirty_pages.begin(), dirty_pages.end());
+    taken->pages = dirty_pages;
+    taken->allocate_pages();
+    for(std::size_t i = 0, run; i < dirty_pages.size(); i += run)
+    {
+        for(run = 1; i + run < dirty_pages.size() && dirty_pages[i + run] == dirty_pages[i] + run; ++run)
+            ;
+        const uint8_t* source = memory + std::size_t(dirty_pages[i]) * GUEST_PAGE_SIZE;
+#if defined(__unix__)
+        /// write() fills the memfd without taking a fault per page through the mapping.
+        if(taken->fd >= 0 && pwrite(taken->fd, source, run * GUEST_PAGE_SIZE, off_t(i) * GUEST_PAGE_SIZE) == ssize_t(run * GUEST_PAGE_SIZE))
+            continue;
+#endif
+        memcpy(taken->data + i * GUEST_PAGE_SIZE, source, run * GUEST_PAGE_SIZE);
+    }
+    for(uint32_t page : dirty_pages)
+        dirty_bitmap[page >> 6] = 0;
+    dirty_pages.clear();
+    
+    snapshot_base = taken;
+    return snapshot_base;
+}
+
+template<class Config>
+void BasicCPU<Config>::restore(const std::shared_ptr<const Snapshot>& target)
+{
+    /// Memory holds snapshot_base plus the dirty pages. Walking both chains up to their common ancestor finds every
+    /// other page that can differ from target. A null base is the all zero memory of a fresh CPU.
+    std::vector<uint32_t> reload;
+    reload.swap(dirty_pages);
+    const Snapshot* from = snapshot_base.get();
+    const Snapshot* to = target.get();
+    while(from != to)
+    {
+        if(from && (!to || from->depth >= to->depth))
+        {
+            add_pages(*from, Config::guest_page_count, dirty_bitmap, reload);
+            from = from->parent.get();
+        }
+        else
+        {
+            add_pages(*to, Config::guest_page_count, dirty_bitmap, reload);
+            to = to->parent.get();
+        }
+    }
+    std::sort(reload.begin(), reload.end());
+    
+    for(uint32_t page : reload)
+    {
+        dirty_bitmap[page >> 6] = 0;
+        uint8_t* destination = memory + std::size_t(page) * GUEST_PAGE_SIZE;
+#if defined(__unix__)
+        if(is_read_only(page))
+            mprotect(destination, GUEST_PAGE_SIZE, PROT_READ | PROT_WRITE);
+#endif
+        std::size_t index;
+        const Snapshot* owner = find_owner(target.get(), page, index);
+        if(!owner)
+        {
+            memset(destination, 0, GUEST_PAGE_SIZE);
+            continue;
+        }
+#if defined(__unix__)
+        /// Reading the memfd directly skips faulting in the snapshot's own mapping of the page.
+        if(owner->fd >= 0 && pread(owner->fd, destination, GUEST_PAGE_SIZE, off_t(index) * GUEST_PAGE_SIZE) == GUEST_PAGE_SIZE)
+            continue;
+#endif
+        memcpy(destination, owner->data + index * GUEST_PAGE_SIZE, GUEST_PAGE_SIZE);
+    }
+#if defined(__unix__)
+    /// Write-protected pages were opened up for the copy, a guest store to them has to fault again.
+    if(!read_only_bitmap.empty())
+        for(uint32_t page : reload)
+            if(is_read_only(page))
+                mprotect(memory + std::size_t(page) * GUEST_PAGE_SIZE, GUEST_PAGE_SIZE, PROT_READ);
+#endif
+    
+    /// Past a handful of pages every decode cache slot gets looked at anyway.
+    if(reload.size() * (GUEST_PAGE_SIZE / 8) >= Config::decode_cache_size)
+    {
+        flush_decode_cache();
+        if(jit)
+            jit_invalidate();
+    }
+    else
+    {
+        for(uint32_t page : reload)
+            invalidate_range(page << GUEST_PAGE_BITS, GUEST_PAGE_SIZE);
+    }
+    
+    reload.clear();
+    dirty_pages.swap(reload);
+    apply_state(*target, *this);
+    snapshot_base = target;
+}
+
+template<class Config>
+std::unique_ptr<BasicCPU<Config>> BasicCPU<Config>::fork(const std::shared_ptr<const Snapshot>& snapshot)
+{
+    std::unique_ptr<BasicCPU> cpu(new BasicCPU());
+    const std::vector<SnapshotPage>& table = snapshot->page_table();
+    std::size_t count = std::size_t(std::lower_bound(table.begin(), table.end(), Config::guest_page_count,
+                                                     [](const SnapshotPage& a, uint32_t page) { return a.page < page; }) - table.begin());
+    for(std::size_t i = 0, run; i < count; i += run)
+    {
+        const SnapshotPage& first = table[i];
+        for(run = 1; i + run < count; ++run)
+        {
+            const SnapshotPage& next = table[i + run];
+            if(next.owner != first.owner || next.page != first.page + run || next.index != first.index + run)
+                break;
+        }
+        
+        uint8_t* destination = cpu->memory + std::size_t(first.page) * GUEST_PAGE_SIZE;
+        const uint8_t* source = first.owner->data + std::size_t(first.index) * GUEST_PAGE_SIZE;
+#if defined(__unix__)
+        if(first.owner->fd >= 0 && mmap(destination, run * GUEST_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                                        first.owner->fd, off_t(first.index) * GUEST_PAGE_SIZE) != MAP_FAILED)
+            continue;
+#endif
+        memcpy(destination, source, run * GUEST_PAGE_SIZE);
+    }
+    
+    apply_state(*snapshot, *cpu);
+    cpu->snapshot_base = snapshot;
+    return cpu;
+}
+
+template<class Config>
+std::unique_ptr<BasicCPU<Config>> BasicCPU<Config>::fork()
+{
+    std::unique_ptr<BasicCPU> child = fork(snapshot());
+    child->trap_memory_faults = trap_memory_faults;
+    child->read_only_bitmap = read_only_bitmap;
+#if defined(__unix__)
+    /// The copy-on-write mapping of the snapshot pages is writable throughout.
+    for(std::size_t word = 0; word < read_only_bitmap.size(); ++word)
+        for(uint64_t bits = read_only_bitmap[word]; bits; bits &= bits - 1)
+            mprotect(child->memory + (word * 64 + __builtin_ctzll(bits)) * GUEST_PAGE_SIZE, GUEST_PAGE_SIZE, PROT_READ);
+#endif
+    return child;
+}
+
+static bool page_is_zero(const uint8_t* page)
+{
+    uint64_t any = 0;
+    for(int i = 0; i < GUEST_PAGE_SIZE; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, page + i, 8);
+        any |= word;
+    }
+    return any == 0;
+}
+
+bool serialize_snapshot(const Snapshot& snapshot, const Snapshot* base, std::vector<uint8_t>& out, std::string& error)
+{
+    /// Newest copy of every page captured below base, like page_table() but stopping early.
+    std::vector<SnapshotPage> pages;
+    std::vector<uint64_t> seen(MAX_GUEST_PAGE_COUNT / 64);
+    const Snapshot* level = &snapshot;
+    for(; level && level != base; level = level->parent.get())
+    {
+        for(std::size_t i = 0; i < level->pages.size(); ++i)
+        {
+            uint32_t page = level->pages[i];
+            uint64_t bit = uint64_t(1) << (page & 63);
+            if(!(seen[page >> 6] & bit))
+            {
+                seen[page >> 6] |= bit;
+                pages.push_back({page, uint32_t(i), level});
+            }
+        }
+    }
+    if(level != base)
+    {
+        error = "base is not an ancestor of the snapshot";
+        return false;
+    }
+    std::sort(pages.begin(), pages.end(), [](const SnapshotPage& a, const SnapshotPage& b) { return a.page < b.page; });
+    
+    SnapshotFileHeader header;
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.exception_reason = snapshot.exception_reason;
+    header.halted = snapshot.halted;
+    header.id = snapshot.id;
+    header.base_id = base ? base->id : 0;
+    header.stack_address = snapshot.stack_address;
+    header.program_counter = snapshot.program_counter;
+    header.exception_handler_routine_address = snapshot.exception_handler_routine_address;
+    header.errored_program_counter = snapshot.errored_program_counter;
+    header.halt_value = snapshot.halt_value;
+    header.page_count = uint32_t(pages.size());
+    header.return_depth = uint32_t(snapshot.return_stack.size());
+    header.interrupt_state = snapshot.held_interrupts | (snapshot.interrupts_enabled ? 0 : SNAPSHOT_INTERRUPTS_DISABLED) |
+                             (snapshot.in_exception_handler ? SNAPSHOT_IN_EXCEPTION_HANDLER : 0);
+    memcpy(header.registers, snapshot.registers, NUM_REGISTERS);
+    
+    std::vector<SnapshotFilePage> entries;
+    std::size_t stored = 0;
+    for(const SnapshotPage& page : pages)
+    {
+        bool zero = page_is_zero(page.owner->data + std::size_t(page.index) * GUEST_PAGE_SIZE);
+        entries.push_back({page.page, zero ? uint32_t(SnapshotPageZero) : 0u});
+        stored += !zero;
+    }
+    
+    std::size_t start = out.size();
+    std::size_t frames_size = snapshot.return_stack.size() * sizeof(ReturnFrame);
+    out.resize(start + sizeof(header) + frames_size + entries.size() * sizeof(SnapshotFilePage) + stored * GUEST_PAGE_SIZE);
+    uint8_t* cursor = out.data() + start;
+    memcpy(cursor, &header, sizeof(header));
+    cursor += sizeof(header);
+    if(frames_size)
+        memcpy(cursor, snapshot.return_stack.data(), frames_size);
+    cursor += frames_size;
+    memcpy(cursor, entries.data(), entries.size() * sizeof(SnapshotFilePage));
+    cursor += entries.size() * sizeof(SnapshotFilePage);
+    for(std::size_t i = 0; i < pages.size(); ++i)
+    {
+        if(entries[i].flags & SnapshotPageZero)
+            continue;
+        memcpy(cursor, pages[i].owner->data + std::size_t(pages[i].index) * GUEST_PAGE_SIZE, GUEST_PAGE_SIZE);
+        cursor += GUEST_PAGE_SIZE;
+    }
+    return true;
+}
+
+bool write_snapshot(const char* path, const Snapshot& snapshot, const Snapshot* base, std::string& error)
+{
+    std::vector<uint8_t> bytes;
+    if(!serialize_snapshot(snapshot, base, bytes, error))
+        return false;
+    
+    FILE* out = fopen(path, "wb");
+    if(!out)
+    {
+        error = std::string("could not create \"") + path + "\"";
+        return false;
+    }
+    fwrite(bytes.data(), 1, bytes.size(), out);
+    bool ok = !ferror(out);
+    ok = fclose(out) == 0 && ok;
+    if(!ok)
+        error = std::string("could not write \"") + path + "\"";
+    return ok;
+}
+
+/// Checks the header against base and the page table, returns the number of stored pages or -1.
+static long check_snapshot_tables(const uint8_t* bytes, std::size_t size, const Snapshot* base, SnapshotFileHeader& header,
+                                  std::string& error)
+{
+    if(size < sizeof(header))
+    {
+        error = "too small for a snapshot header";
+        return -1;
+    }
+    memcpy(&header, bytes, sizeof(header));
+    if(header.magic != SNAPSHOT_MAGIC)
+    {
+        error = "not a snapshot";
+        return -1;
+    }
+    if(header.version != SNAPSHOT_VERSION)
+    {
+        error = "unsupported snapshot version " + std::to_string(header.version);
+        return -1;
+    }
+    if(header.base_id != (base ? base->id : 0))
+    {
+        error = header.base_id ? "snapshot is a delta against a different base" : "snapshot is not a delta";
+        return -1;
+    }
+    if(header.return_depth > MAX_RETURN_STACK_SIZE)
+    {
+        error = "bad return stack";
+        return -1;
+    }
+    uint64_t table = sizeof(header) + uint64_t(header.return_depth) * sizeof(ReturnFrame);
+    if(header.page_count > MAX_GUEST_PAGE_COUNT || table + uint64_t(header.page_count) * sizeof(SnapshotFilePage) > size)
+    {
+        error = "truncated page table";
+        return -1;
+    }
+    
+    long stored = 0;
+    uint32_t previous = 0;
+    for(uint32_t i = 0; i < header.page_count; ++i)
+    {
+        SnapshotFilePage entry;
+        memcpy(&entry, bytes + table + i * sizeof(entry), sizeof(entry));
+        if(entry.page >= MAX_GUEST_PAGE_COUNT || (i && entry.page <= previous))
+        {
+            error = "bad page table";
+            return -1;
+        }
+        previous = entry.page;
+        stored += !(entry.flags & SnapshotPageZero);
+    }
+    if(table + uint64_t(header.page_count) * sizeof(SnapshotFilePage) + uint64_t(stored) * GUEST_PAGE_SIZE != size)
+    {
+        error = "truncated page data";
+        return -1;
+    }
+    return stored;
+}
+
+std::shared_ptr<const Snapshot> deserialize_snapshot(const uint8_t* bytes, std::size_t size, const std::shared_ptr<const Snapshot>& base,
+                                                     std::string& error)
+{
+    SnapshotFileHeader header;
+    if(check_snapshot_tables(bytes, size, base.get(), header, error) < 0)
+        return nullptr;
+    
+    std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+    snapshot->id = header.id;
+    snapshot->parent = base;
+    snapshot->depth = base ? base->depth + 1 : 0;
+    memcpy(snapshot->registers, header.registers, NUM_REGISTERS);
+    snapshot->stack_address = header.stack_address;
+    snapshot->return_stack.resize(header.return_depth);
+    if(header.return_depth)
+        memcpy(snapshot->return_stack.data(), bytes + sizeof(header), header.return_depth * sizeof(ReturnFrame));
+    snapshot->program_counter = header.program_counter;
+    snapshot->exception_handler_routine_address = header.exception_handler_routine_address;
+    snapshot->exception_reason = header.exception_reason;
+    snapshot->errored_program_counter = header.errored_program_counter;
+    snapshot->interrupts_enabled = !(header.interrupt_state & SNAPSHOT_INTERRUPTS_DISABLED);
+    snapshot->in_exception_handler = header.interrupt_state & SNAPSHOT_IN_EXCEPTION_HANDLER;
+    snapshot->held_interrupts = header.interrupt_state & ~(SNAPSHOT_INTERRUPTS_DISABLED | SNAPSHOT_IN_EXCEPTION_HANDLER);
+    snapshot->halted = header.halted != 0;
+    snapshot->halt_value = header.halt_value;
+    
+    const uint8_t* entries = bytes + sizeof(header) + header.return_depth * sizeof(ReturnFrame);
+    for(uint32_t i = 0; i < header.page_count; ++i)
+    {
+        SnapshotFilePage entry;
+        memcpy(&entry, entries + i * sizeof(entry), sizeof(entry));
+        snapshot->pages.push_back(entry.page);
+    }
+    snapshot->allocate_pages();
+    
+    /// Zero pages are left as allocated.
+    const uint8_t* data = entries + header.page_count * sizeof(SnapshotFilePage);
+    for(uint32_t i = 0; i < header.page_count; ++i)
+    {
+        SnapshotFilePage entry;
+        memcpy(&entry, entries + i * sizeof(entry), sizeof(entry));
+        if(entry.flags & SnapshotPageZero)
+            continue;
+        memcpy(snapshot->data + std::size_t(i) * GUEST_PAGE_SIZE, data, GUEST_PAGE_SIZE);
+        data += GUEST_PAGE_SIZE;
+    }
+    return snapshot;
+}
+
+std::shared_ptr<const Snapshot> read_snapshot(const char* path, const std::shared_ptr<const Snapshot>& base, std::string& error)
+{
+    FILE* in = fopen(path, "rb");
+    if(!in)
+    {
+        error = std::string("could not open \"") + path + "\"";
+        return nullptr;
+    }
+    std::vector<uint8_t> bytes;
+    uint8_t block[1 << 16];
+    for(std::size_t got; (got = fread(block, 1, sizeof(block), in)) > 0; )
+        bytes.insert(bytes.end(), block, block + got);
+    fclose(in);
+    return deserialize_snapshot(bytes.data(), bytes.size(), base, error);
+}
+
+#define INSTANTIATE_SNAPSHOT(Config) \
+    template std::shared_ptr<const Snapshot> BasicCPU<Config>::snapshot(); \
+    template void BasicCPU<Config>::restore(const std::shared_ptr<const Snapshot>&); \
+    template std::unique_ptr<BasicCPU<Config>> BasicCPU<Config>::fork(const std::shared_ptr<const Snapshot>&); \
+    template std::unique_ptr<BasicCPU<Config>> BasicCPU<Config>::fork();
+CPU_CONFIGS(INSTANTIATE_SNAPSHOT)
+#undef INSTANTIATE_SNAPSHOT
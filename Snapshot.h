@@ -0,0 +1,119 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "CPU.h"
+
+#define SNAPSHOT_MAGIC 0x504E5344 /// "DSNP" read as a little-endian uint32_t.
+#define SNAPSHOT_VERSION 2
+/// Bit of SnapshotFileHeader::interrupt_state set while interrupts are disabled. The bit is PREEMPT_REQUEST's, which
+/// is never held.
+#define SNAPSHOT_INTERRUPTS_DISABLED (1u << 31)
+/// Bit of SnapshotFileHeader::interrupt_state set inside the exception handler routine, above every reason's bit.
+#define SNAPSHOT_IN_EXCEPTION_HANDLER (1u << 30)
+
+/// A page held somewhere in a snapshot chain: owner->data + index * GUEST_PAGE_SIZE.
+struct SnapshotPage
+{
+    uint32_t page;
+    uint32_t index;
+    const struct Snapshot* owner;
+};
+
+/// CPU state plus the guest pages written since parent. Pages held by no snapshot in the chain are zero.
+/// Immutable once taken, so one snapshot can be restored into or forked from by any number of CPUs and threads.
+struct Snapshot
+{
+    Snapshot();
+    ~Snapshot();
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+    
+    /// Allocates data for pages.size() pages, zero filled.
+    void allocate_pages();
+    /// Every page held anywhere in the chain with the snapshot holding its newest copy, ascending. Built on first use.
+    const std::vector<SnapshotPage>& page_table() const;
+    /// The newest copy of page in the chain, null if no snapshot holds it. One binary search per snapshot walked.
+    const uint8_t* find_page(uint32_t page) const;
+    
+    uint64_t id; /// Unique across processes, ties a delta file to its base.
+    std::shared_ptr<const Snapshot> parent;
+    uint32_t depth; /// Snapshots above this one in the chain.
+    
+    uint8_t registers[NUM_REGISTERS];
+    uint32_t stack_address;
+    std::vector<ReturnFrame> return_stack;
+    uint32_t program_counter;
+    uint32_t exception_handler_routine_address;
+    uint8_t exception_reason;
+    uint32_t errored_program_counter;
+    bool interrupts_enabled;
+    bool in_exception_handler;
+    uint32_t held_interrupts;
+    bool halted;
+    uint32_t halt_value;
+    
+    std::vector<uint32_t> pages; /// Page numbers captured here, ascending.
+    uint8_t* data; /// One GUEST_PAGE_SIZE block per entry of pages, in the same order.
+    int fd; /// memfd behind data that forks map from, -1 where pages can only be copied.
+
+private:
+    mutable std::once_flag table_built;
+    mutable std::vector<SnapshotPage> table;
+};
+
+/// On disk layout, all fields little-endian:
+///     SnapshotFileHeader
+///     ReturnFrame[return_depth], innermost last
+///     SnapshotFilePage[page_count], ascending
+///     GUEST_PAGE_SIZE bytes for every page without SnapshotPageZero, in the same order
+struct SnapshotFileHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint8_t exception_reason;
+    uint8_t halted;
+    uint64_t id;
+    uint64_t base_id; /// Snapshot the pages are a delta against, 0 if they hold everything.
+    uint32_t stack_address;
+    uint32_t program_counter;
+    uint32_t exception_handler_routine_address;
+    uint32_t errored_program_counter;
+    uint32_t halt_value;
+    uint32_t page_count;
+    uint32_t return_depth;
+    /// held_interrupts, with SNAPSHOT_INTERRUPTS_DISABLED and SNAPSHOT_IN_EXCEPTION_HANDLER. Zero, enabled and outside
+    /// the handler, in older files.
+    uint32_t interrupt_state;
+    uint8_t registers[NUM_REGISTERS];
+};
+
+enum SnapshotPageFlags
+{
+    SnapshotPageZero = 1, /// All zero, no data stored.
+};
+
+struct SnapshotFilePage
+{
+    uint32_t page;
+    uint32_t flags;
+};
+
+static_assert(sizeof(SnapshotFileHeader) == 312 && sizeof(ReturnFrame) == 8 && sizeof(SnapshotFilePage) == 8, "Snapshot structures must have no padding.");
+
+/// Appends snapshot to out in the file layout above, as a delta against base. base must be snapshot itself or one
+/// of its ancestors, or null to hold every page.
+bool serialize_snapshot(const Snapshot& snapshot, const Snapshot* base, std::vector<uint8_t>& out, std::string& error);
+/// Reverses serialize_snapshot. base must be the snapshot the bytes were written against and becomes the parent.
+std::shared_ptr<const Snapshot> deserialize_snapshot(const uint8_t* bytes, std::size_t size, const std::shared_ptr<const Snapshot>& base,
+                                                     std::string& error);
+
+/// Writes the pages that differ between base and snapshot, or all of them if base is null. base must be snapshot
+/// itself or one of its ancestors.
+bool write_snapshot(const char* path, const Snapshot& snapshot, const Snapshot* base, std::string& error);
+
+/// Reads a file written by write_snapshot. base must be the snapshot it was written against, with the same id,
+/// and becomes the parent of the result. Returns null on error.
+std::shared_ptr<const Snapshot> read_snapshot(const char* path, const std::shared_ptr<const Snapshot>& base, std::string& error);
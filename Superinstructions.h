@@ -0,0 +1,80 @@
+#pragma once
+#include <cstdint>
+#include "Instructions.h"
+
+/// Most instructions fused into one dispatch.
+#define SUPERINSTRUCTION_MAX_LENGTH 3
+/// Sequences written by Profiler::write_superinstructions.
+#define PROFILE_SUPERINSTRUCTIONS 16
+
+/// The handler name of opcode, as written in SUPERINSTRUCTIONS.
+const char* handler_name(uint8_t opcode);
+
+/// Division and modulo, which trap on a zero divisor.
+constexpr bool is_division(unsigned opcode)
+{
+    return opcode >= RegisterOpcodeBase + DivImmediateRegister && opcode <= RegisterOpcodeBase + ModRegisterRegister;
+}
+
+/// opcode can start a superinstruction or sit inside one: it always goes on to the next instruction and never
+/// writes guest memory, so the instructions fused after it cannot change under it.
+constexpr bool fusable_leader(unsigned opcode)
+{
+    if(opcode >= RegisterOpcodeBase && opcode < ImmediateOpcodeBase)
+        return !is_division(opcode);
+    switch(opcode)
+    {
+        case MemoryOpcodeBase + LoadMemoryRegister: case MemoryOpcodeBase + LoadMemoryImmediate:
+        case MemoryOpcodeBase + BlockCompare: case MemoryOpcodeBase + BlockSearch:
+        case ImmediateOpcodeBase + SetStackAddressImmediateQuadAddress: case ImmediateOpcodeBase + SetStackAddressRegisterQuadAddress:
+        case ImmediateOpcodeBase + PrintToScreenImmediate: case ImmediateOpcodeBase + PrintToScreenRegister:
+        case ImmediateOpcodeBase + SetInterruptHandlerRoutineImmediate: case ImmediateOpcodeBase + SaveInterruptReasonRegister:
+        case ImmediateOpcodeBase + SaveStackAddressRegisterQuad:
+            return true;
+        default:
+            return opcode >= VectorOpcodeBase && opcode < InvalidOpcode && opcode != VectorOpcodeBase + VectorStoreMemory;
+    }
+}
+
+/// opcode can end a superinstruction: anything the run loop need not check for a halt after, so no halts, no stack
+/// instructions, faddmrq or division, which trap from their handlers, no reti and no invalid opcode.
+constexpr bool fusable_last(unsigned opcode)
+{
+    return opcode < InvalidOpcode && (opcode < ImmediateOpcodeBase + HaltImmediateQuad || opcode > ImmediateOpcodeBase + HaltRegisterQuad) &&
+           opcode != MemoryOpcodeBase + FetchAddQuad && !is_division(opcode) && opcode != ImmediateOpcodeBase + ReturnFromInterruptImmediate &&
+           (opcode < ImmediateOpcodeBase + PushStackRegisterArguments || opcode > ImmediateOpcodeBase + PopStack) &&
+           opcode != ImmediateOpcodeBase + CallImmediateQuad && opcode != ImmediateOpcodeBase + CallRegisterQuad;
+}
+
+/// opcode ends a basic block. A superinstruction ending in one checks the budget and enters the JIT like the jump.
+constexpr bool ends_basic_block(unsigned opcode)
+{
+    return opcode >= ImmediateOpcodeBase + JumpImmediateQuad && opcode <= ImmediateOpcodeBase + JumpBackRegisterQuad;
+}
+
+/// Sequences of handlers the run loop dispatches as one, in program order. The decode cache fuses a sequence the
+/// first time it decodes its first instruction, preferring the longest match and then the earliest entry. Leaders
+/// must satisfy fusable_leader and the last handler fusable_last, which is checked at compile time.
+/// Mined from the benchmark programs. Regenerate with --profile, which writes name.superinstructions in this form.
+#define SUPERINSTRUCTIONS(PAIR, TRIPLE) \
+    TRIPLE(RILoadRegister, RILoadRegister, RILoadRegister) \
+    PAIR(RIAddImmediate, IIJumpBackImmediateQuad) \
+    PAIR(RIAddRegisterSaveCarry, RIAddRegisterSaveCarry) \
+    TRIPLE(RIAddImmediateSaveCarry, RIAddRegisterSaveCarry, RIOrRegister) \
+    PAIR(RIAddRegisterSaveCarry, RIOrRegister) \
+    TRIPLE(RIAddRegisterSaveCarry, RIAddRegisterSaveCarry, RIOrRegister) \
+    PAIR(RILoadRegister, RILoadRegister) \
+    TRIPLE(RIAddRegister32, RIShiftLeftImmediate32, RIShiftLeftImmediate32) \
+    TRIPLE(RIShiftLeftImmediate32, RIAddImmediate, IIJumpBackImmediateQuad) \
+    TRIPLE(RIAddRegisterSaveCarry, RIOrRegister, IIJumpBackImmediateQuad) \
+    TRIPLE(RIAddRegisterSaveCarry, RIAddRegisterSaveCarry, RIAddRegisterSaveCarry) \
+    PAIR(RIAddImmediateSaveCarry, RIAddRegisterSaveCarry) \
+    TRIPLE(RILoadImmediate, RILoadImmediate, RILoadImmediate) \
+    TRIPLE(MILoadMemoryRegister, MILoadMemoryRegister, RIAddRegisterSaveCarry) \
+    TRIPLE(RIAddRegisterSaveCarry, RIOrRegister, MIStoreMemoryRegister) \
+    PAIR(RILoadImmediate, RILoadImmediate) \
+    PAIR(MILoadMemoryRegister, MILoadMemoryRegister) \
+    TRIPLE(RILoadImmediate, RILoadImmediate, MIStoreMemoryRegister) \
+    PAIR(RIOrRegister, IIJumpBackImmediateQuad) \
+    TRIPLE(RILoadRegister, RIXorImmediate, IIJumpBackImmediateQuad) \
+    PAIR(RIAndImmediate, IIJumpImmediateQuad)
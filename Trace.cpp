@@ -0,0 +1,525 @@
+#include <cstring>
+#include <algorithm>
+#include <csetjmp>
+#include "Trace.h"
+#include "Faults.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+static void put_varint(std::vector<uint8_t>& out, uint64_t value)
+{
+    for(; value >= 0x80; value >>= 7)
+        out.push_back(uint8_t(value) | 0x80);
+    out.push_back(uint8_t(value));
+}
+
+static void put_uint32(std::vector<uint8_t>& out, uint32_t value)
+{
+    for(int i = 0; i < 4; ++i)
+        out.push_back(uint8_t(value >> (8*i)));
+}
+
+/// LZ4 style lengths: a nibble in the token, 15 meaning more bytes follow, each 255 meaning one more after that.
+static void put_length(std::vector<uint8_t>& out, std::size_t length)
+{
+    for(; length >= 255; length -= 255)
+        out.push_back(255);
+    out.push_back(uint8_t(length));
+}
+
+/// Literals then a back reference. The last sequence of a block has no back reference.
+static void put_sequence(std::vector<uint8_t>& out, const uint8_t* literals, std::size_t literal_length, std::size_t offset, std::size_t match_length)
+{
+    std::size_t match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+    out.push_back(uint8_t((std::min<std::size_t>(literal_length, 15) << 4) | std::min<std::size_t>(match_code, 15)));
+    if(literal_length >= 15)
+        put_length(out, literal_length - 15);
+    out.insert(out.end(), literals, literals + literal_length);
+    if(!match_length)
+        return;
+    out.push_back(uint8_t(offset));
+    out.push_back(uint8_t(offset >> 8));
+    if(match_code >= 15)
+        put_length(out, match_code - 15);
+}
+
+/// Greedy LZ77 with a single entry hash table. Checkpoints XOR their predecessor and guest pages are mostly zero
+/// or code, so long runs and repeats are where the savings are.
+static void lz_compress(const uint8_t* in, std::size_t size, std::vector<uint8_t>& out)
+{
+    uint32_t table[1 << LZ_HASH_BITS] = {}; /// Position + 1 of the last sequence with that hash, 0 for none.
+    std::size_t anchor = 0;
+    std::size_t i = 0;
+    while(i + LZ_MIN_MATCH <= size)
+    {
+        uint32_t sequence;
+        memcpy(&sequence, in + i, LZ_MIN_MATCH);
+        uint32_t slot = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        std::size_t candidate = table[slot];
+        table[slot] = uint32_t(i + 1);
+        if(!candidate || i + 1 - candidate > LZ_MAX_OFFSET || memcmp(in + candidate - 1, in + i, LZ_MIN_MATCH) != 0)
+        {
+            ++i;
+            continue;
+        }
+        
+        std::size_t from = candidate - 1;
+        std::size_t length = LZ_MIN_MATCH;
+        while(i + length < size && in[from + length] == in[i + length])
+            ++length;
+        put_sequence(out, in + anchor, i - anchor, i - from, length);
+        i += length;
+        anchor = i;
+    }
+    put_sequence(out, in + anchor, size - anchor, 0, 0);
+}
+
+static bool lz_decompress(const uint8_t* in, std::size_t size, std::size_t raw_size, std::vector<uint8_t>& out)
+{
+    std::size_t start = out.size();
+    std::size_t i = 0;
+    auto get_length = [&](std::size_t& length)
+    {
+        uint8_t byte;
+        do
+        {
+            if(i == size)
+                return false;
+            byte = in[i++];
+            length += byte;
+        } while(byte == 255);
+        return true;
+    };
+    
+    out.reserve(start + raw_size);
+    while(i < size)
+    {
+        uint8_t token = in[i++];
+        std::size_t literal_length = token >> 4;
+        if((literal_length == 15 && !get_length(literal_length)) || literal_length > size - i ||
+           out.size() - start + literal_length > raw_size)
+            return false;
+        out.insert(out.end(), in + i, in + i + literal_length);
+        i += literal_length;
+        if(i == size)
+            break;
+        
+        if(size - i < 2)
+            return false;
+        std::size_t offset = in[i] | (in[i + 1] << 8);
+        i += 2;
+        std::size_t length = (token & 15) + LZ_MIN_MATCH;
+        if(((token & 15) == 15 && !get_length(length)) || !offset || offset > out.size() - start ||
+           out.size() - start + length > raw_size)
+            return false;
+        
+        /// Byte by byte, the source may overlap what is being written.
+        std::size_t at = out.size();
+        out.resize(at + length);
+        uint8_t* destination = out.data() + at;
+        const uint8_t* source = destination - offset;
+        for(std::size_t k = 0; k < length; ++k)
+            destination[k] = source[k];
+    }
+    return out.size() - start == raw_size;
+}
+
+TraceRecorder::TraceRecorder(CPU& cpu, uint64_t checkpoint_interval) : checkpoint_interval(checkpoint_interval), stored_bytes(0),
+    raw_bytes(0), cpu(cpu), out(nullptr), tap(*this), start(0), last_event(0), next_checkpoint(0), failed(false)
+{
+    memset(previous_registers, 0, sizeof(previous_registers));
+}
+
+TraceRecorder::~TraceRecorder()
+{
+    std::string error;
+    if(out)
+        close(error);
+}
+
+bool TraceRecorder::open(const char* path, std::string& error)
+{
+    out = fopen(path, "wb");
+    if(!out)
+    {
+        error = std::string("could not create \"") + path + "\"";
+        return false;
+    }
+    
+    TraceFileHeader header;
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.flags = cpu.trap_memory_faults ? TraceTrapMemoryFaults : 0;
+    header.checkpoint_interval = checkpoint_interval;
+    fwrite(&header, sizeof(header), 1, out);
+    stored_bytes = sizeof(header);
+    raw_bytes = 0;
+    failed = false;
+    
+    std::vector<uint8_t> state;
+    if(!serialize_snapshot(*cpu.snapshot(), nullptr, state, error))
+    {
+        fclose(out);
+        out = nullptr;
+        return false;
+    }
+    buffer.clear();
+    put_varint(buffer, state.size());
+    buffer.insert(buffer.end(), state.begin(), state.end());
+    
+    start = cpu.instructions_retired();
+    last_event = 0;
+    next_checkpoint = checkpoint_interval;
+    memcpy(previous_registers, cpu.registers, NUM_REGISTERS);
+    tap.next = &cpu.console();
+    cpu.output = &tap;
+    return write_block(error);
+}
+
+uint32_t TraceRecorder::run(uint64_t instruction_budget)
+{
+    uint64_t limit = instruction_budget > UINT64_MAX - position() ? UINT64_MAX : position() + instruction_budget;
+    while(position() < limit)
+    {
+        uint32_t value = cpu.run(std::min(next_checkpoint, limit) - position());
+        if(cpu.halted)
+        {
+            event(TraceHalt);
+            put_varint(buffer, value);
+            return value;
+        }
+        if(position() >= next_checkpoint)
+            checkpoint();
+    }
+    return 0;
+}
+
+void TraceRecorder::event(uint8_t kind)
+{
+    if(buffer.size() >= TRACE_BLOCK_SIZE)
+    {
+        std::string error;
+        write_block(error);
+    }
+    buffer.push_back(kind);
+    put_varint(buffer, position() - last_event);
+    last_event = position();
+}
+
+void TraceRecorder::checkpoint()
+{
+    event(TraceCheckpoint);
+    put_uint32(buffer, cpu.program_counter);
+    put_uint32(buffer, cpu.stack_address);
+    for(int i = 0; i < NUM_REGISTERS; ++i)
+        buffer.push_back(cpu.registers[i] ^ previous_registers[i]);
+    memcpy(previous_registers, cpu.registers, NUM_REGISTERS);
+    next_checkpoint = position() + checkpoint_interval;
+}
+
+bool TraceRecorder::write_block(std::string& error)
+{
+    for(std::size_t offset = 0; offset < buffer.size() && !failed; offset += TRACE_BLOCK_SIZE)
+    {
+        std::size_t length = std::min<std::size_t>(buffer.size() - offset, TRACE_BLOCK_SIZE);
+        compressed.clear();
+        lz_compress(buffer.data() + offset, length, compressed);
+        
+        bool raw = compressed.size() >= length;
+        TraceBlockHeader block = {uint32_t(length), uint32_t(raw ? length : compressed.size())};
+        fwrite(&block, sizeof(block), 1, out);
+        fwrite(raw ? buffer.data() + offset : compressed.data(), 1, block.stored_size, out);
+        failed = ferror(out) != 0;
+        stored_bytes += sizeof(block) + block.stored_size;
+        raw_bytes += length;
+    }
+    buffer.clear();
+    if(failed)
+        error = "could not write the trace";
+    return !failed;
+}
+
+bool TraceRecorder::flush(std::string& error)
+{
+    if(!write_block(error))
+        return false;
+    if(fflush(out) != 0)
+    {
+        error = "could not write the trace";
+        return false;
+    }
+    return true;
+}
+
+bool TraceRecorder::close(std::string& error)
+{
+    if(!out)
+        return true;
+    bool ok = write_block(error);
+    cpu.output = tap.next;
+    if(fclose(out) != 0 && ok)
+    {
+        error = "could not write the trace";
+        ok = false;
+    }
+    out = nullptr;
+    return ok;
+}
+
+void TraceRecorder::Tap::put(uint8_t byte)
+{
+    recorder.event(TraceOutput);
+    recorder.buffer.push_back(byte);
+    next->put(byte);
+}
+
+void TraceRecorder::Tap::halt()
+{
+    next->halt();
+}
+
+void TraceRecorder::Tap::flush()
+{
+    next->flush();
+}
+
+TraceReplayer::TraceReplayer() : checkpoint_interval(0), recorded_halt(false), end_position(0), halt_value(0), capture(*this), start(0)
+{
+}
+
+bool TraceReplayer::open(const char* path, std::string& error)
+{
+    FILE* in = fopen(path, "rb");
+    if(!in)
+    {
+        error = std::string("could not open \"") + path + "\"";
+        return false;
+    }
+    
+    TraceFileHeader header;
+    std::vector<uint8_t> events;
+    std::vector<uint8_t> stored;
+    bool ok = fread(&header, sizeof(header), 1, in) == 1 && header.magic == TRACE_MAGIC;
+    if(!ok)
+        error = "not a trace";
+    else if(header.version != TRACE_VERSION)
+    {
+        error = "unsupported trace version " + std::to_string(header.version);
+        ok = false;
+    }
+    
+    TraceBlockHeader block;
+    while(ok && fread(&block, sizeof(block), 1, in) == 1)
+    {
+        stored.resize(block.stored_size);
+        if(block.raw_size > TRACE_BLOCK_SIZE || block.stored_size > block.raw_size ||
+           fread(stored.data(), 1, stored.size(), in) != stored.size())
+        {
+            error = "truncated trace block";
+            ok = false;
+        }
+        else if(block.stored_size == block.raw_size)
+            events.insert(events.end(), stored.begin(), stored.end());
+        else if(!lz_decompress(stored.data(), stored.size(), block.raw_size, events))
+        {
+            error = "corrupt trace block";
+            ok = false;
+        }
+    }
+    fclose(in);
+    if(!ok || !parse(events, error))
+        return false;
+    
+    checkpoint_interval = header.checkpoint_interval;
+    cpu = CPU::fork(initial);
+    cpu->trap_memory_faults = header.flags & TraceTrapMemoryFaults;
+    cpu->output = &capture;
+    start = cpu->instructions_retired();
+    checkpoint_snapshots.assign(checkpoints.size(), nullptr);
+    output.clear();
+    divergence.clear();
+    return true;
+}
+
+static bool get_varint(const std::vector<uint8_t>& bytes, std::size_t& at, uint64_t& value)
+{
+    value = 0;
+    for(int shift = 0; shift < 64 && at < bytes.size(); shift += 7)
+    {
+        uint8_t byte = bytes[at++];
+        value |= uint64_t(byte & 0x7F) << shift;
+        if(!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static uint32_t get_uint32(const uint8_t* bytes)
+{
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (uint32_t(bytes[3]) << 24);
+}
+
+bool TraceReplayer::parse(const std::vector<uint8_t>& events, std::string& error)
+{
+    std::size_t at = 0;
+    uint64_t state_size;
+    if(!get_varint(events, at, state_size) || state_size > events.size() - at)
+    {
+        error = "truncated initial state";
+        return false;
+    }
+    initial = deserialize_snapshot(events.data() + at, state_size, nullptr, error);
+    if(!initial)
+        return false;
+    at += state_size;
+    
+    checkpoints.clear();
+    recorded_output.clear();
+    recorded_halt = false;
+    uint8_t previous[NUM_REGISTERS];
+    memcpy(previous, initial->registers, NUM_REGISTERS);
+    uint64_t position = 0;
+    while(at < events.size() && !recorded_halt)
+    {
+        uint8_t kind = events[at++];
+        uint64_t delta;
+        if(!get_varint(events, at, delta))
+        {
+            error = "truncated event";
+            return false;
+        }
+        position += delta;
+        
+        if(kind == TraceCheckpoint && events.size() - at >= 8 + NUM_REGISTERS)
+        {
+            TraceCheckpointRecord record;
+            record.position = position;
+            record.program_counter = get_uint32(&events[at]);
+            record.stack_address = get_uint32(&events[at + 4]);
+            for(int i = 0; i < NUM_REGISTERS; ++i)
+                record.registers[i] = events[at + 8 + i] ^ previous[i];
+            at += 8 + NUM_REGISTERS;
+            memcpy(previous, record.registers, NUM_REGISTERS);
+            checkpoints.push_back(record);
+        }
+        else if(kind == TraceOutput && at < events.size())
+        {
+            recorded_output.push_back({position, events[at++]});
+        }
+        else if(kind == TraceHalt)
+        {
+            uint64_t value;
+            if(!get_varint(events, at, value))
+            {
+                error = "truncated event";
+                return false;
+            }
+            recorded_halt = true;
+            halt_value = uint32_t(value);
+        }
+        else
+        {
+            error = "bad event at byte " + std::to_string(at);
+            return false;
+        }
+    }
+    end_position = position;
+    return true;
+}
+
+void TraceReplayer::restore(const std::shared_ptr<const Snapshot>& snapshot, uint64_t position)
+{
+    cpu->restore(snapshot);
+    start = cpu->instructions_retired() - position;
+    auto printed = std::upper_bound(recorded_output.begin(), recorded_output.end(), position,
+                                    [](uint64_t position, const TraceOutputRecord& record) { return position < record.position; });
+    output.resize(std::min<std::size_t>(output.size(), printed - recorded_output.begin()));
+}
+
+void TraceReplayer::step()
+{
+#if defined(__unix__)
+    /// run() catches guard page faults itself, step() needs a resume point here.
+    if(cpu->trap_memory_faults)
+    {
+        sigjmp_buf fault_resume;
+        FaultScope fault_scope(cpu->memory, &fault_resume);
+        install_fault_handler();
+        if(sigsetjmp(fault_resume, 0))
+        {
+            cpu->raise_exception(MemoryFault);
+            return;
+        }
+        cpu->step();
+        return;
+    }
+#endif
+    cpu->step();
+}
+
+/// run() can overshoot by one straight-line stretch. If that ever carries it past target, the stretch is redone one
+/// instruction at a time from where this call started.
+void TraceReplayer::advance(uint64_t target)
+{
+    std::shared_ptr<const Snapshot> from = cpu->snapshot();
+    uint64_t from_position = position();
+    while(!cpu->halted && position() + TRACE_STEP_WINDOW < target)
+        cpu->run(target - TRACE_STEP_WINDOW - position());
+    if(position() > target)
+        restore(from, from_position);
+    while(!cpu->halted && position() < target)
+        step();
+}
+
+bool TraceReplayer::seek(uint64_t target)
+{
+    auto after = [](uint64_t position, const TraceCheckpointRecord& record) { return position < record.position; };
+    if(target < position())
+    {
+        /// Checkpoints are passed in order, so every one before the current position has its snapshot.
+        std::size_t passed = std::upper_bound(checkpoints.begin(), checkpoints.end(), target, after) - checkpoints.begin();
+        while(passed && !checkpoint_snapshots[passed - 1])
+            --passed;
+        if(passed)
+            restore(checkpoint_snapshots[passed - 1], checkpoints[passed - 1].position);
+        else
+            restore(initial, 0);
+    }
+    
+    while(!cpu->halted && position() < target)
+    {
+        std::size_t next = std::upper_bound(checkpoints.begin(), checkpoints.end(), position(), after) - checkpoints.begin();
+        if(next == checkpoints.size() || checkpoints[next].position > target)
+        {
+            advance(target);
+            continue;
+        }
+        
+        const TraceCheckpointRecord& record = checkpoints[next];
+        advance(record.position);
+        if(position() != record.position)
+            continue;
+        if(divergence.empty() && (cpu->program_counter != record.program_counter || cpu->stack_address != record.stack_address ||
+                                  memcmp(cpu->registers, record.registers, NUM_REGISTERS) != 0))
+            divergence = "state differs from checkpoint " + std::to_string(next) + " at instruction " + std::to_string(position());
+        checkpoint_snapshots[next] = cpu->snapshot();
+    }
+    
+    /// Past the end of a recording that stopped early there is nothing left to compare with.
+    bool expected = recorded_halt ? position() == end_position && cpu->halt_value == halt_value : position() > end_position;
+    if(cpu->halted && divergence.empty() && !expected)
+        divergence = "halted with " + std::to_string(cpu->halt_value) + " at instruction " + std::to_string(position());
+    return divergence.empty();
+}
+
+void TraceReplayer::Capture::put(uint8_t byte)
+{
+    std::size_t index = replayer.output.size();
+    const std::vector<TraceOutputRecord>& recorded = replayer.recorded_output;
+    if(replayer.divergence.empty() && (index >= recorded.size() || recorded[index].position != replayer.position() ||
+                                       recorded[index].byte != byte))
+        replayer.divergence = "output byte " + std::to_string(index) + " differs at instruction " + std::to_string(replayer.position());
+    replayer.output.push_back(char(byte));
+}
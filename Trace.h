@@ -0,0 +1,183 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include "CPU.h"
+#include "Console.h"
+#include "Snapshot.h"
+
+#define TRACE_MAGIC 0x43525444 /// "DTRC" read as a little-endian uint32_t.
+#define TRACE_VERSION 1
+/// Instructions between register checkpoints, also the longest stretch a backwards seek re-executes.
+#define TRACE_CHECKPOINT_INTERVAL (1 << 22)
+/// Event bytes gathered before a block is compressed and written.
+#define TRACE_BLOCK_SIZE (1 << 16)
+/// Replay hands run() all but this many instructions of a stretch and steps through the rest, since run() only
+/// stops at jumps.
+#define TRACE_STEP_WINDOW 4096
+
+/// On disk layout, all fields little-endian:
+///     TraceFileHeader
+///     blocks of TraceBlockHeader then stored_size bytes, LZ compressed unless stored_size == raw_size
+/// The blocks decompress to one event stream: a varint length and the initial state as serialize_snapshot writes
+/// it, then events. Each event is a TraceEvents byte and the varint count of instructions since the previous event.
+///     TraceCheckpoint: program_counter and stack_address as uint32_t, registers XOR the previous checkpoint's
+///     TraceOutput: the byte printed
+///     TraceHalt: varint halt value, always the last event
+/// Positions count every instruction retired since recording started, predicate skips included.
+struct TraceFileHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint64_t checkpoint_interval;
+};
+
+enum TraceFlags
+{
+    TraceTrapMemoryFaults = 1,
+};
+
+struct TraceBlockHeader
+{
+    uint32_t raw_size;
+    uint32_t stored_size;
+};
+
+static_assert(sizeof(TraceFileHeader) == 16 && sizeof(TraceBlockHeader) == 8, "Trace structures must have no padding.");
+
+/// Guest output is deterministic and only logged so replay can check itself against it. Device inputs get their
+/// own event kinds as devices that take input appear.
+enum TraceEvents
+{
+    TraceCheckpoint = 1,
+    TraceOutput,
+    TraceHalt,
+};
+
+/// Records a CPU's execution so it can be replayed exactly. Only the initial state goes in whole, after that the
+/// log grows by a checkpoint every checkpoint_interval instructions and one event per byte printed.
+class TraceRecorder
+{
+public:
+    TraceRecorder(CPU& cpu, uint64_t checkpoint_interval = TRACE_CHECKPOINT_INTERVAL);
+    /// Closes the trace if still open.
+    ~TraceRecorder();
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+    
+    /// Writes the header and the CPU's current state and starts logging its output. Takes a snapshot, so the CPU's
+    /// dirty tracking starts over.
+    bool open(const char* path, std::string& error);
+    /// CPU::run, stopping every checkpoint_interval instructions to log a checkpoint.
+    uint32_t run(uint64_t instruction_budget = UINT64_MAX);
+    /// Writes out everything logged so far, so a crash of the host loses nothing before this point.
+    bool flush(std::string& error);
+    /// Flushes, puts the CPU's own output device back and closes the file.
+    bool close(std::string& error);
+    
+    inline uint64_t position() const
+    {
+        return cpu.instructions_retired() - start;
+    }
+    
+    uint64_t checkpoint_interval;
+    uint64_t stored_bytes; /// Compressed bytes written so far, headers included.
+    uint64_t raw_bytes; /// Event stream bytes before compression.
+
+private:
+    class Tap : public OutputDevice
+    {
+    public:
+        Tap(TraceRecorder& recorder) : recorder(recorder), next(nullptr) {}
+        void put(uint8_t byte) override;
+        void halt() override;
+        void flush() override;
+        
+        TraceRecorder& recorder;
+        OutputDevice* next;
+    };
+    
+    void event(uint8_t kind);
+    void checkpoint();
+    bool write_block(std::string& error);
+    
+    CPU& cpu;
+    FILE* out;
+    Tap tap;
+    uint64_t start; /// cpu.instructions_retired() when recording began.
+    uint64_t last_event;
+    uint64_t next_checkpoint;
+    uint8_t previous_registers[NUM_REGISTERS];
+    std::vector<uint8_t> buffer;
+    std::vector<uint8_t> compressed;
+    bool failed;
+};
+
+struct TraceCheckpointRecord
+{
+    uint64_t position;
+    uint32_t program_counter;
+    uint32_t stack_address;
+    uint8_t registers[NUM_REGISTERS];
+};
+
+struct TraceOutputRecord
+{
+    uint64_t position;
+    uint8_t byte;
+};
+
+/// Re-executes a recorded trace on a private CPU, checking every checkpoint and printed byte on the way. Checkpoints
+/// passed are kept as snapshots, so seeking backwards restores the nearest one and re-executes at most
+/// checkpoint_interval instructions.
+class TraceReplayer
+{
+public:
+    TraceReplayer();
+    TraceReplayer(const TraceReplayer&) = delete;
+    TraceReplayer& operator=(const TraceReplayer&) = delete;
+    
+    /// Reads the whole trace and puts the CPU in its initial state.
+    bool open(const char* path, std::string& error);
+    /// Moves to exactly target instructions after the start of the recording, or to the halt if that comes first.
+    /// Returns false once the replay no longer matches the recording, see divergence.
+    bool seek(uint64_t target);
+    
+    inline uint64_t position() const
+    {
+        return cpu->instructions_retired() - start;
+    }
+    
+    std::unique_ptr<CPU> cpu; /// Runs without a JIT so stops land on exact instruction counts.
+    uint64_t checkpoint_interval;
+    std::vector<TraceCheckpointRecord> checkpoints;
+    std::vector<TraceOutputRecord> recorded_output;
+    bool recorded_halt; /// False if recording stopped before the guest halted.
+    uint64_t end_position; /// Position of the last event.
+    uint32_t halt_value;
+    std::string output; /// What the guest has printed up to position().
+    std::string divergence; /// First difference from the recording, empty while the replay matches.
+
+private:
+    class Capture : public OutputDevice
+    {
+    public:
+        Capture(TraceReplayer& replayer) : replayer(replayer) {}
+        void put(uint8_t byte) override;
+        
+        TraceReplayer& replayer;
+    };
+    
+    bool parse(const std::vector<uint8_t>& events, std::string& error);
+    void restore(const std::shared_ptr<const Snapshot>& snapshot, uint64_t position);
+    void advance(uint64_t target);
+    void step();
+    
+    Capture capture;
+    uint64_t start; /// cpu->instructions_retired() at position 0.
+    std::shared_ptr<const Snapshot> initial;
+    std::vector<std::shared_ptr<const Snapshot>> checkpoint_snapshots; /// Null until replay first passes the checkpoint.
+};
@@ -0,0 +1,1519 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "CPU.h"
+#include "JIT.h"
+#include "Assembler.h"
+#include "Image.h"
+#include "Console.h"
+#include "Profiler.h"
+#include "Instructions.h"
+#include "Batch.h"
+#include "Lockstep.h"
+#include "Snapshot.h"
+#include "Trace.h"
+#include "Optimizer.h"
+#include "Machine.h"
+#include "FileDevice.h"
+#include "Interrupts.h"
+#include "MemoryTrace.h"
+
+static bool json_output = false;
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// Prints one result line, "section key=value ...". With --json the same line is printed as a JSON object instead,
+/// with the section under "section" and numeric values unquoted.
+static void report(const char* format, ...)
+{
+    char line[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    
+    if(!json_output)
+    {
+        printf("%s\n", line);
+        return;
+    }
+    
+    std::string object = "{\"section\": \"";
+    const char* token = line;
+    const char* end = strchr(token, ' ');
+    object.append(token, end ? end : token + strlen(token));
+    object += '"';
+    while(end)
+    {
+        token = end + 1;
+        end = strchr(token, ' ');
+        std::string field(token, end ? end : token + strlen(token));
+        size_t equals = field.find('=');
+        if(equals == std::string::npos)
+            continue;
+        
+        std::string value = field.substr(equals + 1);
+        char* number_end = nullptr;
+        strtod(value.c_str(), &number_end);
+        bool numeric = !value.empty() && *number_end == '\0';
+        object += ", \"" + field.substr(0, equals) + "\": " + (numeric ? value : "\"" + value + "\"");
+    }
+    printf("%s}\n", object.c_str());
+}
+
+static long peak_rss_kilobytes()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/// Counts $1 down from iterations*256 with a few ALU ops per step, then halts with $10.
+static long file_size(const char* path)
+{
+    struct stat status;
+    return stat(path, &status) == 0 ? long(status.st_size) : -1;
+}
+
+static std::vector<uint64_t> alu_loop_program(uint8_t iterations)
+{
+    return {
+        encode_register_instruction(LoadImmediate, 2, iterations),
+        encode_register_instruction(LoadImmediate, 1, 0),
+        encode_register_instruction(AddRegister, 10, 10, 11),
+        encode_register_instruction(AddRegisterSaveCarry, 12, 13, 10, 11),
+        encode_register_instruction(XorRegister, 14, 12, 10),
+        encode_register_instruction(AddImmediate, 1, 1, 255),
+        encode_immediate_quad_instruction(JumpBackImmediateQuad, 32, 1),
+        encode_register_instruction(AddImmediate, 2, 2, 255),
+        encode_immediate_quad_instruction(JumpBackImmediateQuad, 56, 2),
+        encode_immediate_instruction(HaltRegisterQuad, 0, 0, 0, 10),
+    };
+}
+
+/// Runs the same mix of short and long guests with 1, 2, 4 ... host threads.
+static void benchmark_batch(unsigned jobs_count)
+{
+    std::vector<BatchJob> jobs(jobs_count);
+    for(unsigned i = 0; i < jobs_count; ++i)
+    {
+        /// One in sixteen guests runs 64x longer than the rest.
+        jobs[i].program = alu_loop_program(i % 16 == 0 ? 64 : 1);
+        jobs[i].registers[11] = uint8_t(i);
+    }
+    
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    double single = 0;
+    
+    for(unsigned threads = 1; threads <= max_threads; threads *= 2)
+    {
+        BatchExecutor executor(threads, 1 << 16);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<BatchResult> results = executor.run(jobs);
+        double elapsed = seconds_since(start);
+        
+        uint64_t instructions = 0;
+        for(const BatchResult& result : results)
+            instructions += result.instructions;
+        if(threads == 1)
+            single = elapsed;
+        
+        report("batch threads=%u jobs=%u seconds=%.3f jobs_per_second=%.0f minst_per_second=%.1f speedup=%.2f steals=%llu",
+               threads, jobs_count, elapsed, jobs_count / elapsed, instructions / elapsed / 1e6, single / elapsed,
+               (unsigned long long)executor.steals);
+        
+        if(threads * 2 > max_threads && threads != max_threads)
+            threads = max_threads / 2;
+    }
+}
+
+/// The same program over LOCKSTEP_LANES different inputs, in lockstep and as separate scalar runs.
+static void benchmark_lockstep()
+{
+    std::vector<uint64_t> program = alu_loop_program(64);
+    
+    LockstepGroup group;
+    group.load_program(program, 0);
+    for(unsigned i = 0; i < group.lane_count(); ++i)
+        group.lane(i).registers[11] = uint8_t(i * 7);
+    
+    auto start = std::chrono::steady_clock::now();
+    group.run();
+    double lockstep = seconds_since(start);
+    
+    double scalar = 0;
+    uint64_t instructions = 0;
+    for(unsigned i = 0; i < group.lane_count(); ++i)
+    {
+        CPU cpu;
+        cpu.load_program(program, 0);
+        cpu.registers[11] = uint8_t(i * 7);
+        start = std::chrono::steady_clock::now();
+        cpu.run();
+        scalar += seconds_since(start);
+        instructions += cpu.instructions_retired();
+        
+        if(cpu.halt_value != group.lane(i).halt_value)
+            fprintf(stderr, "lockstep lane %u halted with %u, scalar run with %u\n", i, group.lane(i).halt_value, cpu.halt_value);
+    }
+    
+    report("lockstep lanes=%u guest_instructions=%llu lockstep_seconds=%.3f scalar_seconds=%.3f speedup=%.2f diverged=%u",
+           group.lane_count(), (unsigned long long)instructions, lockstep, scalar, scalar / lockstep, group.diverged_lanes);
+}
+
+/// Assembles a generated source of roughly megabytes MB, with comments, predicates and forward and backward labels.
+static void benchmark_assembler(unsigned megabytes)
+{
+    std::string text;
+    char line[256];
+    unsigned block = 0;
+    for(; text.size() < megabytes * (1u << 20); ++block)
+    {
+        snprintf(line, sizeof(line),
+                 "block_%u: // %u\n"
+                 "    loadi $1, %u\n"
+                 "    addrc $2, $3, $1, $2 ?4\n"
+                 "    xori $5, $5, 0x5A; mulic $6, $7, 'q', $8\n"
+                 "    storemi 0x%X, $6\n"
+                 "    jumpiq block_%u ?9\n"
+                 "    bjumpiq block_%u ?10\n",
+                 block, block, block & 0xFF, block * 16, block + 1, block);
+        text += line;
+    }
+    snprintf(line, sizeof(line), "block_%u: haltiq 0\n", block);
+    text += line;
+    
+    AssembledProgram program;
+    std::string error;
+    auto start = std::chrono::steady_clock::now();
+    bool ok = assemble(text.data(), text.size(), 0, program, error);
+    double elapsed = seconds_since(start);
+    if(!ok)
+        fprintf(stderr, "assembler benchmark failed: %s\n", error.c_str());
+    
+    report("assembler bytes=%zu instructions=%zu labels=%zu seconds=%.3f mb_per_second=%.1f",
+           text.size(), program.code.size(), program.labels.size(), elapsed, text.size() / elapsed / (1 << 20));
+}
+
+/// Time from nothing to the first instruction halting, for a mapped image and for load_program, as the program grows.
+static void benchmark_image()
+{
+    const char* path = "derp_bench.img";
+    for(unsigned megabytes = 1; megabytes <= 64; megabytes *= 4)
+    {
+        std::vector<uint64_t> code((megabytes << 20) / 8, encode_register_instruction(AddImmediate, 1, 1, 1));
+        code[0] = encode_immediate_quad_instruction(HaltImmediateQuad, 0);
+        
+        ProgramImage image;
+        add_code_section(image, code, 0);
+        std::string error;
+        if(!write_image(path, image, error))
+        {
+            fprintf(stderr, "image benchmark failed: %s\n", error.c_str());
+            return;
+        }
+        
+        CPU mapped;
+        auto start = std::chrono::steady_clock::now();
+        if(!load_image(mapped, path, error))
+            fprintf(stderr, "image benchmark failed: %s\n", error.c_str());
+        mapped.run();
+        double image_seconds = seconds_since(start);
+        
+        CPU copied;
+        start = std::chrono::steady_clock::now();
+        copied.load_program(code, 0);
+        copied.run();
+        double copy_seconds = seconds_since(start);
+        
+        report("image megabytes=%u load_image_us=%.1f load_program_us=%.1f", megabytes, image_seconds * 1e6, copy_seconds * 1e6);
+    }
+    remove(path);
+}
+
+/// A VM with megabytes of written memory: snapshot, rollback after a few stores, fork and the delta file, next to
+/// a plain copy of the same memory.
+static void benchmark_snapshot(unsigned megabytes)
+{
+    const char* path = "derp_bench.snap";
+    uint32_t data_address = 1 << 24;
+    uint32_t length = megabytes << 20;
+    CPU cpu;
+    cpu.load_program(alu_loop_program(4), 0);
+    cpu.mark_dirty_range(data_address, length);
+    for(uint32_t i = 0; i < length; i += 64)
+        cpu.memory[data_address + i] = uint8_t(i >> 6);
+    
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<const Snapshot> warm = cpu.snapshot();
+    double snapshot_seconds = seconds_since(start);
+    
+    std::vector<uint8_t> copy(length);
+    start = std::chrono::steady_clock::now();
+    memcpy(copy.data(), cpu.memory + data_address, length);
+    double copy_seconds = seconds_since(start);
+    
+    cpu.run();
+    uint32_t expected = cpu.halt_value;
+    /// Rollback as a fuzzing loop does it, the first round also pays for faulting in the decode cache.
+    double restore_seconds = 0;
+    for(int round = 0; round < 4; ++round)
+    {
+        for(uint32_t i = 0; i < 16; ++i)
+            cpu.store(data_address + i * 65536, 0xFF);
+        start = std::chrono::steady_clock::now();
+        cpu.restore(warm);
+        restore_seconds = seconds_since(start);
+    }
+    
+    const int forks = 16;
+    start = std::chrono::steady_clock::now();
+    std::vector<std::unique_ptr<CPU>> children;
+    for(int i = 0; i < forks; ++i)
+        children.push_back(cpu.fork());
+    double fork_seconds = seconds_since(start) / forks;
+    bool ok = cpu.memory[data_address + 65536] == 0 && children.back()->memory[data_address + 64] == 1;
+    for(std::unique_ptr<CPU>& child : children)
+        ok = child->run() == expected && ok;
+    
+    /// A second snapshot holds only the pages written since the first.
+    cpu.run();
+    for(uint32_t i = 0; i < 16; ++i)
+        cpu.store(data_address + i * 65536, 0xFF);
+    std::shared_ptr<const Snapshot> after = cpu.snapshot();
+    std::string error;
+    long full_bytes = -1, delta_bytes = -1;
+    if(write_snapshot(path, *after, nullptr, error))
+        full_bytes = file_size(path);
+    if(write_snapshot(path, *after, warm.get(), error) && read_snapshot(path, warm, error))
+        delta_bytes = file_size(path);
+    else
+        ok = false;
+    remove(path);
+    
+    report("snapshot megabytes=%u snapshot_us=%.1f memcpy_us=%.1f restore_16_pages_us=%.1f fork_us=%.1f full_file_bytes=%ld "
+           "delta_file_bytes=%ld ok=%d", megabytes, snapshot_seconds * 1e6, copy_seconds * 1e6, restore_seconds * 1e6,
+           fork_seconds * 1e6, full_bytes, delta_bytes, ok);
+}
+
+/// A guest printing lines of 79 characters to /dev/null under each console configuration. Capacity 1 writes every
+/// byte on its own, as the old printf and fflush per character did.
+static void benchmark_console(uint8_t lines_over_256)
+{
+    char source[512];
+    snprintf(source, sizeof(source),
+             "    loadi 3, %u\n"
+             "line: loadi 1, 79\n"
+             "char: prti 'x'\n"
+             "    addi 1 1 255\n"
+             "    bjumpiq char ?1\n"
+             "    prti 10\n"
+             "    addi 2 2 1\n"
+             "    bjumpiq line ?2\n"
+             "    addi 3 3 255\n"
+             "    bjumpiq line ?3\n"
+             "    haltiq 0\n", lines_over_256);
+    AssembledProgram program;
+    std::string error;
+    if(!assemble(source, strlen(source), 0, program, error))
+    {
+        fprintf(stderr, "console benchmark failed: %s\n", error.c_str());
+        return;
+    }
+    
+    int fd = open("/dev/null", O_WRONLY);
+    struct Configuration
+    {
+        const char* name;
+        unsigned policy;
+        bool background;
+        size_t capacity;
+    };
+    const Configuration configurations[] = {
+        {"unbuffered", ConsoleFlushDefault, false, 1},
+        {"newline", ConsoleFlushDefault, false, CONSOLE_BUFFER_SIZE},
+        {"size", ConsoleFlushOnSize | ConsoleFlushOnHalt, false, CONSOLE_BUFFER_SIZE},
+        {"background", ConsoleFlushDefault, true, CONSOLE_BUFFER_SIZE},
+        {"background_timer", ConsoleFlushOnTimer | ConsoleFlushOnHalt, true, CONSOLE_BUFFER_SIZE},
+    };
+    
+    for(const Configuration& configuration : configurations)
+    {
+        ConsoleDevice console(fd, configuration.policy, configuration.background, configuration.capacity);
+        CPU cpu;
+        cpu.output = &console;
+        cpu.load_program(program.code, 0);
+        auto start = std::chrono::steady_clock::now();
+        cpu.run();
+        double elapsed = seconds_since(start);
+        
+        uint64_t bytes = uint64_t(lines_over_256 ? lines_over_256 : 256) * 256 * 80;
+        report("console mode=%s bytes=%llu seconds=%.3f mb_per_second=%.1f host_writes=%llu", configuration.name,
+               (unsigned long long)bytes, elapsed, bytes / elapsed / (1 << 20), (unsigned long long)console.host_writes);
+    }
+    close(fd);
+}
+
+/// The ALU loop with and without a profiler attached. Build with -DDERP_PROFILE to measure the attached case, the
+/// plain build gives the compiled out baseline.
+static void benchmark_profile(unsigned repeats)
+{
+    std::vector<uint64_t> program = alu_loop_program(255);
+    
+    CPU plain;
+    plain.load_program(program, 0);
+    auto start = std::chrono::steady_clock::now();
+    for(unsigned i = 0; i < repeats; ++i)
+    {
+        plain.program_counter = 0;
+        plain.run();
+    }
+    double plain_seconds = seconds_since(start);
+    double minst = plain.instructions_retired() / plain_seconds / 1e6;
+    
+#if defined(DERP_PROFILE)
+    CPU profiled;
+    Profiler profiler;
+    profiled.load_program(program, 0);
+    profiler.attach(profiled);
+    start = std::chrono::steady_clock::now();
+    for(unsigned i = 0; i < repeats; ++i)
+    {
+        profiled.program_counter = 0;
+        profiled.run();
+    }
+    profiler.collect(profiled);
+    double profiled_seconds = seconds_since(start);
+    
+    report("profile compiled_in=1 minst_per_second=%.1f profiled_minst_per_second=%.1f overhead_percent=%.1f stacks=%zu", minst,
+           profiled.instructions_retired() / profiled_seconds / 1e6, (profiled_seconds / plain_seconds - 1) * 100, profiler.stacks.size());
+#else
+    report("profile compiled_in=0 minst_per_second=%.1f", minst);
+#endif
+}
+
+/// Assembles source or reports why not.
+static bool assemble_benchmark(const char* name, const std::string& source, std::vector<uint64_t>& code)
+{
+    AssembledProgram program;
+    std::string error;
+    if(!assemble(source.data(), source.size(), 0, program, error))
+    {
+        fprintf(stderr, "%s: %s\n", name, error.c_str());
+        return false;
+    }
+    code = std::move(program.code);
+    return true;
+}
+
+/// A store into the write-protected code of a loaded image must fault after the page went through a restore, and in a
+/// fork, as it does right after loading.
+static void benchmark_snapshot_read_only()
+{
+    const char* path = "derp_bench.img";
+    std::vector<uint64_t> code;
+    if(!assemble_benchmark("snapshot", "    storemi 0, $1\n    haltiq 7\n", code))
+        return;
+    ProgramImage image;
+    add_code_section(image, code, 0);
+    std::string error;
+    CPU cpu;
+    cpu.trap_memory_faults = true;
+    std::shared_ptr<const Snapshot> empty = cpu.snapshot();
+    if(!write_image(path, image, error) || !load_image(cpu, path, error))
+    {
+        fprintf(stderr, "snapshot benchmark failed: %s\n", error.c_str());
+        remove(path);
+        return;
+    }
+    remove(path);
+    
+    /// Going back to the empty snapshot and forward again rewrites the code page both ways.
+    std::shared_ptr<const Snapshot> loaded = cpu.snapshot();
+    cpu.restore(empty);
+    cpu.restore(loaded);
+    std::unique_ptr<CPU> child = cpu.fork();
+    uint32_t restored = cpu.run();
+    uint32_t forked = child->run();
+    bool ok = restored == UNHANDLED_EXCEPTION_HALT_VALUE && cpu.exception_reason == MemoryFault &&
+              forked == UNHANDLED_EXCEPTION_HALT_VALUE && child->exception_reason == MemoryFault;
+    report("snapshot name=read_only restored_halt=%u forked_halt=%u ok=%d", restored, forked, ok);
+}
+
+/// Runs code to its halt, once interpreted and once with the JIT, and reports rate and cost per instruction.
+/// setup prepares guest memory and registers, expected is the halt value a correct run produces.
+static void run_guest(const char* section, const char* name, const std::vector<uint64_t>& code, void (*setup)(CPU&), uint32_t expected)
+{
+    for(JitModes mode : {JitOff, JitOn})
+    {
+        CPU cpu;
+        JIT jit(mode);
+        if(mode != JitOff)
+            cpu.jit = &jit;
+        cpu.load_program(code, 0);
+        if(setup)
+            setup(cpu);
+        
+        auto start = std::chrono::steady_clock::now();
+        uint32_t result = cpu.run();
+        double elapsed = seconds_since(start);
+        uint64_t instructions = cpu.instructions_retired();
+        
+        report("%s name=%s jit=%d instructions=%llu seconds=%.4f mips=%.1f ns_per_instruction=%.2f halt=%u ok=%d peak_rss_kb=%ld",
+               section, name, mode != JitOff, (unsigned long long)instructions, elapsed, instructions / elapsed / 1e6,
+               elapsed * 1e9 / instructions, result, result == expected, peak_rss_kilobytes());
+    }
+}
+
+/// body repeated 32 times inside a loop of 256 * outer iterations, outer 0 meaning 256. Registers $1, $2 and $250-$255 belong to the loop.
+static std::string micro_loop(const char* prologue, const char* body, unsigned outer)
+{
+    std::string source = prologue;
+    source += "\n    loadi $2, " + std::to_string(outer) + "\n    loadi $1, 0\nloop:\n";
+    for(int i = 0; i < 32; ++i)
+        source += body;
+    source += "    addi $1, $1, 255\n    bjumpiq loop ?1\n    addi $2, $2, 255\n    bjumpiq loop ?2\n    haltiq 0\n";
+    return source;
+}
+
+/// One loop per handler family. Loop overhead is 2 of every 34+ instructions.
+static void benchmark_micro()
+{
+    struct Micro
+    {
+        const char* name;
+        const char* prologue;
+        const char* body;
+    };
+    
+    /// The same work as the vector body, one register at a time.
+    std::string unrolled;
+    for(int i = 0; i < 32; ++i)
+        unrolled += "    addr $" + std::to_string(100 + i) + ", $" + std::to_string(100 + i) + ", $" + std::to_string(140 + i) + "\n";
+    for(int i = 0; i < 32; ++i)
+        unrolled += "    xorr $" + std::to_string(140 + i) + ", $" + std::to_string(140 + i) + ", $" + std::to_string(100 + i) + "\n";
+    
+    const Micro micros[] = {
+        {"alu", "loadi $3, 1",
+         "    addi $4, $4, 3\n    addr $5, $5, $4\n    andr $6, $5, $4\n    xori $7, $6, 0x5A\n    orr $8, $7, $3\n    bcomp $9, $8\n    loadr $10, $9\n"},
+        {"carry", "loadi $3, 7",
+         "    addic $4, $5, $4, 200\n    addrc $6, $7, $6, $4\n    mulic $8, $9, 13, $6\n    mulrc $10, $11, $8, $3\n"},
+        {"divmod", "loadi $3, 7; loadi $4, 250",
+         "    divrr $5, $4, $3\n    modri $6, $4, 9\n    divri $7, $4, 3\n    modir $8, 201, $3\n    divir $9, 199, $3\n    modrr $10, $4, $3\n"},
+        {"memory", "loadi $20, 0; loadi $21, 0x10; loadi $22, 0x20",
+         "    loadmr $20, $21, $22, $1, $4\n    addi $4, $4, 1\n    storemr $20, $21, $22, $1, $4\n    loadmi 0x100000, $5\n    storemi 0x100001, $5\n"},
+        {"stack", "setstkiq 0x200000; loadi $3, 9\n    jumpiq start\nleaf:\n    popstk\nstart:",
+         "    pushstki 2, 1, 2\n    calliq leaf, 1\n    pushstkr 1, $3\n    calliq leaf, 1\n"},
+        {"jump", "",
+         "    jumpiq 8\n    jumpiq 16\n    loadi $3, 1\n    bjumpiq 8 ?0\n"},
+        {"vector", "loadi $140, 3",
+         "    vadd $100, $100, $140, 32\n    vxor $140, $140, $100, 32\n"},
+        {"vector_unrolled", "loadi $140, 3", unrolled.c_str()},
+    };
+    
+    for(const Micro& micro : micros)
+    {
+        std::vector<uint64_t> code;
+        if(assemble_benchmark(micro.name, micro_loop(micro.prologue, micro.body, 0), code))
+            run_guest("micro", micro.name, code, nullptr, 0);
+    }
+}
+
+/// Primes below 32768 with a byte per number at 0x100000. Halts with the count.
+static const char* sieve_source = R"(
+    loadi $20, 0; loadi $21, 0x10; loadi $22, 1
+    loadi $1, 0; loadi $2, 2          // i
+    loadi $10, 0; loadi $11, 0        // count
+next:
+    loadmr $20, $21, $1, $2, $5
+    jumpiq skip ?5
+    addic $11, $6, $11, 1
+    addrc $10, $7, $10, $6
+    addrc $4, $6, $2, $2              // j = i + i
+    addrc $3, $7, $1, $1
+    addrc $3, $7, $3, $6
+mark:
+    andi $5, $3, 0x80
+    jumpiq skip ?5                    // j >= 32768
+    storemr $20, $21, $3, $4, $22
+    addrc $4, $6, $4, $2
+    addrc $3, $7, $3, $1
+    addrc $3, $7, $3, $6
+    bjumpiq mark
+skip:
+    addic $2, $6, $2, 1
+    addrc $1, $7, $1, $6
+    andi $5, $1, 0x80
+    xori $5, $5, 0x80
+    bjumpiq next ?5
+    haltrq $0, $0, $10, $11
+)";
+
+/// A += B 2048 times over 256 byte little-endian numbers at 0x200000 and 0x300000. Halts with A's top and bottom byte.
+static const char* bignum_source = R"(
+    loadi $20, 0; loadi $21, 0x20; loadi $23, 0x30
+    loadi $9, 8; loadi $19, 0
+round:
+    loadi $2, 0; loadi $6, 0
+limb:
+    loadmr $20, $21, $20, $2, $3
+    loadmr $20, $23, $20, $2, $4
+    addrc $3, $7, $3, $4
+    addrc $3, $8, $3, $6
+    orr $6, $7, $8
+    storemr $20, $21, $20, $2, $3
+    addi $2, $2, 1
+    bjumpiq limb ?2
+    addi $19, $19, 1
+    bjumpiq round ?19
+    addi $9, $9, 255
+    bjumpiq round ?9
+    loadi $2, 255
+    loadmr $20, $21, $20, $2, $4
+    loadmr $20, $21, $20, $20, $5
+    haltrq $0, $0, $4, $5
+)";
+
+static void bignum_setup(CPU& cpu)
+{
+    for(int i = 0; i < 256; ++i)
+        cpu.memory[0x300000 + i] = uint8_t(i * 37 + 1);
+}
+
+static uint32_t bignum_expected()
+{
+    uint8_t a[256] = {}, b[256];
+    for(int i = 0; i < 256; ++i)
+        b[i] = uint8_t(i * 37 + 1);
+    for(int round = 0; round < 2048; ++round)
+    {
+        unsigned carry = 0;
+        for(int i = 0; i < 256; ++i)
+        {
+            unsigned sum = a[i] + b[i] + carry;
+            a[i] = uint8_t(sum);
+            carry = sum >> 8;
+        }
+    }
+    return (a[255] << 8) | a[0];
+}
+
+/// memset 64KiB at 0x200000 to the round number, then memcpy it to 0x300000, 16 rounds. Halts with a copied byte.
+static const char* memcpy_source = R"(
+    loadi $20, 0; loadi $21, 0x20; loadi $23, 0x30
+    loadi $9, 16
+round:
+    loadi $1, 0; loadi $2, 0
+set:
+    storemr $20, $21, $1, $2, $9
+    addic $2, $6, $2, 1
+    addrc $1, $7, $1, $6
+    orr $8, $1, $2
+    bjumpiq set ?8
+copy:
+    loadmr $20, $21, $1, $2, $5
+    storemr $20, $23, $1, $2, $5
+    addic $2, $6, $2, 1
+    addrc $1, $7, $1, $6
+    orr $8, $1, $2
+    bjumpiq copy ?8
+    addi $9, $9, 255
+    bjumpiq round ?9
+    loadi $1, 0x12; loadi $2, 0x34
+    loadmr $20, $23, $1, $2, $5
+    haltrq $0, $0, $0, $5
+)";
+
+/// memcpy_source with the block instructions.
+static const char* block_copy_source = R"(
+    loadi $20, 0; loadi $21, 0x20; loadi $22, 0; loadi $23, 0    // 0x200000
+    loadi $24, 0; loadi $25, 0x30; loadi $26, 0; loadi $27, 0    // 0x300000
+    loadi $28, 0; loadi $29, 1; loadi $30, 0; loadi $31, 0       // 64KiB
+    loadi $9, 16
+round:
+    fillmr $20, $28, $9
+    copymr $24, $20, $28
+    addi $9, $9, 255
+    bjumpiq round ?9
+    loadi $1, 0x12; loadi $2, 0x34
+    loadmr $24, $25, $1, $2, $5
+    haltrq $0, $0, $0, $5
+)";
+
+/// Bubble sort of 256 bytes at 0x400000. Halts with the smallest and largest byte, in place.
+static const char* bubble_sort_source = R"(
+    loadi $20, 0; loadi $24, 0x40
+    loadi $30, 255
+pass:
+    loadi $2, 0
+inner:
+    addi $5, $2, 1
+    loadmr $20, $24, $20, $2, $3
+    loadmr $20, $24, $20, $5, $4
+    bcomp $10, $3
+    addic $11, $12, $10, 1
+    addrc $11, $13, $4, $11
+    orr $14, $12, $13                 // arr[j+1] >= arr[j]
+    jumpiq ordered ?14
+    storemr $20, $24, $20, $2, $4
+    storemr $20, $24, $20, $5, $3
+ordered:
+    loadr $2, $5
+    xori $15, $2, 255
+    bjumpiq inner ?15
+    addi $30, $30, 255
+    bjumpiq pass ?30
+    loadi $2, 255
+    loadmr $20, $24, $20, $20, $3
+    loadmr $20, $24, $20, $2, $4
+    haltrq $0, $0, $3, $4
+)";
+
+static void bubble_sort_setup(CPU& cpu)
+{
+    uint32_t state = 12345;
+    for(int i = 0; i < 256; ++i)
+    {
+        state = state * 1103515245 + 12345;
+        cpu.memory[0x400000 + i] = uint8_t(state >> 16);
+    }
+}
+
+static uint32_t bubble_sort_expected()
+{
+    uint8_t values[256];
+    uint32_t state = 12345;
+    for(int i = 0; i < 256; ++i)
+    {
+        state = state * 1103515245 + 12345;
+        values[i] = uint8_t(state >> 16);
+    }
+    return (*std::min_element(values, values + 256) << 8) | *std::max_element(values, values + 256);
+}
+
+/// Fibonacci(65536) mod 2^32 in four byte registers. Halts with the result.
+static const char* fibonacci_source = R"(
+    loadi $47, 1                      // a = $40-$43 = 0, b = $44-$47 = 1, big-endian
+    loadi $1, 0; loadi $9, 0
+step:
+    addrc $53, $6, $43, $47
+    addrc $52, $7, $42, $46
+    addrc $52, $8, $52, $6
+    orr $6, $7, $8
+    addrc $51, $7, $41, $45
+    addrc $51, $8, $51, $6
+    orr $6, $7, $8
+    addrc $50, $7, $40, $44
+    addrc $50, $8, $50, $6
+    loadr $40, $44; loadr $41, $45; loadr $42, $46; loadr $43, $47
+    loadr $44, $50; loadr $45, $51; loadr $46, $52; loadr $47, $53
+    addi $1, $1, 255
+    bjumpiq step ?1
+    addi $9, $9, 255
+    bjumpiq step ?9
+    haltrq $40, $41, $42, $43
+)";
+
+/// fibonacci_source with the wide instructions, a shift by 0 moves a group.
+static const char* fibonacci_wide_source = R"(
+    loadi $47, 1
+    loadi $1, 0; loadi $9, 0
+step:
+    add32 $50, $40, $44
+    shl32 $40, $44, 0
+    shl32 $44, $50, 0
+    addi $1, $1, 255
+    bjumpiq step ?1
+    addi $9, $9, 255
+    bjumpiq step ?9
+    haltrq $40, $41, $42, $43
+)";
+
+static uint32_t fibonacci_expected()
+{
+    uint32_t a = 0, b = 1;
+    for(int i = 0; i < 65536; ++i)
+    {
+        uint32_t c = a + b;
+        a = b;
+        b = c;
+    }
+    return a;
+}
+
+/// Fibonacci(25) by naive recursion, adding the leaves into $40-$43. fib keeps $3. Halts with the sum.
+static const char* recursion_source = R"(
+    setstkiq 0x200000
+    loadi $3, 25
+    calliq fib, 0
+    haltrq $40, $41, $42, $43
+fib:
+    andi $5, $3, 0xFE
+    jumpiq recurse ?5
+    loadr $47, $3
+    add32 $40, $40, $44
+    popstk
+recurse:
+    addi $3, $3, 255
+    calliq fib, 0
+    addi $3, $3, 255
+    calliq fib, 0
+    addi $3, $3, 2
+    popstk
+)";
+
+struct GuestProgram
+{
+    const char* name;
+    const char* source;
+    void (*setup)(CPU&);
+    uint32_t expected;
+};
+
+static std::vector<GuestProgram> guest_programs()
+{
+    return {
+        {"sieve", sieve_source, nullptr, 3512},
+        {"bignum_add", bignum_source, bignum_setup, bignum_expected()},
+        {"memcpy_memset", memcpy_source, nullptr, 1},
+        {"block_copy", block_copy_source, nullptr, 1},
+        {"bubble_sort", bubble_sort_source, bubble_sort_setup, bubble_sort_expected()},
+        {"fibonacci", fibonacci_source, nullptr, fibonacci_expected()},
+        {"fibonacci_wide", fibonacci_wide_source, nullptr, fibonacci_expected()},
+        {"recursion", recursion_source, nullptr, 75025},
+    };
+}
+
+static void benchmark_programs()
+{
+    for(const GuestProgram& program : guest_programs())
+    {
+        std::vector<uint64_t> code;
+        if(assemble_benchmark(program.name, program.source, code))
+            run_guest("program", program.name, code, program.setup, program.expected);
+    }
+}
+
+/// Each program interpreted without and then with superinstructions, best of 3 runs.
+static void benchmark_superinstructions()
+{
+    for(const GuestProgram& program : guest_programs())
+    {
+        std::vector<uint64_t> code;
+        if(!assemble_benchmark(program.name, program.source, code))
+            continue;
+        
+        double seconds[2] = {1e9, 1e9};
+        uint64_t instructions = 0;
+        bool ok = true;
+        for(int fused = 0; fused < 2; ++fused)
+        {
+            for(int run = 0; run < 3; ++run)
+            {
+                CPU cpu;
+                cpu.superinstructions = fused;
+                cpu.load_program(code, 0);
+                if(program.setup)
+                    program.setup(cpu);
+                
+                auto start = std::chrono::steady_clock::now();
+                uint32_t result = cpu.run();
+                seconds[fused] = std::min(seconds[fused], seconds_since(start));
+                instructions = cpu.instructions_retired();
+                ok = ok && result == program.expected;
+            }
+        }
+        
+        report("superinstructions name=%s instructions=%llu seconds_plain=%.4f seconds_fused=%.4f mips_plain=%.1f mips_fused=%.1f speedup=%.2f ok=%d",
+               program.name, (unsigned long long)instructions, seconds[0], seconds[1], instructions / seconds[0] / 1e6,
+               instructions / seconds[1] / 1e6, seconds[0] / seconds[1], ok);
+    }
+}
+
+/// The kind of code a naive code generator emits: constants loaded and then adjusted, copies through temporaries,
+/// flags that are always set and jumps to jumps. Halts with the checksum of a 2^16 iteration loop.
+static const char* redundant_source = R"(
+    loadi $1, 0; loadi $2, 0; loadi $30, 1
+loop:
+    loadi $3, 3
+    addi $3, $3, 4                    // $3 = 7
+    loadr $4, $3
+    loadr $4, $4
+    mulr $5, $10, $4                  // $10 * 7
+    loadi $6, 0
+    addr $5, $5, $6
+    xori $5, $5, 0
+    addr $10, $5, $30
+    loadi $7, 1
+    jumpiq keep ?$7
+    loadi $10, 0
+keep:
+    loadi $8, 0x5A
+    loadi $8, 0x5A
+    xorr $11, $11, $10
+    jumpiq next
+next:
+    addi $1, $1, 255
+    jumpiq continue
+continue:
+    jumpiq test
+test:
+    bjumpiq loop ?1
+    addi $2, $2, 255
+    bjumpiq loop ?2
+    haltrq $0, $0, $10, $11
+)";
+
+static uint32_t redundant_expected()
+{
+    uint8_t a = 0, checksum = 0;
+    for(int i = 0; i < 65536; ++i)
+    {
+        a = uint8_t(a * 7 + 1);
+        checksum ^= a;
+    }
+    return (a << 8) | checksum;
+}
+
+/// Static and dynamic instruction counts and interpreter time of each program as written and as optimized.
+static void benchmark_optimizer()
+{
+    std::vector<GuestProgram> programs = guest_programs();
+    programs.push_back({"redundant", redundant_source, nullptr, redundant_expected()});
+    
+    for(const GuestProgram& program : programs)
+    {
+        std::vector<uint64_t> code;
+        if(!assemble_benchmark(program.name, program.source, code))
+            continue;
+        std::vector<uint64_t> optimized = code;
+        uint32_t entry = 0;
+        OptimizerReport optimizer_report;
+        std::string error;
+        auto start = std::chrono::steady_clock::now();
+        if(!optimize_program(optimized, 0, entry, optimizer_report, error))
+        {
+            fprintf(stderr, "%s: %s\n", program.name, error.c_str());
+            continue;
+        }
+        double optimize_seconds = seconds_since(start);
+        
+        uint64_t instructions[2];
+        double seconds[2];
+        bool ok = true;
+        for(int i = 0; i < 2; ++i)
+        {
+            CPU cpu;
+            cpu.load_program(i ? optimized : code, 0);
+            cpu.program_counter = i ? entry : 0;
+            if(program.setup)
+                program.setup(cpu);
+            start = std::chrono::steady_clock::now();
+            ok &= cpu.run() == program.expected;
+            seconds[i] = seconds_since(start);
+            instructions[i] = cpu.instructions_retired();
+        }
+        
+        report("optimizer name=%s static_before=%zu static_after=%zu optimize_us=%.1f instructions_before=%llu instructions_after=%llu "
+               "removed_percent=%.1f seconds_before=%.4f seconds_after=%.4f ok=%d", program.name, optimizer_report.instructions_before,
+               optimizer_report.instructions_after, optimize_seconds * 1e6, (unsigned long long)instructions[0],
+               (unsigned long long)instructions[1], 100.0 * (instructions[0] - instructions[1]) / instructions[0], seconds[0], seconds[1], ok);
+    }
+}
+
+static const char* trace_source = R"(
+    loadi 3, 64
+outer: loadi 2, 0
+middle: loadi 1, 0
+inner: addr 10 10 11
+    addrc 12 13 10 11
+    xorr 14 12 10
+    addi 1 1 255
+    bjumpiq inner ?1
+    prtr 14
+    addi 2 2 255
+    bjumpiq middle ?2
+    addi 3 3 255
+    bjumpiq outer ?3
+    haltrq 0 0 0 10
+)";
+
+/// One guest run plain and under a TraceRecorder at the default and at a short checkpoint interval, then the last
+/// trace replayed to the end, back to the middle and forward again.
+static void benchmark_trace()
+{
+    std::vector<uint64_t> code;
+    if(!assemble_benchmark("trace", trace_source, code))
+        return;
+    const char* path = "derp_bench.trace";
+    int fd = open("/dev/null", O_WRONLY);
+    std::string error;
+    
+    for(JitModes mode : {JitOff, JitOn})
+    {
+        double plain_seconds = 0;
+        uint32_t plain_result = 0;
+        for(uint64_t interval : {uint64_t(0), uint64_t(TRACE_CHECKPOINT_INTERVAL), uint64_t(1) << 16})
+        {
+            CPU cpu;
+            JIT jit(mode);
+            if(mode != JitOff)
+                cpu.jit = &jit;
+            ConsoleDevice console(fd);
+            cpu.output = &console;
+            cpu.load_program(code, 0);
+            cpu.registers[11] = 3;
+            TraceRecorder recorder(cpu, interval ? interval : TRACE_CHECKPOINT_INTERVAL);
+            
+            auto start = std::chrono::steady_clock::now();
+            if(interval && !recorder.open(path, error))
+            {
+                fprintf(stderr, "trace benchmark failed: %s\n", error.c_str());
+                return;
+            }
+            uint32_t result = interval ? recorder.run() : cpu.run();
+            if(interval && !recorder.close(error))
+                fprintf(stderr, "trace benchmark failed: %s\n", error.c_str());
+            double elapsed = seconds_since(start);
+            if(!interval)
+            {
+                plain_seconds = elapsed;
+                plain_result = result;
+            }
+            
+            report("trace jit=%d checkpoint_interval=%llu instructions=%llu seconds=%.4f overhead_percent=%.1f trace_bytes=%llu "
+                   "event_bytes=%llu ok=%d", mode != JitOff, (unsigned long long)interval, (unsigned long long)cpu.instructions_retired(),
+                   elapsed, (elapsed / plain_seconds - 1) * 100, (unsigned long long)recorder.stored_bytes,
+                   (unsigned long long)recorder.raw_bytes, result == plain_result);
+        }
+    }
+    close(fd);
+    
+    TraceReplayer replayer;
+    auto start = std::chrono::steady_clock::now();
+    bool ok = replayer.open(path, error);
+    double open_seconds = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    ok = ok && replayer.seek(UINT64_MAX);
+    double end_seconds = seconds_since(start);
+    uint64_t length = replayer.position();
+    start = std::chrono::steady_clock::now();
+    ok = ok && replayer.seek(length / 2 + 12345);
+    double back_seconds = seconds_since(start);
+    ok = ok && replayer.seek(UINT64_MAX) && replayer.output.size() == replayer.recorded_output.size();
+    remove(path);
+    
+    report("replay open_ms=%.2f seek_end_ms=%.2f seek_back_ms=%.3f checkpoints=%zu ok=%d", open_seconds * 1e3, end_seconds * 1e3,
+           back_seconds * 1e3, replayer.checkpoints.size(), ok);
+}
+
+/// Hart 0 spawns harts - 1 more at work, and after its own share joins them all and halts with the quad at 0x100000.
+static std::string hart_program(unsigned harts, const char* work)
+{
+    std::string source;
+    for(unsigned i = 1; i < harts; ++i)
+        source += "    spawniq work, $200\n";
+    source += "work:\n";
+    source += work;
+    source += "    hartr $6\n    haltiq 0 ?6\n";
+    for(unsigned i = 1; i < harts; ++i)
+        source += "    loadi $80, " + std::to_string(i) + "\n    joinr $80, $90\n";
+    source += "    loadmi 0x100000, $60; loadmi 0x100001, $61; loadmi 0x100002, $62; loadmi 0x100003, $63\n"
+              "    haltrq $60, $61, $62, $63\n";
+    return source;
+}
+
+/// Every hart sums its own 64 KiB at 0x200000 + 64 KiB * hart id 16 times, then adds the sum in with one faddmrq.
+static const char* parallel_sum_work = R"(
+    hartr $6
+    loadi $20, 0; addi $21, $6, 0x20
+    loadi $40, 0; loadi $41, 0; loadi $42, 0; loadi $43, 0; loadi $44, 0; loadi $45, 0; loadi $46, 0
+    loadi $3, 16
+pass:
+    loadi $22, 0; loadi $23, 0; loadi $1, 0; loadi $2, 0
+byte:
+    loadmr $20, $21, $22, $23, $47
+    add32 $40, $40, $44
+    inc16 $22, 1
+    addi $1, $1, 255
+    bjumpiq byte ?1
+    addi $2, $2, 255
+    bjumpiq byte ?2
+    addi $3, $3, 255
+    bjumpiq pass ?3
+    loadi $30, 0; loadi $31, 0x10; loadi $32, 0; loadi $33, 0
+    faddmrq $30, $40, $50
+)";
+
+/// Every hart takes a casmr spin lock at 0x100010 16384 times to bump the quad at 0x100000 with plain loads and stores.
+static const char* lock_contention_work = R"(
+    loadi $20, 0; loadi $21, 0x10; loadi $22, 0; loadi $23, 0x10
+    loadi $0, 0; loadi $3, 1
+    loadi $1, 0; loadi $2, 64
+acquire:
+    casmr $20, $0, $3, $4
+    bjumpiq acquire ?4
+    loadmi 0x100000, $10; loadmi 0x100001, $11; loadmi 0x100002, $12; loadmi 0x100003, $13
+    inc32 $10, 1
+    storemi 0x100000, $10; storemi 0x100001, $11; storemi 0x100002, $12; storemi 0x100003, $13
+    fence
+    storemi 0x100010, $0
+    addi $1, $1, 255
+    bjumpiq acquire ?1
+    addi $2, $2, 255
+    bjumpiq acquire ?2
+)";
+
+/// Parallel sum and a contended lock with 1, 2, 4 ... harts up to the host cores. Every hart does the same work, so
+/// speedup is the work done per second over the one hart run; spinning on the lock counts as instructions, not work.
+static void benchmark_harts()
+{
+    unsigned max_harts = std::min(std::max(1u, std::thread::hardware_concurrency()), unsigned(MACHINE_MAX_HARTS));
+    for(int program = 0; program < 2; ++program)
+    {
+        const char* name = program == 0 ? "parallel_sum" : "lock_contention";
+        double single = 0;
+        for(unsigned harts = 1; harts <= max_harts; harts *= 2)
+        {
+            std::vector<uint64_t> code;
+            if(!assemble_benchmark(name, hart_program(harts, program == 0 ? parallel_sum_work : lock_contention_work), code))
+                return;
+            
+            CPU cpu;
+            cpu.load_program(code, 0);
+            uint32_t expected = 0;
+            for(uint32_t i = 0; program == 0 && i < harts << 16; ++i)
+            {
+                cpu.memory[0x200000 + i] = uint8_t(i * 7 + (i >> 16));
+                expected += 16 * cpu.memory[0x200000 + i];
+            }
+            if(program == 1)
+                expected = harts * 16384;
+            
+            Machine machine(cpu);
+            auto start = std::chrono::steady_clock::now();
+            uint32_t result = machine.run();
+            double elapsed = seconds_since(start);
+            uint64_t instructions = cpu.instructions_retired();
+            for(unsigned i = 1; i < machine.hart_count(); ++i)
+                instructions += machine.hart(i).instructions_retired();
+            double rate = instructions / elapsed / 1e6;
+            if(harts == 1)
+                single = elapsed;
+            
+            report("harts name=%s harts=%u instructions=%llu seconds=%.4f minst_per_second=%.1f speedup=%.2f halt=%u ok=%d", name, harts,
+                   (unsigned long long)instructions, elapsed, rate, harts * single / elapsed, result, result == expected);
+            
+            if(harts * 2 > max_harts && harts != max_harts)
+                harts = max_harts / 2;
+        }
+    }
+}
+
+/// Xors every byte of a window of 2^window_bits bytes at 0x10000000 into $6, laps times over, one loadmr per byte.
+static std::string file_scan_program(unsigned window_bits, unsigned laps)
+{
+    /// The address quad is $20-$23, the window is left when bit window_bits comes on.
+    std::string wrap = "$" + std::to_string(23 - window_bits / 8);
+    unsigned bit = 1u << (window_bits % 8);
+    return "    loadi $20, 0x10; loadi $21, 0; loadi $22, 0; loadi $23, 0; loadi $6, 0; loadi $8, 0\n"
+           "loop:\n"
+           "    loadmr $20, $21, $22, $23, $5\n"
+           "    xorr $6, $6, $5\n"
+           "    inc32 $20, 1\n"
+           "    andi $7, " + wrap + ", " + std::to_string(bit) + "\n"
+           "    andi " + wrap + ", " + wrap + ", " + std::to_string(255 - bit) + " ?7\n"
+           "    addi $8, $8, 1 ?7\n"
+           "    xori $9, $8, " + std::to_string(laps) + "\n"
+           "    bjumpiq loop ?9\n"
+           "    haltrq $0, $0, $0, $6\n";
+}
+
+/// A guest scanning a file of megabytes MB, copied into memory by hand, mapped with map_file and streamed through a
+/// 1 MB window. setup_ms is the time before the first instruction, the scan pays for the page-ins.
+static void benchmark_files(unsigned megabytes)
+{
+    const char* path = "derp_bench.dat";
+    uint64_t size = uint64_t(megabytes) << 20;
+    std::vector<uint8_t> data(size);
+    uint8_t expected = 0;
+    for(uint64_t i = 0; i < size; ++i)
+    {
+        data[i] = uint8_t(i * 2654435761u >> 11);
+        expected ^= data[i];
+    }
+    FILE* out = fopen(path, "wb");
+    if(!out || fwrite(data.data(), 1, size, out) != size)
+    {
+        fprintf(stderr, "file benchmark could not write %s\n", path);
+        if(out)
+            fclose(out);
+        return;
+    }
+    fclose(out);
+    
+    unsigned size_bits = __builtin_ctzll(size);
+    for(const char* mode : {"copy", "map", "stream"})
+    {
+        bool stream = strcmp(mode, "stream") == 0;
+        std::vector<uint64_t> code;
+        if(!assemble_benchmark("files", stream ? file_scan_program(20, megabytes) : file_scan_program(size_bits, 1), code))
+            return;
+        
+        CPU cpu;
+        cpu.load_program(code, 0);
+        FileStream window;
+        std::string error;
+        uint64_t mapped_size = 0;
+        bool ok = true;
+        auto start = std::chrono::steady_clock::now();
+        if(stream)
+        {
+            ok = window.open(cpu, path, 0x10000000, 1 << 20, FileReadOnly, error);
+        }
+        else if(strcmp(mode, "map") == 0)
+        {
+            ok = map_file(cpu, path, 0x10000000, FileReadOnly, mapped_size, error);
+        }
+        else
+        {
+            FILE* in = fopen(path, "rb");
+            ok = in && fread(cpu.memory + 0x10000000, 1, size, in) == size;
+            if(in)
+                fclose(in);
+            cpu.mark_dirty_range(0x10000000, uint32_t(size));
+        }
+        double setup = seconds_since(start);
+        if(!ok)
+        {
+            fprintf(stderr, "file benchmark %s failed: %s\n", mode, error.c_str());
+            continue;
+        }
+        
+        start = std::chrono::steady_clock::now();
+        uint32_t result = cpu.run();
+        double scan = seconds_since(start);
+        report("files mode=%s megabytes=%u setup_ms=%.3f scan_seconds=%.3f mb_per_second=%.1f page_ins=%llu ok=%d", mode, megabytes,
+               setup * 1e3, scan, size / scan / (1 << 20), (unsigned long long)window.page_ins.load(), result == expected);
+    }
+    remove(path);
+}
+
+/// The cost of the safe point polls: the alu micro loop with no timer, then with timer interrupts every interval
+/// instructions entering a handler that counts them and returns. The chain loop does the same work split over two
+/// blocks, which compiled code runs back to back, and should take one interrupt per interval like the interpreter.
+/// Then how long a spinning guest takes to hand control back after a host thread preempts it, with and without the
+/// JIT, the way --timeout stops it, spinning in one block and in two. Also checks that a fault inside the handler
+/// halts as a double fault.
+static void benchmark_interrupts()
+{
+    const char* handler = "setihriq handler; jumpiq start\nhandler:\n    inc16 $10, 1\n    reti\nstart:";
+    const char* body = "    addi $4, $4, 3\n    addr $5, $5, $4\n    xori $7, $5, 0x5A\n";
+    std::string chain = std::string(handler) + "\n    loadi $2, 0\n    loadi $1, 0\nloop:\n";
+    for(int i = 0; i < 32; ++i)
+        chain += std::string(body) + (i == 15 ? "    jumpiq second\nsecond:\n" : "");
+    chain += "    addi $1, $1, 255\n    bjumpiq loop ?1\n    addi $2, $2, 255\n    bjumpiq loop ?2\n    haltiq 0\n";
+    
+    struct Program
+    {
+        const char* name;
+        std::string source;
+    };
+    
+    for(const Program& program : {Program{"timer", micro_loop(handler, body, 0)}, Program{"timer_chain", chain}})
+    {
+        std::vector<uint64_t> code;
+        if(!assemble_benchmark("interrupts", program.source, code))
+            return;
+        for(JitModes mode : {JitOff, JitOn})
+        {
+            for(uint64_t interval : {uint64_t(0), uint64_t(100000), uint64_t(10000), uint64_t(1000)})
+            {
+                double seconds = 1e9;
+                uint64_t instructions = 0;
+                unsigned interrupts = 0;
+                for(int run = 0; run < 3; ++run)
+                {
+                    CPU cpu;
+                    JIT jit(mode);
+                    if(mode != JitOff)
+                        cpu.jit = &jit;
+                    cpu.load_program(code, 0);
+                    cpu.set_timer(interval);
+                    
+                    auto start = std::chrono::steady_clock::now();
+                    cpu.run();
+                    seconds = std::min(seconds, seconds_since(start));
+                    instructions = cpu.instructions_retired();
+                    interrupts = cpu.registers[10] << 8 | cpu.registers[11];
+                }
+                /// One per interval passed, but for the last one when the program halts before the next safe point.
+                uint64_t expected = interval ? instructions / interval : 0;
+                bool ok = interrupts <= expected && interrupts + 1 >= expected;
+                report("interrupts name=%s jit=%d interval=%llu instructions=%llu seconds=%.4f mips=%.1f interrupts=%u expected=%llu ok=%d",
+                       program.name, mode != JitOff, (unsigned long long)interval, (unsigned long long)instructions, seconds,
+                       instructions / seconds / 1e6, interrupts, (unsigned long long)expected, ok);
+            }
+        }
+        
+        /// One run at interval 1000 in each JIT mode. Compiled code stops at the same safe points as the interpreter and
+        /// verification steps the interpreter through every compiled block, neither may change what the guest sees.
+        const JitModes modes[] = {JitOff, JitOn, JitVerify};
+        uint64_t instructions[3];
+        unsigned interrupts[3];
+        for(int i = 0; i < 3; ++i)
+        {
+            CPU cpu;
+            JIT jit(modes[i]);
+            if(modes[i] != JitOff)
+                cpu.jit = &jit;
+            cpu.load_program(code, 0);
+            cpu.set_timer(1000);
+            cpu.run();
+            instructions[i] = cpu.instructions_retired();
+            interrupts[i] = cpu.registers[10] << 8 | cpu.registers[11];
+        }
+        bool ok = interrupts[1] == interrupts[0] && interrupts[2] == interrupts[0] && instructions[1] == instructions[0] &&
+                  instructions[2] == instructions[0];
+        report("interrupts name=%s_modes interval=1000 interrupts_off=%u interrupts_jit=%u interrupts_verify=%u ok=%d",
+               program.name, interrupts[0], interrupts[1], interrupts[2], ok);
+    }
+    
+    /// A division by zero whose handler divides by zero at its second instruction. The second fault halts rather than
+    /// entering the handler again, and leaves the first one's return address.
+    {
+        std::vector<uint64_t> code;
+        if(!assemble_benchmark("interrupts", "    setihriq handler\n    jumpiq start\nhandler:\n    addi $5, $5, 1\n"
+                                             "    divrr $6, $7, $8\n    reti 1\nstart:\n    divrr $1, $2, $3\n    haltiq 2\n", code))
+            return;
+        CPU cpu;
+        cpu.load_program(code, 0);
+        uint32_t result = cpu.run(1 << 20);
+        bool ok = cpu.halted && result == UNHANDLED_EXCEPTION_HALT_VALUE && cpu.exception_reason == DivideByZero &&
+                  cpu.errored_program_counter == 5 * 8 && cpu.registers[5] == 1;
+        report("interrupts name=double_fault halted=%d halt=%u errored_program_counter=%u handler_entries=%u ok=%d", cpu.halted,
+               result, cpu.errored_program_counter, cpu.registers[5], ok);
+    }
+    
+    std::string spin_chain = "spin:\n";
+    for(int i = 0; i < 2 * JIT_MIN_BLOCK_INSTRUCTIONS; ++i)
+        spin_chain += i == JIT_MIN_BLOCK_INSTRUCTIONS ? "    jumpiq next\nnext:\n    addi $1, $1, 1\n" : "    addi $1, $1, 1\n";
+    spin_chain += "    bjumpiq spin\n";
+    for(const Program& program : {Program{"preempt", "spin:\n    addi $1, $1, 1\n    bjumpiq spin\n"}, Program{"preempt_chain", spin_chain}})
+    {
+        std::vector<uint64_t> code;
+        if(!assemble_benchmark("interrupts", program.source, code))
+            return;
+        for(JitModes mode : {JitOff, JitOn})
+        {
+            const int samples = 50;
+            /// Far more than a millisecond of spinning, so a run that ignores the preempt ends at the budget instead.
+            const uint64_t budget = 1ull << 28;
+            double total = 0, worst = 0;
+            bool ok = true;
+            CPU cpu;
+            JIT jit(mode);
+            if(mode != JitOff)
+                cpu.jit = &jit;
+            cpu.load_program(code, 0);
+            for(int sample = 0; sample < samples; ++sample)
+            {
+                std::atomic<int64_t> requested(0);
+                std::thread host([&]
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    requested = std::chrono::steady_clock::now().time_since_epoch().count();
+                    cpu.preempt();
+                });
+                uint64_t before = cpu.instructions_retired();
+                cpu.run(budget);
+                int64_t returned = std::chrono::steady_clock::now().time_since_epoch().count();
+                host.join();
+                ok = ok && cpu.instructions_retired() - before < budget;
+                double latency = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::duration(returned - requested)).count();
+                total += latency;
+                worst = std::max(worst, latency);
+            }
+            report("interrupts name=%s jit=%d samples=%d mean_latency_us=%.2f max_latency_us=%.2f ok=%d", program.name,
+                   mode != JitOff, samples, total / samples, worst, ok);
+        }
+    }
+}
+
+/// The memcpy program interpreted with no tracer attached, then tracing every access, 1 in 64 and 1 in 4096, best of 3
+/// runs each. Build with -DDERP_TRACE_MEMORY to measure the traced cases, the plain build gives the compiled out
+/// baseline.
+static void benchmark_memory_trace()
+{
+    std::vector<uint64_t> code;
+    if(!assemble_benchmark("memory", memcpy_source, code))
+        return;
+#if defined(DERP_TRACE_MEMORY)
+    const bool compiled_in = true;
+#else
+    const bool compiled_in = false;
+#endif
+    double untraced_seconds = 0;
+    for(uint32_t period : {0u, 1u, 64u, 4096u})
+    {
+        if(period && !compiled_in)
+            break;
+        double seconds = 1e9;
+        uint64_t instructions = 0, recorded = 0;
+        double miss_rate = 0;
+        for(int run = 0; run < 3; ++run)
+        {
+            CPU cpu;
+            MemoryTracer tracer(period);
+            tracer.add_default_caches();
+            cpu.load_program(code, 0);
+            if(period)
+                tracer.attach(cpu);
+            
+            auto start = std::chrono::steady_clock::now();
+            cpu.run();
+            seconds = std::min(seconds, seconds_since(start));
+            tracer.collect(cpu);
+            instructions = cpu.instructions_retired();
+            recorded = tracer.accesses[MemoryRead] + tracer.accesses[MemoryWrite] + tracer.accesses[MemoryExecute];
+            const CacheSimulator& l1d = tracer.caches[1];
+            uint64_t lookups = l1d.accesses[MemoryRead] + l1d.accesses[MemoryWrite];
+            miss_rate = lookups ? double(l1d.misses[MemoryRead] + l1d.misses[MemoryWrite]) / lookups : 0;
+        }
+        if(!period)
+            untraced_seconds = seconds;
+        report("memory compiled_in=%d sample_period=%u instructions=%llu seconds=%.4f mips=%.1f overhead_percent=%.1f recorded=%llu "
+               "l1d_miss_rate=%.4f", compiled_in, period, (unsigned long long)instructions, seconds, instructions / seconds / 1e6,
+               (seconds / untraced_seconds - 1) * 100, (unsigned long long)recorded, miss_rate);
+    }
+}
+
+/// The decoder and the programs without a setup on one configuration, interpreted, best of 3 runs. Every
+/// configuration decodes the same encoding, so their decode rates should match and the program rates differ only
+/// through memory and decode cache size.
+template<class Config>
+static void benchmark_config(const char* config)
+{
+    std::vector<uint64_t> words;
+    for(const GuestProgram& program : guest_programs())
+    {
+        std::vector<uint64_t> code;
+        if(assemble_benchmark(program.name, program.source, code))
+            words.insert(words.end(), code.begin(), code.end());
+    }
+    
+    const unsigned repeats = 1 << 16;
+    DecodedInstruction inst;
+    uint64_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(unsigned repeat = 0; repeat < repeats; ++repeat)
+    {
+        for(uint64_t word : words)
+        {
+            decode_instruction<typename Config::Encoding>(word, inst);
+            checksum += inst.dispatch + inst.quad + inst.val5;
+        }
+    }
+    double elapsed = seconds_since(start);
+    report("configs name=decode config=%s memory_bits=%d decode_cache=%u decodes=%llu ns_per_decode=%.2f checksum=%llu", config,
+           __builtin_ctzll(Config::physical_memory_size), Config::decode_cache_size, (unsigned long long)words.size() * repeats,
+           elapsed * 1e9 / (words.size() * repeats), (unsigned long long)checksum);
+    
+    for(const GuestProgram& program : guest_programs())
+    {
+        std::vector<uint64_t> code;
+        if(program.setup || !assemble_benchmark(program.name, program.source, code))
+            continue;
+        
+        double seconds = 1e9;
+        uint64_t instructions = 0;
+        bool ok = true;
+        for(int run = 0; run < 3; ++run)
+        {
+            BasicCPU<Config> cpu;
+            cpu.load_program(code, 0);
+            
+            auto start = std::chrono::steady_clock::now();
+            uint32_t result = cpu.run();
+            seconds = std::min(seconds, seconds_since(start));
+            instructions = cpu.instructions_retired();
+            ok = ok && result == program.expected;
+        }
+        report("configs name=%s config=%s instructions=%llu seconds=%.4f mips=%.1f ok=%d", program.name, config,
+               (unsigned long long)instructions, seconds, instructions / seconds / 1e6, ok);
+    }
+}
+
+static void benchmark_configs()
+{
+    benchmark_config<DefaultConfig>("default");
+    benchmark_config<SmallConfig>("small");
+    benchmark_config<LargeConfig>("large");
+}
+
+int main(int argc, char** argv)
+{
+    std::string only;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(strcmp(argv[i], "--json") == 0)
+            json_output = true;
+        else
+            only = argv[i];
+    }
+    
+    if(only.empty() || only == "micro")
+        benchmark_micro();
+    if(only.empty() || only == "programs")
+        benchmark_programs();
+    if(only.empty() || only == "superinstructions")
+        benchmark_superinstructions();
+    if(only.empty() || only == "batch")
+        benchmark_batch(4096);
+    if(only.empty() || only == "lockstep")
+        benchmark_lockstep();
+    if(only.empty() || only == "harts")
+        benchmark_harts();
+    if(only.empty() || only == "configs")
+        benchmark_configs();
+    if(only.empty() || only == "assembler")
+        benchmark_assembler(32);
+    if(only.empty() || only == "image")
+        benchmark_image();
+    if(only.empty() || only == "files")
+        benchmark_files(16);
+    if(only.empty() || only == "interrupts")
+        benchmark_interrupts();
+    if(only.empty() || only == "memory")
+        benchmark_memory_trace();
+    if(only.empty() || only == "snapshot")
+    {
+        benchmark_snapshot(1);
+        benchmark_snapshot(64);
+        benchmark_snapshot_read_only();
+    }
+    if(only.empty() || only == "optimizer")
+        benchmark_optimizer();
+    if(only.empty() || only == "trace")
+        benchmark_trace();
+    if(only.empty() || only == "console")
+        benchmark_console(16);
+    if(only.empty() || only == "profile")
+        benchmark_profile(100);
+    
+    report("rss peak_kb=%ld", peak_rss_kilobytes());
+    return 0;
+}
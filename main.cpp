@@ -1,8 +1,424 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
 #include "CPU.h"
+#include "Assembler.h"
+#include "Image.h"
+#include "Console.h"
+#include "Profiler.h"
+#include "JIT.h"
+#include "Optimizer.h"
+#include "Trace.h"
+#include "Machine.h"
+#include "FileDevice.h"
+#include "Interrupts.h"
+#include "MemoryTrace.h"
 
+static CPU cpu;
 
+/// Reads a flat file of little-endian 64-bit instruction words.
+static bool read_program(const char* path, std::vector<uint64_t>& program)
+{
+    FILE* in = fopen(path, "rb");
+    if(!in)
+        return false;
+    
+    uint8_t bytes[8];
+    while(fread(bytes, 1, 8, in) == 8)
+    {
+        uint64_t instruction = 0;
+        for(int i = 7; i >= 0; --i)
+            instruction = (instruction << 8) | bytes[i];
+        program.push_back(instruction);
+    }
+    
+    fclose(in);
+    return true;
+}
+
+#if defined(DERP_PROFILE)
+/// Writes what profiler gathered to path.json, path.folded and path.superinstructions.
+static bool write_profile(const Profiler& profiler, const char* path)
+{
+    std::string json_path = std::string(path) + ".json";
+    std::string folded_path = std::string(path) + ".folded";
+    std::string superinstructions_path = std::string(path) + ".superinstructions";
+    FILE* json = fopen(json_path.c_str(), "w");
+    FILE* folded = fopen(folded_path.c_str(), "w");
+    FILE* superinstructions = fopen(superinstructions_path.c_str(), "w");
+    if(json)
+        profiler.write_json(json);
+    if(folded)
+        profiler.write_folded(folded);
+    if(superinstructions)
+        profiler.write_superinstructions(superinstructions);
+    if(json)
+        fclose(json);
+    if(folded)
+        fclose(folded);
+    if(superinstructions)
+        fclose(superinstructions);
+    return json && folded && superinstructions;
+}
+#endif
+
+/// Writes the summary of tracer to path.memory.json.
+static bool write_memory_trace(const MemoryTracer& tracer, const char* path)
+{
+    std::string json_path = std::string(path) + ".memory.json";
+    FILE* json = fopen(json_path.c_str(), "w");
+    if(!json)
+        return false;
+    tracer.write_json(json);
+    return fclose(json) == 0;
+}
+
+/// A --map-file or --stream-file argument. window is 0 for a whole file mapping.
+struct FileArgument
+{
+    const char* path;
+    uint32_t address;
+    uint32_t window;
+};
 
 int main(int argc, char** argv)
 {
-    return 0;
-}
\ No newline at end of file
+    JitModes jit_mode = JitOff;
+    bool trap_faults = false;
+    const char* path = nullptr;
+    const char* image_path = nullptr;
+    bool async_output = false;
+    const char* profile_path = nullptr;
+    const char* record_path = nullptr;
+    const char* replay_path = nullptr;
+    bool optimize = false;
+    std::vector<FileArgument> files;
+    uint64_t timer_interval = 0;
+    unsigned long timeout_milliseconds = 0;
+    const char* memory_trace_path = nullptr;
+    const char* memory_log_path = nullptr;
+    const char* memory_replay_path = nullptr;
+    uint32_t memory_sample_period = 1;
+    std::vector<CacheGeometry> caches;
+    
+    for(int i = 1; i < argc; ++i)
+    {
+        if(strcmp(argv[i], "--jit") == 0)
+            jit_mode = JitOn;
+        else if(strcmp(argv[i], "--jit-verify") == 0)
+            jit_mode = JitVerify;
+        else if(strcmp(argv[i], "--trap-faults") == 0)
+            trap_faults = true;
+        else if(strcmp(argv[i], "--async-output") == 0)
+            async_output = true;
+        else if(strcmp(argv[i], "--optimize") == 0)
+            optimize = true;
+        else if(strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+            profile_path = argv[++i];
+        else if(strcmp(argv[i], "--write-image") == 0 && i + 1 < argc)
+            image_path = argv[++i];
+        else if(strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+            record_path = argv[++i];
+        else if(strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+            replay_path = argv[++i];
+        else if(strcmp(argv[i], "--timer-interrupt") == 0 && i + 1 < argc)
+            timer_interval = strtoull(argv[++i], nullptr, 0);
+        else if(strcmp(argv[i], "--timeout") == 0 && i + 1 < argc)
+            timeout_milliseconds = strtoul(argv[++i], nullptr, 0);
+        else if(strcmp(argv[i], "--trace-memory") == 0 && i + 1 < argc)
+            memory_trace_path = argv[++i];
+        else if(strcmp(argv[i], "--memory-sample") == 0 && i + 1 < argc)
+            memory_sample_period = uint32_t(strtoul(argv[++i], nullptr, 0));
+        else if(strcmp(argv[i], "--memory-log") == 0 && i + 1 < argc)
+            memory_log_path = argv[++i];
+        else if(strcmp(argv[i], "--memory-replay") == 0 && i + 1 < argc)
+            memory_replay_path = argv[++i];
+        else if(strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+        {
+            caches.emplace_back();
+            std::string error;
+            if(!parse_cache_geometry(argv[++i], caches.back(), error))
+            {
+                fprintf(stderr, "--cache: %s\n", error.c_str());
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--map-file") == 0 && i + 2 < argc)
+        {
+            files.push_back({argv[i + 1], uint32_t(strtoul(argv[i + 2], nullptr, 0)), 0});
+            i += 2;
+        }
+        else if(strcmp(argv[i], "--stream-file") == 0 && i + 3 < argc)
+        {
+            files.push_back({argv[i + 1], uint32_t(strtoul(argv[i + 2], nullptr, 0)), uint32_t(strtoul(argv[i + 3], nullptr, 0))});
+            i += 3;
+        }
+        else
+            path = argv[i];
+    }
+    
+    if(replay_path)
+    {
+        /// The trace holds the initial state and fault handling mode, so no program is needed.
+        TraceReplayer replayer;
+        std::string error;
+        if(!replayer.open(replay_path, error))
+        {
+            fprintf(stderr, "%s: %s\n", replay_path, error.c_str());
+            return 1;
+        }
+        bool matched = replayer.seek(UINT64_MAX);
+        fwrite(replayer.output.data(), 1, replayer.output.size(), stdout);
+        if(!matched)
+        {
+            fprintf(stderr, "%s: replay diverged: %s\n", replay_path, replayer.divergence.c_str());
+            return 1;
+        }
+        return replayer.cpu->halt_value;
+    }
+    
+    /// Memory tracing wants the interpreter, so the tracer is set up whether or not a build can feed it.
+    MemoryTracer tracer(memory_sample_period);
+    std::string error;
+    for(const CacheGeometry& geometry : caches)
+        tracer.add_cache(geometry, error);
+    if(caches.empty())
+        tracer.add_default_caches();
+    
+    if(memory_replay_path)
+    {
+        /// The log holds every access recorded, so no program is needed and the caches can differ from the run's.
+        if(!replay_memory_trace(memory_replay_path, tracer, error))
+        {
+            fprintf(stderr, "%s: %s\n", memory_replay_path, error.c_str());
+            return 1;
+        }
+        tracer.write_json(stdout);
+        return 0;
+    }
+    
+    if(!path)
+    {
+        fprintf(stderr, "Usage: %s [--jit | --jit-verify] [--trap-faults] [--async-output] [--profile name] [--optimize] [--write-image out.img] [--record out.trace]\n"
+                "       [--map-file file address] [--stream-file file address window] [--timer-interrupt instructions] [--timeout milliseconds]\n"
+                "       [--trace-memory name] [--memory-sample n] [--memory-log out.mlog] [--cache name:size:line_size:ways:rwx]...\n"
+                "       program.bin | program.asm | program.img\n"
+                "       %s --replay in.trace\n"
+                "       %s --memory-replay in.mlog [--cache name:size:line_size:ways:rwx]...\n", argv[0], argv[0], argv[0]);
+        return 1;
+    }
+    
+    JIT jit(jit_mode);
+    if(jit_mode != JitOff)
+        cpu.jit = &jit;
+    cpu.trap_memory_faults = trap_faults;
+    if(async_output)
+    {
+        cpu.output = new ConsoleDevice(1, ConsoleFlushDefault | ConsoleFlushOnTimer, true);
+        cpu.owns_output = true;
+    }
+    
+    size_t length = strlen(path);
+    bool is_image = length > 4 && strcmp(path + length - 4, ".img") == 0;
+    AssembledProgram program;
+    if(is_image)
+    {
+        std::string error;
+        if(!load_image(cpu, path, error, &program.labels))
+        {
+            fprintf(stderr, "%s: %s\n", path, error.c_str());
+            return 1;
+        }
+    }
+    else if(length > 4 && strcmp(path + length - 4, ".asm") == 0)
+    {
+        FILE* in = fopen(path, "rb");
+        std::string error;
+        if(!in)
+        {
+            fprintf(stderr, "Could not read \"%s\"\n", path);
+            return 1;
+        }
+        bool ok = assemble_file(in, 0, program, error);
+        fclose(in);
+        if(!ok)
+        {
+            fprintf(stderr, "%s: %s\n", path, error.c_str());
+            return 1;
+        }
+    }
+    else if(!read_program(path, program.code))
+    {
+        fprintf(stderr, "Could not read \"%s\"\n", path);
+        return 1;
+    }
+    
+    if(optimize && is_image)
+    {
+        fprintf(stderr, "--optimize works on .asm and .bin programs, images are mapped as they are\n");
+        return 1;
+    }
+    uint32_t entry = 0;
+    if(optimize)
+    {
+        /// A program the optimizer cannot follow still runs, just as written.
+        OptimizerReport report;
+        std::string error;
+        if(optimize_program(program.code, 0, entry, report, error, &program.labels))
+            write_optimizer_report(stderr, report);
+        else
+            fprintf(stderr, "%s: not optimized, %s\n", path, error.c_str());
+    }
+    
+    if(image_path && !is_image)
+    {
+        ProgramImage image;
+        add_code_section(image, program.code, 0);
+        image.entry = entry;
+        image.symbols = program.labels;
+        std::string error;
+        if(!write_image(image_path, image, error))
+        {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        return 0;
+    }
+    
+    if(!is_image)
+    {
+        cpu.load_program(program.code, 0);
+        cpu.program_counter = entry;
+    }
+    
+    /// Read-only, after the program so it cannot load over them. Streams live until main returns, before cpu goes.
+    std::vector<std::unique_ptr<FileStream>> streams;
+    for(const FileArgument& file : files)
+    {
+        std::string error;
+        uint64_t size;
+        bool ok;
+        if(file.window)
+        {
+            streams.emplace_back(new FileStream());
+            ok = streams.back()->open(cpu, file.path, file.address, file.window, FileReadOnly, error);
+        }
+        else
+        {
+            ok = map_file(cpu, file.path, file.address, FileReadOnly, size, error);
+        }
+        if(!ok)
+        {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+    }
+    
+    if(record_path && !streams.empty())
+    {
+        fprintf(stderr, "--record cannot replay a --stream-file, its window is not part of the trace\n");
+        return 1;
+    }
+    if(record_path && (timer_interval || timeout_milliseconds))
+    {
+        fprintf(stderr, "--record cannot replay interrupts, replay steps instructions where they are not delivered\n");
+        return 1;
+    }
+    if(record_path && (profile_path || memory_trace_path))
+    {
+        fprintf(stderr, "--record runs its own loop, --profile and --trace-memory need the interpreter's\n");
+        return 1;
+    }
+    if(record_path)
+    {
+        TraceRecorder recorder(cpu);
+        std::string error;
+        if(!recorder.open(record_path, error))
+        {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        uint32_t result = recorder.run();
+        if(!recorder.close(error))
+        {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        return result;
+    }
+    
+    cpu.set_timer(timer_interval);
+    /// The run loop polls for the request at block boundaries, so the guest stops within one block of the timeout.
+    std::unique_ptr<InterruptTimer> timeout;
+    if(timeout_milliseconds)
+        timeout.reset(new InterruptTimer(cpu.pending_interrupts, PREEMPT_REQUEST, std::chrono::milliseconds(timeout_milliseconds), false));
+    
+    /// Traces and profiles follow one hart, so spawniq only starts harts here.
+    if(!profile_path && !memory_trace_path)
+    {
+        Machine machine(cpu);
+        uint32_t result = machine.run();
+        if(!cpu.halted)
+        {
+            fprintf(stderr, "%s: timed out after %lu ms\n", path, timeout_milliseconds);
+            return 1;
+        }
+        return result;
+    }
+    
+#if defined(DERP_PROFILE)
+    Profiler profiler;
+    if(profile_path)
+    {
+        profiler.set_symbols(program.labels);
+        profiler.attach(cpu);
+    }
+#else
+    if(profile_path)
+    {
+        fprintf(stderr, "--profile needs a build with -DDERP_PROFILE\n");
+        return 1;
+    }
+#endif
+#if defined(DERP_TRACE_MEMORY)
+    if(memory_trace_path)
+    {
+        if(memory_log_path && !tracer.open_log(memory_log_path, error))
+        {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        tracer.attach(cpu);
+    }
+#else
+    if(memory_trace_path)
+    {
+        fprintf(stderr, "--trace-memory needs a build with -DDERP_TRACE_MEMORY\n");
+        return 1;
+    }
+#endif
+    
+    uint32_t result = cpu.run();
+    if(!cpu.halted)
+        fprintf(stderr, "%s: timed out after %lu ms, writing what was gathered so far\n", path, timeout_milliseconds);
+    
+#if defined(DERP_PROFILE)
+    if(profile_path)
+    {
+        profiler.collect(cpu);
+        if(!write_profile(profiler, profile_path))
+            fprintf(stderr, "Could not write the profile to %s.*\n", profile_path);
+    }
+#endif
+    if(memory_trace_path)
+    {
+        tracer.collect(cpu);
+        if(!tracer.close_log(error))
+            fprintf(stderr, "%s: %s\n", memory_log_path, error.c_str());
+        if(!write_memory_trace(tracer, memory_trace_path))
+            fprintf(stderr, "Could not write the memory trace to %s.memory.json\n", memory_trace_path);
+    }
+    return result;
+}